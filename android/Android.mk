@@ -41,6 +41,7 @@ LOCAL_SRC_FILES := \
 	bluez/android/hog.c \
 	bluez/android/hidhost.c \
 	bluez/android/socket.c \
+	bluez/android/socket-proxy.c \
 	bluez/android/ipc.c \
 	bluez/android/avdtp.c \
 	bluez/android/a2dp.c \
@@ -301,6 +302,7 @@ LOCAL_SRC_FILES := \
 	bluez/android/hal-audio.c \
 	bluez/android/hal-audio-sbc.c \
 	bluez/android/hal-audio-aptx.c \
+	bluez/android/hal-pcm.c \
 
 LOCAL_C_INCLUDES = \
 	$(LOCAL_PATH)/bluez \
@@ -327,7 +329,9 @@ include $(BUILD_SHARED_LIBRARY)
 
 include $(CLEAR_VARS)
 
-LOCAL_SRC_FILES := bluez/android/hal-sco.c
+LOCAL_SRC_FILES := \
+	bluez/android/hal-sco.c \
+	bluez/android/hal-pcm.c \
 
 LOCAL_C_INCLUDES = \
 	$(call include-path-for, system-core) \
@@ -21,6 +21,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
@@ -35,6 +36,7 @@
 #include "hal-log.h"
 #include "hal-msg.h"
 #include "hal-audio.h"
+#include "hal-pcm.h"
 #include "src/shared/util.h"
 #include "src/shared/queue.h"
 
@@ -44,6 +46,27 @@
 
 #define MAX_DELAY	100000 /* 100ms */
 
+/*
+ * Link quality control: media socket queue depth (in media packets) above
+ * which the link is considered congested and below which it is considered
+ * clear. Bitpool is decreased after a few consecutive congested samples
+ * and increased again only after the link was clear for a while.
+ */
+#define QOS_OUTQ_HIGH		6
+#define QOS_OUTQ_LOW		2
+#define QOS_CONGESTED_SAMPLES	3
+#define QOS_DECREASE_HOLDOFF	200000 /* 200ms */
+#define QOS_INCREASE_HOLDOFF	3000000 /* 3s */
+#define QOS_STATS_INTERVAL	10000000 /* 10s */
+#define QOS_POLICY_NONE		0xff
+
+/*
+ * Number of media packets encoder thread can prepare ahead of pacer thread
+ * and size of PCM ring between out_write and encoder thread.
+ */
+#define MP_QUEUE_LEN		3
+#define PCM_RING_SIZE		FIXED_BUFFER_SIZE
+
 static const uint8_t a2dp_src_uuid[] = {
 		0x00, 0x00, 0x11, 0x0a, 0x00, 0x00, 0x10, 0x00,
 		0x80, 0x00, 0x00, 0x80, 0x5f, 0x9b, 0x34, 0xfb };
@@ -108,13 +131,88 @@ static const audio_codec_get_t audio_codecs[] = {
 
 static struct queue *loaded_codecs;
 
+struct qos_monitor {
+	unsigned int congested;
+	bool clear;
+	struct timespec clear_since;
+	struct timespec last_change;
+	struct timespec last_stats;
+
+	/* statistics since last report */
+	unsigned int samples;
+	uint64_t outq_sum;
+	int outq_max;
+	uint64_t wait_sum;
+	uint64_t wait_max;
+	unsigned int decreases;
+	unsigned int increases;
+};
+
+struct pcm_ring {
+	uint8_t *buf;
+	size_t size;
+	size_t head;
+	size_t tail;
+};
+
+struct mp_slot {
+	struct media_packet *mp;
+	size_t len;
+	uint32_t samples;
+};
+
+struct mp_queue {
+	struct mp_slot slots[MP_QUEUE_LEN];
+	unsigned int head;
+	unsigned int tail;
+};
+
+/* Updated by the pipeline threads, read with __atomic_load_n() */
+struct pipeline_stats {
+	uint64_t packets;
+	uint64_t bytes;
+	unsigned int underruns;
+	unsigned int overruns;
+	unsigned int ring_full;
+	uint64_t encode_max;
+};
+
+/*
+ * out_write only copies PCM into the ring, encoder thread turns it into
+ * media packets ahead of time and pacer thread sends them on schedule so
+ * encoding time does not add jitter to transmission.
+ */
+struct audio_pipeline {
+	struct pcm_ring ring;
+	struct mp_queue queue;
+
+	uint8_t *enc_buf;
+	size_t enc_buf_size;
+
+	bool running;
+	bool failed;
+
+	pthread_t encoder_th;
+	pthread_t pacer_th;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t data_cond;
+	pthread_cond_t ring_space_cond;
+	pthread_cond_t queue_space_cond;
+	pthread_cond_t packet_cond;
+
+	struct pipeline_stats stats;
+};
+
 struct audio_endpoint {
 	uint8_t id;
 	const struct audio_codec *codec;
 	void *codec_data;
 	int fd;
 
+	/* MP_QUEUE_LEN media packets, mp_len bytes each */
 	struct media_packet *mp;
+	size_t mp_len;
 	size_t mp_data_len;
 
 	uint16_t seq;
@@ -122,6 +220,10 @@ struct audio_endpoint {
 	struct timespec start;
 
 	bool resync;
+
+	int sndbuf;
+	struct qos_monitor qos;
+	uint8_t qos_op;
 };
 
 static struct audio_endpoint audio_endpoints[MAX_AUDIO_ENDPOINTS];
@@ -141,6 +243,8 @@ struct a2dp_stream_out {
 	struct audio_input_config cfg;
 
 	uint8_t *downmix_buf;
+
+	struct audio_pipeline pl;
 };
 
 struct a2dp_audio_dev {
@@ -483,6 +587,7 @@ static bool open_endpoint(struct audio_endpoint **epp,
 	const struct audio_codec *codec;
 	uint16_t mtu;
 	uint16_t payload_len;
+	socklen_t len;
 	int fd;
 	size_t i;
 	uint8_t ep_id = 0;
@@ -515,17 +620,25 @@ static bool open_endpoint(struct audio_endpoint **epp,
 
 	ep->fd = fd;
 
+	len = sizeof(ep->sndbuf);
+	if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &ep->sndbuf, &len) < 0) {
+		warn("getsockopt(SO_SNDBUF) failed (%d)", errno);
+		ep->sndbuf = 0;
+	}
+
 	codec = ep->codec;
 	codec->init(preset, payload_len, &ep->codec_data);
 	codec->get_config(ep->codec_data, cfg);
 
-	ep->mp = calloc(mtu, 1);
+	ep->mp = calloc(MP_QUEUE_LEN, mtu);
 	if (!ep->mp)
 		goto failed;
 
-	if (ep->codec->use_rtp) {
-		struct media_packet_rtp *mp_rtp =
-					(struct media_packet_rtp *) ep->mp;
+	ep->mp_len = mtu;
+
+	for (i = 0; ep->codec->use_rtp && i < MP_QUEUE_LEN; i++) {
+		struct media_packet_rtp *mp_rtp = (struct media_packet_rtp *)
+					((uint8_t *) ep->mp + i * mtu);
 		mp_rtp->hdr.v = 2;
 		mp_rtp->hdr.pt = 0x60;
 		mp_rtp->hdr.ssrc = htonl(1);
@@ -567,26 +680,143 @@ static bool resume_endpoint(struct audio_endpoint *ep)
 	ep->resync = false;
 
 	ep->codec->update_qos(ep->codec_data, QOS_POLICY_DEFAULT);
+	ep->qos_op = QOS_POLICY_NONE;
+
+	memset(&ep->qos, 0, sizeof(ep->qos));
+	clock_gettime(CLOCK_MONOTONIC, &ep->qos.last_change);
+	ep->qos.last_stats = ep->qos.last_change;
 
 	return true;
 }
 
-static void downmix_to_mono(struct a2dp_stream_out *out, const uint8_t *buffer,
-								size_t bytes)
+/*
+ * For Bluetooth sockets TIOCOUTQ returns free space in the send buffer
+ * rather than queued bytes, so queue depth is derived from SO_SNDBUF.
+ */
+static int get_outq(struct audio_endpoint *ep)
+{
+	int space;
+
+	if (!ep->sndbuf)
+		return -1;
+
+	if (ioctl(ep->fd, TIOCOUTQ, &space) < 0)
+		return -1;
+
+	if (space > ep->sndbuf)
+		return 0;
+
+	return ep->sndbuf - space;
+}
+
+static void qos_request(struct audio_endpoint *ep, uint8_t op,
+						struct timespec *now)
+{
+	/* applied by encoder thread which owns codec state */
+	__atomic_store_n(&ep->qos_op, op, __ATOMIC_RELEASE);
+
+	ep->qos.last_change = *now;
+	ep->qos.congested = 0;
+	ep->qos.clear = false;
+}
+
+static void qos_apply(struct audio_endpoint *ep)
+{
+	uint8_t op;
+
+	op = __atomic_exchange_n(&ep->qos_op, QOS_POLICY_NONE,
+							__ATOMIC_ACQ_REL);
+	if (op == QOS_POLICY_NONE)
+		return;
+
+	if (!ep->codec->update_qos(ep->codec_data, op))
+		return;
+
+	if (op == QOS_POLICY_DECREASE)
+		__atomic_add_fetch(&ep->qos.decreases, 1, __ATOMIC_RELAXED);
+	else if (op == QOS_POLICY_INCREASE)
+		__atomic_add_fetch(&ep->qos.increases, 1, __ATOMIC_RELAXED);
+}
+
+static void qos_stats(struct audio_endpoint *ep, struct timespec *now)
 {
-	const int16_t *input = (const void *) buffer;
-	int16_t *output = (void *) out->downmix_buf;
-	size_t i, frames;
+	struct qos_monitor *qos = &ep->qos;
+
+	if (timespec_diff_us(now, &qos->last_stats) < QOS_STATS_INTERVAL)
+		return;
+
+	if (qos->samples)
+		DBG("outq avg=%ju max=%d wait avg=%juus max=%juus "
+				"bitpool decreases=%u increases=%u",
+				qos->outq_sum / qos->samples, qos->outq_max,
+				qos->wait_sum / qos->samples, qos->wait_max,
+				qos->decreases, qos->increases);
+
+	qos->samples = 0;
+	qos->outq_sum = 0;
+	qos->outq_max = 0;
+	qos->wait_sum = 0;
+	qos->wait_max = 0;
+	__atomic_store_n(&qos->decreases, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&qos->increases, 0, __ATOMIC_RELAXED);
+	qos->last_stats = *now;
+}
+
+static void qos_update(struct audio_endpoint *ep, size_t pkt_len,
+							uint64_t wait_us)
+{
+	struct qos_monitor *qos = &ep->qos;
+	struct timespec now;
+	uint64_t pkt_duration;
+	size_t queued = 0;
+	int outq;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pkt_duration = ep->codec->get_mediapacket_duration(ep->codec_data);
 
-	/* PCM 16bit stereo */
-	frames = bytes / (2 * sizeof(int16_t));
+	outq = get_outq(ep);
+	if (outq > 0 && pkt_len > 0)
+		queued = outq / pkt_len;
 
-	for (i = 0; i < frames; i++) {
-		int16_t l = le16_to_cpu(get_unaligned(&input[i * 2]));
-		int16_t r = le16_to_cpu(get_unaligned(&input[i * 2 + 1]));
+	qos->samples++;
+	qos->outq_sum += outq > 0 ? outq : 0;
+	qos->wait_sum += wait_us;
 
-		put_unaligned(cpu_to_le16((l + r) / 2), &output[i]);
+	if (outq > qos->outq_max)
+		qos->outq_max = outq;
+
+	if (wait_us > qos->wait_max)
+		qos->wait_max = wait_us;
+
+	if (queued >= QOS_OUTQ_HIGH || wait_us > pkt_duration) {
+		qos->clear = false;
+
+		if (++qos->congested >= QOS_CONGESTED_SAMPLES &&
+				timespec_diff_us(&now, &qos->last_change) >=
+							QOS_DECREASE_HOLDOFF) {
+			DBG("link congested (queued %zu wait %juus)", queued,
+								wait_us);
+			qos_request(ep, QOS_POLICY_DECREASE, &now);
+		}
+	} else if (queued <= QOS_OUTQ_LOW && wait_us < pkt_duration / 4) {
+		qos->congested = 0;
+
+		if (!qos->clear) {
+			qos->clear = true;
+			qos->clear_since = now;
+		} else if (timespec_diff_us(&now, &qos->clear_since) >=
+							QOS_INCREASE_HOLDOFF &&
+				timespec_diff_us(&now, &qos->last_change) >=
+							QOS_INCREASE_HOLDOFF) {
+			qos_request(ep, QOS_POLICY_INCREASE, &now);
+		}
+	} else {
+		qos->congested = 0;
+		qos->clear = false;
 	}
+
+	qos_stats(ep, &now);
 }
 
 static bool wait_for_endpoint(struct audio_endpoint *ep, bool *writable)
@@ -617,9 +847,9 @@ static bool wait_for_endpoint(struct audio_endpoint *ep, bool *writable)
 	return true;
 }
 
-static bool write_to_endpoint(struct audio_endpoint *ep, size_t bytes)
+static bool write_to_endpoint(struct audio_endpoint *ep,
+					struct media_packet *mp, size_t bytes)
 {
-	struct media_packet *mp = (struct media_packet *) ep->mp;
 	int ret;
 
 	while (true) {
@@ -648,51 +878,301 @@ static bool write_to_endpoint(struct audio_endpoint *ep, size_t bytes)
 	return true;
 }
 
-static bool write_data(struct a2dp_stream_out *out, const void *buffer,
-								size_t bytes)
+/*
+ * PCM ring and media packet queue are single producer, single consumer:
+ * head is only written by producer and tail only by consumer so both can
+ * be accessed without locking. Mutex and condition are only used to sleep
+ * when ring/queue is empty or full.
+ */
+static size_t ring_avail(struct pcm_ring *ring)
 {
-	struct audio_endpoint *ep = out->ep;
-	struct media_packet *mp = (struct media_packet *) ep->mp;
-	struct media_packet_rtp *mp_rtp = (struct media_packet_rtp *) ep->mp;
-	size_t free_space = ep->mp_data_len;
-	size_t consumed = 0;
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) -
+				__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+static size_t ring_write(struct pcm_ring *ring, const uint8_t *buf,
+								size_t len)
+{
+	size_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	size_t space = ring->size - ring_avail(ring);
+	size_t offset, chunk;
+
+	if (len > space)
+		len = space;
+
+	offset = head % ring->size;
+	chunk = ring->size - offset;
+	if (chunk > len)
+		chunk = len;
+
+	memcpy(ring->buf + offset, buf, chunk);
+	memcpy(ring->buf, buf + chunk, len - chunk);
+
+	__atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+
+	return len;
+}
+
+static void ring_peek(struct pcm_ring *ring, uint8_t *buf, size_t len)
+{
+	size_t offset = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED) %
+								ring->size;
+	size_t chunk = ring->size - offset;
+
+	if (chunk > len)
+		chunk = len;
+
+	memcpy(buf, ring->buf + offset, chunk);
+	memcpy(buf + chunk, ring->buf, len - chunk);
+}
+
+static void ring_consume(struct pcm_ring *ring, size_t len)
+{
+	size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&ring->tail, tail + len, __ATOMIC_RELEASE);
+}
+
+static unsigned int mp_queue_len(struct mp_queue *queue)
+{
+	return __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) -
+				__atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+}
+
+static bool pipeline_running(struct audio_pipeline *pl)
+{
+	return __atomic_load_n(&pl->running, __ATOMIC_ACQUIRE);
+}
+
+static void pipeline_signal(struct audio_pipeline *pl, pthread_cond_t *cond)
+{
+	pthread_mutex_lock(&pl->mutex);
+	pthread_cond_signal(cond);
+	pthread_mutex_unlock(&pl->mutex);
+}
+
+/*
+ * Waiters recheck their condition under the mutex before sleeping so that
+ * a signal sent between the lock-free check and pthread_cond_wait is not
+ * lost.
+ */
+static bool ring_wait_data(struct audio_pipeline *pl, size_t len)
+{
+	while (ring_avail(&pl->ring) < len) {
+		pthread_mutex_lock(&pl->mutex);
+
+		if (pipeline_running(pl) && ring_avail(&pl->ring) < len)
+			pthread_cond_wait(&pl->data_cond, &pl->mutex);
+
+		pthread_mutex_unlock(&pl->mutex);
+
+		if (!pipeline_running(pl))
+			return false;
+	}
+
+	return true;
+}
+
+static struct mp_slot *mp_queue_wait_free(struct audio_pipeline *pl)
+{
+	struct mp_queue *queue = &pl->queue;
+
+	while (mp_queue_len(queue) == MP_QUEUE_LEN) {
+		pthread_mutex_lock(&pl->mutex);
+
+		if (pipeline_running(pl) && mp_queue_len(queue) == MP_QUEUE_LEN)
+			pthread_cond_wait(&pl->queue_space_cond, &pl->mutex);
+
+		pthread_mutex_unlock(&pl->mutex);
+
+		if (!pipeline_running(pl))
+			return NULL;
+	}
+
+	return &queue->slots[queue->head % MP_QUEUE_LEN];
+}
+
+static void mp_queue_push(struct audio_pipeline *pl)
+{
+	__atomic_add_fetch(&pl->queue.head, 1, __ATOMIC_RELEASE);
+	pipeline_signal(pl, &pl->packet_cond);
+}
+
+static struct mp_slot *mp_queue_wait_packet(struct audio_pipeline *pl,
+								bool *waited)
+{
+	struct mp_queue *queue = &pl->queue;
+
+	*waited = false;
+
+	while (!mp_queue_len(queue)) {
+		*waited = true;
+
+		pthread_mutex_lock(&pl->mutex);
 
-	while (consumed < bytes) {
-		size_t written = 0;
+		if (pipeline_running(pl) && !mp_queue_len(queue))
+			pthread_cond_wait(&pl->packet_cond, &pl->mutex);
+
+		pthread_mutex_unlock(&pl->mutex);
+
+		if (!pipeline_running(pl))
+			return NULL;
+	}
+
+	return &queue->slots[queue->tail % MP_QUEUE_LEN];
+}
+
+static void mp_queue_pop(struct audio_pipeline *pl)
+{
+	__atomic_add_fetch(&pl->queue.tail, 1, __ATOMIC_RELEASE);
+	pipeline_signal(pl, &pl->queue_space_cond);
+}
+
+static void *encoder_thread(void *data)
+{
+	struct a2dp_stream_out *out = data;
+	struct audio_pipeline *pl = &out->pl;
+	struct audio_endpoint *ep = out->ep;
+	uint32_t pending_samples = 0;
+
+	while (pipeline_running(pl)) {
+		struct media_packet_rtp *mp_rtp;
+		struct timespec start, end;
+		struct mp_slot *slot;
+		size_t in_len, len, written = 0;
+		uint64_t encode_us;
 		ssize_t read;
-		uint32_t samples;
-		int ret;
-		struct timespec current;
-		uint64_t audio_sent, audio_passed;
-		bool do_write = false;
+
+		qos_apply(ep);
 
 		/*
-		 * prepare media packet in advance so we don't waste time after
-		 * wakeup
+		 * wait until there is enough PCM to fill complete media
+		 * packet, codecs which do not know that (aptX) take anything
 		 */
+		in_len = ep->codec->get_buffer_size(ep->codec_data);
+		if (!in_len || in_len > pl->enc_buf_size)
+			in_len = 1;
+
+		if (!ring_wait_data(pl, in_len))
+			break;
+
+		slot = mp_queue_wait_free(pl);
+		if (!slot)
+			break;
+
+		len = ring_avail(&pl->ring);
+		if (len > pl->enc_buf_size)
+			len = pl->enc_buf_size;
+
+		ring_peek(&pl->ring, pl->enc_buf, len);
+
 		if (ep->codec->use_rtp) {
+			mp_rtp = (struct media_packet_rtp *) slot->mp;
 			mp_rtp->hdr.sequence_number = htons(ep->seq++);
 			mp_rtp->hdr.timestamp = htonl(ep->samples);
 		}
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
 		read = ep->codec->encode_mediapacket(ep->codec_data,
-						buffer + consumed,
-						bytes - consumed, mp,
-						free_space, &written);
+						pl->enc_buf, len, slot->mp,
+						ep->mp_data_len, &written);
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		/*
+		 * not much we can do here, let's just drop data which can't be
+		 * encoded and continue
+		 */
+		if (read <= 0) {
+			ring_consume(&pl->ring, len);
+			pipeline_signal(pl, &pl->ring_space_cond);
+			continue;
+		}
+
+		ring_consume(&pl->ring, read);
+		pipeline_signal(pl, &pl->ring_space_cond);
+
+		encode_us = timespec_diff_us(&end, &start);
+		if (encode_us > pl->stats.encode_max)
+			__atomic_store_n(&pl->stats.encode_max, encode_us,
+							__ATOMIC_RELAXED);
+
+		/*
+		 * AudioFlinger provides 16bit PCM, so sample size is 2 bytes
+		 * multiplied by number of channels. Number of channels is
+		 * simply number of bits set in channels mask.
+		 */
+		pending_samples += read / (2 * popcount(out->cfg.channels));
+		ep->samples += read / (2 * popcount(out->cfg.channels));
 
 		/*
-		 * not much we can do here, let's just ignore remaining
-		 * data and continue
+		 * some codecs do internal buffering and output data only if
+		 * full frame can be encoded, in such case samples are accounted
+		 * to next packet
 		 */
-		if (read <= 0)
-			return true;
+		if (!written)
+			continue;
+
+		if (ep->codec->use_rtp)
+			written += sizeof(struct rtp_header);
+
+		slot->len = written;
+		slot->samples = pending_samples;
+		pending_samples = 0;
+
+		mp_queue_push(pl);
+	}
+
+	return NULL;
+}
+
+static void *pacer_thread(void *data)
+{
+	struct a2dp_stream_out *out = data;
+	struct audio_pipeline *pl = &out->pl;
+	struct audio_endpoint *ep = out->ep;
+	uint64_t sent_samples = 0;
+	bool first = true;
+
+	while (true) {
+		struct timespec current, ready;
+		uint64_t audio_sent, audio_passed;
+		struct mp_slot *slot;
+		bool do_write = false;
+		bool waited;
+		int ret;
+
+		slot = mp_queue_wait_packet(pl, &waited);
+		if (!slot)
+			break;
 
 		/* calculate where are we and where we should be */
 		clock_gettime(CLOCK_MONOTONIC, &current);
-		if (!ep->samples)
+		if (first)
 			memcpy(&ep->start, &current, sizeof(ep->start));
-		audio_sent = ep->samples * 1000000ll / out->cfg.rate;
+		audio_sent = sent_samples * 1000000ll / out->cfg.rate;
 		audio_passed = timespec_diff_us(&current, &ep->start);
 
+		/*
+		 * if encoder could not deliver packet in time we've underrun,
+		 * restart timing from now instead of dropping packets to
+		 * catch up with time when there was nothing to send
+		 */
+		if (!first && waited && audio_passed > audio_sent) {
+			struct timespec sent;
+
+			__atomic_add_fetch(&pl->stats.underruns, 1,
+							__ATOMIC_RELAXED);
+
+			sent.tv_sec = audio_sent / 1000000;
+			sent.tv_nsec = (audio_sent % 1000000) * 1000;
+			timespec_diff(&current, &sent, &ep->start);
+			audio_passed = audio_sent;
+		}
+
+		first = false;
+
 		/*
 		 * if we're ahead of stream then wait for next write point,
 		 * if we're lagging more than 100ms then stop writing and just
@@ -716,7 +1196,7 @@ static bool write_data(struct a2dp_stream_out *out, const void *buffer,
 				if (ret != EINTR) {
 					error("clock_nanosleep failed (%d)",
 									ret);
-					return false;
+					goto done;
 				}
 			}
 		} else if (!ep->resync) {
@@ -725,41 +1205,161 @@ static bool write_data(struct a2dp_stream_out *out, const void *buffer,
 			if (diff > MAX_DELAY) {
 				warn("lag is %jums, resyncing", diff / 1000);
 
-				ep->codec->update_qos(ep->codec_data,
-							QOS_POLICY_DECREASE);
+				qos_request(ep, QOS_POLICY_DECREASE, &current);
 				ep->resync = true;
 			}
 		}
 
-		/* we send data only in case codec encoded some data, i.e. some
-		 * codecs do internal buffering and output data only if full
-		 * frame can be encoded
-		 * in resync mode we'll just drop mediapackets
-		 */
-		if (written > 0 && !ep->resync) {
+		/* in resync mode we'll just drop mediapackets */
+		if (!ep->resync) {
 			/* wait some time for socket to be ready for write,
 			 * but we'll just skip writing data if timeout occurs
 			 */
+			clock_gettime(CLOCK_MONOTONIC, &current);
+
 			if (!wait_for_endpoint(ep, &do_write))
-				return false;
+				goto done;
 
-			if (do_write) {
-				if (ep->codec->use_rtp)
-					written += sizeof(struct rtp_header);
+			clock_gettime(CLOCK_MONOTONIC, &ready);
 
-				if (!write_to_endpoint(ep, written))
-					return false;
+			if (do_write) {
+				if (!write_to_endpoint(ep, slot->mp, slot->len))
+					goto done;
+
+				__atomic_add_fetch(&pl->stats.packets, 1,
+							__ATOMIC_RELAXED);
+				__atomic_add_fetch(&pl->stats.bytes, slot->len,
+							__ATOMIC_RELAXED);
+			} else {
+				__atomic_add_fetch(&pl->stats.overruns, 1,
+							__ATOMIC_RELAXED);
 			}
+
+			qos_update(ep, slot->len,
+					timespec_diff_us(&ready, &current));
+		} else {
+			__atomic_add_fetch(&pl->stats.overruns, 1,
+							__ATOMIC_RELAXED);
+		}
+
+		sent_samples += slot->samples;
+
+		mp_queue_pop(pl);
+	}
+
+	return NULL;
+
+done:
+	__atomic_store_n(&pl->failed, true, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&pl->mutex);
+	pthread_cond_broadcast(&pl->ring_space_cond);
+	pthread_cond_broadcast(&pl->queue_space_cond);
+	pthread_mutex_unlock(&pl->mutex);
+
+	return NULL;
+}
+
+static void pipeline_stop(struct a2dp_stream_out *out)
+{
+	struct audio_pipeline *pl = &out->pl;
+
+	if (!pipeline_running(pl))
+		return;
+
+	pthread_mutex_lock(&pl->mutex);
+	__atomic_store_n(&pl->running, false, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&pl->data_cond);
+	pthread_cond_broadcast(&pl->ring_space_cond);
+	pthread_cond_broadcast(&pl->queue_space_cond);
+	pthread_cond_broadcast(&pl->packet_cond);
+	pthread_mutex_unlock(&pl->mutex);
+
+	pthread_join(pl->encoder_th, NULL);
+	pthread_join(pl->pacer_th, NULL);
+
+	/* Both threads are joined, no concurrent updates anymore */
+	DBG("packets=%ju underruns=%u overruns=%u", pl->stats.packets,
+				pl->stats.underruns, pl->stats.overruns);
+}
+
+static bool pipeline_start(struct a2dp_stream_out *out)
+{
+	struct audio_pipeline *pl = &out->pl;
+	unsigned int i;
+
+	if (pipeline_running(pl))
+		return true;
+
+	pl->ring.head = 0;
+	pl->ring.tail = 0;
+	pl->queue.head = 0;
+	pl->queue.tail = 0;
+	pl->failed = false;
+
+	for (i = 0; i < MP_QUEUE_LEN; i++)
+		pl->queue.slots[i].mp = (struct media_packet *)
+				((uint8_t *) out->ep->mp + i * out->ep->mp_len);
+
+	__atomic_store_n(&pl->running, true, __ATOMIC_RELEASE);
+
+	if (pthread_create(&pl->encoder_th, NULL, encoder_thread, out)) {
+		error("audio: failed to create encoder thread");
+		pl->running = false;
+		return false;
+	}
+
+	if (pthread_create(&pl->pacer_th, NULL, pacer_thread, out)) {
+		error("audio: failed to create pacer thread");
+		pthread_mutex_lock(&pl->mutex);
+		__atomic_store_n(&pl->running, false, __ATOMIC_RELEASE);
+		pthread_cond_broadcast(&pl->data_cond);
+		pthread_cond_broadcast(&pl->queue_space_cond);
+		pthread_mutex_unlock(&pl->mutex);
+		pthread_join(pl->encoder_th, NULL);
+		return false;
+	}
+
+	return true;
+}
+
+static bool write_data(struct a2dp_stream_out *out, const void *buffer,
+								size_t bytes)
+{
+	struct audio_pipeline *pl = &out->pl;
+	size_t copied = 0;
+
+	if (!pipeline_start(out))
+		return false;
+
+	while (copied < bytes) {
+		size_t len;
+
+		if (__atomic_load_n(&pl->failed, __ATOMIC_ACQUIRE)) {
+			pipeline_stop(out);
+			return false;
+		}
+
+		len = ring_write(&pl->ring, buffer + copied, bytes - copied);
+		if (len) {
+			copied += len;
+			pipeline_signal(pl, &pl->data_cond);
+			continue;
 		}
 
 		/*
-		 * AudioFlinger provides 16bit PCM, so sample size is 2 bytes
-		 * multiplied by number of channels. Number of channels is
-		 * simply number of bits set in channels mask.
+		 * ring is full, wait for encoder to take some data; this is
+		 * what paces AudioFlinger
 		 */
-		samples = read / (2 * popcount(out->cfg.channels));
-		ep->samples += samples;
-		consumed += read;
+		__atomic_add_fetch(&pl->stats.ring_full, 1, __ATOMIC_RELAXED);
+
+		pthread_mutex_lock(&pl->mutex);
+
+		if (ring_avail(&pl->ring) == pl->ring.size &&
+				!__atomic_load_n(&pl->failed, __ATOMIC_ACQUIRE))
+			pthread_cond_wait(&pl->ring_space_cond, &pl->mutex);
+
+		pthread_mutex_unlock(&pl->mutex);
 	}
 
 	return true;
@@ -810,7 +1410,9 @@ static ssize_t out_write(struct audio_stream_out *stream, const void *buffer,
 			return -1;
 		}
 
-		downmix_to_mono(out, buffer, bytes);
+		/* PCM 16bit stereo */
+		pcm_downmix_to_mono(out->downmix_buf, buffer,
+						bytes / (2 * sizeof(int16_t)));
 
 		in_buf = out->downmix_buf;
 		in_len = bytes / 2;
@@ -893,6 +1495,8 @@ static int out_standby(struct audio_stream *stream)
 	DBG("");
 
 	if (out->audio_state == AUDIO_A2DP_STATE_STARTED) {
+		pipeline_stop(out);
+
 		if (ipc_suspend_stream_cmd(out->ep->id) != AUDIO_STATUS_SUCCESS)
 			return -1;
 		out->audio_state = AUDIO_A2DP_STATE_STANDBY;
@@ -903,8 +1507,35 @@ static int out_standby(struct audio_stream *stream)
 
 static int out_dump(const struct audio_stream *stream, int fd)
 {
+	struct a2dp_stream_out *out = (struct a2dp_stream_out *) stream;
+	struct pipeline_stats *stats = &out->pl.stats;
+	char buf[512];
+	int len;
+
 	DBG("");
-	return -ENOSYS;
+
+	len = snprintf(buf, sizeof(buf),
+			"A2DP output stream:\n"
+			"  state: %d\n"
+			"  packets sent: %ju (%ju bytes)\n"
+			"  underruns: %u\n"
+			"  overruns (packets dropped): %u\n"
+			"  writes blocked on full buffer: %u\n"
+			"  max encode time: %juus\n"
+			"  queued packets: %u/%u\n",
+			out->audio_state,
+			__atomic_load_n(&stats->packets, __ATOMIC_RELAXED),
+			__atomic_load_n(&stats->bytes, __ATOMIC_RELAXED),
+			__atomic_load_n(&stats->underruns, __ATOMIC_RELAXED),
+			__atomic_load_n(&stats->overruns, __ATOMIC_RELAXED),
+			__atomic_load_n(&stats->ring_full, __ATOMIC_RELAXED),
+			__atomic_load_n(&stats->encode_max, __ATOMIC_RELAXED),
+			mp_queue_len(&out->pl.queue), MP_QUEUE_LEN);
+
+	if (write(fd, buf, len) < 0)
+		return -errno;
+
+	return 0;
 }
 
 static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
@@ -948,6 +1579,8 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
 	free(str);
 
 	if (enter_suspend && out->audio_state == AUDIO_A2DP_STATE_STARTED) {
+		pipeline_stop(out);
+
 		if (ipc_suspend_stream_cmd(out->ep->id) != AUDIO_STATUS_SUCCESS)
 			return -1;
 		out->audio_state = AUDIO_A2DP_STATE_SUSPENDED;
@@ -970,13 +1603,20 @@ static uint32_t out_get_latency(const struct audio_stream_out *stream)
 {
 	struct a2dp_stream_out *out = (struct a2dp_stream_out *) stream;
 	struct audio_endpoint *ep = out->ep;
-	size_t pkt_duration;
+	size_t pkt_duration, frames;
 
 	DBG("");
 
 	pkt_duration = ep->codec->get_mediapacket_duration(ep->codec_data);
 
-	return FIXED_A2DP_PLAYBACK_LATENCY_MS + pkt_duration / 1000;
+	/* PCM written but not yet taken by the encoder */
+	frames = ring_avail(&out->pl.ring) /
+					(2 * popcount(out->cfg.channels));
+
+	/* encoder can be up to MP_QUEUE_LEN packets ahead of transmission */
+	return FIXED_A2DP_PLAYBACK_LATENCY_MS +
+				pkt_duration * MP_QUEUE_LEN / 1000 +
+				frames * 1000 / out->cfg.rate;
 }
 
 static int out_set_volume(struct audio_stream_out *stream, float left,
@@ -1151,6 +1791,19 @@ static int audio_open_output_stream(struct audio_hw_device *dev,
 			goto fail;
 	}
 
+	out->pl.ring.size = PCM_RING_SIZE;
+	out->pl.ring.buf = malloc(PCM_RING_SIZE);
+	out->pl.enc_buf_size = PCM_RING_SIZE;
+	out->pl.enc_buf = malloc(PCM_RING_SIZE);
+	if (!out->pl.ring.buf || !out->pl.enc_buf)
+		goto fail;
+
+	pthread_mutex_init(&out->pl.mutex, NULL);
+	pthread_cond_init(&out->pl.data_cond, NULL);
+	pthread_cond_init(&out->pl.ring_space_cond, NULL);
+	pthread_cond_init(&out->pl.queue_space_cond, NULL);
+	pthread_cond_init(&out->pl.packet_cond, NULL);
+
 	*stream_out = &out->stream;
 	a2dp_dev->out = out;
 
@@ -1160,6 +1813,9 @@ static int audio_open_output_stream(struct audio_hw_device *dev,
 
 fail:
 	error("audio: cannot open output stream");
+	free(out->pl.ring.buf);
+	free(out->pl.enc_buf);
+	free(out->downmix_buf);
 	free(out);
 	*stream_out = NULL;
 	return -EIO;
@@ -1173,10 +1829,20 @@ static void audio_close_output_stream(struct audio_hw_device *dev,
 
 	DBG("");
 
+	pipeline_stop(out);
+
 	close_endpoint(a2dp_dev->out->ep);
 
 	free(out->downmix_buf);
 
+	free(out->pl.ring.buf);
+	free(out->pl.enc_buf);
+	pthread_mutex_destroy(&out->pl.mutex);
+	pthread_cond_destroy(&out->pl.data_cond);
+	pthread_cond_destroy(&out->pl.ring_space_cond);
+	pthread_cond_destroy(&out->pl.queue_space_cond);
+	pthread_cond_destroy(&out->pl.packet_cond);
+
 	free(stream);
 	a2dp_dev->out = NULL;
 }
@@ -0,0 +1,559 @@
+/*
+ * Copyright (C) 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "../src/shared/util.h"
+#include "hal-pcm.h"
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+
+#if defined(__SSE2__)
+#define HAVE_PCM_SSE2
+#include <emmintrin.h>
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || \
+		(__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#define HAVE_PCM_AVX2
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define HAVE_PCM_NEON
+#include <arm_neon.h>
+#endif
+
+#endif
+
+static inline int16_t sat16(int32_t val)
+{
+	if (val > INT16_MAX)
+		return INT16_MAX;
+
+	if (val < INT16_MIN)
+		return INT16_MIN;
+
+	return val;
+}
+
+static inline int16_t load16(const int16_t *ptr)
+{
+	return le16_to_cpu(get_unaligned(ptr));
+}
+
+static inline void store16(int16_t val, int16_t *ptr)
+{
+	put_unaligned(cpu_to_le16(val), ptr);
+}
+
+static void downmix_c(void *out, const void *in, size_t frames)
+{
+	const int16_t *input = in;
+	int16_t *output = out;
+	size_t i;
+
+	for (i = 0; i < frames; i++) {
+		int16_t l = load16(&input[i * 2]);
+		int16_t r = load16(&input[i * 2 + 1]);
+
+		store16((l + r) >> 1, &output[i]);
+	}
+}
+
+static void interleave_c(void *out, const void *left, const void *right,
+								size_t frames)
+{
+	const int16_t *l = left;
+	const int16_t *r = right;
+	int16_t *output = out;
+	size_t i;
+
+	for (i = 0; i < frames; i++) {
+		store16(load16(&l[i]), &output[i * 2]);
+		store16(load16(&r[i]), &output[i * 2 + 1]);
+	}
+}
+
+static void deinterleave_c(void *left, void *right, const void *in,
+								size_t frames)
+{
+	const int16_t *input = in;
+	int16_t *l = left;
+	int16_t *r = right;
+	size_t i;
+
+	for (i = 0; i < frames; i++) {
+		store16(load16(&input[i * 2]), &l[i]);
+		store16(load16(&input[i * 2 + 1]), &r[i]);
+	}
+}
+
+static void scale_c(void *out, const void *in, size_t samples, int16_t gain)
+{
+	const int16_t *input = in;
+	int16_t *output = out;
+	size_t i;
+
+	for (i = 0; i < samples; i++) {
+		int32_t val = load16(&input[i]) * gain;
+
+		store16(sat16(val >> 12), &output[i]);
+	}
+}
+
+static void saturate_c(void *out, const int32_t *in, size_t samples)
+{
+	int16_t *output = out;
+	size_t i;
+
+	for (i = 0; i < samples; i++)
+		store16(sat16(get_unaligned(&in[i])), &output[i]);
+}
+
+static const struct pcm_ops pcm_c = {
+	.name = "c",
+	.downmix = downmix_c,
+	.interleave = interleave_c,
+	.deinterleave = deinterleave_c,
+	.scale = scale_c,
+	.saturate = saturate_c,
+};
+
+#ifdef HAVE_PCM_SSE2
+static void downmix_sse2(void *out, const void *in, size_t frames)
+{
+	const int16_t *input = in;
+	int16_t *output = out;
+	const __m128i ones = _mm_set1_epi16(1);
+	size_t i;
+
+	for (i = 0; i + 8 <= frames; i += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i *) &input[i * 2]);
+		__m128i b = _mm_loadu_si128((const __m128i *) &input[i * 2 + 8]);
+
+		/* l + r as 32bit for each frame */
+		a = _mm_srai_epi32(_mm_madd_epi16(a, ones), 1);
+		b = _mm_srai_epi32(_mm_madd_epi16(b, ones), 1);
+
+		_mm_storeu_si128((__m128i *) &output[i], _mm_packs_epi32(a, b));
+	}
+
+	downmix_c(&output[i], &input[i * 2], frames - i);
+}
+
+static void interleave_sse2(void *out, const void *left, const void *right,
+								size_t frames)
+{
+	const int16_t *l = left;
+	const int16_t *r = right;
+	int16_t *output = out;
+	size_t i;
+
+	for (i = 0; i + 8 <= frames; i += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i *) &l[i]);
+		__m128i b = _mm_loadu_si128((const __m128i *) &r[i]);
+
+		_mm_storeu_si128((__m128i *) &output[i * 2],
+						_mm_unpacklo_epi16(a, b));
+		_mm_storeu_si128((__m128i *) &output[i * 2 + 8],
+						_mm_unpackhi_epi16(a, b));
+	}
+
+	interleave_c(&output[i * 2], &l[i], &r[i], frames - i);
+}
+
+static void deinterleave_sse2(void *left, void *right, const void *in,
+								size_t frames)
+{
+	const int16_t *input = in;
+	int16_t *l = left;
+	int16_t *r = right;
+	size_t i;
+
+	for (i = 0; i + 8 <= frames; i += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i *) &input[i * 2]);
+		__m128i b = _mm_loadu_si128((const __m128i *) &input[i * 2 + 8]);
+		__m128i la, lb;
+
+		/* sign extend low halves (left) and high halves (right) */
+		la = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+		lb = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+
+		_mm_storeu_si128((__m128i *) &l[i], _mm_packs_epi32(la, lb));
+		_mm_storeu_si128((__m128i *) &r[i],
+					_mm_packs_epi32(_mm_srai_epi32(a, 16),
+							_mm_srai_epi32(b, 16)));
+	}
+
+	deinterleave_c(&l[i], &r[i], &input[i * 2], frames - i);
+}
+
+static void scale_sse2(void *out, const void *in, size_t samples,
+								int16_t gain)
+{
+	const int16_t *input = in;
+	int16_t *output = out;
+	const __m128i g = _mm_set1_epi16(gain);
+	size_t i;
+
+	for (i = 0; i + 8 <= samples; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *) &input[i]);
+		__m128i lo = _mm_mullo_epi16(v, g);
+		__m128i hi = _mm_mulhi_epi16(v, g);
+		__m128i p0 = _mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), 12);
+		__m128i p1 = _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), 12);
+
+		_mm_storeu_si128((__m128i *) &output[i],
+						_mm_packs_epi32(p0, p1));
+	}
+
+	scale_c(&output[i], &input[i], samples - i, gain);
+}
+
+static void saturate_sse2(void *out, const int32_t *in, size_t samples)
+{
+	int16_t *output = out;
+	size_t i;
+
+	for (i = 0; i + 8 <= samples; i += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i *) &in[i]);
+		__m128i b = _mm_loadu_si128((const __m128i *) &in[i + 4]);
+
+		_mm_storeu_si128((__m128i *) &output[i], _mm_packs_epi32(a, b));
+	}
+
+	saturate_c(&output[i], &in[i], samples - i);
+}
+
+static const struct pcm_ops pcm_sse2 = {
+	.name = "sse2",
+	.downmix = downmix_sse2,
+	.interleave = interleave_sse2,
+	.deinterleave = deinterleave_sse2,
+	.scale = scale_sse2,
+	.saturate = saturate_sse2,
+};
+#endif
+
+#ifdef HAVE_PCM_AVX2
+/*
+ * 256bit pack and unpack instructions work within 128bit lanes, so results
+ * need to be reordered with a cross-lane permute.
+ */
+#define AVX2 __attribute__((target("avx2")))
+
+static AVX2 void downmix_avx2(void *out, const void *in, size_t frames)
+{
+	const int16_t *input = in;
+	int16_t *output = out;
+	const __m256i ones = _mm256_set1_epi16(1);
+	size_t i;
+
+	for (i = 0; i + 16 <= frames; i += 16) {
+		__m256i a = _mm256_loadu_si256((const __m256i *) &input[i * 2]);
+		__m256i b = _mm256_loadu_si256((const __m256i *)
+							&input[i * 2 + 16]);
+
+		a = _mm256_srai_epi32(_mm256_madd_epi16(a, ones), 1);
+		b = _mm256_srai_epi32(_mm256_madd_epi16(b, ones), 1);
+		a = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xd8);
+
+		_mm256_storeu_si256((__m256i *) &output[i], a);
+	}
+
+	downmix_c(&output[i], &input[i * 2], frames - i);
+}
+
+static AVX2 void interleave_avx2(void *out, const void *left,
+					const void *right, size_t frames)
+{
+	const int16_t *l = left;
+	const int16_t *r = right;
+	int16_t *output = out;
+	size_t i;
+
+	for (i = 0; i + 16 <= frames; i += 16) {
+		__m256i a = _mm256_loadu_si256((const __m256i *) &l[i]);
+		__m256i b = _mm256_loadu_si256((const __m256i *) &r[i]);
+		__m256i lo = _mm256_unpacklo_epi16(a, b);
+		__m256i hi = _mm256_unpackhi_epi16(a, b);
+
+		_mm256_storeu_si256((__m256i *) &output[i * 2],
+				_mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i *) &output[i * 2 + 16],
+				_mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+
+	interleave_c(&output[i * 2], &l[i], &r[i], frames - i);
+}
+
+static AVX2 void deinterleave_avx2(void *left, void *right, const void *in,
+								size_t frames)
+{
+	const int16_t *input = in;
+	int16_t *l = left;
+	int16_t *r = right;
+	size_t i;
+
+	for (i = 0; i + 16 <= frames; i += 16) {
+		__m256i a = _mm256_loadu_si256((const __m256i *) &input[i * 2]);
+		__m256i b = _mm256_loadu_si256((const __m256i *)
+							&input[i * 2 + 16]);
+		__m256i la, lb, v;
+
+		la = _mm256_srai_epi32(_mm256_slli_epi32(a, 16), 16);
+		lb = _mm256_srai_epi32(_mm256_slli_epi32(b, 16), 16);
+		v = _mm256_permute4x64_epi64(_mm256_packs_epi32(la, lb), 0xd8);
+		_mm256_storeu_si256((__m256i *) &l[i], v);
+
+		v = _mm256_packs_epi32(_mm256_srai_epi32(a, 16),
+						_mm256_srai_epi32(b, 16));
+		v = _mm256_permute4x64_epi64(v, 0xd8);
+		_mm256_storeu_si256((__m256i *) &r[i], v);
+	}
+
+	deinterleave_c(&l[i], &r[i], &input[i * 2], frames - i);
+}
+
+static AVX2 void scale_avx2(void *out, const void *in, size_t samples,
+								int16_t gain)
+{
+	const int16_t *input = in;
+	int16_t *output = out;
+	const __m256i g = _mm256_set1_epi16(gain);
+	size_t i;
+
+	/* unpack and pack both stay in lane so no permute is needed here */
+	for (i = 0; i + 16 <= samples; i += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) &input[i]);
+		__m256i lo = _mm256_mullo_epi16(v, g);
+		__m256i hi = _mm256_mulhi_epi16(v, g);
+		__m256i p0 = _mm256_srai_epi32(_mm256_unpacklo_epi16(lo, hi),
+									12);
+		__m256i p1 = _mm256_srai_epi32(_mm256_unpackhi_epi16(lo, hi),
+									12);
+
+		_mm256_storeu_si256((__m256i *) &output[i],
+						_mm256_packs_epi32(p0, p1));
+	}
+
+	scale_c(&output[i], &input[i], samples - i, gain);
+}
+
+static AVX2 void saturate_avx2(void *out, const int32_t *in, size_t samples)
+{
+	int16_t *output = out;
+	size_t i;
+
+	for (i = 0; i + 16 <= samples; i += 16) {
+		__m256i a = _mm256_loadu_si256((const __m256i *) &in[i]);
+		__m256i b = _mm256_loadu_si256((const __m256i *) &in[i + 8]);
+
+		a = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xd8);
+		_mm256_storeu_si256((__m256i *) &output[i], a);
+	}
+
+	saturate_c(&output[i], &in[i], samples - i);
+}
+
+static const struct pcm_ops pcm_avx2 = {
+	.name = "avx2",
+	.downmix = downmix_avx2,
+	.interleave = interleave_avx2,
+	.deinterleave = deinterleave_avx2,
+	.scale = scale_avx2,
+	.saturate = saturate_avx2,
+};
+
+static bool avx2_supported(void)
+{
+	__builtin_cpu_init();
+
+	return __builtin_cpu_supports("avx2");
+}
+#endif
+
+#ifdef HAVE_PCM_NEON
+static void downmix_neon(void *out, const void *in, size_t frames)
+{
+	const int16_t *input = in;
+	int16_t *output = out;
+	size_t i;
+
+	/* halving add is (l + r) >> 1 without intermediate overflow */
+	for (i = 0; i + 8 <= frames; i += 8) {
+		int16x8x2_t v = vld2q_s16(&input[i * 2]);
+
+		vst1q_s16(&output[i], vhaddq_s16(v.val[0], v.val[1]));
+	}
+
+	downmix_c(&output[i], &input[i * 2], frames - i);
+}
+
+static void interleave_neon(void *out, const void *left, const void *right,
+								size_t frames)
+{
+	const int16_t *l = left;
+	const int16_t *r = right;
+	int16_t *output = out;
+	size_t i;
+
+	for (i = 0; i + 8 <= frames; i += 8) {
+		int16x8x2_t v;
+
+		v.val[0] = vld1q_s16(&l[i]);
+		v.val[1] = vld1q_s16(&r[i]);
+		vst2q_s16(&output[i * 2], v);
+	}
+
+	interleave_c(&output[i * 2], &l[i], &r[i], frames - i);
+}
+
+static void deinterleave_neon(void *left, void *right, const void *in,
+								size_t frames)
+{
+	const int16_t *input = in;
+	int16_t *l = left;
+	int16_t *r = right;
+	size_t i;
+
+	for (i = 0; i + 8 <= frames; i += 8) {
+		int16x8x2_t v = vld2q_s16(&input[i * 2]);
+
+		vst1q_s16(&l[i], v.val[0]);
+		vst1q_s16(&r[i], v.val[1]);
+	}
+
+	deinterleave_c(&l[i], &r[i], &input[i * 2], frames - i);
+}
+
+static void scale_neon(void *out, const void *in, size_t samples,
+								int16_t gain)
+{
+	const int16_t *input = in;
+	int16_t *output = out;
+	const int16x4_t g = vdup_n_s16(gain);
+	size_t i;
+
+	for (i = 0; i + 8 <= samples; i += 8) {
+		int16x8_t v = vld1q_s16(&input[i]);
+		int32x4_t lo = vmull_s16(vget_low_s16(v), g);
+		int32x4_t hi = vmull_s16(vget_high_s16(v), g);
+
+		vst1q_s16(&output[i], vcombine_s16(vqshrn_n_s32(lo, 12),
+						vqshrn_n_s32(hi, 12)));
+	}
+
+	scale_c(&output[i], &input[i], samples - i, gain);
+}
+
+static void saturate_neon(void *out, const int32_t *in, size_t samples)
+{
+	int16_t *output = out;
+	size_t i;
+
+	for (i = 0; i + 8 <= samples; i += 8) {
+		int32x4_t a = vld1q_s32(&in[i]);
+		int32x4_t b = vld1q_s32(&in[i + 4]);
+
+		vst1q_s16(&output[i], vcombine_s16(vqmovn_s32(a),
+							vqmovn_s32(b)));
+	}
+
+	saturate_c(&output[i], &in[i], samples - i);
+}
+
+static const struct pcm_ops pcm_neon = {
+	.name = "neon",
+	.downmix = downmix_neon,
+	.interleave = interleave_neon,
+	.deinterleave = deinterleave_neon,
+	.scale = scale_neon,
+	.saturate = saturate_neon,
+};
+#endif
+
+static const struct pcm_ops *impls[5];
+static unsigned int impls_count;
+
+static void init_impls(void)
+{
+	unsigned int count = 0;
+
+	impls[count++] = &pcm_c;
+
+#ifdef HAVE_PCM_SSE2
+	impls[count++] = &pcm_sse2;
+#endif
+
+#ifdef HAVE_PCM_AVX2
+	if (avx2_supported())
+		impls[count++] = &pcm_avx2;
+#endif
+
+#ifdef HAVE_PCM_NEON
+	impls[count++] = &pcm_neon;
+#endif
+
+	impls[count] = NULL;
+
+	/* setting this last makes concurrent first calls harmless */
+	__atomic_store_n(&impls_count, count, __ATOMIC_RELEASE);
+}
+
+const struct pcm_ops *pcm_get_impl(unsigned int index)
+{
+	unsigned int count = __atomic_load_n(&impls_count, __ATOMIC_ACQUIRE);
+
+	if (!count) {
+		init_impls();
+		count = impls_count;
+	}
+
+	if (index >= count)
+		return NULL;
+
+	return impls[index];
+}
+
+const struct pcm_ops *pcm_get_ops(void)
+{
+	unsigned int count = __atomic_load_n(&impls_count, __ATOMIC_ACQUIRE);
+
+	if (!count) {
+		init_impls();
+		count = impls_count;
+	}
+
+	return impls[count - 1];
+}
+
+int16_t pcm_gain_from_float(float volume)
+{
+	float gain = volume * PCM_GAIN_UNITY;
+
+	if (gain <= 0)
+		return 0;
+
+	if (gain >= INT16_MAX)
+		return INT16_MAX;
+
+	return (int16_t) (gain + 0.5f);
+}
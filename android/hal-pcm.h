@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Gain for pcm_scale() is Q12 fixed point */
+#define PCM_GAIN_UNITY	4096
+
+/*
+ * All buffers hold signed 16bit little endian PCM (except 32bit input of
+ * saturate) and need not be aligned.
+ */
+struct pcm_ops {
+	const char *name;
+
+	void (*downmix) (void *out, const void *in, size_t frames);
+	void (*interleave) (void *out, const void *left, const void *right,
+							size_t frames);
+	void (*deinterleave) (void *left, void *right, const void *in,
+							size_t frames);
+	void (*scale) (void *out, const void *in, size_t samples,
+							int16_t gain);
+	void (*saturate) (void *out, const int32_t *in, size_t samples);
+};
+
+/* Implementations usable on this CPU, scalar one first, NULL terminated */
+const struct pcm_ops *pcm_get_impl(unsigned int index);
+
+/* Fastest implementation usable on this CPU */
+const struct pcm_ops *pcm_get_ops(void);
+
+int16_t pcm_gain_from_float(float volume);
+
+static inline void pcm_downmix_to_mono(void *out, const void *in,
+								size_t frames)
+{
+	pcm_get_ops()->downmix(out, in, frames);
+}
+
+static inline void pcm_interleave(void *out, const void *left,
+					const void *right, size_t frames)
+{
+	pcm_get_ops()->interleave(out, left, right, frames);
+}
+
+static inline void pcm_deinterleave(void *left, void *right,
+					const void *in, size_t frames)
+{
+	pcm_get_ops()->deinterleave(left, right, in, frames);
+}
+
+static inline void pcm_scale(void *out, const void *in, size_t samples,
+								int16_t gain)
+{
+	pcm_get_ops()->scale(out, in, samples, gain);
+}
+
+static inline void pcm_saturate(void *out, const int32_t *in, size_t samples)
+{
+	pcm_get_ops()->saturate(out, in, samples);
+}
@@ -33,6 +33,7 @@
 #include "sco-msg.h"
 #include "ipc-common.h"
 #include "hal-log.h"
+#include "hal-pcm.h"
 
 #define AUDIO_STREAM_DEFAULT_RATE	44100
 #define AUDIO_STREAM_SCO_RATE		8000
@@ -262,21 +263,6 @@ static int ipc_connect_sco(int *fd, uint16_t *mtu)
 
 /* Audio stream functions */
 
-static void downmix_to_mono(struct sco_stream_out *out, const uint8_t *buffer,
-							size_t frame_num)
-{
-	const int16_t *input = (const void *) buffer;
-	int16_t *output = (void *) out->downmix_buf;
-	size_t i;
-
-	for (i = 0; i < frame_num; i++) {
-		int16_t l = le16_to_cpu(get_unaligned(&input[i * 2]));
-		int16_t r = le16_to_cpu(get_unaligned(&input[i * 2 + 1]));
-
-		put_unaligned(cpu_to_le16((l + r) >> 1), &output[i]);
-	}
-}
-
 static bool write_data(struct sco_stream_out *out, const uint8_t *buffer,
 								size_t bytes)
 {
@@ -362,7 +348,7 @@ static ssize_t out_write(struct audio_stream_out *stream, const void *buffer,
 		return -1;
 	}
 
-	downmix_to_mono(out, buffer, frame_num);
+	pcm_downmix_to_mono(out->downmix_buf, buffer, frame_num);
 
 	if (out->resampler) {
 		int ret;
@@ -0,0 +1,396 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2014  Intel Corporation. All rights reserved.
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <glib.h>
+
+#include "src/log.h"
+
+#include "socket-proxy.h"
+
+#define COND_ERR (G_IO_HUP | G_IO_ERR | G_IO_NVAL)
+
+/*
+ * Each direction moves data from in_fd to out_fd. When splice is available
+ * data goes socket -> pipe -> socket without being copied to userspace,
+ * otherwise it is bounced through buf. In both cases at most buf_size
+ * bytes are in flight, and while they are pending the in_fd is not polled
+ * for reading so a slow destination throttles the source instead of making
+ * us spin on EAGAIN.
+ */
+struct proxy_dir {
+	struct sock_proxy *proxy;
+	int in_fd;
+	int out_fd;
+	GIOChannel *in_io;
+	GIOChannel *out_io;
+	guint in_watch;
+	guint out_watch;
+	int pipe[2];
+	uint8_t *buf;
+	size_t buf_off;
+	size_t pending;
+	uint64_t bytes;
+	unsigned int stalls;
+};
+
+struct sock_proxy {
+	struct proxy_dir dir[2];
+	GIOChannel *io[2];
+	size_t buf_size;
+	sock_proxy_disconnect_func_t disconnect_cb;
+	void *user_data;
+};
+
+static gboolean in_event_cb(GIOChannel *io, GIOCondition cond,
+							gpointer user_data);
+static gboolean out_event_cb(GIOChannel *io, GIOCondition cond,
+							gpointer user_data);
+
+static void close_pipe(struct proxy_dir *dir)
+{
+	if (dir->pipe[0] >= 0)
+		close(dir->pipe[0]);
+
+	if (dir->pipe[1] >= 0)
+		close(dir->pipe[1]);
+
+	dir->pipe[0] = -1;
+	dir->pipe[1] = -1;
+}
+
+static bool switch_to_copy(struct proxy_dir *dir)
+{
+	ssize_t len;
+
+	DBG("splice not supported on fd %d -> fd %d, copying", dir->in_fd,
+								dir->out_fd);
+
+	if (!dir->buf)
+		dir->buf = g_malloc(dir->proxy->buf_size);
+
+	dir->buf_off = 0;
+
+	/* Move whatever was already spliced into the pipe to the buffer */
+	if (dir->pending > 0) {
+		len = read(dir->pipe[0], dir->buf, dir->pending);
+		if (len < 0 || (size_t) len != dir->pending) {
+			close_pipe(dir);
+			return false;
+		}
+	}
+
+	close_pipe(dir);
+
+	return true;
+}
+
+static ssize_t dir_read(struct proxy_dir *dir)
+{
+	size_t size = dir->proxy->buf_size;
+	ssize_t len;
+
+	if (dir->pipe[1] >= 0) {
+		len = splice(dir->in_fd, NULL, dir->pipe[1], NULL, size,
+					SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (len >= 0)
+			return len;
+
+		if (errno != EINVAL && errno != ENOSYS)
+			return -errno;
+
+		if (!switch_to_copy(dir))
+			return -EIO;
+	}
+
+	len = read(dir->in_fd, dir->buf, size);
+	if (len < 0)
+		return -errno;
+
+	dir->buf_off = 0;
+
+	return len;
+}
+
+static int dir_flush(struct proxy_dir *dir)
+{
+	while (dir->pending > 0) {
+		ssize_t len;
+
+		if (dir->pipe[0] >= 0) {
+			len = splice(dir->pipe[0], NULL, dir->out_fd, NULL,
+					dir->pending,
+					SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (len < 0 && (errno == EINVAL || errno == ENOSYS)) {
+				if (!switch_to_copy(dir))
+					return -EIO;
+				continue;
+			}
+		} else {
+			len = write(dir->out_fd, dir->buf + dir->buf_off,
+								dir->pending);
+			if (len > 0)
+				dir->buf_off += len;
+		}
+
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		if (!len)
+			return -EAGAIN;
+
+		dir->pending -= len;
+		dir->bytes += len;
+	}
+
+	return 0;
+}
+
+static void remove_watches(struct sock_proxy *proxy)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		struct proxy_dir *dir = &proxy->dir[i];
+
+		if (dir->in_watch > 0)
+			g_source_remove(dir->in_watch);
+
+		if (dir->out_watch > 0)
+			g_source_remove(dir->out_watch);
+
+		dir->in_watch = 0;
+		dir->out_watch = 0;
+	}
+}
+
+static void proxy_disconnect(struct sock_proxy *proxy)
+{
+	remove_watches(proxy);
+
+	if (proxy->disconnect_cb)
+		proxy->disconnect_cb(proxy->user_data);
+}
+
+static gboolean in_event_cb(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	struct proxy_dir *dir = user_data;
+	ssize_t len;
+	int err;
+
+	if (cond & G_IO_HUP) {
+		DBG("Socket %d hang up", dir->in_fd);
+		goto fail;
+	}
+
+	if (cond & (G_IO_ERR | G_IO_NVAL)) {
+		error("Socket %d error", dir->in_fd);
+		goto fail;
+	}
+
+	len = dir_read(dir);
+	if (len == -EAGAIN || len == -EINTR)
+		return TRUE;
+
+	if (len < 0) {
+		error("read(): %s", strerror(-len));
+		goto fail;
+	}
+
+	if (!len) {
+		DBG("Socket %d closed", dir->in_fd);
+		goto fail;
+	}
+
+	dir->pending = len;
+
+	err = dir_flush(dir);
+	if (!err)
+		return TRUE;
+
+	if (err != -EAGAIN) {
+		error("write(): %s", strerror(-err));
+		goto fail;
+	}
+
+	/* Destination is full, stop reading until it drains */
+	dir->stalls++;
+	dir->in_watch = 0;
+	dir->out_watch = g_io_add_watch(dir->out_io, G_IO_OUT | COND_ERR,
+							out_event_cb, dir);
+
+	return FALSE;
+
+fail:
+	proxy_disconnect(dir->proxy);
+
+	return FALSE;
+}
+
+static gboolean out_event_cb(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	struct proxy_dir *dir = user_data;
+	int err;
+
+	if (cond & COND_ERR) {
+		DBG("Socket %d hang up or error", dir->out_fd);
+		goto fail;
+	}
+
+	err = dir_flush(dir);
+	if (err == -EAGAIN)
+		return TRUE;
+
+	if (err < 0) {
+		error("write(): %s", strerror(-err));
+		goto fail;
+	}
+
+	dir->out_watch = 0;
+	dir->in_watch = g_io_add_watch(dir->in_io, G_IO_IN | COND_ERR,
+							in_event_cb, dir);
+
+	return FALSE;
+
+fail:
+	proxy_disconnect(dir->proxy);
+
+	return FALSE;
+}
+
+static int set_nonblock(int fd)
+{
+	int flags;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0)
+		return -errno;
+
+	if (flags & O_NONBLOCK)
+		return 0;
+
+	if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static void dir_init(struct sock_proxy *proxy, struct proxy_dir *dir,
+						int in, int out)
+{
+	dir->proxy = proxy;
+	dir->in_fd = g_io_channel_unix_get_fd(proxy->io[in]);
+	dir->out_fd = g_io_channel_unix_get_fd(proxy->io[out]);
+	dir->in_io = proxy->io[in];
+	dir->out_io = proxy->io[out];
+
+	if (pipe2(dir->pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+		error("pipe2(): %s", strerror(errno));
+		dir->pipe[0] = -1;
+		dir->pipe[1] = -1;
+		dir->buf = g_malloc(proxy->buf_size);
+	}
+
+	dir->in_watch = g_io_add_watch(dir->in_io, G_IO_IN | COND_ERR,
+							in_event_cb, dir);
+}
+
+struct sock_proxy *sock_proxy_new(int fd_a, int fd_b, size_t buf_size,
+					sock_proxy_disconnect_func_t func,
+					void *user_data)
+{
+	struct sock_proxy *proxy;
+
+	if (fd_a < 0 || fd_b < 0 || !buf_size)
+		return NULL;
+
+	if (set_nonblock(fd_a) < 0 || set_nonblock(fd_b) < 0) {
+		error("Failed to set non-blocking mode: %s", strerror(errno));
+		return NULL;
+	}
+
+	proxy = g_new0(struct sock_proxy, 1);
+	proxy->buf_size = buf_size;
+	proxy->disconnect_cb = func;
+	proxy->user_data = user_data;
+
+	proxy->io[0] = g_io_channel_unix_new(fd_a);
+	proxy->io[1] = g_io_channel_unix_new(fd_b);
+
+	dir_init(proxy, &proxy->dir[SOCK_PROXY_A_TO_B], 0, 1);
+	dir_init(proxy, &proxy->dir[SOCK_PROXY_B_TO_A], 1, 0);
+
+	DBG("proxy %p fd %d <-> fd %d buf_size %zu", proxy, fd_a, fd_b,
+								buf_size);
+
+	return proxy;
+}
+
+void sock_proxy_free(struct sock_proxy *proxy)
+{
+	int i;
+
+	if (!proxy)
+		return;
+
+	remove_watches(proxy);
+
+	for (i = 0; i < 2; i++) {
+		close_pipe(&proxy->dir[i]);
+		g_free(proxy->dir[i].buf);
+		g_io_channel_unref(proxy->io[i]);
+	}
+
+	g_free(proxy);
+}
+
+void sock_proxy_get_stats(struct sock_proxy *proxy,
+					struct sock_proxy_stats *stats)
+{
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+
+	if (!proxy)
+		return;
+
+	for (i = 0; i < 2; i++) {
+		stats->bytes[i] = proxy->dir[i].bytes;
+		stats->stalls[i] = proxy->dir[i].stalls;
+		stats->splice[i] = proxy->dir[i].pipe[0] >= 0;
+	}
+}
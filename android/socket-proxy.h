@@ -0,0 +1,48 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2014  Intel Corporation. All rights reserved.
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum sock_proxy_dir {
+	SOCK_PROXY_A_TO_B,
+	SOCK_PROXY_B_TO_A,
+};
+
+struct sock_proxy_stats {
+	uint64_t bytes[2];	/* bytes delivered, indexed by direction */
+	unsigned int stalls[2];	/* times the destination was full */
+	bool splice[2];		/* direction still uses zero-copy splice */
+};
+
+struct sock_proxy;
+
+typedef void (*sock_proxy_disconnect_func_t)(void *user_data);
+
+struct sock_proxy *sock_proxy_new(int fd_a, int fd_b, size_t buf_size,
+					sock_proxy_disconnect_func_t func,
+					void *user_data);
+void sock_proxy_free(struct sock_proxy *proxy);
+
+void sock_proxy_get_stats(struct sock_proxy *proxy,
+					struct sock_proxy_stats *stats);
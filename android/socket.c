@@ -29,6 +29,7 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <errno.h>
+#include <inttypes.h>
 
 #include "lib/bluetooth.h"
 #include "btio/btio.h"
@@ -43,6 +44,7 @@
 #include "ipc.h"
 #include "utils.h"
 #include "bluetooth.h"
+#include "socket-proxy.h"
 #include "socket.h"
 
 #define RFCOMM_CHANNEL_MAX 30
@@ -69,7 +71,6 @@ struct rfcomm_sock {
 
 	/* for socket to BT */
 	int bt_sock;
-	guint bt_watch;
 
 	/* for socket to HAL */
 	int jv_sock;
@@ -78,7 +79,8 @@ struct rfcomm_sock {
 	bdaddr_t dst;
 	uint32_t service_handle;
 
-	uint8_t *buf;
+	/* moves data between jv_sock (A) and bt_sock (B) once connected */
+	struct sock_proxy *proxy;
 	int buf_size;
 };
 
@@ -119,7 +121,6 @@ static int rfsock_set_buffer(struct rfcomm_sock *rfsock)
 
 	DBG("Set buffer size %d", size);
 
-	rfsock->buf = g_malloc(size);
 	rfsock->buf_size = size;
 
 	return 0;
@@ -132,6 +133,21 @@ static void cleanup_rfsock(gpointer data)
 	DBG("rfsock %p bt_sock %d jv_sock %d", rfsock, rfsock->bt_sock,
 							rfsock->jv_sock);
 
+	if (rfsock->proxy) {
+		struct sock_proxy_stats stats;
+
+		sock_proxy_get_stats(rfsock->proxy, &stats);
+
+		DBG("rfsock %p sent %" PRIu64 " (%u stalls) received %" PRIu64
+			" (%u stalls)", rfsock,
+			stats.bytes[SOCK_PROXY_A_TO_B],
+			stats.stalls[SOCK_PROXY_A_TO_B],
+			stats.bytes[SOCK_PROXY_B_TO_A],
+			stats.stalls[SOCK_PROXY_B_TO_A]);
+
+		sock_proxy_free(rfsock->proxy);
+	}
+
 	if (rfsock->jv_sock >= 0)
 		if (close(rfsock->jv_sock) < 0)
 			error("close() fd %d failed: %s", rfsock->jv_sock,
@@ -142,10 +158,6 @@ static void cleanup_rfsock(gpointer data)
 			error("close() fd %d: failed: %s", rfsock->bt_sock,
 							strerror(errno));
 
-	if (rfsock->bt_watch > 0)
-		if (!g_source_remove(rfsock->bt_watch))
-			error("bt_watch source was not found");
-
 	if (rfsock->jv_watch > 0)
 		if (!g_source_remove(rfsock->jv_watch))
 			error("stack_watch source was not found");
@@ -153,9 +165,6 @@ static void cleanup_rfsock(gpointer data)
 	if (rfsock->service_handle)
 		bt_adapter_remove_record(rfsock->service_handle);
 
-	if (rfsock->buf)
-		g_free(rfsock->buf);
-
 	g_free(rfsock);
 }
 
@@ -513,105 +522,28 @@ static const struct profile_info *get_profile_by_uuid(const uint8_t *uuid)
 	return NULL;
 }
 
-static int try_write_all(int fd, unsigned char *buf, int len)
+static void rfsock_disconnect_cb(void *user_data)
 {
-	int sent = 0;
-
-	while (len > 0) {
-		int written;
-
-		written = write(fd, buf, len);
-		if (written < 0) {
-			if (errno == EINTR || errno == EAGAIN)
-				continue;
-			return -1;
-		}
-
-		if (!written)
-			return 0;
-
-		len -= written; buf += written; sent += written;
-	}
-
-	return sent;
-}
-
-static gboolean jv_sock_client_event_cb(GIOChannel *io, GIOCondition cond,
-								gpointer data)
-{
-	struct rfcomm_sock *rfsock = data;
-	int len, sent;
-
-	if (cond & G_IO_HUP) {
-		DBG("Socket %d hang up", g_io_channel_unix_get_fd(io));
-		goto fail;
-	}
-
-	if (cond & (G_IO_ERR | G_IO_NVAL)) {
-		error("Socket %d error", g_io_channel_unix_get_fd(io));
-		goto fail;
-	}
-
-	len = read(rfsock->jv_sock, rfsock->buf, rfsock->buf_size);
-	if (len <= 0) {
-		error("read(): %s", strerror(errno));
-		/* Read again */
-		return TRUE;
-	}
-
-	sent = try_write_all(rfsock->bt_sock, rfsock->buf, len);
-	if (sent < 0) {
-		error("write(): %s", strerror(errno));
-		goto fail;
-	}
+	struct rfcomm_sock *rfsock = user_data;
 
-	return TRUE;
-fail:
-	DBG("rfsock %p jv_sock %d cond %d", rfsock, rfsock->jv_sock, cond);
+	DBG("rfsock %p bt_sock %d jv_sock %d", rfsock, rfsock->bt_sock,
+							rfsock->jv_sock);
 
 	connections = g_list_remove(connections, rfsock);
 	cleanup_rfsock(rfsock);
-
-	return FALSE;
 }
 
-static gboolean bt_sock_event_cb(GIOChannel *io, GIOCondition cond,
-								gpointer data)
+static bool rfsock_start_proxy(struct rfcomm_sock *rfsock)
 {
-	struct rfcomm_sock *rfsock = data;
-	int len, sent;
-
-	if (cond & G_IO_HUP) {
-		DBG("Socket %d hang up", g_io_channel_unix_get_fd(io));
-		goto fail;
-	}
-
-	if (cond & (G_IO_ERR | G_IO_NVAL)) {
-		error("Socket %d error", g_io_channel_unix_get_fd(io));
-		goto fail;
-	}
-
-	len = read(rfsock->bt_sock, rfsock->buf, rfsock->buf_size);
-	if (len <= 0) {
-		error("read(): %s", strerror(errno));
-		/* Read again */
-		return TRUE;
-	}
-
-	sent = try_write_all(rfsock->jv_sock, rfsock->buf, len);
-	if (sent < 0) {
-		error("write(): %s", strerror(errno));
-		goto fail;
+	rfsock->proxy = sock_proxy_new(rfsock->jv_sock, rfsock->bt_sock,
+						rfsock->buf_size,
+						rfsock_disconnect_cb, rfsock);
+	if (!rfsock->proxy) {
+		error("Failed to set up socket proxy");
+		return false;
 	}
 
-	return TRUE;
-fail:
-	DBG("rfsock %p bt_sock %d cond %d", rfsock, rfsock->bt_sock, cond);
-
-	connections = g_list_remove(connections, rfsock);
-	cleanup_rfsock(rfsock);
-
-	return FALSE;
+	return true;
 }
 
 static bool sock_send_accept(struct rfcomm_sock *rfsock, bdaddr_t *bdaddr,
@@ -658,14 +590,11 @@ static void accept_cb(GIOChannel *io, GError *err, gpointer user_data)
 {
 	struct rfcomm_sock *rfsock = user_data;
 	struct rfcomm_sock *new_rfsock;
-	GIOChannel *jv_io;
 	GError *gerr = NULL;
 	bdaddr_t dst;
 	char address[18];
 	int new_sock;
 	int hal_sock;
-	guint id;
-	GIOCondition cond;
 
 	if (err) {
 		error("%s", err->message);
@@ -701,22 +630,15 @@ static void accept_cb(GIOChannel *io, GError *err, gpointer user_data)
 		return;
 	}
 
-	connections = g_list_append(connections, new_rfsock);
-
-	/* Handle events from Android */
-	cond = G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL;
-	jv_io = g_io_channel_unix_new(new_rfsock->jv_sock);
-	id = g_io_add_watch(jv_io, cond, jv_sock_client_event_cb, new_rfsock);
-	g_io_channel_unref(jv_io);
-
-	new_rfsock->jv_watch = id;
-
-	/* Handle rfcomm events */
-	cond = G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL;
-	id = g_io_add_watch(io, cond, bt_sock_event_cb, new_rfsock);
+	/* new_rfsock owns the socket from now on */
 	g_io_channel_set_close_on_unref(io, FALSE);
 
-	new_rfsock->bt_watch = id;
+	if (!rfsock_start_proxy(new_rfsock)) {
+		cleanup_rfsock(new_rfsock);
+		return;
+	}
+
+	connections = g_list_append(connections, new_rfsock);
 }
 
 static int find_free_channel(void)
@@ -919,10 +841,7 @@ static void connect_cb(GIOChannel *io, GError *err, gpointer user_data)
 {
 	struct rfcomm_sock *rfsock = user_data;
 	bdaddr_t *dst = &rfsock->dst;
-	GIOChannel *jv_io;
 	char address[18];
-	guint id;
-	GIOCondition cond;
 
 	if (err) {
 		error("%s", err->message);
@@ -936,20 +855,8 @@ static void connect_cb(GIOChannel *io, GError *err, gpointer user_data)
 	if (!sock_send_connect(rfsock, dst))
 		goto fail;
 
-	/* Handle events from Android */
-	cond = G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL;
-	jv_io = g_io_channel_unix_new(rfsock->jv_sock);
-	id = g_io_add_watch(jv_io, cond, jv_sock_client_event_cb, rfsock);
-	g_io_channel_unref(jv_io);
-
-	rfsock->jv_watch = id;
-
-	/* Handle rfcomm events */
-	cond = G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL;
-	id = g_io_add_watch(io, cond, bt_sock_event_cb, rfsock);
-	g_io_channel_set_close_on_unref(io, FALSE);
-
-	rfsock->bt_watch = id;
+	if (!rfsock_start_proxy(rfsock))
+		goto fail;
 
 	return;
 fail:
@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "android/hal-pcm.h"
+
+/* odd number so that every implementation also runs its scalar tail */
+#define FRAMES		1027
+#define BENCH_FRAMES	4096
+#define BENCH_ROUNDS	2000
+
+/* spare bytes allow testing unaligned buffers */
+struct buffers {
+	uint8_t in[FRAMES * 4 * 2 + 8];
+	uint8_t left[FRAMES * 2 + 8];
+	uint8_t right[FRAMES * 2 + 8];
+	uint8_t out[FRAMES * 4 + 8];
+	uint8_t ref[FRAMES * 4 + 8];
+	int32_t wide[FRAMES * 2];
+};
+
+static const int16_t edge_values[] = {
+	INT16_MIN, INT16_MIN + 1, -1, 0, 1, INT16_MAX - 1, INT16_MAX,
+};
+
+static void fill_random(void *buf, size_t len, uint32_t seed)
+{
+	uint8_t *ptr = buf;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		seed = seed * 1103515245 + 12345;
+		ptr[i] = seed >> 16;
+	}
+
+	/* make sure extremes are exercised */
+	memcpy(buf, edge_values, MIN(len, sizeof(edge_values)));
+}
+
+static void fill_wide(int32_t *buf, size_t samples)
+{
+	size_t i;
+
+	for (i = 0; i < samples; i++)
+		buf[i] = (int32_t) (i * 2654435761u) >> (i % 15);
+}
+
+static void test_bitexact(gconstpointer data)
+{
+	const struct pcm_ops *ref = pcm_get_impl(0);
+	const struct pcm_ops *ops;
+	static struct buffers b;
+	static const int16_t gains[] = { 0, 1, 2048, PCM_GAIN_UNITY, 5000,
+								INT16_MAX };
+	unsigned int i, j, off;
+
+	g_assert(ref);
+	g_assert(pcm_get_ops());
+
+	fill_random(b.in, sizeof(b.in), 1);
+	fill_random(b.left, sizeof(b.left), 2);
+	fill_random(b.right, sizeof(b.right), 3);
+	fill_wide(b.wide, G_N_ELEMENTS(b.wide));
+
+	for (i = 1; (ops = pcm_get_impl(i)); i++) {
+		for (off = 0; off < 2; off++) {
+			size_t len;
+
+			len = FRAMES * 2;
+			ref->downmix(b.ref, b.in + off, FRAMES);
+			ops->downmix(b.out + off, b.in + off, FRAMES);
+			g_assert(!memcmp(b.ref, b.out + off, len));
+
+			len = FRAMES * 4;
+			ref->interleave(b.ref, b.left + off, b.right, FRAMES);
+			ops->interleave(b.out + off, b.left + off, b.right,
+								FRAMES);
+			g_assert(!memcmp(b.ref, b.out + off, len));
+
+			len = FRAMES * 2;
+			ref->deinterleave(b.ref, b.ref + len, b.in + off,
+								FRAMES);
+			ops->deinterleave(b.out + off, b.out + len + off + 1,
+							b.in + off, FRAMES);
+			g_assert(!memcmp(b.ref, b.out + off, len));
+			g_assert(!memcmp(b.ref + len, b.out + len + off + 1,
+									len));
+
+			for (j = 0; j < G_N_ELEMENTS(gains); j++) {
+				len = FRAMES * 4;
+				ref->scale(b.ref, b.in + off, FRAMES * 2,
+								gains[j]);
+				ops->scale(b.out + off, b.in + off, FRAMES * 2,
+								gains[j]);
+				g_assert(!memcmp(b.ref, b.out + off, len));
+			}
+
+			len = FRAMES * 4;
+			ref->saturate(b.ref, b.wide, FRAMES * 2);
+			ops->saturate(b.out + off, b.wide, FRAMES * 2);
+			g_assert(!memcmp(b.ref, b.out + off, len));
+		}
+
+		g_test_message("%s matches %s", ops->name, ref->name);
+	}
+}
+
+static void test_scalar(gconstpointer data)
+{
+	const struct pcm_ops *ops = pcm_get_impl(0);
+	int16_t in[] = { INT16_MAX, INT16_MAX, INT16_MIN, INT16_MIN, -3, 0,
+								100, -201 };
+	int16_t out[8];
+	int32_t wide[] = { 40000, -40000, 32767, -32768 };
+
+	ops->downmix(out, in, 4);
+	g_assert(out[0] == INT16_MAX);
+	g_assert(out[1] == INT16_MIN);
+	g_assert(out[2] == -2);
+	g_assert(out[3] == -51);
+
+	ops->scale(out, in, 2, PCM_GAIN_UNITY * 2);
+	g_assert(out[0] == INT16_MAX);
+	g_assert(out[1] == INT16_MAX);
+
+	ops->scale(out, in + 2, 1, PCM_GAIN_UNITY / 2);
+	g_assert(out[0] == INT16_MIN / 2);
+
+	ops->saturate(out, wide, 4);
+	g_assert(out[0] == INT16_MAX);
+	g_assert(out[1] == INT16_MIN);
+	g_assert(out[2] == INT16_MAX);
+	g_assert(out[3] == INT16_MIN);
+
+	g_assert(pcm_gain_from_float(1.0f) == PCM_GAIN_UNITY);
+	g_assert(pcm_gain_from_float(0.0f) == 0);
+	g_assert(pcm_gain_from_float(100.0f) == INT16_MAX);
+}
+
+static double bench_downmix(const struct pcm_ops *ops, void *out,
+							const void *in)
+{
+	gint64 start;
+	int i;
+
+	start = g_get_monotonic_time();
+
+	for (i = 0; i < BENCH_ROUNDS; i++)
+		ops->downmix(out, in, BENCH_FRAMES);
+
+	return (g_get_monotonic_time() - start) / 1000.0;
+}
+
+static double bench_scale(const struct pcm_ops *ops, void *out,
+							const void *in)
+{
+	gint64 start;
+	int i;
+
+	start = g_get_monotonic_time();
+
+	for (i = 0; i < BENCH_ROUNDS; i++)
+		ops->scale(out, in, BENCH_FRAMES * 2, PCM_GAIN_UNITY / 3);
+
+	return (g_get_monotonic_time() - start) / 1000.0;
+}
+
+static void test_benchmark(gconstpointer data)
+{
+	const struct pcm_ops *ref = pcm_get_impl(0);
+	const struct pcm_ops *ops;
+	double ref_downmix, ref_scale;
+	uint8_t *in, *out;
+	unsigned int i;
+
+	in = g_malloc(BENCH_FRAMES * 4);
+	out = g_malloc(BENCH_FRAMES * 4);
+
+	fill_random(in, BENCH_FRAMES * 4, 4);
+
+	ref_downmix = bench_downmix(ref, out, in);
+	ref_scale = bench_scale(ref, out, in);
+
+	g_test_message("%-5s downmix %8.2f ms scale %8.2f ms", ref->name,
+						ref_downmix, ref_scale);
+
+	for (i = 1; (ops = pcm_get_impl(i)); i++) {
+		double downmix = bench_downmix(ops, out, in);
+		double scale = bench_scale(ops, out, in);
+
+		g_test_message("%-5s downmix %8.2f ms (%.1fx) scale %8.2f ms "
+				"(%.1fx)", ops->name, downmix,
+				ref_downmix / downmix, scale,
+				ref_scale / scale);
+	}
+
+	g_free(in);
+	g_free(out);
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_data_func("/hal_pcm/scalar", NULL, test_scalar);
+	g_test_add_data_func("/hal_pcm/bitexact", NULL, test_bitexact);
+	g_test_add_data_func("/hal_pcm/benchmark", NULL, test_benchmark);
+
+	return g_test_run();
+}
@@ -0,0 +1,396 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2014  Intel Corporation. All rights reserved.
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+
+#include "src/log.h"
+#include "android/socket-proxy.h"
+
+/*
+ * The proxy sits between the "HAL" socketpair (app <-> fd_a) and the
+ * "RFCOMM" socketpair (fd_b <-> remote), exactly like android/socket.c
+ * connects jv_sock and bt_sock.
+ */
+struct test_data {
+	size_t total;
+	size_t chunk;
+	size_t buf_size;
+	int sndbuf;
+	enum sock_proxy_dir dir;
+	unsigned int reader_delay;
+	bool expect_stall;
+	bool hangup;
+};
+
+struct context {
+	GMainLoop *main_loop;
+	const struct test_data *data;
+
+	struct sock_proxy *proxy;
+
+	int app[2];
+	int rf[2];
+
+	int src;
+	int dst;
+
+	size_t written;
+	size_t received;
+	uint8_t *wbuf;
+	uint8_t *rbuf;
+
+	guint write_source;
+	guint read_source;
+	guint delay_source;
+	guint timeout_source;
+
+	bool disconnected;
+	gint64 start;
+};
+
+static uint8_t pattern(size_t offset)
+{
+	return (offset * 7) % 251;
+}
+
+static void context_quit(struct context *context)
+{
+	g_main_loop_quit(context->main_loop);
+}
+
+static gboolean write_cb(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	struct context *context = user_data;
+	const struct test_data *data = context->data;
+	size_t len, i;
+	ssize_t ret;
+
+	g_assert(!(cond & (G_IO_ERR | G_IO_NVAL)));
+
+	len = MIN(data->chunk, data->total - context->written);
+
+	for (i = 0; i < len; i++)
+		context->wbuf[i] = pattern(context->written + i);
+
+	ret = write(context->src, context->wbuf, len);
+	if (ret < 0) {
+		g_assert(errno == EAGAIN || errno == EINTR);
+		return TRUE;
+	}
+
+	context->written += ret;
+
+	if (context->written < data->total)
+		return TRUE;
+
+	context->write_source = 0;
+
+	return FALSE;
+}
+
+static gboolean read_cb(GIOChannel *io, GIOCondition cond, gpointer user_data)
+{
+	struct context *context = user_data;
+	const struct test_data *data = context->data;
+	ssize_t ret, i;
+
+	g_assert(!(cond & (G_IO_ERR | G_IO_NVAL)));
+
+	ret = read(context->dst, context->rbuf, data->chunk);
+	if (ret < 0) {
+		g_assert(errno == EAGAIN || errno == EINTR);
+		return TRUE;
+	}
+
+	g_assert(ret > 0);
+
+	for (i = 0; i < ret; i++)
+		g_assert(context->rbuf[i] ==
+					pattern(context->received + i));
+
+	context->received += ret;
+
+	g_assert(context->received <= data->total);
+
+	if (context->received < data->total)
+		return TRUE;
+
+	context->read_source = 0;
+	context_quit(context);
+
+	return FALSE;
+}
+
+static void start_reader(struct context *context)
+{
+	GIOChannel *io;
+
+	io = g_io_channel_unix_new(context->dst);
+	context->read_source = g_io_add_watch(io, G_IO_IN | G_IO_ERR |
+						G_IO_NVAL, read_cb, context);
+	g_io_channel_unref(io);
+}
+
+static gboolean delay_cb(gpointer user_data)
+{
+	struct context *context = user_data;
+
+	context->delay_source = 0;
+	start_reader(context);
+
+	return FALSE;
+}
+
+static gboolean timeout_cb(gpointer user_data)
+{
+	struct context *context = user_data;
+
+	context->timeout_source = 0;
+	g_assert_not_reached();
+
+	return FALSE;
+}
+
+static void disconnect_cb(void *user_data)
+{
+	struct context *context = user_data;
+
+	context->disconnected = true;
+	context_quit(context);
+}
+
+static void set_nonblock(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	g_assert(flags >= 0);
+	g_assert(fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0);
+}
+
+static struct context *create_context(const struct test_data *data)
+{
+	struct context *context = g_new0(struct context, 1);
+
+	context->main_loop = g_main_loop_new(NULL, FALSE);
+	context->data = data;
+
+	g_assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0,
+							context->app) == 0);
+	g_assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0,
+							context->rf) == 0);
+
+	if (data->sndbuf) {
+		g_assert(setsockopt(context->rf[0], SOL_SOCKET, SO_SNDBUF,
+					&data->sndbuf, sizeof(int)) == 0);
+		g_assert(setsockopt(context->app[1], SOL_SOCKET, SO_SNDBUF,
+					&data->sndbuf, sizeof(int)) == 0);
+	}
+
+	set_nonblock(context->app[0]);
+	set_nonblock(context->rf[1]);
+
+	if (data->dir == SOCK_PROXY_A_TO_B) {
+		context->src = context->app[0];
+		context->dst = context->rf[1];
+	} else {
+		context->src = context->rf[1];
+		context->dst = context->app[0];
+	}
+
+	context->wbuf = g_malloc(data->chunk);
+	context->rbuf = g_malloc(data->chunk);
+
+	context->proxy = sock_proxy_new(context->app[1], context->rf[0],
+						data->buf_size, disconnect_cb,
+						context);
+	g_assert(context->proxy);
+
+	context->timeout_source = g_timeout_add_seconds(30, timeout_cb,
+								context);
+
+	return context;
+}
+
+static void destroy_context(struct context *context)
+{
+	if (context->write_source > 0)
+		g_source_remove(context->write_source);
+
+	if (context->read_source > 0)
+		g_source_remove(context->read_source);
+
+	if (context->delay_source > 0)
+		g_source_remove(context->delay_source);
+
+	if (context->timeout_source > 0)
+		g_source_remove(context->timeout_source);
+
+	sock_proxy_free(context->proxy);
+
+	if (context->app[0] >= 0)
+		close(context->app[0]);
+	close(context->app[1]);
+	close(context->rf[0]);
+	close(context->rf[1]);
+
+	g_free(context->wbuf);
+	g_free(context->rbuf);
+
+	g_main_loop_unref(context->main_loop);
+	g_free(context);
+}
+
+static void test_transfer(gconstpointer user_data)
+{
+	const struct test_data *data = user_data;
+	struct context *context = create_context(data);
+	struct sock_proxy_stats stats;
+	GIOChannel *io;
+	double secs;
+
+	io = g_io_channel_unix_new(context->src);
+	context->write_source = g_io_add_watch(io, G_IO_OUT | G_IO_ERR |
+						G_IO_NVAL, write_cb, context);
+	g_io_channel_unref(io);
+
+	if (data->reader_delay)
+		context->delay_source = g_timeout_add(data->reader_delay,
+							delay_cb, context);
+	else
+		start_reader(context);
+
+	context->start = g_get_monotonic_time();
+
+	g_main_loop_run(context->main_loop);
+
+	secs = (g_get_monotonic_time() - context->start) / 1000000.0;
+
+	g_assert(!context->disconnected);
+	g_assert(context->received == data->total);
+
+	sock_proxy_get_stats(context->proxy, &stats);
+
+	g_assert(stats.bytes[data->dir] == data->total);
+	g_assert(stats.bytes[!data->dir] == 0);
+
+	if (data->expect_stall)
+		g_assert(stats.stalls[data->dir] > 0);
+
+	g_test_message("%zu bytes in %.3f s (%.1f MB/s), %u stalls, %s",
+				data->total, secs,
+				data->total / secs / (1024 * 1024),
+				stats.stalls[data->dir],
+				stats.splice[data->dir] ? "splice" : "copy");
+
+	destroy_context(context);
+}
+
+static void test_hangup(gconstpointer user_data)
+{
+	const struct test_data *data = user_data;
+	struct context *context = create_context(data);
+
+	close(context->app[0]);
+	context->app[0] = -1;
+
+	g_main_loop_run(context->main_loop);
+
+	g_assert(context->disconnected);
+
+	destroy_context(context);
+}
+
+static const struct test_data transfer_a_to_b = {
+	.total = 64 * 1024 * 1024,
+	.chunk = 32 * 1024,
+	.buf_size = 64 * 1024,
+	.dir = SOCK_PROXY_A_TO_B,
+};
+
+static const struct test_data transfer_b_to_a = {
+	.total = 64 * 1024 * 1024,
+	.chunk = 32 * 1024,
+	.buf_size = 64 * 1024,
+	.dir = SOCK_PROXY_B_TO_A,
+};
+
+static const struct test_data backpressure_a_to_b = {
+	.total = 4 * 1024 * 1024,
+	.chunk = 4096,
+	.buf_size = 16 * 1024,
+	.sndbuf = 4096,
+	.reader_delay = 100,
+	.dir = SOCK_PROXY_A_TO_B,
+	.expect_stall = true,
+};
+
+static const struct test_data backpressure_b_to_a = {
+	.total = 4 * 1024 * 1024,
+	.chunk = 4096,
+	.buf_size = 16 * 1024,
+	.sndbuf = 4096,
+	.reader_delay = 100,
+	.dir = SOCK_PROXY_B_TO_A,
+	.expect_stall = true,
+};
+
+static const struct test_data hangup = {
+	.chunk = 1,
+	.buf_size = 1024,
+};
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+	if (g_test_verbose())
+		__btd_log_init("*", 0);
+
+	g_test_add_data_func("/android_socket_proxy/throughput_a_to_b",
+					&transfer_a_to_b, test_transfer);
+	g_test_add_data_func("/android_socket_proxy/throughput_b_to_a",
+					&transfer_b_to_a, test_transfer);
+	g_test_add_data_func("/android_socket_proxy/backpressure_a_to_b",
+					&backpressure_a_to_b, test_transfer);
+	g_test_add_data_func("/android_socket_proxy/backpressure_b_to_a",
+					&backpressure_b_to_a, test_transfer);
+	g_test_add_data_func("/android_socket_proxy/hangup", &hangup,
+								test_hangup);
+
+	return g_test_run();
+}
@@ -28,6 +28,8 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <glib.h>
 #include <bluetooth/sdp.h>
 #include <bluetooth/sdp_lib.h>
@@ -1086,6 +1088,1163 @@ guint gatt_signed_write_cmd(GAttrib *attrib, uint16_t handle,
 	return g_attrib_send(attrib, 0, buf, plen, NULL, user_data, notify);
 }
 
+struct gatt_cache {
+	int ref;
+	GSList *primaries;
+	GSList *includes;
+	GSList *chars;
+	GSList *descs;
+	GSList *missing;	/* ranges not discovered */
+};
+
+struct gatt_cache *gatt_cache_new(void)
+{
+	struct gatt_cache *cache;
+
+	cache = g_new0(struct gatt_cache, 1);
+
+	return gatt_cache_ref(cache);
+}
+
+struct gatt_cache *gatt_cache_ref(struct gatt_cache *cache)
+{
+	cache->ref++;
+
+	return cache;
+}
+
+void gatt_cache_unref(struct gatt_cache *cache)
+{
+	if (!cache)
+		return;
+
+	cache->ref--;
+
+	if (cache->ref > 0)
+		return;
+
+	g_slist_free_full(cache->primaries, g_free);
+	g_slist_free_full(cache->includes, g_free);
+	g_slist_free_full(cache->chars, g_free);
+	g_slist_free_full(cache->descs, g_free);
+	g_slist_free_full(cache->missing, g_free);
+	g_free(cache);
+}
+
+static gint primary_cmp(gconstpointer a, gconstpointer b)
+{
+	const struct gatt_primary *pa = a, *pb = b;
+
+	return pa->range.start - pb->range.start;
+}
+
+static gint included_cmp(gconstpointer a, gconstpointer b)
+{
+	const struct gatt_included *ia = a, *ib = b;
+
+	return ia->handle - ib->handle;
+}
+
+static gint char_cmp(gconstpointer a, gconstpointer b)
+{
+	const struct gatt_char *ca = a, *cb = b;
+
+	return ca->handle - cb->handle;
+}
+
+static gint desc_cmp(gconstpointer a, gconstpointer b)
+{
+	const struct gatt_desc *da = a, *db = b;
+
+	return da->handle - db->handle;
+}
+
+void gatt_cache_add_primary(struct gatt_cache *cache,
+					const struct gatt_primary *prim)
+{
+	cache->primaries = g_slist_insert_sorted(cache->primaries,
+				g_memdup(prim, sizeof(*prim)), primary_cmp);
+}
+
+void gatt_cache_add_included(struct gatt_cache *cache,
+					const struct gatt_included *incl)
+{
+	cache->includes = g_slist_insert_sorted(cache->includes,
+				g_memdup(incl, sizeof(*incl)), included_cmp);
+}
+
+void gatt_cache_add_char(struct gatt_cache *cache, const struct gatt_char *chr)
+{
+	cache->chars = g_slist_insert_sorted(cache->chars,
+				g_memdup(chr, sizeof(*chr)), char_cmp);
+}
+
+void gatt_cache_add_desc(struct gatt_cache *cache, const struct gatt_desc *desc)
+{
+	cache->descs = g_slist_insert_sorted(cache->descs,
+				g_memdup(desc, sizeof(*desc)), desc_cmp);
+}
+
+void gatt_cache_add_missing(struct gatt_cache *cache, uint16_t start,
+								uint16_t end)
+{
+	struct att_range *range;
+
+	range = g_new0(struct att_range, 1);
+	range->start = start;
+	range->end = end;
+
+	cache->missing = g_slist_prepend(cache->missing, range);
+}
+
+static gboolean cache_missing(struct gatt_cache *cache, uint16_t start,
+								uint16_t end)
+{
+	GSList *l;
+
+	for (l = cache->missing; l; l = l->next) {
+		struct att_range *range = l->data;
+
+		if (range->start <= end && range->end >= start)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* UUIDs are stored as 128-bit strings, use the short form when possible */
+static int cache_uuid(const char *str, bt_uuid_t *uuid)
+{
+	bt_uuid_t uuid16, uuid128;
+
+	if (bt_string_to_uuid(uuid, str) < 0)
+		return -EINVAL;
+
+	if (uuid->type == BT_UUID16)
+		return 0;
+
+	if (uuid->type == BT_UUID32) {
+		bt_uuid_to_uuid128(uuid, &uuid128);
+		*uuid = uuid128;
+	}
+
+	bt_uuid16_create(&uuid16, get_be16(&uuid->value.u128.data[2]));
+	bt_uuid_to_uuid128(&uuid16, &uuid128);
+
+	if (!bt_uuid_cmp(&uuid128, uuid))
+		*uuid = uuid16;
+
+	return 0;
+}
+
+static uint16_t cache_primaries(struct gatt_cache *cache, uint16_t start,
+				uint16_t end, uint8_t *rsp, size_t len)
+{
+	size_t w = 2, elen = 0;
+	GSList *l;
+
+	for (l = cache->primaries; l; l = l->next) {
+		struct gatt_primary *prim = l->data;
+		bt_uuid_t uuid;
+
+		if (prim->range.start < start)
+			continue;
+
+		if (prim->range.start > end)
+			break;
+
+		if (cache_uuid(prim->uuid, &uuid) < 0)
+			break;
+
+		if (!elen)
+			elen = 4 + bt_uuid_len(&uuid);
+		else if (elen != 4 + (size_t) bt_uuid_len(&uuid))
+			break;
+
+		if (w + elen > len)
+			break;
+
+		put_le16(prim->range.start, &rsp[w]);
+		put_le16(prim->range.end, &rsp[w + 2]);
+		put_uuid_le(&uuid, &rsp[w + 4]);
+		w += elen;
+	}
+
+	if (!elen)
+		return 0;
+
+	rsp[0] = ATT_OP_READ_BY_GROUP_RESP;
+	rsp[1] = elen;
+
+	return w;
+}
+
+static uint16_t cache_includes(struct gatt_cache *cache, uint16_t start,
+				uint16_t end, uint8_t *rsp, size_t len)
+{
+	size_t w = 2, elen = 0;
+	GSList *l;
+
+	for (l = cache->includes; l; l = l->next) {
+		struct gatt_included *incl = l->data;
+		bt_uuid_t uuid;
+		size_t ulen;
+
+		if (incl->handle < start)
+			continue;
+
+		if (incl->handle > end)
+			break;
+
+		if (cache_uuid(incl->uuid, &uuid) < 0)
+			break;
+
+		/* 128-bit UUIDs are not part of the include declaration */
+		ulen = uuid.type == BT_UUID16 ? 2 : 0;
+
+		if (!elen)
+			elen = 6 + ulen;
+		else if (elen != 6 + ulen)
+			break;
+
+		if (w + elen > len)
+			break;
+
+		put_le16(incl->handle, &rsp[w]);
+		put_le16(incl->range.start, &rsp[w + 2]);
+		put_le16(incl->range.end, &rsp[w + 4]);
+		if (ulen)
+			put_le16(uuid.value.u16, &rsp[w + 6]);
+		w += elen;
+	}
+
+	if (!elen)
+		return 0;
+
+	rsp[0] = ATT_OP_READ_BY_TYPE_RESP;
+	rsp[1] = elen;
+
+	return w;
+}
+
+static uint16_t cache_chars(struct gatt_cache *cache, uint16_t start,
+				uint16_t end, uint8_t *rsp, size_t len)
+{
+	size_t w = 2, elen = 0;
+	GSList *l;
+
+	for (l = cache->chars; l; l = l->next) {
+		struct gatt_char *chr = l->data;
+		bt_uuid_t uuid;
+
+		if (chr->handle < start)
+			continue;
+
+		if (chr->handle > end)
+			break;
+
+		if (cache_uuid(chr->uuid, &uuid) < 0)
+			break;
+
+		if (!elen)
+			elen = 5 + bt_uuid_len(&uuid);
+		else if (elen != 5 + (size_t) bt_uuid_len(&uuid))
+			break;
+
+		if (w + elen > len)
+			break;
+
+		put_le16(chr->handle, &rsp[w]);
+		rsp[w + 2] = chr->properties;
+		put_le16(chr->value_handle, &rsp[w + 3]);
+		put_uuid_le(&uuid, &rsp[w + 5]);
+		w += elen;
+	}
+
+	if (!elen)
+		return 0;
+
+	rsp[0] = ATT_OP_READ_BY_TYPE_RESP;
+	rsp[1] = elen;
+
+	return w;
+}
+
+static uint16_t cache_descs(struct gatt_cache *cache, uint16_t start,
+				uint16_t end, uint8_t *rsp, size_t len)
+{
+	size_t w = 2, elen = 0;
+	GSList *l;
+
+	for (l = cache->descs; l; l = l->next) {
+		struct gatt_desc *desc = l->data;
+		bt_uuid_t uuid;
+
+		if (desc->handle < start)
+			continue;
+
+		if (desc->handle > end)
+			break;
+
+		if (cache_uuid(desc->uuid, &uuid) < 0)
+			break;
+
+		if (!elen)
+			elen = 2 + bt_uuid_len(&uuid);
+		else if (elen != 2 + (size_t) bt_uuid_len(&uuid))
+			break;
+
+		if (w + elen > len)
+			break;
+
+		put_le16(desc->handle, &rsp[w]);
+		put_uuid_le(&uuid, &rsp[w + 2]);
+		w += elen;
+	}
+
+	if (!elen)
+		return 0;
+
+	rsp[0] = ATT_OP_FIND_INFO_RESP;
+	rsp[1] = elen == 4 ? ATT_FIND_INFO_RESP_FMT_16BIT :
+					ATT_FIND_INFO_RESP_FMT_128BIT;
+
+	return w;
+}
+
+/* Only service declarations are known, anything else goes to the device */
+static uint16_t cache_read(struct gatt_cache *cache, uint16_t handle,
+						uint8_t *rsp, size_t len)
+{
+	GSList *l;
+
+	for (l = cache->primaries; l; l = l->next) {
+		struct gatt_primary *prim = l->data;
+		bt_uuid_t uuid;
+
+		if (prim->range.start < handle)
+			continue;
+
+		if (prim->range.start > handle)
+			break;
+
+		if (cache_uuid(prim->uuid, &uuid) < 0)
+			break;
+
+		if (len < 1 + (size_t) bt_uuid_len(&uuid))
+			break;
+
+		rsp[0] = ATT_OP_READ_RESP;
+		put_uuid_le(&uuid, &rsp[1]);
+
+		return 1 + bt_uuid_len(&uuid);
+	}
+
+	return 0;
+}
+
+static uint16_t cache_respond(const uint8_t *pdu, uint16_t len, uint8_t *rsp,
+					size_t rsp_len, gpointer user_data)
+{
+	struct gatt_cache *cache = user_data;
+	uint16_t start, end, plen;
+	bt_uuid_t type;
+
+	switch (pdu[0]) {
+	case ATT_OP_READ_BY_GROUP_REQ:
+		if (!dec_read_by_grp_req(pdu, len, &start, &end, &type))
+			return 0;
+
+		if (type.type != BT_UUID16 ||
+					type.value.u16 != GATT_PRIM_SVC_UUID)
+			return 0;
+
+		plen = cache_primaries(cache, start, end, rsp, rsp_len);
+		break;
+	case ATT_OP_READ_BY_TYPE_REQ:
+		if (!dec_read_by_type_req(pdu, len, &start, &end, &type))
+			return 0;
+
+		if (type.type != BT_UUID16)
+			return 0;
+
+		if (type.value.u16 == GATT_CHARAC_UUID)
+			plen = cache_chars(cache, start, end, rsp, rsp_len);
+		else if (type.value.u16 == GATT_INCLUDE_UUID)
+			plen = cache_includes(cache, start, end, rsp, rsp_len);
+		else
+			return 0;
+		break;
+	case ATT_OP_FIND_INFO_REQ:
+		if (!dec_find_info_req(pdu, len, &start, &end))
+			return 0;
+
+		plen = cache_descs(cache, start, end, rsp, rsp_len);
+		break;
+	case ATT_OP_READ_REQ:
+		if (!dec_read_req(pdu, len, &start))
+			return 0;
+
+		return cache_read(cache, start, rsp, rsp_len);
+	default:
+		return 0;
+	}
+
+	/* Invalid ranges are left for the device to reject */
+	if (start == 0 || start > end)
+		return 0;
+
+	/* Only the device knows what wasn't discovered */
+	if (cache_missing(cache, start, end))
+		return 0;
+
+	if (plen)
+		return plen;
+
+	return enc_error_resp(pdu[0], start, ATT_ECODE_ATTR_NOT_FOUND, rsp,
+								rsp_len);
+}
+
+gboolean gatt_cache_attach(GAttrib *attrib, struct gatt_cache *cache)
+{
+	if (!attrib || !cache)
+		return FALSE;
+
+	return g_attrib_set_local_handler(attrib, cache_respond,
+					gatt_cache_ref(cache),
+					(GDestroyNotify) gatt_cache_unref);
+}
+
+void gatt_cache_detach(GAttrib *attrib)
+{
+	g_attrib_set_local_handler(attrib, NULL, NULL, NULL);
+}
+
+/*
+ * Discovery of the whole attribute database. Every procedure covers all
+ * services at once (ATT responses are packed up to the MTU regardless of
+ * service boundaries) and independent requests, like the descriptors of
+ * different characteristics, are queued together so the next one goes out
+ * as soon as the previous response arrives.
+ */
+enum discover_all_stage {
+	DISCOVER_ALL_MTU,
+	DISCOVER_ALL_PRIMARY,
+	DISCOVER_ALL_INCLUDE,
+	DISCOVER_ALL_CHAR,
+	DISCOVER_ALL_INCLUDE_UUID,
+	DISCOVER_ALL_DESC,
+	DISCOVER_ALL_DONE,
+};
+
+struct discover_all {
+	int ref;
+	GAttrib *attrib;
+	guint id;
+	GSList *reqs;
+	enum discover_all_stage stage;
+	uint16_t mtu;
+	uint8_t err;
+	unsigned int pending;
+	unsigned int round_trips;
+	gint64 start;
+	GSList *primaries;
+	GSList *includes;
+	GSList *chars;
+	GSList *attributes;
+	gatt_discovery_cb_t cb;
+	void *user_data;
+};
+
+struct discover_all_req {
+	struct discover_all *da;
+	guint id;
+	uint16_t end;
+	struct gatt_included *included;
+};
+
+/* Running discoveries, to find them by ID when cancelled */
+static GSList *discover_all_list;
+
+static void discover_all_advance(struct discover_all *da);
+
+static void discover_all_unref(struct discover_all *da)
+{
+	da->ref--;
+
+	if (da->ref > 0)
+		return;
+
+	discover_all_list = g_slist_remove(discover_all_list, da);
+
+	g_slist_free_full(da->primaries, g_free);
+	g_slist_free_full(da->includes, g_free);
+	g_slist_free_full(da->chars, g_free);
+	g_slist_free_full(da->attributes, g_free);
+	g_attrib_unref(da->attrib);
+	g_free(da);
+}
+
+static void discover_all_req_free(gpointer data)
+{
+	struct discover_all_req *req = data;
+	struct discover_all *da = req->da;
+
+	da->reqs = g_slist_remove(da->reqs, req);
+	discover_all_unref(da);
+	g_free(req);
+}
+
+static guint discover_all_send(struct discover_all *da, uint16_t plen,
+					GAttribResultFunc func, uint16_t end,
+					struct gatt_included *included)
+{
+	struct discover_all_req *req;
+	uint8_t *buf;
+	size_t buflen;
+	guint id;
+
+	if (plen == 0)
+		return 0;
+
+	buf = g_attrib_get_buffer(da->attrib, &buflen);
+
+	req = g_new0(struct discover_all_req, 1);
+	req->da = da;
+	req->end = end;
+	req->included = included;
+	da->ref++;
+
+	id = g_attrib_send(da->attrib, 0, buf, plen, func, req,
+							discover_all_req_free);
+	if (!id) {
+		da->ref--;
+		g_free(req);
+		return 0;
+	}
+
+	req->id = id;
+	da->reqs = g_slist_prepend(da->reqs, req);
+
+	if (!da->id)
+		da->id = id;
+
+	da->pending++;
+	da->round_trips++;
+
+	return id;
+}
+
+/* Callers have to check for errors before processing the response */
+static struct discover_all *discover_all_response(gpointer user_data,
+								uint8_t status)
+{
+	struct discover_all_req *req = user_data;
+	struct discover_all *da = req->da;
+
+	da->pending--;
+
+	if (status && status != ATT_ECODE_ATTR_NOT_FOUND && !da->err)
+		da->err = status;
+
+	return da;
+}
+
+static void discover_all_attribute(struct discover_all *da, uint16_t handle,
+							const bt_uuid_t *type)
+{
+	struct gatt_desc *attr;
+	bt_uuid_t uuid128;
+
+	attr = g_new0(struct gatt_desc, 1);
+	attr->handle = handle;
+
+	if (type->type == BT_UUID16)
+		attr->uuid16 = type->value.u16;
+
+	bt_uuid_to_uuid128(type, &uuid128);
+	bt_uuid_to_string(&uuid128, attr->uuid, sizeof(attr->uuid));
+
+	da->attributes = g_slist_prepend(da->attributes, attr);
+}
+
+static void discover_all_finish(struct discover_all *da)
+{
+	struct gatt_discovery disc;
+	bt_uuid_t type, uuid;
+	size_t mtu;
+	GSList *l;
+
+	da->stage = DISCOVER_ALL_DONE;
+
+	if (da->err) {
+		da->cb(da->err, NULL, da->user_data);
+		return;
+	}
+
+	/* Declarations and values are known without Find Information */
+	bt_uuid16_create(&type, GATT_PRIM_SVC_UUID);
+	for (l = da->primaries; l; l = l->next) {
+		struct gatt_primary *prim = l->data;
+
+		discover_all_attribute(da, prim->range.start, &type);
+	}
+
+	bt_uuid16_create(&type, GATT_INCLUDE_UUID);
+	for (l = da->includes; l; l = l->next) {
+		struct gatt_included *incl = l->data;
+
+		discover_all_attribute(da, incl->handle, &type);
+	}
+
+	bt_uuid16_create(&type, GATT_CHARAC_UUID);
+	for (l = da->chars; l; l = l->next) {
+		struct gatt_char *chr = l->data;
+
+		discover_all_attribute(da, chr->handle, &type);
+
+		if (cache_uuid(chr->uuid, &uuid) == 0)
+			discover_all_attribute(da, chr->value_handle, &uuid);
+	}
+
+	da->attributes = g_slist_sort(da->attributes, desc_cmp);
+
+	/* Merged descriptor ranges return declarations found above too */
+	for (l = da->attributes; l && l->next;) {
+		struct gatt_desc *attr = l->data, *next = l->next->data;
+
+		if (attr->handle == next->handle) {
+			g_free(next);
+			l = g_slist_delete_link(l, l->next);
+		} else
+			l = l->next;
+	}
+
+	g_attrib_get_buffer(da->attrib, &mtu);
+
+	memset(&disc, 0, sizeof(disc));
+	disc.primaries = da->primaries;
+	disc.includes = da->includes;
+	disc.chars = da->chars;
+	disc.attributes = da->attributes;
+	disc.round_trips = da->round_trips;
+	disc.mtu = mtu;
+	disc.elapsed = g_get_monotonic_time() - da->start;
+
+	da->cb(0, &disc, da->user_data);
+}
+
+static void discover_all_mtu_cb(guint8 status, const guint8 *pdu,
+					guint16 len, gpointer user_data)
+{
+	struct discover_all *da = discover_all_response(user_data, 0);
+	uint16_t mtu;
+
+	/* Not fatal, discovery continues with the default MTU */
+	if (!status && dec_mtu_resp(pdu, len, &mtu))
+		g_attrib_set_mtu(da->attrib, MIN(mtu, da->mtu));
+
+	discover_all_advance(da);
+}
+
+static void discover_all_primary_cb(guint8 status, const guint8 *pdu,
+					guint16 len, gpointer user_data);
+
+static guint discover_all_primaries(struct discover_all *da, uint16_t start)
+{
+	uint8_t *buf;
+	size_t buflen;
+	guint16 plen;
+
+	buf = g_attrib_get_buffer(da->attrib, &buflen);
+	plen = encode_discover_primary(start, 0xffff, NULL, buf, buflen);
+
+	return discover_all_send(da, plen, discover_all_primary_cb, 0xffff,
+									NULL);
+}
+
+static void discover_all_primary_cb(guint8 status, const guint8 *pdu,
+					guint16 len, gpointer user_data)
+{
+	struct discover_all *da = discover_all_response(user_data, status);
+	struct att_data_list *list;
+	uint16_t end = 0xffff;
+	unsigned int i;
+	uint8_t type;
+
+	if (status || da->err)
+		goto done;
+
+	list = dec_read_by_grp_resp(pdu, len);
+	if (!list || (list->len != 6 && list->len != 20)) {
+		if (list)
+			att_data_list_free(list);
+		da->err = ATT_ECODE_INVALID_PDU;
+		goto done;
+	}
+
+	type = list->len == 6 ? BT_UUID16 : BT_UUID128;
+
+	for (i = 0; i < list->num; i++) {
+		const uint8_t *data = list->data[i];
+		struct gatt_primary *prim;
+		bt_uuid_t uuid128;
+
+		prim = g_new0(struct gatt_primary, 1);
+		prim->range.start = get_le16(&data[0]);
+		prim->range.end = get_le16(&data[2]);
+
+		get_uuid128(type, &data[4], &uuid128);
+		bt_uuid_to_string(&uuid128, prim->uuid, sizeof(prim->uuid));
+
+		da->primaries = g_slist_append(da->primaries, prim);
+		end = prim->range.end;
+	}
+
+	att_data_list_free(list);
+
+	if (end != 0xffff && !discover_all_primaries(da, end + 1))
+		da->err = ATT_ECODE_IO;
+
+done:
+	discover_all_advance(da);
+}
+
+static void discover_all_include_cb(guint8 status, const guint8 *pdu,
+					guint16 len, gpointer user_data);
+
+static guint discover_all_includes(struct discover_all *da, uint16_t start)
+{
+	uint8_t *buf;
+	size_t buflen;
+	bt_uuid_t uuid;
+
+	buf = g_attrib_get_buffer(da->attrib, &buflen);
+	bt_uuid16_create(&uuid, GATT_INCLUDE_UUID);
+
+	return discover_all_send(da, enc_read_by_type_req(start, 0xffff,
+						&uuid, buf, buflen),
+					discover_all_include_cb, 0xffff, NULL);
+}
+
+static void discover_all_include_cb(guint8 status, const guint8 *pdu,
+					guint16 len, gpointer user_data)
+{
+	struct discover_all *da = discover_all_response(user_data, status);
+	struct att_data_list *list;
+	uint16_t last = 0xffff;
+	unsigned int i;
+
+	if (status || da->err)
+		goto done;
+
+	list = dec_read_by_type_resp(pdu, len);
+	if (!list || (list->len != 6 && list->len != 8)) {
+		if (list)
+			att_data_list_free(list);
+		da->err = ATT_ECODE_INVALID_PDU;
+		goto done;
+	}
+
+	for (i = 0; i < list->num; i++) {
+		const uint8_t *data = list->data[i];
+		struct gatt_included *incl;
+
+		incl = g_new0(struct gatt_included, 1);
+		incl->handle = get_le16(&data[0]);
+		incl->range.start = get_le16(&data[2]);
+		incl->range.end = get_le16(&data[4]);
+
+		/* 128-bit UUIDs are read once all includes are known */
+		if (list->len == 8) {
+			bt_uuid_t uuid128;
+
+			get_uuid128(BT_UUID16, &data[6], &uuid128);
+			bt_uuid_to_string(&uuid128, incl->uuid,
+							sizeof(incl->uuid));
+		}
+
+		da->includes = g_slist_append(da->includes, incl);
+		last = incl->handle;
+	}
+
+	att_data_list_free(list);
+
+	if (last != 0xffff && !discover_all_includes(da, last + 1))
+		da->err = ATT_ECODE_IO;
+
+done:
+	discover_all_advance(da);
+}
+
+static void discover_all_char_cb(guint8 status, const guint8 *pdu,
+					guint16 len, gpointer user_data);
+
+static guint discover_all_chars(struct discover_all *da, uint16_t start)
+{
+	uint8_t *buf;
+	size_t buflen;
+	bt_uuid_t uuid;
+
+	buf = g_attrib_get_buffer(da->attrib, &buflen);
+	bt_uuid16_create(&uuid, GATT_CHARAC_UUID);
+
+	return discover_all_send(da, enc_read_by_type_req(start, 0xffff,
+						&uuid, buf, buflen),
+					discover_all_char_cb, 0xffff, NULL);
+}
+
+static void discover_all_char_cb(guint8 status, const guint8 *pdu,
+					guint16 len, gpointer user_data)
+{
+	struct discover_all *da = discover_all_response(user_data, status);
+	struct att_data_list *list;
+	uint16_t last = 0xffff;
+	unsigned int i;
+	uint8_t type;
+
+	if (status || da->err)
+		goto done;
+
+	list = dec_read_by_type_resp(pdu, len);
+	if (!list || (list->len != 7 && list->len != 21)) {
+		if (list)
+			att_data_list_free(list);
+		da->err = ATT_ECODE_INVALID_PDU;
+		goto done;
+	}
+
+	type = list->len == 7 ? BT_UUID16 : BT_UUID128;
+
+	for (i = 0; i < list->num; i++) {
+		const uint8_t *data = list->data[i];
+		struct gatt_char *chr;
+		bt_uuid_t uuid128;
+
+		chr = g_new0(struct gatt_char, 1);
+		chr->handle = get_le16(&data[0]);
+		chr->properties = data[2];
+		chr->value_handle = get_le16(&data[3]);
+
+		get_uuid128(type, &data[5], &uuid128);
+		bt_uuid_to_string(&uuid128, chr->uuid, sizeof(chr->uuid));
+
+		da->chars = g_slist_append(da->chars, chr);
+		last = chr->handle;
+	}
+
+	att_data_list_free(list);
+
+	if (last != 0xffff && !discover_all_chars(da, last + 1))
+		da->err = ATT_ECODE_IO;
+
+done:
+	discover_all_advance(da);
+}
+
+static void discover_all_include_uuid_cb(guint8 status, const guint8 *pdu,
+					guint16 len, gpointer user_data)
+{
+	struct discover_all_req *req = user_data;
+	struct discover_all *da = discover_all_response(user_data, status);
+	uint8_t value[16];
+	bt_uuid_t uuid128, type;
+
+	if (da->err)
+		goto done;
+
+	/* Nothing to include, only the declaration itself is left */
+	if (status == ATT_ECODE_ATTR_NOT_FOUND) {
+		bt_uuid16_create(&type, GATT_INCLUDE_UUID);
+		discover_all_attribute(da, req->included->handle, &type);
+
+		da->includes = g_slist_remove(da->includes, req->included);
+		g_free(req->included);
+		goto done;
+	}
+
+	if (dec_read_resp(pdu, len, value, sizeof(value)) != 16) {
+		da->err = ATT_ECODE_INVALID_PDU;
+		goto done;
+	}
+
+	get_uuid128(BT_UUID128, value, &uuid128);
+	bt_uuid_to_string(&uuid128, req->included->uuid,
+						sizeof(req->included->uuid));
+
+done:
+	discover_all_advance(da);
+}
+
+static void discover_all_resolve_includes(struct discover_all *da)
+{
+	uint8_t *buf;
+	size_t buflen;
+	GSList *l;
+
+	buf = g_attrib_get_buffer(da->attrib, &buflen);
+
+	for (l = da->includes; l && !da->err; l = l->next) {
+		struct gatt_included *incl = l->data;
+
+		if (incl->uuid[0])
+			continue;
+
+		if (!discover_all_send(da, enc_read_req(incl->range.start, buf,
+								buflen),
+					discover_all_include_uuid_cb, 0, incl))
+			da->err = ATT_ECODE_IO;
+	}
+}
+
+static void discover_all_desc_cb(guint8 status, const guint8 *pdu,
+					guint16 len, gpointer user_data);
+
+static guint discover_all_descs(struct discover_all *da, uint16_t start,
+								uint16_t end)
+{
+	uint8_t *buf;
+	size_t buflen;
+
+	buf = g_attrib_get_buffer(da->attrib, &buflen);
+
+	return discover_all_send(da, enc_find_info_req(start, end, buf,
+								buflen),
+					discover_all_desc_cb, end, NULL);
+}
+
+static void discover_all_desc_cb(guint8 status, const guint8 *pdu,
+					guint16 len, gpointer user_data)
+{
+	struct discover_all_req *req = user_data;
+	struct discover_all *da = discover_all_response(user_data, status);
+	struct att_data_list *list;
+	uint16_t last = req->end;
+	unsigned int i;
+	uint8_t format;
+
+	if (status || da->err)
+		goto done;
+
+	list = dec_find_info_resp(pdu, len, &format);
+	if (!list) {
+		da->err = ATT_ECODE_INVALID_PDU;
+		goto done;
+	}
+
+	for (i = 0; i < list->num; i++) {
+		const uint8_t *data = list->data[i];
+		bt_uuid_t uuid;
+
+		last = get_le16(&data[0]);
+		if (last > req->end)
+			break;
+
+		if (format == ATT_FIND_INFO_RESP_FMT_16BIT)
+			bt_uuid16_create(&uuid, get_le16(&data[2]));
+		else
+			get_uuid128(BT_UUID128, &data[2], &uuid);
+
+		discover_all_attribute(da, last, &uuid);
+	}
+
+	att_data_list_free(list);
+
+	if (last < req->end && !discover_all_descs(da, last + 1, req->end))
+		da->err = ATT_ECODE_IO;
+
+done:
+	discover_all_advance(da);
+}
+
+static int boundary_cmp(const void *a, const void *b)
+{
+	const uint32_t *ba = a, *bb = b;
+
+	return *ba - *bb;
+}
+
+/*
+ * Descriptors of a characteristic follow its value up to the next
+ * characteristic, service or included service. Characteristics without
+ * room for descriptors cost no request at all, and neighbouring ranges are
+ * read together when only 16-bit types lie between them since Find
+ * Information then packs them into the same responses.
+ */
+static void discover_all_find_descs(struct discover_all *da)
+{
+	uint32_t *bounds;
+	unsigned int n = 0, i = 0;
+	uint16_t start = 0, end = 0;
+	gboolean wide = FALSE;
+	GSList *l;
+
+	bounds = g_new(uint32_t, 2 * g_slist_length(da->primaries) +
+					2 * g_slist_length(da->includes) +
+					g_slist_length(da->chars));
+
+	for (l = da->primaries; l; l = l->next) {
+		struct gatt_primary *prim = l->data;
+
+		bounds[n++] = prim->range.start;
+		bounds[n++] = prim->range.end + 1;
+	}
+
+	for (l = da->includes; l; l = l->next) {
+		struct gatt_included *incl = l->data;
+
+		bounds[n++] = incl->range.start;
+		bounds[n++] = incl->range.end + 1;
+	}
+
+	for (l = da->chars; l; l = l->next) {
+		struct gatt_char *chr = l->data;
+
+		bounds[n++] = chr->handle;
+	}
+
+	qsort(bounds, n, sizeof(*bounds), boundary_cmp);
+
+	for (l = da->chars; l && !da->err; l = l->next) {
+		struct gatt_char *chr = l->data;
+		uint32_t next = 0x10000;
+		bt_uuid_t uuid;
+
+		if (cache_uuid(chr->uuid, &uuid) < 0 || uuid.type != BT_UUID16)
+			wide = TRUE;
+
+		while (i < n && bounds[i] <= chr->value_handle)
+			i++;
+
+		if (i < n)
+			next = bounds[i];
+
+		if (chr->value_handle + 1 >= next)
+			continue;
+
+		if (end && !wide) {
+			end = next - 1;
+			continue;
+		}
+
+		if (end && !discover_all_descs(da, start, end))
+			da->err = ATT_ECODE_IO;
+
+		start = chr->value_handle + 1;
+		end = next - 1;
+		wide = FALSE;
+	}
+
+	if (end && !da->err && !discover_all_descs(da, start, end))
+		da->err = ATT_ECODE_IO;
+
+	g_free(bounds);
+}
+
+static void discover_all_advance(struct discover_all *da)
+{
+	while (!da->pending && da->stage != DISCOVER_ALL_DONE) {
+		if (da->err) {
+			discover_all_finish(da);
+			return;
+		}
+
+		da->stage++;
+
+		switch (da->stage) {
+		case DISCOVER_ALL_PRIMARY:
+			if (!discover_all_primaries(da, 0x0001))
+				da->err = ATT_ECODE_IO;
+			break;
+		case DISCOVER_ALL_INCLUDE:
+			if (da->primaries && !discover_all_includes(da, 0x0001))
+				da->err = ATT_ECODE_IO;
+			break;
+		case DISCOVER_ALL_CHAR:
+			if (da->primaries && !discover_all_chars(da, 0x0001))
+				da->err = ATT_ECODE_IO;
+			break;
+		case DISCOVER_ALL_INCLUDE_UUID:
+			discover_all_resolve_includes(da);
+			break;
+		case DISCOVER_ALL_DESC:
+			discover_all_find_descs(da);
+			break;
+		case DISCOVER_ALL_DONE:
+			discover_all_finish(da);
+			return;
+		case DISCOVER_ALL_MTU:
+			break;
+		}
+	}
+}
+
+guint gatt_discover_all(GAttrib *attrib, uint16_t mtu,
+				gatt_discovery_cb_t func, gpointer user_data)
+{
+	struct discover_all *da;
+	uint8_t *buf;
+	size_t buflen;
+	guint id;
+
+	da = g_new0(struct discover_all, 1);
+	da->attrib = g_attrib_ref(attrib);
+	da->mtu = mtu;
+	da->cb = func;
+	da->user_data = user_data;
+	da->start = g_get_monotonic_time();
+
+	/* Keep it alive in case the first request can't be queued */
+	da->ref = 1;
+	discover_all_list = g_slist_prepend(discover_all_list, da);
+
+	if (mtu > ATT_DEFAULT_LE_MTU) {
+		buf = g_attrib_get_buffer(attrib, &buflen);
+		id = discover_all_send(da, enc_mtu_req(mtu, buf, buflen),
+					discover_all_mtu_cb, 0, NULL);
+	} else {
+		da->stage = DISCOVER_ALL_PRIMARY;
+		id = discover_all_primaries(da, 0x0001);
+	}
+
+	discover_all_unref(da);
+
+	return id;
+}
+
+gboolean gatt_discover_all_cancel(GAttrib *attrib, guint id)
+{
+	struct discover_all *da;
+	GSList *l, *reqs;
+
+	for (l = discover_all_list; l; l = l->next) {
+		da = l->data;
+
+		if (da->attrib == attrib && da->id == id)
+			break;
+	}
+
+	if (!l || da->stage == DISCOVER_ALL_DONE)
+		return FALSE;
+
+	/* Nothing is sent and the callback isn't called from now on */
+	da->stage = DISCOVER_ALL_DONE;
+	da->ref++;
+
+	reqs = g_slist_copy(da->reqs);
+
+	for (l = reqs; l; l = l->next) {
+		struct discover_all_req *req = l->data;
+
+		g_attrib_cancel(attrib, req->id);
+	}
+
+	g_slist_free(reqs);
+	discover_all_unref(da);
+
+	return TRUE;
+}
+
 static sdp_data_t *proto_seq_find(sdp_list_t *proto_list)
 {
 	sdp_list_t *list;
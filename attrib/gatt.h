@@ -73,9 +73,32 @@ struct gatt_desc {
 	uint16_t uuid16;
 };
 
+/*
+ * Result of gatt_discover_all(), valid during the callback only. Attributes
+ * holds every handle found with its type, declarations included.
+ */
+struct gatt_discovery {
+	GSList *primaries;
+	GSList *includes;
+	GSList *chars;
+	GSList *attributes;
+	unsigned int round_trips;
+	uint16_t mtu;
+	int64_t elapsed;	/* microseconds */
+};
+
+typedef void (*gatt_discovery_cb_t) (uint8_t status,
+					const struct gatt_discovery *disc,
+					void *user_data);
+
 guint gatt_discover_primary(GAttrib *attrib, bt_uuid_t *uuid, gatt_cb_t func,
 							gpointer user_data);
 
+/* MTU is exchanged first unless it is the default one */
+guint gatt_discover_all(GAttrib *attrib, uint16_t mtu,
+				gatt_discovery_cb_t func, gpointer user_data);
+gboolean gatt_discover_all_cancel(GAttrib *attrib, guint id);
+
 unsigned int gatt_find_included(GAttrib *attrib, uint16_t start, uint16_t end,
 					gatt_cb_t func, gpointer user_data);
 
@@ -119,6 +142,30 @@ guint gatt_read_char_by_uuid(GAttrib *attrib, uint16_t start, uint16_t end,
 guint gatt_exchange_mtu(GAttrib *attrib, uint16_t mtu, GAttribResultFunc func,
 							gpointer user_data);
 
+/*
+ * Discovered attributes of a bonded device. While attached to a GAttrib the
+ * discovery requests covered by the cache are answered without ATT traffic.
+ */
+struct gatt_cache;
+
+struct gatt_cache *gatt_cache_new(void);
+struct gatt_cache *gatt_cache_ref(struct gatt_cache *cache);
+void gatt_cache_unref(struct gatt_cache *cache);
+
+void gatt_cache_add_primary(struct gatt_cache *cache,
+					const struct gatt_primary *prim);
+void gatt_cache_add_included(struct gatt_cache *cache,
+					const struct gatt_included *incl);
+void gatt_cache_add_char(struct gatt_cache *cache, const struct gatt_char *chr);
+void gatt_cache_add_desc(struct gatt_cache *cache, const struct gatt_desc *desc);
+
+/* Requests touching a missing range are sent to the device */
+void gatt_cache_add_missing(struct gatt_cache *cache, uint16_t start,
+								uint16_t end);
+
+gboolean gatt_cache_attach(GAttrib *attrib, struct gatt_cache *cache);
+void gatt_cache_detach(GAttrib *attrib);
+
 gboolean gatt_parse_record(const sdp_record_t *rec,
 					uuid_t *prim_uuid, uint16_t *psm,
 					uint16_t *start, uint16_t *end);
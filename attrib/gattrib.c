@@ -26,9 +26,11 @@
 #include "config.h"
 #endif
 
+#include <errno.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <glib.h>
 
 #include <stdio.h>
@@ -38,12 +40,18 @@
 #include "btio/btio.h"
 #include "lib/uuid.h"
 #include "src/shared/util.h"
+#include "src/shared/att-types.h"
 #include "src/log.h"
 #include "attrib/att.h"
 #include "attrib/gattrib.h"
 
 #define GATT_TIMEOUT 30
 
+/* PDUs handled per wakeup before other sources get a chance to run */
+#define READ_BURST 16
+
+#define EVENT_KEY(opcode, handle) GUINT_TO_POINTER((opcode) << 16 | (handle))
+
 struct _GAttrib {
 	GIOChannel *io;
 	int refs;
@@ -54,11 +62,21 @@ struct _GAttrib {
 	guint timeout_watch;
 	GQueue *requests;
 	GQueue *responses;
+	GQueue *local;
+	guint local_watch;
+	GAttribLocalFunc local_func;
+	gpointer local_user_data;
+	GDestroyNotify local_destroy;
 	GSList *events;
+	GHashTable *handlers;	/* (opcode, handle) -> events, by id */
+	GSList *wildcards;	/* events matching more than one handle */
+	unsigned int dispatching;
+	GSList *removed;
 	guint next_cmd_id;
 	GDestroyNotify destroy;
 	gpointer destroy_user_data;
 	bool stale;
+	struct bt_att_stats stats;
 };
 
 struct command {
@@ -68,6 +86,7 @@ struct command {
 	guint16 len;
 	guint8 expected;
 	bool sent;
+	gint64 sent_time;
 	GAttribResultFunc func;
 	gpointer user_data;
 	GDestroyNotify notify;
@@ -80,6 +99,7 @@ struct event {
 	GAttribNotifyFunc func;
 	gpointer user_data;
 	GDestroyNotify notify;
+	bool removed;
 };
 
 static guint8 opcode2expected(guint8 opcode)
@@ -178,6 +198,89 @@ static void event_destroy(struct event *evt)
 	g_free(evt);
 }
 
+static bool is_wildcard(struct event *evt)
+{
+	return evt->expected == GATTRIB_ALL_EVENTS ||
+					evt->expected == GATTRIB_ALL_REQS ||
+					evt->handle == GATTRIB_ALL_HANDLES;
+}
+
+static void event_link(struct _GAttrib *attrib, struct event *evt)
+{
+	gpointer key = EVENT_KEY(evt->expected, evt->handle);
+	GSList *l;
+
+	attrib->events = g_slist_append(attrib->events, evt);
+
+	if (is_wildcard(evt)) {
+		attrib->wildcards = g_slist_append(attrib->wildcards, evt);
+		return;
+	}
+
+	/* Ids only grow so appending keeps every list sorted by id */
+	l = g_hash_table_lookup(attrib->handlers, key);
+	l = g_slist_append(l, evt);
+	g_hash_table_insert(attrib->handlers, key, l);
+}
+
+static void event_unlink(struct _GAttrib *attrib, struct event *evt)
+{
+	gpointer key = EVENT_KEY(evt->expected, evt->handle);
+	GSList *l;
+
+	if (is_wildcard(evt)) {
+		attrib->wildcards = g_slist_remove(attrib->wildcards, evt);
+		return;
+	}
+
+	l = g_hash_table_lookup(attrib->handlers, key);
+	l = g_slist_remove(l, evt);
+
+	if (l)
+		g_hash_table_insert(attrib->handlers, key, l);
+	else
+		g_hash_table_remove(attrib->handlers, key);
+}
+
+/*
+ * Events removed from a notification callback stay linked, but inactive,
+ * until the dispatch loop is done walking the lists.
+ */
+static void event_remove(struct _GAttrib *attrib, struct event *evt)
+{
+	attrib->events = g_slist_remove(attrib->events, evt);
+
+	if (evt->notify)
+		evt->notify(evt->user_data);
+
+	if (attrib->dispatching) {
+		evt->removed = true;
+		attrib->removed = g_slist_prepend(attrib->removed, evt);
+		return;
+	}
+
+	event_unlink(attrib, evt);
+	g_free(evt);
+}
+
+static void purge_removed(struct _GAttrib *attrib)
+{
+	GSList *l;
+
+	for (l = attrib->removed; l; l = l->next) {
+		event_unlink(attrib, l->data);
+		g_free(l->data);
+	}
+
+	g_slist_free(attrib->removed);
+	attrib->removed = NULL;
+}
+
+static void free_handlers(gpointer key, gpointer value, gpointer user_data)
+{
+	g_slist_free(value);
+}
+
 static void attrib_destroy(GAttrib *attrib)
 {
 	GSList *l;
@@ -189,18 +292,33 @@ static void attrib_destroy(GAttrib *attrib)
 	while ((c = g_queue_pop_head(attrib->responses)))
 		command_destroy(c);
 
+	while ((c = g_queue_pop_head(attrib->local)))
+		command_destroy(c);
+
 	g_queue_free(attrib->requests);
 	attrib->requests = NULL;
 
 	g_queue_free(attrib->responses);
 	attrib->responses = NULL;
 
+	g_queue_free(attrib->local);
+	attrib->local = NULL;
+
+	if (attrib->local_destroy)
+		attrib->local_destroy(attrib->local_user_data);
+
 	for (l = attrib->events; l; l = l->next)
 		event_destroy(l->data);
 
 	g_slist_free(attrib->events);
 	attrib->events = NULL;
 
+	g_hash_table_foreach(attrib->handlers, free_handlers, NULL);
+	g_hash_table_destroy(attrib->handlers);
+
+	g_slist_free(attrib->wildcards);
+	attrib->wildcards = NULL;
+
 	if (attrib->timeout_watch > 0)
 		g_source_remove(attrib->timeout_watch);
 
@@ -269,6 +387,8 @@ static gboolean disconnect_timeout(gpointer data)
 	if (c == NULL)
 		goto done;
 
+	attrib->stats.timeouts++;
+
 	if (c->func)
 		c->func(ATT_ECODE_TIMEOUT, NULL, 0, c->user_data);
 
@@ -331,6 +451,9 @@ static gboolean can_write_data(GIOChannel *io, GIOCondition cond,
 		return FALSE;
 	}
 
+	attrib->stats.tx_pdus++;
+	attrib->stats.tx_bytes += len;
+
 	if (cmd->expected == 0) {
 		g_queue_pop_head(queue);
 		command_destroy(cmd);
@@ -339,6 +462,8 @@ static gboolean can_write_data(GIOChannel *io, GIOCondition cond,
 	}
 
 	cmd->sent = true;
+	cmd->sent_time = g_get_monotonic_time();
+	attrib->stats.requests++;
 
 	if (attrib->timeout_watch == 0)
 		attrib->timeout_watch = g_timeout_add_seconds(GATT_TIMEOUT,
@@ -390,49 +515,74 @@ static bool match_event(struct event *evt, const uint8_t *pdu, gsize len)
 	return false;
 }
 
-static gboolean received_data(GIOChannel *io, GIOCondition cond, gpointer data)
+static guint first_id(GSList *l)
 {
-	struct _GAttrib *attrib = data;
-	struct command *cmd = NULL;
-	GSList *l;
-	uint8_t buf[512], status;
-	gsize len;
-	GIOStatus iostat;
+	struct event *evt;
 
-	if (attrib->stale)
-		return FALSE;
+	if (!l)
+		return G_MAXUINT;
 
-	if (cond & (G_IO_HUP | G_IO_ERR | G_IO_NVAL)) {
-		struct command *c;
+	evt = l->data;
 
-		while ((c = g_queue_pop_head(attrib->requests))) {
-			if (c->func)
-				c->func(ATT_ECODE_IO, NULL, 0, c->user_data);
-			command_destroy(c);
-		}
+	return evt->id;
+}
 
-		attrib->read_watch = 0;
+static void dispatch_events(struct _GAttrib *attrib, const uint8_t *pdu,
+								gsize len)
+{
+	GSList *handlers = NULL, *wildcards = attrib->wildcards;
 
-		return FALSE;
+	if (len >= 3)
+		handlers = g_hash_table_lookup(attrib->handlers,
+				EVENT_KEY(pdu[0], get_le16(&pdu[1])));
+
+	attrib->dispatching++;
+
+	/* Merge both lists by id to keep the order of registration */
+	while (handlers || wildcards) {
+		struct event *evt;
+
+		if (first_id(handlers) < first_id(wildcards)) {
+			evt = handlers->data;
+			handlers = handlers->next;
+		} else {
+			evt = wildcards->data;
+			wildcards = wildcards->next;
+
+			if (!match_event(evt, pdu, len))
+				continue;
+		}
+
+		if (!evt->removed)
+			evt->func(pdu, len, evt->user_data);
 	}
 
-	memset(buf, 0, sizeof(buf));
+	if (--attrib->dispatching == 0 && attrib->removed)
+		purge_removed(attrib);
+}
 
-	iostat = g_io_channel_read_chars(io, (char *) buf, sizeof(buf),
-								&len, NULL);
-	if (iostat != G_IO_STATUS_NORMAL) {
+static gboolean process_pdu(struct _GAttrib *attrib, const uint8_t *pdu,
+								ssize_t len)
+{
+	struct command *cmd = NULL;
+	uint8_t status;
+
+	if (len <= 0) {
 		status = ATT_ECODE_IO;
 		goto done;
 	}
 
-	for (l = attrib->events; l; l = l->next) {
-		struct event *evt = l->data;
+	attrib->stats.rx_pdus++;
+	attrib->stats.rx_bytes += len;
 
-		if (match_event(evt, buf, len))
-			evt->func(buf, len, evt->user_data);
-	}
+	if (pdu[0] == ATT_OP_HANDLE_NOTIFY)
+		attrib->stats.notifications++;
+	else if (pdu[0] == ATT_OP_HANDLE_IND)
+		attrib->stats.indications++;
+
+	dispatch_events(attrib, pdu, len);
 
-	if (!is_response(buf[0]))
+	if (!is_response(pdu[0]))
 		return TRUE;
 
 	if (attrib->timeout_watch > 0) {
@@ -446,12 +596,17 @@ static gboolean received_data(GIOChannel *io, GIOCondition cond, gpointer data)
 		return attrib->events != NULL;
 	}
 
-	if (buf[0] == ATT_OP_ERROR) {
-		status = buf[4];
+	if (cmd->sent)
+		bt_att_stats_add_rtt(&attrib->stats,
+				g_get_monotonic_time() - cmd->sent_time);
+
+	if (pdu[0] == ATT_OP_ERROR) {
+		attrib->stats.errors++;
+		status = len > 4 ? pdu[4] : ATT_ECODE_IO;
 		goto done;
 	}
 
-	if (cmd->expected != buf[0]) {
+	if (cmd->expected != pdu[0]) {
 		status = ATT_ECODE_IO;
 		goto done;
 	}
@@ -465,7 +620,7 @@ done:
 
 	if (cmd) {
 		if (cmd->func)
-			cmd->func(status, buf, len, cmd->user_data);
+			cmd->func(status, pdu, len, cmd->user_data);
 
 		command_destroy(cmd);
 	}
@@ -473,6 +628,111 @@ done:
 	return TRUE;
 }
 
+static gboolean received_data(GIOChannel *io, GIOCondition cond, gpointer data)
+{
+	struct _GAttrib *attrib = data;
+	uint8_t buf[512];
+	gboolean keep = TRUE;
+	int fd, i;
+
+	if (attrib->stale)
+		return FALSE;
+
+	if (cond & (G_IO_HUP | G_IO_ERR | G_IO_NVAL)) {
+		struct command *c;
+
+		while ((c = g_queue_pop_head(attrib->requests))) {
+			if (c->func)
+				c->func(ATT_ECODE_IO, NULL, 0, c->user_data);
+			command_destroy(c);
+		}
+
+		attrib->read_watch = 0;
+
+		return FALSE;
+	}
+
+	fd = g_io_channel_unix_get_fd(io);
+
+	/* Callbacks may drop the last reference while the loop runs */
+	g_attrib_ref(attrib);
+
+	for (i = 0; i < READ_BURST && keep && !attrib->stale; i++) {
+		ssize_t len;
+
+		len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (len < 0 && (errno == EAGAIN || errno == EINTR))
+			break;
+
+		keep = process_pdu(attrib, buf, len);
+		if (len <= 0)
+			break;
+	}
+
+	g_attrib_unref(attrib);
+
+	return keep;
+}
+
+static gboolean local_responses(gpointer data)
+{
+	struct _GAttrib *attrib = data;
+	struct command *cmd;
+
+	while ((cmd = g_queue_pop_head(attrib->local))) {
+		guint8 status = 0;
+
+		if (cmd->pdu[0] == ATT_OP_ERROR)
+			status = cmd->len > 4 ? cmd->pdu[4] : ATT_ECODE_IO;
+
+		if (cmd->func)
+			cmd->func(status, cmd->pdu, cmd->len, cmd->user_data);
+
+		command_destroy(cmd);
+	}
+
+	return FALSE;
+}
+
+static void destroy_local(gpointer data)
+{
+	struct _GAttrib *attrib = data;
+
+	attrib->local_watch = 0;
+	g_attrib_unref(attrib);
+}
+
+static bool answer_locally(struct _GAttrib *attrib, struct command *c)
+{
+	uint8_t rsp[512];
+	guint16 len;
+
+	if (!attrib->local_func || !c->expected)
+		return false;
+
+	len = attrib->local_func(c->pdu, c->len, rsp,
+					MIN(sizeof(rsp), attrib->buflen),
+					attrib->local_user_data);
+	if (!len)
+		return false;
+
+	g_free(c->pdu);
+	c->pdu = g_memdup(rsp, len);
+	c->len = len;
+
+	g_queue_push_tail(attrib->local, c);
+
+	attrib->stats.cached++;
+
+	if (attrib->local_watch == 0)
+		attrib->local_watch = g_idle_add_full(G_PRIORITY_DEFAULT,
+						local_responses,
+						g_attrib_ref(attrib),
+						destroy_local);
+
+	return true;
+}
+
 GAttrib *g_attrib_new(GIOChannel *io)
 {
 	struct _GAttrib *attrib;
@@ -504,6 +764,8 @@ GAttrib *g_attrib_new(GIOChannel *io)
 	attrib->io = g_io_channel_ref(io);
 	attrib->requests = g_queue_new();
 	attrib->responses = g_queue_new();
+	attrib->local = g_queue_new();
+	attrib->handlers = g_hash_table_new(g_direct_hash, g_direct_equal);
 
 	attrib->read_watch = g_io_add_watch(attrib->io,
 			G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
@@ -543,6 +805,11 @@ guint g_attrib_send(GAttrib *attrib, guint id, const guint8 *pdu, guint16 len,
 	else
 		queue = attrib->requests;
 
+	if (answer_locally(attrib, c)) {
+		c->id = id ? id : ++attrib->next_cmd_id;
+		return c->id;
+	}
+
 	if (id) {
 		c->id = id;
 		if (!is_response(opcode))
@@ -563,6 +830,10 @@ guint g_attrib_send(GAttrib *attrib, guint id, const guint8 *pdu, guint16 len,
 	if (g_queue_get_length(queue) == 1)
 		wake_up_sender(attrib);
 
+	attrib->stats.max_queued = MAX(attrib->stats.max_queued,
+					g_queue_get_length(attrib->requests) +
+					g_queue_get_length(attrib->responses));
+
 	return c->id;
 }
 
@@ -595,6 +866,12 @@ gboolean g_attrib_cancel(GAttrib *attrib, guint id)
 					command_cmp_by_id);
 	}
 
+	if (l == NULL) {
+		queue = attrib->local;
+		l = g_queue_find_custom(queue, GUINT_TO_POINTER(id),
+					command_cmp_by_id);
+	}
+
 	if (l == NULL)
 		return FALSE;
 
@@ -647,10 +924,28 @@ gboolean g_attrib_cancel_all(GAttrib *attrib)
 
 	ret = cancel_all_per_queue(attrib->requests);
 	ret = cancel_all_per_queue(attrib->responses) && ret;
+	ret = cancel_all_per_queue(attrib->local) && ret;
 
 	return ret;
 }
 
+gboolean g_attrib_set_local_handler(GAttrib *attrib, GAttribLocalFunc func,
+					gpointer user_data,
+					GDestroyNotify destroy)
+{
+	if (attrib == NULL)
+		return FALSE;
+
+	if (attrib->local_destroy)
+		attrib->local_destroy(attrib->local_user_data);
+
+	attrib->local_func = func;
+	attrib->local_user_data = user_data;
+	attrib->local_destroy = destroy;
+
+	return TRUE;
+}
+
 gboolean g_attrib_set_debug(GAttrib *attrib,
 		GAttribDebugFunc func, gpointer user_data)
 {
@@ -667,6 +962,18 @@ uint8_t *g_attrib_get_buffer(GAttrib *attrib, size_t *len)
 	return attrib->buf;
 }
 
+gboolean g_attrib_get_stats(GAttrib *attrib, struct bt_att_stats *stats)
+{
+	if (!attrib || !stats)
+		return FALSE;
+
+	*stats = attrib->stats;
+	stats->queued = g_queue_get_length(attrib->requests) +
+				g_queue_get_length(attrib->responses);
+
+	return TRUE;
+}
+
 gboolean g_attrib_set_mtu(GAttrib *attrib, int mtu)
 {
 	if (mtu < ATT_DEFAULT_LE_MTU)
@@ -697,7 +1004,7 @@ guint g_attrib_register(GAttrib *attrib, guint8 opcode, guint16 handle,
 	event->notify = notify;
 	event->id = ++next_evt_id;
 
-	attrib->events = g_slist_append(attrib->events, event);
+	event_link(attrib, event);
 
 	return event->id;
 }
@@ -724,7 +1031,6 @@ gboolean g_attrib_is_encrypted(GAttrib *attrib)
 
 gboolean g_attrib_unregister(GAttrib *attrib, guint id)
 {
-	struct event *evt;
 	GSList *l;
 
 	if (id == 0) {
@@ -737,36 +1043,18 @@ gboolean g_attrib_unregister(GAttrib *attrib, guint id)
 	if (l == NULL)
 		return FALSE;
 
-	evt = l->data;
-
-	attrib->events = g_slist_remove(attrib->events, evt);
-
-	if (evt->notify)
-		evt->notify(evt->user_data);
-
-	g_free(evt);
+	event_remove(attrib, l->data);
 
 	return TRUE;
 }
 
 gboolean g_attrib_unregister_all(GAttrib *attrib)
 {
-	GSList *l;
-
 	if (attrib->events == NULL)
 		return FALSE;
 
-	for (l = attrib->events; l; l = l->next) {
-		struct event *evt = l->data;
-
-		if (evt->notify)
-			evt->notify(evt->user_data);
-
-		g_free(evt);
-	}
-
-	g_slist_free(attrib->events);
-	attrib->events = NULL;
+	while (attrib->events)
+		event_remove(attrib, attrib->events->data);
 
 	return TRUE;
 }
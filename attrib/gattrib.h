@@ -35,12 +35,17 @@ extern "C" {
 struct _GAttrib;
 typedef struct _GAttrib GAttrib;
 
+struct bt_att_stats;
+
 typedef void (*GAttribResultFunc) (guint8 status, const guint8 *pdu,
 					guint16 len, gpointer user_data);
 typedef void (*GAttribDisconnectFunc)(gpointer user_data);
 typedef void (*GAttribDebugFunc)(const char *str, gpointer user_data);
 typedef void (*GAttribNotifyFunc)(const guint8 *pdu, guint16 len,
 							gpointer user_data);
+typedef guint16 (*GAttribLocalFunc)(const guint8 *pdu, guint16 len,
+					guint8 *rsp, size_t rsp_len,
+					gpointer user_data);
 
 GAttrib *g_attrib_new(GIOChannel *io);
 GAttrib *g_attrib_ref(GAttrib *attrib);
@@ -58,6 +63,14 @@ guint g_attrib_send(GAttrib *attrib, guint id, const guint8 *pdu, guint16 len,
 gboolean g_attrib_cancel(GAttrib *attrib, guint id);
 gboolean g_attrib_cancel_all(GAttrib *attrib);
 
+/*
+ * Requests for which func returns a response are answered with it instead
+ * of being sent to the remote device.
+ */
+gboolean g_attrib_set_local_handler(GAttrib *attrib, GAttribLocalFunc func,
+					gpointer user_data,
+					GDestroyNotify destroy);
+
 gboolean g_attrib_set_debug(GAttrib *attrib,
 		GAttribDebugFunc func, gpointer user_data);
 
@@ -73,6 +86,8 @@ gboolean g_attrib_set_mtu(GAttrib *attrib, int mtu);
 gboolean g_attrib_unregister(GAttrib *attrib, guint id);
 gboolean g_attrib_unregister_all(GAttrib *attrib);
 
+gboolean g_attrib_get_stats(GAttrib *attrib, struct bt_att_stats *stats);
+
 #ifdef __cplusplus
 }
 #endif
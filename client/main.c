@@ -30,6 +30,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <inttypes.h>
 #include <signal.h>
 #include <sys/signalfd.h>
 
@@ -58,7 +59,9 @@ static char *auto_register_agent = NULL;
 
 static GDBusProxy *default_ctrl;
 static GList *ctrl_list;
-static GList *dev_list;
+static GQueue *dev_list;
+static GHashTable *dev_index;
+static GList *stats_list;
 
 static const char * const agent_arguments[] = {
 	"on",
@@ -76,6 +79,68 @@ static void proxy_leak(gpointer data)
 	printf("Leaking proxy %p\n", data);
 }
 
+static const char *proxy_address(GDBusProxy *proxy)
+{
+	DBusMessageIter iter;
+	const char *address;
+
+	if (g_dbus_proxy_get_property(proxy, "Address", &iter) == FALSE)
+		return NULL;
+
+	dbus_message_iter_get_basic(&iter, &address);
+
+	return address;
+}
+
+/*
+ * Devices are listed in order of discovery and indexed by address, the
+ * index points to the list link so removals don't walk the list either.
+ */
+static void dev_list_add(GDBusProxy *proxy)
+{
+	const char *address = proxy_address(proxy);
+
+	g_queue_push_tail(dev_list, proxy);
+
+	if (address)
+		g_hash_table_replace(dev_index, g_strdup(address),
+					g_queue_peek_tail_link(dev_list));
+}
+
+static void dev_list_remove(GDBusProxy *proxy)
+{
+	const char *address = proxy_address(proxy);
+	GList *link = NULL;
+
+	if (address)
+		link = g_hash_table_lookup(dev_index, address);
+
+	if (link == NULL || link->data != proxy) {
+		g_queue_remove(dev_list, proxy);
+		return;
+	}
+
+	g_hash_table_remove(dev_index, address);
+	g_queue_delete_link(dev_list, link);
+}
+
+static void dev_list_clear(void)
+{
+	g_hash_table_remove_all(dev_index);
+	g_queue_clear(dev_list);
+}
+
+static GDBusProxy *find_device(const char *address)
+{
+	GList *link;
+
+	link = g_hash_table_lookup(dev_index, address);
+	if (link == NULL)
+		return NULL;
+
+	return link->data;
+}
+
 static void connect_handler(DBusConnection *connection, void *user_data)
 {
 	rl_set_prompt(PROMPT_ON);
@@ -96,8 +161,10 @@ static void disconnect_handler(DBusConnection *connection, void *user_data)
 
 	default_ctrl = NULL;
 
-	g_list_free(dev_list);
-	dev_list = NULL;
+	dev_list_clear();
+
+	g_list_free(stats_list);
+	stats_list = NULL;
 }
 
 static void print_adapter(GDBusProxy *proxy, const char *description)
@@ -290,7 +357,7 @@ static void proxy_added(GDBusProxy *proxy, void *user_data)
 
 	if (!strcmp(interface, "org.bluez.Device1")) {
 		if (device_is_child(proxy, default_ctrl) == TRUE) {
-			dev_list = g_list_append(dev_list, proxy);
+			dev_list_add(proxy);
 
 			print_device(proxy, COLORED_NEW);
 		}
@@ -301,6 +368,8 @@ static void proxy_added(GDBusProxy *proxy, void *user_data)
 			default_ctrl = proxy;
 
 		print_adapter(proxy, COLORED_NEW);
+	} else if (!strcmp(interface, "org.bluez.AttStatistics1")) {
+		stats_list = g_list_append(stats_list, proxy);
 	} else if (!strcmp(interface, "org.bluez.AgentManager1")) {
 		if (!agent_manager) {
 			agent_manager = proxy;
@@ -320,7 +389,7 @@ static void proxy_removed(GDBusProxy *proxy, void *user_data)
 
 	if (!strcmp(interface, "org.bluez.Device1")) {
 		if (device_is_child(proxy, default_ctrl) == TRUE) {
-			dev_list = g_list_remove(dev_list, proxy);
+			dev_list_remove(proxy);
 
 			print_device(proxy, COLORED_DEL);
 		}
@@ -332,9 +401,10 @@ static void proxy_removed(GDBusProxy *proxy, void *user_data)
 		if (default_ctrl == proxy) {
 			default_ctrl = NULL;
 
-			g_list_free(dev_list);
-			dev_list = NULL;
+			dev_list_clear();
 		}
+	} else if (!strcmp(interface, "org.bluez.AttStatistics1")) {
+		stats_list = g_list_remove(stats_list, proxy);
 	} else if (!strcmp(interface, "org.bluez.AgentManager1")) {
 		if (agent_manager == proxy) {
 			agent_manager = NULL;
@@ -548,15 +618,14 @@ static void cmd_select(const char *arg)
 	default_ctrl = proxy;
 	print_adapter(proxy, NULL);
 
-	g_list_free(dev_list);
-	dev_list = NULL;
+	dev_list_clear();
 }
 
 static void cmd_devices(const char *arg)
 {
 	GList *list;
 
-	for (list = g_list_first(dev_list); list; list = g_list_next(list)) {
+	for (list = dev_list->head; list; list = g_list_next(list)) {
 		GDBusProxy *proxy = list->data;
 		print_device(proxy, NULL);
 	}
@@ -566,7 +635,7 @@ static void cmd_paired_devices(const char *arg)
 {
 	GList *list;
 
-	for (list = g_list_first(dev_list); list; list = g_list_next(list)) {
+	for (list = dev_list->head; list; list = g_list_next(list)) {
 		GDBusProxy *proxy = list->data;
 		DBusMessageIter iter;
 		dbus_bool_t paired;
@@ -781,7 +850,7 @@ static void cmd_info(const char *arg)
 		return;
 	}
 
-	proxy = find_proxy_by_address(dev_list, arg);
+	proxy = find_device(arg);
 	if (!proxy) {
 		rl_printf("Device %s not available\n", arg);
 		return;
@@ -831,7 +900,7 @@ static void cmd_pair(const char *arg)
 		return;
 	}
 
-	proxy = find_proxy_by_address(dev_list, arg);
+	proxy = find_device(arg);
 	if (!proxy) {
 		rl_printf("Device %s not available\n", arg);
 		return;
@@ -857,7 +926,7 @@ static void cmd_trust(const char *arg)
 		return;
 	}
 
-	proxy = find_proxy_by_address(dev_list, arg);
+	proxy = find_device(arg);
 	if (!proxy) {
 		rl_printf("Device %s not available\n", arg);
 		return;
@@ -886,7 +955,7 @@ static void cmd_untrust(const char *arg)
 		return;
 	}
 
-	proxy = find_proxy_by_address(dev_list, arg);
+	proxy = find_device(arg);
 	if (!proxy) {
 		rl_printf("Device %s not available\n", arg);
 		return;
@@ -915,7 +984,7 @@ static void cmd_block(const char *arg)
 		return;
 	}
 
-	proxy = find_proxy_by_address(dev_list, arg);
+	proxy = find_device(arg);
 	if (!proxy) {
 		rl_printf("Device %s not available\n", arg);
 		return;
@@ -944,7 +1013,7 @@ static void cmd_unblock(const char *arg)
 		return;
 	}
 
-	proxy = find_proxy_by_address(dev_list, arg);
+	proxy = find_device(arg);
 	if (!proxy) {
 		rl_printf("Device %s not available\n", arg);
 		return;
@@ -997,7 +1066,7 @@ static void cmd_remove(const char *arg)
 	if (check_default_ctrl() == FALSE)
 		return;
 
-	proxy = find_proxy_by_address(dev_list, arg);
+	proxy = find_device(arg);
 	if (!proxy) {
 		rl_printf("Device %s not available\n", arg);
 		return;
@@ -1039,7 +1108,7 @@ static void cmd_connect(const char *arg)
 		return;
 	}
 
-	proxy = find_proxy_by_address(dev_list, arg);
+	proxy = find_device(arg);
 	if (!proxy) {
 		rl_printf("Device %s not available\n", arg);
 		return;
@@ -1078,7 +1147,7 @@ static void cmd_disconn(const char *arg)
 		return;
 	}
 
-	proxy = find_proxy_by_address(dev_list, arg);
+	proxy = find_device(arg);
 	if (!proxy) {
 		rl_printf("Device %s not available\n", arg);
 		return;
@@ -1093,6 +1162,115 @@ static void cmd_disconn(const char *arg)
 	rl_printf("Attempting to disconnect from %s\n", arg);
 }
 
+static void print_stats_histogram(DBusMessageIter *iter)
+{
+	DBusMessageIter array;
+	dbus_uint32_t *buckets;
+	int i, n;
+
+	dbus_message_iter_recurse(iter, &array);
+	dbus_message_iter_get_fixed_array(&array, &buckets, &n);
+
+	for (i = 0; i < n; i++) {
+		if (!buckets[i])
+			continue;
+
+		if (i == n - 1)
+			rl_printf("\t\t>= %u ms: %u\n", 1U << (i - 1),
+								buckets[i]);
+		else
+			rl_printf("\t\t<  %u ms: %u\n", 1U << i,
+								buckets[i]);
+	}
+}
+
+static void stats_reply(DBusMessage *message, void *user_data)
+{
+	DBusMessageIter iter, dict;
+	DBusError error;
+
+	dbus_error_init(&error);
+
+	if (dbus_set_error_from_message(&error, message) == TRUE) {
+		rl_printf("Failed to get statistics: %s\n", error.name);
+		dbus_error_free(&error);
+		return;
+	}
+
+	if (dbus_message_iter_init(message, &iter) == FALSE)
+		return;
+
+	dbus_message_iter_recurse(&iter, &dict);
+
+	while (dbus_message_iter_get_arg_type(&dict) ==
+						DBUS_TYPE_DICT_ENTRY) {
+		DBusMessageIter entry, value;
+		dbus_uint64_t valu64;
+		dbus_uint32_t valu32;
+		const char *key;
+
+		dbus_message_iter_recurse(&dict, &entry);
+		dbus_message_iter_get_basic(&entry, &key);
+		dbus_message_iter_next(&entry);
+		dbus_message_iter_recurse(&entry, &value);
+
+		switch (dbus_message_iter_get_arg_type(&value)) {
+		case DBUS_TYPE_UINT64:
+			dbus_message_iter_get_basic(&value, &valu64);
+			rl_printf("\t%s: %" PRIu64 "\n", key, valu64);
+			break;
+		case DBUS_TYPE_UINT32:
+			dbus_message_iter_get_basic(&value, &valu32);
+			rl_printf("\t%s: %u\n", key, valu32);
+			break;
+		case DBUS_TYPE_ARRAY:
+			rl_printf("\t%s:\n", key);
+			print_stats_histogram(&value);
+			break;
+		}
+
+		dbus_message_iter_next(&dict);
+	}
+}
+
+static void cmd_stats(const char *arg)
+{
+	GDBusProxy *proxy;
+	const char *path;
+	GList *list;
+
+	if (!arg || !strlen(arg)) {
+		rl_printf("Missing device address argument\n");
+		return;
+	}
+
+	proxy = find_device(arg);
+	if (!proxy) {
+		rl_printf("Device %s not available\n", arg);
+		return;
+	}
+
+	path = g_dbus_proxy_get_path(proxy);
+
+	for (list = stats_list; list; list = g_list_next(list)) {
+		if (!strcmp(g_dbus_proxy_get_path(list->data), path))
+			break;
+	}
+
+	if (!list) {
+		rl_printf("No ATT connection to %s\n", arg);
+		return;
+	}
+
+	if (g_dbus_proxy_method_call(list->data, "GetStatistics", NULL,
+					stats_reply, NULL, NULL) == FALSE) {
+		rl_printf("Failed to get statistics\n");
+		return;
+	}
+
+	rl_printf("ATT statistics for %s\n", arg);
+}
+
 static void cmd_version(const char *arg)
 {
 	rl_printf("Version %s\n", VERSION);
@@ -1141,7 +1319,7 @@ static char *ctrl_generator(const char *text, int state)
 
 static char *dev_generator(const char *text, int state)
 {
-	return generic_generator(text, state, dev_list, "Address");
+	return generic_generator(text, state, dev_list->head, "Address");
 }
 
 static char *capability_generator(const char *text, int state)
@@ -1211,6 +1389,8 @@ static const struct {
 							dev_generator },
 	{ "disconnect",   "<dev>",    cmd_disconn, "Disconnect device",
 							dev_generator },
+	{ "stats",        "<dev>",    cmd_stats, "Show ATT link statistics",
+							dev_generator },
 	{ "version",      NULL,       cmd_version, "Display version" },
 	{ "quit",         NULL,       cmd_quit, "Quit program" },
 	{ "exit",         NULL,       cmd_quit },
@@ -1500,6 +1680,10 @@ int main(int argc, char *argv[])
 	main_loop = g_main_loop_new(NULL, FALSE);
 	dbus_conn = g_dbus_setup_bus(DBUS_BUS_SYSTEM, NULL, NULL);
 
+	dev_list = g_queue_new();
+	dev_index = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+									NULL);
+
 	rl_attempted_completion_function = cmd_completion;
 
 	rl_erase_empty_line = 1;
@@ -1535,7 +1719,11 @@ int main(int argc, char *argv[])
 	g_main_loop_unref(main_loop);
 
 	g_list_free_full(ctrl_list, proxy_leak);
-	g_list_free_full(dev_list, proxy_leak);
+	while (!g_queue_is_empty(dev_list))
+		proxy_leak(g_queue_pop_head(dev_list));
+
+	g_queue_free(dev_list);
+	g_hash_table_destroy(dev_index);
 
 	g_free(auto_register_agent);
 
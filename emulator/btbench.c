@@ -0,0 +1,1095 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2014  Intel Corporation
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+
+#include "lib/bluetooth.h"
+#include "src/shared/util.h"
+#include "src/shared/timeout.h"
+#include "monitor/bt.h"
+#include "monitor/mainloop.h"
+#include "btdev.h"
+#include "bthost.h"
+
+/*
+ * Two bthost instances talk to each other through two btdev controllers.
+ * Everything runs in this process; packets between host and controller
+ * go through a FIFO so that nothing recurses across the whole stack.
+ */
+
+#define BENCH_PSM	0x1001
+#define BENCH_CID	0x0040
+#define BENCH_CHANNEL	1
+#define BENCH_TIMEOUT	60000
+
+#define ATT_CID			0x0004
+#define ATT_OP_WRITE_REQ	0x12
+#define ATT_OP_WRITE_RSP	0x13
+#define ATT_OP_HANDLE_NOTIFY	0x1b
+
+#define ERTM_TXWIN	63
+
+struct wire_pkt {
+	struct wire_pkt *next;
+	struct btdev *btdev;
+	struct bthost *bthost;
+	uint16_t len;
+	uint8_t data[0];
+};
+
+struct side {
+	struct btdev *btdev;
+	struct bthost *bthost;
+};
+
+struct bench;
+
+struct test {
+	const char *name;
+	bool le;
+	const unsigned int *mtus;
+	void (*connect) (struct bench *bench);
+	void (*send) (struct bench *bench, uint16_t len);
+	void (*echo) (struct bench *bench, const uint8_t *data, uint16_t len);
+	uint16_t (*payload) (uint16_t mtu);
+	bool (*can_send) (struct bench *bench);
+	bthost_cid_hook_func_t a_received;
+	bthost_cid_hook_func_t b_received;
+};
+
+struct bench {
+	const struct test *test;
+	uint16_t mtu;
+	struct side a;
+	struct side b;
+	uint16_t handle;
+	uint16_t a_cid;
+	uint16_t b_cid;
+	unsigned int timeout_id;
+	bool failed;
+
+	uint64_t start;
+	uint64_t elapsed;
+	size_t sent;
+	size_t received;
+
+	unsigned int rtt_left;
+	uint64_t rtt_start;
+	uint64_t rtt_min;
+	uint64_t rtt_max;
+	uint64_t rtt_sum;
+
+	uint8_t tx_seq;
+	uint8_t tx_acked;
+	uint8_t rx_seq;
+	uint8_t rx_unacked;
+	uint8_t echo_seq;
+};
+
+static struct wire_pkt *wire_head = NULL;
+static struct wire_pkt *wire_tail = NULL;
+static bool wire_busy = false;
+
+static const struct test *tests[8];
+static unsigned int num_tests = 0;
+static unsigned int mtus[16];
+static unsigned int num_mtus = 0;
+static unsigned int cur_test = 0;
+static unsigned int cur_mtu = 0;
+
+static size_t total_size = 1024 * 1024;
+static unsigned int rtt_count = 100;
+static unsigned int window = 16;
+static struct btdev_link_model link_model;
+static bool machine = false;
+static int result = EXIT_SUCCESS;
+
+static uint8_t buf[UINT16_MAX];
+static uint8_t pdu[UINT16_MAX];
+
+static uint64_t get_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void wire_send(struct btdev *btdev, struct bthost *bthost,
+					const void *data, uint16_t len)
+{
+	struct wire_pkt *pkt;
+
+	pkt = malloc(sizeof(*pkt) + len);
+	if (!pkt)
+		return;
+
+	pkt->next = NULL;
+	pkt->btdev = btdev;
+	pkt->bthost = bthost;
+	pkt->len = len;
+	memcpy(pkt->data, data, len);
+
+	if (wire_tail)
+		wire_tail->next = pkt;
+	else
+		wire_head = pkt;
+
+	wire_tail = pkt;
+
+	if (wire_busy)
+		return;
+
+	wire_busy = true;
+
+	while ((pkt = wire_head)) {
+		wire_head = pkt->next;
+		if (!wire_head)
+			wire_tail = NULL;
+
+		if (pkt->btdev)
+			btdev_receive_h4(pkt->btdev, pkt->data, pkt->len);
+		else
+			bthost_receive_h4(pkt->bthost, pkt->data, pkt->len);
+
+		free(pkt);
+	}
+
+	wire_busy = false;
+}
+
+static void wire_flush(void)
+{
+	struct wire_pkt *pkt;
+
+	while ((pkt = wire_head)) {
+		wire_head = pkt->next;
+		free(pkt);
+	}
+
+	wire_tail = NULL;
+}
+
+static void host_send(const void *data, uint16_t len, void *user_data)
+{
+	struct side *side = user_data;
+
+	wire_send(side->btdev, NULL, data, len);
+}
+
+static void dev_send(const void *data, uint16_t len, void *user_data)
+{
+	struct side *side = user_data;
+
+	wire_send(NULL, side->bthost, data, len);
+}
+
+static bool side_setup(struct side *side, uint16_t id)
+{
+	side->btdev = btdev_create(BTDEV_TYPE_BREDRLE, id);
+	if (!side->btdev)
+		return false;
+
+	if (!btdev_set_link_model(side->btdev, &link_model))
+		return false;
+
+	side->bthost = bthost_create();
+	if (!side->bthost)
+		return false;
+
+	btdev_set_send_handler(side->btdev, dev_send, side);
+	bthost_set_send_handler(side->bthost, host_send, side);
+
+	bthost_start(side->bthost);
+
+	return true;
+}
+
+static void side_cleanup(struct side *side)
+{
+	if (side->bthost) {
+		bthost_stop(side->bthost);
+		bthost_destroy(side->bthost);
+	}
+
+	btdev_destroy(side->btdev);
+}
+
+static void next_bench(void);
+
+static bool next_bench_timeout(void *user_data)
+{
+	next_bench();
+
+	return false;
+}
+
+static void bench_report(struct bench *bench)
+{
+	const char *name = bench->test->name;
+	double kbps = 0, rtt_avg = 0;
+	unsigned int rtt_done = rtt_count - bench->rtt_left;
+	uint64_t rtt_min = 0;
+
+	if (bench->elapsed)
+		kbps = bench->received * 8000.0 / bench->elapsed;
+
+	if (rtt_done) {
+		rtt_avg = (double) bench->rtt_sum / rtt_done;
+		rtt_min = bench->rtt_min;
+	}
+
+	if (machine) {
+		printf("%s,%u,%zu,%" PRIu64 ",%.1f,%" PRIu64 ",%.1f,%"
+					PRIu64 ",%s\n", name, bench->mtu,
+					bench->received, bench->elapsed, kbps,
+					rtt_min, rtt_avg, bench->rtt_max,
+					bench->failed ? "failed" : "ok");
+		return;
+	}
+
+	if (bench->failed) {
+		printf("%-8s mtu %5u  failed\n", name, bench->mtu);
+		return;
+	}
+
+	printf("%-8s mtu %5u  %10.1f kbit/s  rtt %" PRIu64 "/%.1f/%" PRIu64
+					" us\n", name, bench->mtu, kbps,
+					rtt_min, rtt_avg, bench->rtt_max);
+}
+
+static void bench_finish(struct bench *bench, bool failed)
+{
+	/* Only the first failure or completion is reported */
+	if (!bench->test)
+		return;
+
+	bench->failed = failed;
+
+	if (failed)
+		result = EXIT_FAILURE;
+
+	bench_report(bench);
+
+	if (bench->timeout_id) {
+		timeout_remove(bench->timeout_id);
+		bench->timeout_id = 0;
+	}
+
+	/* Tear down outside of any host or controller callback */
+	bench->test = NULL;
+
+	timeout_add(1, next_bench_timeout, bench, NULL);
+}
+
+static bool bench_timeout(void *user_data)
+{
+	struct bench *bench = user_data;
+
+	bench->timeout_id = 0;
+	bench_finish(bench, true);
+
+	return false;
+}
+
+static void pump(struct bench *bench)
+{
+	const struct test *test = bench->test;
+	uint16_t payload;
+
+	if (!test)
+		return;
+
+	payload = test->payload(bench->mtu);
+
+	while (bench->sent < total_size &&
+			bench->sent - bench->received < window * payload) {
+		uint16_t len = payload;
+
+		if (len > total_size - bench->sent)
+			len = total_size - bench->sent;
+
+		if (test->can_send && !test->can_send(bench))
+			return;
+
+		bench->sent += len;
+		test->send(bench, len);
+	}
+}
+
+static void rtt_send(struct bench *bench)
+{
+	bench->rtt_start = get_time_us();
+	bench->test->send(bench, 16);
+}
+
+static void start_bench(struct bench *bench)
+{
+	bench->start = get_time_us();
+	pump(bench);
+}
+
+static void receive(struct bench *bench, uint16_t len)
+{
+	if (!bench->test)
+		return;
+
+	if (bench->received < total_size) {
+		bench->received += len;
+
+		if (bench->received < total_size) {
+			pump(bench);
+			return;
+		}
+
+		bench->elapsed = get_time_us() - bench->start;
+		bench->received = total_size;
+
+		if (!rtt_count) {
+			bench_finish(bench, false);
+			return;
+		}
+
+		bench->rtt_left = rtt_count;
+		rtt_send(bench);
+		return;
+	}
+
+	bench->test->echo(bench, buf, len);
+}
+
+static void echo_received(struct bench *bench)
+{
+	uint64_t rtt;
+
+	if (!bench->test || !bench->rtt_left)
+		return;
+
+	rtt = get_time_us() - bench->rtt_start;
+
+	if (rtt < bench->rtt_min)
+		bench->rtt_min = rtt;
+
+	if (rtt > bench->rtt_max)
+		bench->rtt_max = rtt;
+
+	bench->rtt_sum += rtt;
+
+	if (--bench->rtt_left > 0) {
+		rtt_send(bench);
+		return;
+	}
+
+	bench_finish(bench, false);
+}
+
+/* L2CAP basic mode */
+
+static uint16_t l2cap_payload(uint16_t mtu)
+{
+	return mtu;
+}
+
+static void l2cap_send(struct bench *bench, uint16_t len)
+{
+	bthost_send_cid(bench->a.bthost, bench->handle, bench->b_cid, buf, len);
+}
+
+static void l2cap_echo(struct bench *bench, const uint8_t *data, uint16_t len)
+{
+	bthost_send_cid(bench->b.bthost, bench->handle, bench->a_cid, data,
+									len);
+}
+
+static void l2cap_a_received(const void *data, uint16_t len, void *user_data)
+{
+	echo_received(user_data);
+}
+
+static void l2cap_b_received(const void *data, uint16_t len, void *user_data)
+{
+	receive(user_data, len);
+}
+
+static void l2cap_conn_rsp(uint8_t code, const void *data, uint16_t len,
+							void *user_data)
+{
+	const struct bt_l2cap_pdu_conn_rsp *rsp = data;
+	struct bench *bench = user_data;
+
+	if (code != BT_L2CAP_PDU_CONN_RSP || len < sizeof(*rsp) ||
+							rsp->result) {
+		bench_finish(bench, true);
+		return;
+	}
+
+	bench->b_cid = le16_to_cpu(rsp->dcid);
+
+	bthost_add_cid_hook(bench->a.bthost, bench->handle, bench->a_cid,
+					bench->test->a_received, bench);
+	bthost_add_cid_hook(bench->b.bthost, bench->handle, bench->b_cid,
+					bench->test->b_received, bench);
+
+	start_bench(bench);
+}
+
+static void l2cap_connect(struct bench *bench)
+{
+	struct bt_l2cap_pdu_conn_req req;
+
+	bench->a_cid = BENCH_CID;
+
+	req.psm = cpu_to_le16(BENCH_PSM);
+	req.scid = cpu_to_le16(bench->a_cid);
+
+	if (!bthost_l2cap_req(bench->a.bthost, bench->handle,
+					BT_L2CAP_PDU_CONN_REQ, &req,
+					sizeof(req), l2cap_conn_rsp, bench))
+		bench_finish(bench, true);
+}
+
+static const unsigned int l2cap_mtus[] = { 672, 1024, 4096, 0 };
+
+static const struct test l2cap_test = {
+	.name = "l2cap",
+	.mtus = l2cap_mtus,
+	.connect = l2cap_connect,
+	.send = l2cap_send,
+	.echo = l2cap_echo,
+	.payload = l2cap_payload,
+	.a_received = l2cap_a_received,
+	.b_received = l2cap_b_received,
+};
+
+/*
+ * L2CAP enhanced retransmission mode framing. bthost has no ERTM state
+ * machine, so I-frames, acknowledgements and the transmit window are
+ * handled here on top of the basic mode channel, including the FCS.
+ */
+
+static uint16_t crc16_table[256];
+
+static void crc16_init(void)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < 256; i++) {
+		uint16_t crc = i;
+
+		for (j = 0; j < 8; j++)
+			crc = crc & 1 ? (crc >> 1) ^ 0xa001 : crc >> 1;
+
+		crc16_table[i] = crc;
+	}
+}
+
+static uint16_t crc16(uint16_t crc, const uint8_t *data, size_t len)
+{
+	while (len--)
+		crc = (crc >> 8) ^ crc16_table[(crc ^ *data++) & 0xff];
+
+	return crc;
+}
+
+static uint16_t ertm_fcs(uint16_t cid, const uint8_t *data, uint16_t len)
+{
+	uint8_t hdr[4];
+
+	put_le16(len + 2, hdr);
+	put_le16(cid, hdr + 2);
+
+	return crc16(crc16(0, hdr, 4), data, len);
+}
+
+static uint16_t ertm_payload(uint16_t mtu)
+{
+	return mtu;
+}
+
+static void ertm_send_frame(struct bench *bench, struct bthost *bthost,
+				uint16_t cid, uint16_t control,
+				const uint8_t *data, uint16_t len)
+{
+	put_le16(control, pdu);
+	if (len)
+		memcpy(pdu + 2, data, len);
+	put_le16(ertm_fcs(cid, pdu, len + 2), pdu + 2 + len);
+
+	bthost_send_cid(bthost, bench->handle, cid, pdu, len + 4);
+}
+
+static uint16_t ertm_iframe(uint8_t tx_seq, uint8_t req_seq)
+{
+	return (tx_seq & 0x3f) << 1 | (req_seq & 0x3f) << 8;
+}
+
+static bool ertm_can_send(struct bench *bench)
+{
+	return ((bench->tx_seq - bench->tx_acked) & 0x3f) < ERTM_TXWIN;
+}
+
+static void ertm_send(struct bench *bench, uint16_t len)
+{
+	uint16_t control = ertm_iframe(bench->tx_seq++, bench->echo_seq);
+
+	ertm_send_frame(bench, bench->a.bthost, bench->b_cid, control, buf,
+									len);
+}
+
+static void ertm_echo(struct bench *bench, const uint8_t *data, uint16_t len)
+{
+	uint16_t control = ertm_iframe(bench->echo_seq, bench->rx_seq);
+
+	ertm_send_frame(bench, bench->b.bthost, bench->a_cid, control, data,
+									len);
+}
+
+static bool ertm_check(uint16_t cid, const uint8_t *data, uint16_t len)
+{
+	if (len < 4)
+		return false;
+
+	return get_le16(data + len - 2) == ertm_fcs(cid, data, len - 2);
+}
+
+static void ertm_a_received(const void *data, uint16_t len, void *user_data)
+{
+	struct bench *bench = user_data;
+	uint16_t control;
+
+	if (!bench->test)
+		return;
+
+	if (!ertm_check(bench->a_cid, data, len)) {
+		bench_finish(bench, true);
+		return;
+	}
+
+	control = get_le16(data);
+	bench->tx_acked = (control >> 8) & 0x3f;
+
+	/* Supervisory frames only acknowledge */
+	if (control & 0x01) {
+		pump(bench);
+		return;
+	}
+
+	bench->echo_seq = (bench->echo_seq + 1) & 0x3f;
+
+	echo_received(bench);
+}
+
+static void ertm_b_received(const void *data, uint16_t len, void *user_data)
+{
+	struct bench *bench = user_data;
+	uint16_t control;
+
+	if (!bench->test)
+		return;
+
+	if (!ertm_check(bench->b_cid, data, len) || get_le16(data) & 0x01) {
+		bench_finish(bench, true);
+		return;
+	}
+
+	control = get_le16(data);
+	if (((control >> 1) & 0x3f) != bench->rx_seq) {
+		bench_finish(bench, true);
+		return;
+	}
+
+	bench->rx_seq = (bench->rx_seq + 1) & 0x3f;
+
+	/* Acknowledge every half window with a Receiver Ready */
+	if (bench->received < total_size &&
+				++bench->rx_unacked >= ERTM_TXWIN / 2) {
+		uint16_t rr = 0x0001 | bench->rx_seq << 8;
+
+		bench->rx_unacked = 0;
+		ertm_send_frame(bench, bench->b.bthost, bench->a_cid, rr,
+								NULL, 0);
+	}
+
+	receive(bench, len - 4);
+}
+
+static const struct test ertm_test = {
+	.name = "ertm",
+	.mtus = l2cap_mtus,
+	.connect = l2cap_connect,
+	.send = ertm_send,
+	.echo = ertm_echo,
+	.payload = ertm_payload,
+	.can_send = ertm_can_send,
+	.a_received = ertm_a_received,
+	.b_received = ertm_b_received,
+};
+
+/* RFCOMM */
+
+static uint16_t rfcomm_payload(uint16_t mtu)
+{
+	return mtu;
+}
+
+static void rfcomm_send(struct bench *bench, uint16_t len)
+{
+	bthost_send_rfcomm_data(bench->a.bthost, bench->handle, BENCH_CHANNEL,
+								buf, len);
+}
+
+static void rfcomm_echo(struct bench *bench, const uint8_t *data,
+								uint16_t len)
+{
+	bthost_send_rfcomm_data(bench->b.bthost, bench->handle, BENCH_CHANNEL,
+								data, len);
+}
+
+static void rfcomm_a_received(const void *data, uint16_t len, void *user_data)
+{
+	echo_received(user_data);
+}
+
+static void rfcomm_b_received(const void *data, uint16_t len, void *user_data)
+{
+	receive(user_data, len);
+}
+
+static void rfcomm_connect_cb(uint16_t handle, uint16_t cid, void *user_data,
+								bool status)
+{
+	struct bench *bench = user_data;
+
+	if (!status) {
+		bench_finish(bench, true);
+		return;
+	}
+
+	bthost_add_rfcomm_chan_hook(bench->a.bthost, handle, BENCH_CHANNEL,
+						rfcomm_a_received, bench);
+	bthost_add_rfcomm_chan_hook(bench->b.bthost, handle, BENCH_CHANNEL,
+						rfcomm_b_received, bench);
+
+	start_bench(bench);
+}
+
+static void rfcomm_connect(struct bench *bench)
+{
+	if (!bthost_connect_rfcomm(bench->a.bthost, bench->handle,
+					BENCH_CHANNEL, rfcomm_connect_cb,
+					bench))
+		bench_finish(bench, true);
+}
+
+static const unsigned int rfcomm_mtus[] = { 127, 667, 4096, 0 };
+
+static const struct test rfcomm_test = {
+	.name = "rfcomm",
+	.mtus = rfcomm_mtus,
+	.connect = rfcomm_connect,
+	.send = rfcomm_send,
+	.echo = rfcomm_echo,
+	.payload = rfcomm_payload,
+};
+
+/*
+ * ATT over LE. Throughput uses Handle Value Notifications, the round trip
+ * a Write Request answered by a Write Response.
+ */
+
+static uint16_t att_payload(uint16_t mtu)
+{
+	return mtu - 3;
+}
+
+static void att_send(struct bench *bench, uint16_t len)
+{
+	pdu[0] = bench->received < total_size ? ATT_OP_HANDLE_NOTIFY :
+							ATT_OP_WRITE_REQ;
+	put_le16(0x0003, pdu + 1);
+	memcpy(pdu + 3, buf, len);
+
+	bthost_send_cid(bench->a.bthost, bench->handle, ATT_CID, pdu, len + 3);
+}
+
+static void att_echo(struct bench *bench, const uint8_t *data, uint16_t len)
+{
+	uint8_t rsp = ATT_OP_WRITE_RSP;
+
+	bthost_send_cid(bench->b.bthost, bench->handle, ATT_CID, &rsp, 1);
+}
+
+static void att_a_received(const void *data, uint16_t len, void *user_data)
+{
+	const uint8_t *pdu = data;
+
+	if (len > 0 && pdu[0] == ATT_OP_WRITE_RSP)
+		echo_received(user_data);
+}
+
+static void att_b_received(const void *data, uint16_t len, void *user_data)
+{
+	if (len < 3)
+		return;
+
+	receive(user_data, len - 3);
+}
+
+static void att_connect(struct bench *bench)
+{
+	bthost_add_cid_hook(bench->a.bthost, bench->handle, ATT_CID,
+						att_a_received, bench);
+	bthost_add_cid_hook(bench->b.bthost, bench->handle, ATT_CID,
+						att_b_received, bench);
+
+	start_bench(bench);
+}
+
+static const unsigned int att_mtus[] = { 23, 185, 512, 0 };
+
+static const struct test att_test = {
+	.name = "att",
+	.le = true,
+	.mtus = att_mtus,
+	.connect = att_connect,
+	.send = att_send,
+	.echo = att_echo,
+	.payload = att_payload,
+};
+
+static const struct test *all_tests[] = {
+	&l2cap_test, &ertm_test, &rfcomm_test, &att_test, NULL
+};
+
+static void connect_cb(uint16_t handle, void *user_data)
+{
+	struct bench *bench = user_data;
+
+	bench->handle = handle;
+	bench->test->connect(bench);
+}
+
+static struct bench *bench = NULL;
+
+static void bench_cleanup(void)
+{
+	if (!bench)
+		return;
+
+	if (bench->timeout_id)
+		timeout_remove(bench->timeout_id);
+
+	side_cleanup(&bench->a);
+	side_cleanup(&bench->b);
+	wire_flush();
+
+	free(bench);
+	bench = NULL;
+}
+
+static bool bench_start(const struct test *test, uint16_t mtu)
+{
+	bench = calloc(1, sizeof(*bench));
+	if (!bench)
+		return false;
+
+	bench->test = test;
+	bench->mtu = mtu;
+	bench->rtt_min = UINT64_MAX;
+
+	if (!side_setup(&bench->a, 0x0a) || !side_setup(&bench->b, 0x0b))
+		return false;
+
+	bench->timeout_id = timeout_add(BENCH_TIMEOUT, bench_timeout,
+								bench, NULL);
+
+	bthost_add_l2cap_server(bench->b.bthost, BENCH_PSM, NULL, NULL);
+	bthost_add_l2cap_server(bench->b.bthost, 0x0003, NULL, NULL);
+	bthost_add_rfcomm_server(bench->b.bthost, BENCH_CHANNEL, NULL, NULL);
+
+	bthost_set_connect_cb(bench->a.bthost, connect_cb, bench);
+
+	if (test->le) {
+		bthost_set_adv_enable(bench->b.bthost, 0x01);
+		bthost_hci_connect(bench->a.bthost,
+					btdev_get_bdaddr(bench->b.btdev),
+					BDADDR_LE_PUBLIC);
+	} else {
+		bthost_write_scan_enable(bench->b.bthost, 0x03);
+		bthost_hci_connect(bench->a.bthost,
+					btdev_get_bdaddr(bench->b.btdev),
+					BDADDR_BREDR);
+	}
+
+	return true;
+}
+
+static void next_bench(void)
+{
+	const struct test *test;
+	unsigned int mtu;
+
+	bench_cleanup();
+
+	while (cur_test < num_tests) {
+		test = tests[cur_test];
+
+		if (num_mtus)
+			mtu = cur_mtu < num_mtus ? mtus[cur_mtu] : 0;
+		else
+			mtu = test->mtus[cur_mtu];
+
+		if (!mtu) {
+			cur_test++;
+			cur_mtu = 0;
+			continue;
+		}
+
+		cur_mtu++;
+
+		if (test->payload(mtu) < 16 || mtu > UINT16_MAX - 8) {
+			fprintf(stderr, "Invalid MTU %u for %s\n", mtu,
+								test->name);
+			continue;
+		}
+
+		if (!bench_start(test, mtu)) {
+			fprintf(stderr, "Failed to set up %s\n", test->name);
+			bench_cleanup();
+			result = EXIT_FAILURE;
+			break;
+		}
+
+		return;
+	}
+
+	mainloop_quit();
+}
+
+static bool start_timeout(void *user_data)
+{
+	next_bench();
+
+	return false;
+}
+
+static void signal_callback(int signum, void *user_data)
+{
+	switch (signum) {
+	case SIGINT:
+	case SIGTERM:
+		mainloop_quit();
+		break;
+	}
+}
+
+static bool add_test(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; all_tests[i]; i++) {
+		if (strcmp(all_tests[i]->name, name))
+			continue;
+
+		if (num_tests == sizeof(tests) / sizeof(tests[0]))
+			return false;
+
+		tests[num_tests++] = all_tests[i];
+		return true;
+	}
+
+	return false;
+}
+
+static bool parse_mtus(char *str)
+{
+	char *tok;
+
+	for (tok = strtok(str, ","); tok; tok = strtok(NULL, ",")) {
+		if (num_mtus == sizeof(mtus) / sizeof(mtus[0]) - 1)
+			return false;
+
+		mtus[num_mtus] = atoi(tok);
+		if (!mtus[num_mtus])
+			return false;
+
+		num_mtus++;
+	}
+
+	return true;
+}
+
+static void usage(void)
+{
+	printf("btbench - Host protocol benchmark over emulated controllers\n"
+		"Usage:\n");
+	printf("\tbtbench [options]\n");
+	printf("options:\n"
+		"\t-t, --test <name>      Run test (l2cap, ertm, rfcomm, att)\n"
+		"\t-M, --mtu <list>       Comma separated MTUs to test\n"
+		"\t-s, --size <bytes>     Bytes to transfer per test\n"
+		"\t-r, --rtt <count>      Round trips to measure per test\n"
+		"\t-w, --window <count>   SDUs in flight\n"
+		"\t-b, --bitrate <bps>    Link bitrate\n"
+		"\t-l, --latency <ms>     Link latency\n"
+		"\t-p, --loss <permille>  Link retransmission rate\n"
+		"\t-i, --interval <ms>    LE connection interval\n"
+		"\t-n, --buffers <count>  Controller ACL buffers\n"
+		"\t-a, --acl-mtu <bytes>  Controller ACL buffer size\n"
+		"\t-m, --machine          Print results as CSV\n"
+		"\t-h, --help             Show help options\n");
+}
+
+static const struct option main_options[] = {
+	{ "test",     required_argument, NULL, 't' },
+	{ "mtu",      required_argument, NULL, 'M' },
+	{ "size",     required_argument, NULL, 's' },
+	{ "rtt",      required_argument, NULL, 'r' },
+	{ "window",   required_argument, NULL, 'w' },
+	{ "bitrate",  required_argument, NULL, 'b' },
+	{ "latency",  required_argument, NULL, 'l' },
+	{ "loss",     required_argument, NULL, 'p' },
+	{ "interval", required_argument, NULL, 'i' },
+	{ "buffers",  required_argument, NULL, 'n' },
+	{ "acl-mtu",  required_argument, NULL, 'a' },
+	{ "machine",  no_argument,       NULL, 'm' },
+	{ "version",  no_argument,       NULL, 'v' },
+	{ "help",     no_argument,       NULL, 'h' },
+	{ }
+};
+
+int main(int argc, char *argv[])
+{
+	sigset_t mask;
+	unsigned int i;
+
+	for (;;) {
+		int opt;
+
+		opt = getopt_long(argc, argv, "t:M:s:r:w:b:l:p:i:n:a:mvh",
+						main_options, NULL);
+		if (opt < 0)
+			break;
+
+		switch (opt) {
+		case 't':
+			if (!add_test(optarg)) {
+				fprintf(stderr, "Invalid test %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'M':
+			if (!parse_mtus(optarg)) {
+				fprintf(stderr, "Invalid MTU list\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 's':
+			total_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			rtt_count = atoi(optarg);
+			break;
+		case 'w':
+			window = atoi(optarg);
+			break;
+		case 'b':
+			link_model.bitrate = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			link_model.latency = atoi(optarg);
+			break;
+		case 'p':
+			link_model.loss = atoi(optarg);
+			break;
+		case 'i':
+			link_model.conn_interval = atoi(optarg);
+			break;
+		case 'n':
+			link_model.acl_max_pkt = atoi(optarg);
+			break;
+		case 'a':
+			link_model.acl_mtu = atoi(optarg);
+			break;
+		case 'm':
+			machine = true;
+			break;
+		case 'v':
+			printf("%s\n", VERSION);
+			return EXIT_SUCCESS;
+		case 'h':
+			usage();
+			return EXIT_SUCCESS;
+		default:
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!total_size || !window || link_model.loss >= 1000) {
+		fprintf(stderr, "Invalid parameters\n");
+		return EXIT_FAILURE;
+	}
+
+	if (!num_tests) {
+		for (i = 0; all_tests[i]; i++)
+			tests[num_tests++] = all_tests[i];
+	}
+
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = i;
+
+	crc16_init();
+
+	mainloop_init();
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+
+	mainloop_set_signal(&mask, signal_callback, NULL, NULL);
+
+	if (machine)
+		printf("test,mtu,bytes,usec,kbps,rtt_min_us,rtt_avg_us,"
+						"rtt_max_us,status\n");
+
+	timeout_add(1, start_timeout, NULL, NULL);
+
+	mainloop_run();
+
+	bench_cleanup();
+
+	return result;
+}
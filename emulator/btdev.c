@@ -31,6 +31,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <alloca.h>
+#include <time.h>
 
 #include "src/shared/util.h"
 #include "src/shared/timeout.h"
@@ -49,9 +50,34 @@ struct hook {
 
 #define MAX_HOOK_ENTRIES 16
 
+struct link_pkt {
+	struct link_pkt *next;
+	uint64_t done;
+	uint64_t deliver;
+	uint16_t len;
+	uint8_t data[0];
+};
+
+enum {
+	HASH_BDADDR,
+	HASH_RANDOM,
+	HASH_MAX,
+};
+
+enum {
+	LIST_SCAN,
+	LIST_ADV,
+	LIST_MAX,
+};
+
 struct btdev {
 	enum btdev_type type;
 
+	unsigned int index;
+	struct btdev *hash_next[HASH_MAX];
+	struct btdev *list_next[LIST_MAX];
+	struct btdev **list_pprev[LIST_MAX];
+
 	struct btdev *conn;
 
 	bool auth_init;
@@ -130,6 +156,19 @@ struct btdev {
 	uint8_t  le_adv_enable;
 	uint8_t  le_ltk[16];
 
+	unsigned int adv_interval;
+	uint64_t adv_due;
+
+	bool link_enabled;
+	bool link_le;
+	struct btdev_link_model link;
+	struct link_pkt *link_head;
+	struct link_pkt *link_tail;
+	struct link_pkt *link_pending;
+	uint64_t link_busy;
+	uint32_t link_seed;
+	unsigned int link_timer;
+
 	uint16_t sync_train_interval;
 	uint32_t sync_train_timeout;
 	uint8_t  sync_train_service_data;
@@ -145,13 +184,32 @@ struct inquiry_data {
 
 #define DEFAULT_INQUIRY_INTERVAL 100 /* 100 miliseconds */
 
-#define MAX_BTDEV_ENTRIES 16
+/* Index is encoded in two bytes of the generated address */
+#define MAX_BTDEV_ENTRIES 0xff00
 
+#define MIN_HASH_SIZE 64
+
+/* Granularity of periodic advertising of synthetic advertisers */
+#define ADV_TICK_INTERVAL 10
+
+static const uint8_t ADDR_UNSET[6] = { 0 };
 static const uint8_t LINK_KEY_NONE[16] = { 0 };
 static const uint8_t LINK_KEY_DUMMY[16] = {	0, 1, 2, 3, 4, 5, 6, 7,
 						8, 9, 0, 1, 2, 3, 4, 5 };
 
-static struct btdev *btdev_list[MAX_BTDEV_ENTRIES] = { };
+static struct btdev **btdev_list = NULL;
+static unsigned int btdev_list_size = 0;
+static unsigned int btdev_count = 0;
+static unsigned int btdev_free = 0;
+
+static struct btdev **hash_table[HASH_MAX] = { };
+static unsigned int hash_size = 0;
+
+/* Controllers with LE scanning and LE advertising enabled */
+static struct btdev *list_head[LIST_MAX] = { };
+
+static unsigned int adv_tick_id = 0;
+static unsigned int adv_periodic_count = 0;
 
 static int get_hook_index(struct btdev *btdev, enum btdev_hook_type type,
 								uint16_t opcode)
@@ -181,71 +239,275 @@ static bool run_hooks(struct btdev *btdev, enum btdev_hook_type type,
 					btdev->hook_list[index]->user_data);
 }
 
-static inline int add_btdev(struct btdev *btdev)
+static const uint8_t *hash_addr(const struct btdev *btdev, int hash)
+{
+	if (hash == HASH_RANDOM)
+		return btdev->random_addr;
+
+	return btdev->bdaddr;
+}
+
+static unsigned int addr_hash(const uint8_t *addr)
+{
+	uint32_t val = 2166136261u;
+	int i;
+
+	for (i = 0; i < 6; i++)
+		val = (val ^ addr[i]) * 16777619u;
+
+	return val & (hash_size - 1);
+}
+
+static void hash_add(struct btdev *btdev, int hash)
 {
-	int i, index = -1;
+	const uint8_t *addr = hash_addr(btdev, hash);
+	unsigned int bucket;
 
-	for (i = 0; i < MAX_BTDEV_ENTRIES; i++) {
-		if (btdev_list[i] == NULL) {
-			index = i;
-			btdev_list[index] = btdev;
+	/* Unset random addresses are never looked up */
+	if (hash == HASH_RANDOM && !memcmp(addr, ADDR_UNSET, 6))
+		return;
+
+	bucket = addr_hash(addr);
+
+	btdev->hash_next[hash] = hash_table[hash][bucket];
+	hash_table[hash][bucket] = btdev;
+}
+
+static void hash_del(struct btdev *btdev, int hash)
+{
+	struct btdev **ptr;
+
+	ptr = &hash_table[hash][addr_hash(hash_addr(btdev, hash))];
+
+	for (; *ptr; ptr = &(*ptr)->hash_next[hash]) {
+		if (*ptr == btdev) {
+			*ptr = btdev->hash_next[hash];
 			break;
 		}
 	}
 
-	return index;
+	btdev->hash_next[hash] = NULL;
 }
 
-static inline int del_btdev(struct btdev *btdev)
+static bool hash_resize(unsigned int size)
 {
-	int i, index = -1;
+	struct btdev **table[HASH_MAX];
+	unsigned int i;
+	int hash;
 
-	for (i = 0; i < MAX_BTDEV_ENTRIES; i++) {
-		if (btdev_list[i] == btdev) {
-			index = i;
-			btdev_list[index] = NULL;
-			break;
+	for (hash = 0; hash < HASH_MAX; hash++) {
+		table[hash] = calloc(size, sizeof(struct btdev *));
+		if (!table[hash]) {
+			while (hash-- > 0)
+				free(table[hash]);
+			return false;
 		}
 	}
 
+	for (hash = 0; hash < HASH_MAX; hash++) {
+		free(hash_table[hash]);
+		hash_table[hash] = table[hash];
+	}
+
+	hash_size = size;
+
+	for (i = 0; i < btdev_list_size; i++) {
+		if (!btdev_list[i])
+			continue;
+
+		for (hash = 0; hash < HASH_MAX; hash++)
+			hash_add(btdev_list[i], hash);
+	}
+
+	return true;
+}
+
+static void list_add(struct btdev *btdev, int list)
+{
+	if (btdev->list_pprev[list])
+		return;
+
+	btdev->list_next[list] = list_head[list];
+	if (list_head[list])
+		list_head[list]->list_pprev[list] = &btdev->list_next[list];
+
+	list_head[list] = btdev;
+	btdev->list_pprev[list] = &list_head[list];
+}
+
+static void list_del(struct btdev *btdev, int list)
+{
+	struct btdev *next = btdev->list_next[list];
+
+	if (!btdev->list_pprev[list])
+		return;
+
+	*btdev->list_pprev[list] = next;
+	if (next)
+		next->list_pprev[list] = btdev->list_pprev[list];
+
+	btdev->list_next[list] = NULL;
+	btdev->list_pprev[list] = NULL;
+}
+
+/*
+ * Takes the lowest free index, so controllers keep the addresses they had
+ * with a fixed size table. The address itself is hashed by the caller
+ * once it has been derived from the index.
+ */
+static inline int add_btdev(struct btdev *btdev)
+{
+	unsigned int index;
+
+	for (index = btdev_free; index < btdev_list_size; index++) {
+		if (!btdev_list[index])
+			break;
+	}
+
+	if (index == btdev_list_size) {
+		unsigned int size = btdev_list_size ? btdev_list_size * 2 : 16;
+		struct btdev **list;
+
+		if (index >= MAX_BTDEV_ENTRIES)
+			return -1;
+
+		if (size > MAX_BTDEV_ENTRIES)
+			size = MAX_BTDEV_ENTRIES;
+
+		list = realloc(btdev_list, size * sizeof(*list));
+		if (!list)
+			return -1;
+
+		memset(list + btdev_list_size, 0,
+				(size - btdev_list_size) * sizeof(*list));
+
+		btdev_list = list;
+		btdev_list_size = size;
+	}
+
+	if (btdev_count + 1 > hash_size && !hash_resize(hash_size ?
+						hash_size * 2 : MIN_HASH_SIZE))
+		return -1;
+
+	btdev_list[index] = btdev;
+	btdev_count++;
+	btdev_free = index + 1;
+
+	btdev->index = index;
+
 	return index;
 }
 
-static inline struct btdev *find_btdev_by_bdaddr(const uint8_t *bdaddr)
+static inline int del_btdev(struct btdev *btdev)
 {
-	int i;
+	unsigned int index = btdev->index;
+	int hash, list;
+
+	if (index >= btdev_list_size || btdev_list[index] != btdev)
+		return -1;
+
+	for (hash = 0; hash < HASH_MAX; hash++)
+		hash_del(btdev, hash);
+
+	for (list = 0; list < LIST_MAX; list++)
+		list_del(btdev, list);
+
+	btdev_list[index] = NULL;
+	btdev_count--;
 
-	for (i = 0; i < MAX_BTDEV_ENTRIES; i++) {
-		if (btdev_list[i] && !memcmp(btdev_list[i]->bdaddr, bdaddr, 6))
-			return btdev_list[i];
+	if (index < btdev_free)
+		btdev_free = index;
+
+	if (btdev_count > 0)
+		return index;
+
+	for (hash = 0; hash < HASH_MAX; hash++) {
+		free(hash_table[hash]);
+		hash_table[hash] = NULL;
 	}
 
-	return NULL;
+	hash_size = 0;
+
+	free(btdev_list);
+	btdev_list = NULL;
+	btdev_list_size = 0;
+	btdev_free = 0;
+
+	return index;
 }
 
 static inline struct btdev *find_btdev_by_bdaddr_type(const uint8_t *bdaddr,
 							uint8_t bdaddr_type)
 {
-	int i;
-
-	for (i = 0; i < MAX_BTDEV_ENTRIES; i++) {
-		int cmp;
+	int hash = bdaddr_type == 0x01 ? HASH_RANDOM : HASH_BDADDR;
+	struct btdev *btdev;
 
-		if (!btdev_list[i])
-			continue;
+	if (!hash_size)
+		return NULL;
 
-		if (bdaddr_type == 0x01)
-			cmp = memcmp(btdev_list[i]->random_addr, bdaddr, 6);
-		else
-			cmp = memcmp(btdev_list[i]->bdaddr, bdaddr, 6);
+	btdev = hash_table[hash][addr_hash(bdaddr)];
 
-		if (!cmp)
-			return btdev_list[i];
+	for (; btdev; btdev = btdev->hash_next[hash]) {
+		if (!memcmp(hash_addr(btdev, hash), bdaddr, 6))
+			return btdev;
 	}
 
 	return NULL;
 }
 
+static inline struct btdev *find_btdev_by_bdaddr(const uint8_t *bdaddr)
+{
+	return find_btdev_by_bdaddr_type(bdaddr, 0x00);
+}
+
+static void set_random_addr(struct btdev *btdev, const uint8_t *addr)
+{
+	hash_del(btdev, HASH_RANDOM);
+	memcpy(btdev->random_addr, addr, 6);
+	hash_add(btdev, HASH_RANDOM);
+}
+
+static uint64_t get_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void adv_stop_periodic(struct btdev *btdev)
+{
+	if (!btdev->adv_interval)
+		return;
+
+	btdev->adv_interval = 0;
+
+	if (--adv_periodic_count > 0 || !adv_tick_id)
+		return;
+
+	timeout_remove(adv_tick_id);
+	adv_tick_id = 0;
+}
+
+static void link_flush(struct btdev *btdev)
+{
+	struct link_pkt *pkt;
+
+	if (btdev->link_timer) {
+		timeout_remove(btdev->link_timer);
+		btdev->link_timer = 0;
+	}
+
+	while ((pkt = btdev->link_head)) {
+		btdev->link_head = pkt->next;
+		free(pkt);
+	}
+
+	btdev->link_tail = NULL;
+	btdev->link_pending = NULL;
+}
+
 static void hexdump(const unsigned char *buf, uint16_t len)
 {
 	static const char hexdigits[] = "0123456789abcdef";
@@ -285,12 +547,12 @@ static void hexdump(const unsigned char *buf, uint16_t len)
 	}
 }
 
-static void get_bdaddr(uint16_t id, uint8_t index, uint8_t *bdaddr)
+static void get_bdaddr(uint16_t id, unsigned int index, uint8_t *bdaddr)
 {
 	bdaddr[0] = id & 0xff;
 	bdaddr[1] = id >> 8;
-	bdaddr[2] = index;
-	bdaddr[3] = 0x01;
+	bdaddr[2] = index & 0xff;
+	bdaddr[3] = 0x01 + (index >> 8);
 	bdaddr[4] = 0xaa;
 	bdaddr[5] = 0x00;
 }
@@ -564,6 +826,7 @@ struct btdev *btdev_create(enum btdev_type type, uint16_t id)
 	}
 
 	get_bdaddr(id, index, btdev->bdaddr);
+	hash_add(btdev, HASH_BDADDR);
 
 	return btdev;
 }
@@ -576,6 +839,8 @@ void btdev_destroy(struct btdev *btdev)
 	if (btdev->inquiry_id > 0)
 		timeout_remove(btdev->inquiry_id);
 
+	adv_stop_periodic(btdev);
+	link_flush(btdev);
 	del_btdev(btdev);
 
 	free(btdev);
@@ -718,20 +983,152 @@ static void cmd_status(struct btdev *btdev, uint8_t status, uint16_t opcode)
 	free(pkt_data);
 }
 
-static void num_completed_packets(struct btdev *btdev)
+static void num_completed_packets(struct btdev *btdev, uint16_t count)
 {
 	if (btdev->conn) {
 		struct bt_hci_evt_num_completed_packets ncp;
 
 		ncp.num_handles = 1;
 		ncp.handle = cpu_to_le16(42);
-		ncp.count = cpu_to_le16(1);
+		ncp.count = cpu_to_le16(count);
 
 		send_event(btdev, BT_HCI_EVT_NUM_COMPLETED_PACKETS,
 							&ncp, sizeof(ncp));
 	}
 }
 
+/*
+ * With a link model, ACL packets occupy the air for their length at the
+ * configured bitrate, back to back. On LE links a transmission can only
+ * start at a connection event anchor once the link went idle. Lost
+ * packets are retransmitted (in the next connection event on LE), so
+ * loss costs airtime without breaking upper layers. Buffers are handed
+ * back with Number Of Completed Packets once sent, delivery to the peer
+ * happens after the additional latency.
+ */
+static void link_schedule(struct btdev *btdev);
+
+static bool link_timeout(void *user_data)
+{
+	struct btdev *btdev = user_data;
+	uint64_t now = get_time_us();
+	struct link_pkt *pkt;
+	uint16_t count = 0;
+
+	btdev->link_timer = 0;
+
+	for (pkt = btdev->link_pending; pkt && pkt->done <= now;
+							pkt = pkt->next)
+		count++;
+
+	btdev->link_pending = pkt;
+
+	if (count)
+		num_completed_packets(btdev, count);
+
+	/* Packets queued from the callbacks above are still on the air */
+	while ((pkt = btdev->link_head) && pkt != btdev->link_pending &&
+							pkt->deliver <= now) {
+		btdev->link_head = pkt->next;
+		if (!btdev->link_head)
+			btdev->link_tail = NULL;
+
+		if (btdev->conn)
+			send_packet(btdev->conn, pkt->data, pkt->len);
+
+		free(pkt);
+	}
+
+	link_schedule(btdev);
+
+	return false;
+}
+
+static void link_schedule(struct btdev *btdev)
+{
+	uint64_t next, now;
+
+	if (btdev->link_timer || !btdev->link_head)
+		return;
+
+	/* Completion of the sending packet or delivery of the oldest one */
+	next = btdev->link_head->deliver;
+
+	if (btdev->link_pending && btdev->link_pending->done < next)
+		next = btdev->link_pending->done;
+
+	now = get_time_us();
+
+	btdev->link_timer = timeout_add(next > now ?
+					(next - now + 999) / 1000 : 1,
+					link_timeout, btdev, NULL);
+}
+
+static uint64_t link_anchor(struct btdev *btdev, uint64_t time)
+{
+	uint64_t interval = btdev->link.conn_interval * 1000ULL;
+
+	/* BR/EDR links have no connection events */
+	if (!btdev->link_le || !interval)
+		return time;
+
+	return (time + interval - 1) / interval * interval;
+}
+
+static bool link_lost(struct btdev *btdev)
+{
+	if (!btdev->link.loss)
+		return false;
+
+	btdev->link_seed = btdev->link_seed * 1103515245 + 12345;
+
+	return (btdev->link_seed >> 16) % 1000 < btdev->link.loss;
+}
+
+static void link_send(struct btdev *btdev, const void *data, uint16_t len)
+{
+	struct link_pkt *pkt;
+	uint64_t now, airtime = 0;
+
+	pkt = malloc(sizeof(*pkt) + len);
+	if (!pkt)
+		return;
+
+	memcpy(pkt->data, data, len);
+	pkt->len = len;
+	pkt->next = NULL;
+
+	now = get_time_us();
+
+	if (btdev->link.bitrate)
+		airtime = len * 8000000ULL / btdev->link.bitrate;
+
+	if (btdev->link_busy > now)
+		pkt->done = btdev->link_busy;
+	else
+		pkt->done = link_anchor(btdev, now);
+
+	pkt->done += airtime;
+
+	while (link_lost(btdev))
+		pkt->done = link_anchor(btdev, pkt->done) + airtime;
+
+	btdev->link_busy = pkt->done;
+	pkt->deliver = pkt->done + btdev->link.latency * 1000ULL;
+
+	if (btdev->link_tail)
+		btdev->link_tail->next = pkt;
+	else
+		btdev->link_head = pkt;
+
+	btdev->link_tail = pkt;
+
+	if (!btdev->link_pending)
+		btdev->link_pending = pkt;
+
+	link_schedule(btdev);
+}
+
 static bool inquiry_callback(void *user_data)
 {
 	struct inquiry_data *data = user_data;
@@ -741,10 +1138,10 @@ static bool inquiry_callback(void *user_data)
 	int i;
 
 	/*Report devices only once and wait for inquiry timeout*/
-	if (data->iter == MAX_BTDEV_ENTRIES)
+	if (data->iter >= (int) btdev_list_size)
 		return true;
 
-	for (i = data->iter; i < MAX_BTDEV_ENTRIES; i++) {
+	for (i = data->iter; i < (int) btdev_list_size; i++) {
 		/*Lets sent 10 inquiry results at once */
 		if (sent + 10 == data->sent_count)
 			break;
@@ -926,6 +1323,8 @@ static void conn_complete(struct btdev *btdev,
 
 		btdev->conn = remote;
 		remote->conn = btdev;
+		btdev->link_le = false;
+		remote->link_le = false;
 
 		cc.status = status;
 		memcpy(cc.bdaddr, btdev->bdaddr, 6);
@@ -1020,6 +1419,8 @@ static void le_conn_complete(struct btdev *btdev,
 
 		btdev->conn = remote;
 		remote->conn = btdev;
+		btdev->link_le = true;
+		remote->link_le = true;
 
 		cc->status = status;
 		cc->peer_addr_type = btdev->le_scan_own_addr_type;
@@ -1132,6 +1533,9 @@ static void disconnect_complete(struct btdev *btdev, uint16_t handle,
 	btdev->conn = NULL;
 	remote->conn = NULL;
 
+	link_flush(btdev);
+	link_flush(remote);
+
 	send_event(btdev, BT_HCI_EVT_DISCONNECT_COMPLETE, &dc, sizeof(dc));
 	send_event(remote, BT_HCI_EVT_DISCONNECT_COMPLETE, &dc, sizeof(dc));
 }
@@ -1577,39 +1981,49 @@ static void ssp_complete(struct btdev *btdev, const uint8_t *bdaddr,
 	send_event(init, BT_HCI_EVT_AUTH_COMPLETE, &auth, sizeof(auth));
 }
 
-static void le_send_adv_report(struct btdev *btdev, const struct btdev *remote,
-								uint8_t type)
-{
-	struct __packed {
-		uint8_t subevent;
-		union {
-			struct bt_hci_evt_le_adv_report lar;
-			uint8_t raw[10 + 31 + 1];
-		};
-	} meta_event;
+struct adv_report {
+	uint8_t subevent;
+	union {
+		struct bt_hci_evt_le_adv_report lar;
+		uint8_t raw[10 + 31 + 1];
+	};
+} __packed;
 
-	meta_event.subevent = BT_HCI_EVT_LE_ADV_REPORT;
+static uint8_t le_build_adv_report(struct adv_report *meta_event,
+				const struct btdev *remote, uint8_t type)
+{
+	meta_event->subevent = BT_HCI_EVT_LE_ADV_REPORT;
 
-	memset(&meta_event.lar, 0, sizeof(meta_event.lar));
-	meta_event.lar.num_reports = 1;
-	meta_event.lar.event_type = type;
-	meta_event.lar.addr_type = remote->le_adv_own_addr;
-	memcpy(meta_event.lar.addr, adv_addr(remote), 6);
+	memset(&meta_event->lar, 0, sizeof(meta_event->lar));
+	meta_event->lar.num_reports = 1;
+	meta_event->lar.event_type = type;
+	meta_event->lar.addr_type = remote->le_adv_own_addr;
+	memcpy(meta_event->lar.addr, adv_addr(remote), 6);
 
 	/* Scan or advertising response */
 	if (type == 0x04) {
-		meta_event.lar.data_len = remote->le_scan_data_len;
-		memcpy(meta_event.lar.data, remote->le_scan_data,
-						meta_event.lar.data_len);
+		meta_event->lar.data_len = remote->le_scan_data_len;
+		memcpy(meta_event->lar.data, remote->le_scan_data,
+						meta_event->lar.data_len);
 	} else {
-		meta_event.lar.data_len = remote->le_adv_data_len;
-		memcpy(meta_event.lar.data, remote->le_adv_data,
-						meta_event.lar.data_len);
+		meta_event->lar.data_len = remote->le_adv_data_len;
+		memcpy(meta_event->lar.data, remote->le_adv_data,
+						meta_event->lar.data_len);
 	}
 	/* Not available */
-	meta_event.raw[10 + meta_event.lar.data_len] = 127;
-	send_event(btdev, BT_HCI_EVT_LE_META_EVENT, &meta_event,
-					1 + 10 + meta_event.lar.data_len + 1);
+	meta_event->raw[10 + meta_event->lar.data_len] = 127;
+
+	return 1 + 10 + meta_event->lar.data_len + 1;
+}
+
+static void le_send_adv_report(struct btdev *btdev, const struct btdev *remote,
+								uint8_t type)
+{
+	struct adv_report meta_event;
+	uint8_t len;
+
+	len = le_build_adv_report(&meta_event, remote, type);
+	send_event(btdev, BT_HCI_EVT_LE_META_EVENT, &meta_event, len);
 }
 
 static uint8_t get_adv_report_type(uint8_t adv_type)
@@ -1624,63 +2038,128 @@ static uint8_t get_adv_report_type(uint8_t adv_type)
 	return adv_type;
 }
 
-static void le_set_adv_enable_complete(struct btdev *btdev)
+/*
+ * Reports are built once per advertiser and only offered to controllers
+ * that are currently scanning. Repeated reports of periodic advertisers
+ * are skipped for scanners filtering duplicates.
+ */
+static void le_broadcast_adv(struct btdev *adv, bool repeat)
 {
-	uint8_t report_type;
-	int i;
+	struct adv_report report, scan_rsp;
+	uint8_t report_len, scan_rsp_len = 0;
+	struct btdev *scan, *next;
 
-	report_type = get_adv_report_type(btdev->le_adv_type);
+	report_len = le_build_adv_report(&report, adv,
+					get_adv_report_type(adv->le_adv_type));
 
-	for (i = 0; i < MAX_BTDEV_ENTRIES; i++) {
-		if (!btdev_list[i] || btdev_list[i] == btdev)
+	/* ADV_IND & ADV_SCAN_IND generate a scan response */
+	if (adv->le_adv_type == 0x00 || adv->le_adv_type == 0x02)
+		scan_rsp_len = le_build_adv_report(&scan_rsp, adv, 0x04);
+
+	for (scan = list_head[LIST_SCAN]; scan; scan = next) {
+		next = scan->list_next[LIST_SCAN];
+
+		if (scan == adv)
 			continue;
 
-		if (!btdev_list[i]->le_scan_enable)
+		if (repeat && scan->le_filter_dup)
 			continue;
 
-		if (!adv_match(btdev_list[i], btdev))
+		if (!adv_match(scan, adv))
 			continue;
 
-		le_send_adv_report(btdev_list[i], btdev, report_type);
+		send_event(scan, BT_HCI_EVT_LE_META_EVENT, &report, report_len);
 
-		if (btdev_list[i]->le_scan_type != 0x01)
+		if (scan->le_scan_type != 0x01 || !scan_rsp_len)
 			continue;
 
-		/* ADV_IND & ADV_SCAN_IND generate a scan response */
-		if (btdev->le_adv_type == 0x00 || btdev->le_adv_type == 0x02)
-			le_send_adv_report(btdev_list[i], btdev, 0x04);
+		send_event(scan, BT_HCI_EVT_LE_META_EVENT, &scan_rsp,
+							scan_rsp_len);
 	}
 }
 
+static void le_set_adv_enable_complete(struct btdev *btdev)
+{
+	le_broadcast_adv(btdev, false);
+}
+
 static void le_set_scan_enable_complete(struct btdev *btdev)
 {
-	int i;
+	struct btdev *adv, *next;
 
-	for (i = 0; i < MAX_BTDEV_ENTRIES; i++) {
+	for (adv = list_head[LIST_ADV]; adv; adv = next) {
 		uint8_t report_type;
 
-		if (!btdev_list[i] || btdev_list[i] == btdev)
-			continue;
+		next = adv->list_next[LIST_ADV];
 
-		if (!btdev_list[i]->le_adv_enable)
+		if (adv == btdev)
 			continue;
 
-		if (!adv_match(btdev, btdev_list[i]))
+		if (!adv_match(btdev, adv))
 			continue;
 
-		report_type = get_adv_report_type(btdev_list[i]->le_adv_type);
-		le_send_adv_report(btdev, btdev_list[i], report_type);
+		report_type = get_adv_report_type(adv->le_adv_type);
+		le_send_adv_report(btdev, adv, report_type);
 
 		if (btdev->le_scan_type != 0x01)
 			continue;
 
 		/* ADV_IND & ADV_SCAN_IND generate a scan response */
-		if (btdev_list[i]->le_adv_type == 0x00 ||
-					btdev_list[i]->le_adv_type == 0x02)
-			le_send_adv_report(btdev, btdev_list[i], 0x04);
+		if (adv->le_adv_type == 0x00 || adv->le_adv_type == 0x02)
+			le_send_adv_report(btdev, adv, 0x04);
 	}
 }
 
+static void set_adv_enable(struct btdev *btdev, uint8_t enable)
+{
+	btdev->le_adv_enable = enable;
+
+	if (enable)
+		list_add(btdev, LIST_ADV);
+	else
+		list_del(btdev, LIST_ADV);
+}
+
+static void set_scan_enable(struct btdev *btdev, uint8_t enable)
+{
+	btdev->le_scan_enable = enable;
+
+	if (enable)
+		list_add(btdev, LIST_SCAN);
+	else
+		list_del(btdev, LIST_SCAN);
+}
+
+static bool adv_tick(void *user_data)
+{
+	struct btdev *btdev, *next;
+	uint64_t now;
+
+	/* Only scanners without duplicate filtering see repeated reports */
+	for (btdev = list_head[LIST_SCAN]; btdev;
+					btdev = btdev->list_next[LIST_SCAN]) {
+		if (!btdev->le_filter_dup)
+			break;
+	}
+
+	if (!btdev)
+		return true;
+
+	now = get_time_us() / 1000;
+
+	for (btdev = list_head[LIST_ADV]; btdev; btdev = next) {
+		next = btdev->list_next[LIST_ADV];
+
+		if (!btdev->adv_interval || now < btdev->adv_due)
+			continue;
+
+		btdev->adv_due = now + btdev->adv_interval;
+		le_broadcast_adv(btdev, true);
+	}
+
+	return true;
+}
+
 static void le_start_encrypt_complete(struct btdev *btdev)
 {
 	char buf[1 + sizeof(struct bt_hci_evt_le_long_term_key_request)];
@@ -2602,7 +3081,7 @@ static void default_cmd(struct btdev *btdev, uint16_t opcode,
 		if (btdev->type == BTDEV_TYPE_BREDR)
 			goto unsupported;
 		lsra = data;
-		memcpy(btdev->random_addr, lsra->addr, 6);
+		set_random_addr(btdev, lsra->addr);
 		status = BT_HCI_ERR_SUCCESS;
 		cmd_complete(btdev, opcode, &status, sizeof(status));
 		break;
@@ -2642,7 +3121,8 @@ static void default_cmd(struct btdev *btdev, uint16_t opcode,
 		if (btdev->le_adv_enable == lsae->enable)
 			status = BT_HCI_ERR_COMMAND_DISALLOWED;
 		else {
-			btdev->le_adv_enable = lsae->enable;
+			set_adv_enable(btdev, lsae->enable);
+			adv_stop_periodic(btdev);
 			status = BT_HCI_ERR_SUCCESS;
 		}
 		cmd_complete(btdev, opcode, &status, sizeof(status));
@@ -2674,7 +3154,7 @@ static void default_cmd(struct btdev *btdev, uint16_t opcode,
 		if (btdev->le_scan_enable == lsse->enable)
 			status = BT_HCI_ERR_COMMAND_DISALLOWED;
 		else {
-			btdev->le_scan_enable = lsse->enable;
+			set_scan_enable(btdev, lsse->enable);
 			btdev->le_filter_dup = lsse->filter_dup;
 			status = BT_HCI_ERR_SUCCESS;
 		}
@@ -3060,6 +3540,76 @@ static void process_cmd(struct btdev *btdev, const void *data, uint16_t len)
 	}
 }
 
+bool btdev_set_adv_data(struct btdev *btdev, const void *data, uint8_t len)
+{
+	if (!btdev || len > sizeof(btdev->le_adv_data))
+		return false;
+
+	memcpy(btdev->le_adv_data, data, len);
+	btdev->le_adv_data_len = len;
+
+	return true;
+}
+
+bool btdev_set_adv_enable(struct btdev *btdev, bool enable,
+						unsigned int interval)
+{
+	if (!btdev || !has_le(btdev))
+		return false;
+
+	adv_stop_periodic(btdev);
+
+	if (!enable) {
+		set_adv_enable(btdev, 0x00);
+		return true;
+	}
+
+	set_adv_enable(btdev, 0x01);
+	le_set_adv_enable_complete(btdev);
+
+	if (!interval)
+		return true;
+
+	btdev->adv_interval = interval;
+	btdev->adv_due = get_time_us() / 1000 + interval;
+
+	adv_periodic_count++;
+
+	if (!adv_tick_id)
+		adv_tick_id = timeout_add(ADV_TICK_INTERVAL, adv_tick,
+								NULL, NULL);
+
+	return true;
+}
+
+bool btdev_set_link_model(struct btdev *btdev,
+				const struct btdev_link_model *model)
+{
+	if (!btdev)
+		return false;
+
+	if (!model) {
+		btdev->link_enabled = false;
+		return true;
+	}
+
+	if (model->loss >= 1000)
+		return false;
+
+	if (model->acl_mtu)
+		btdev->acl_mtu = model->acl_mtu;
+
+	if (model->acl_max_pkt)
+		btdev->acl_max_pkt = model->acl_max_pkt;
+
+	btdev->link = *model;
+	btdev->link_seed = btdev->index + 1;
+	btdev->link_enabled = model->bitrate || model->latency ||
+					model->loss || model->conn_interval;
+
+	return true;
+}
+
 void btdev_receive_h4(struct btdev *btdev, const void *data, uint16_t len)
 {
 	uint8_t pkt_type;
@@ -3077,9 +3627,15 @@ void btdev_receive_h4(struct btdev *btdev, const void *data, uint16_t len)
 		process_cmd(btdev, data + 1, len - 1);
 		break;
 	case BT_H4_ACL_PKT:
+		if (btdev->link_enabled) {
+			if (btdev->conn)
+				link_send(btdev, data, len);
+			break;
+		}
+
 		if (btdev->conn)
 			send_packet(btdev->conn, data, len);
-		num_completed_packets(btdev);
+		num_completed_packets(btdev, 1);
 		break;
 	default:
 		printf("Unsupported packet 0x%2.2x\n", pkt_type);
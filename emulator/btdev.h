@@ -73,6 +73,19 @@ enum btdev_hook_type {
 
 struct btdev;
 
+/*
+ * Optional model of the ACL link a controller transmits on. Zero values
+ * keep the defaults, a model without any timing forwards data instantly.
+ */
+struct btdev_link_model {
+	uint16_t acl_mtu;
+	uint16_t acl_max_pkt;
+	uint32_t bitrate;		/* bits per second */
+	unsigned int latency;		/* milliseconds */
+	unsigned int loss;		/* retransmissions per 1000 packets */
+	unsigned int conn_interval;	/* LE connection interval in ms */
+};
+
 struct btdev *btdev_create(enum btdev_type type, uint16_t id);
 void btdev_destroy(struct btdev *btdev);
 
@@ -85,6 +98,13 @@ void btdev_set_command_handler(struct btdev *btdev, btdev_command_func handler,
 void btdev_set_send_handler(struct btdev *btdev, btdev_send_func handler,
 							void *user_data);
 
+bool btdev_set_adv_data(struct btdev *btdev, const void *data, uint8_t len);
+bool btdev_set_adv_enable(struct btdev *btdev, bool enable,
+						unsigned int interval);
+
+bool btdev_set_link_model(struct btdev *btdev,
+				const struct btdev_link_model *model);
+
 void btdev_receive_h4(struct btdev *btdev, const void *data, uint16_t len);
 
 int btdev_add_hook(struct btdev *btdev, enum btdev_hook_type type,
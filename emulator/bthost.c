@@ -119,6 +119,13 @@ struct cmd_queue {
 	struct cmd *tail;
 };
 
+struct acl_pkt {
+	struct acl_pkt *next;
+	uint16_t handle;
+	uint16_t len;
+	uint8_t data[0];
+};
+
 struct cid_hook {
 	uint16_t cid;
 	bthost_cid_hook_func_t func;
@@ -145,6 +152,10 @@ struct btconn {
 	struct rfcomm_chan_hook *rfcomm_chan_hooks;
 	struct btconn *next;
 	void *smp_data;
+	uint16_t acl_outstanding;
+	uint8_t *recv_data;
+	uint16_t recv_len;
+	uint16_t recv_size;
 };
 
 struct l2conn {
@@ -210,6 +221,11 @@ struct bthost {
 	bool reject_user_confirm;
 	void *smp_data;
 	bool conn_init;
+	uint16_t acl_mtu;
+	uint16_t acl_max_pkt;
+	uint16_t acl_credits;
+	struct acl_pkt *acl_head;
+	struct acl_pkt *acl_tail;
 };
 
 struct bthost *bthost_create(void)
@@ -263,6 +279,7 @@ static void btconn_free(struct btconn *conn)
 		free(hook);
 	}
 
+	free(conn->recv_data);
 	free(conn);
 }
 
@@ -432,6 +449,13 @@ void bthost_destroy(struct bthost *bthost)
 	if (bthost->rfcomm_conn_data)
 		free(bthost->rfcomm_conn_data);
 
+	while (bthost->acl_head) {
+		struct acl_pkt *pkt = bthost->acl_head;
+
+		bthost->acl_head = pkt->next;
+		free(pkt);
+	}
+
 	free(bthost);
 }
 
@@ -477,27 +501,91 @@ static void send_packet(struct bthost *bthost, const void *data, uint16_t len)
 	bthost->send_handler(data, len, bthost->send_data);
 }
 
+/*
+ * Once the controller buffers are known, ACL packets are only sent while
+ * buffers are available and queued otherwise.
+ */
+static void send_acl_pkt(struct bthost *bthost, struct btconn *conn,
+						const void *data, uint16_t len)
+{
+	struct acl_pkt *pkt;
+
+	if (!bthost->acl_max_pkt) {
+		send_packet(bthost, data, len);
+		return;
+	}
+
+	if (bthost->acl_credits > 0 && !bthost->acl_head) {
+		bthost->acl_credits--;
+		conn->acl_outstanding++;
+		send_packet(bthost, data, len);
+		return;
+	}
+
+	pkt = malloc(sizeof(*pkt) + len);
+	if (!pkt)
+		return;
+
+	pkt->next = NULL;
+	pkt->handle = conn->handle;
+	pkt->len = len;
+	memcpy(pkt->data, data, len);
+
+	if (bthost->acl_tail)
+		bthost->acl_tail->next = pkt;
+	else
+		bthost->acl_head = pkt;
+
+	bthost->acl_tail = pkt;
+}
+
+static void next_acl(struct bthost *bthost)
+{
+	struct acl_pkt *pkt;
+
+	while (bthost->acl_credits > 0 && (pkt = bthost->acl_head)) {
+		struct btconn *conn = bthost_find_conn(bthost, pkt->handle);
+
+		bthost->acl_head = pkt->next;
+		if (!bthost->acl_head)
+			bthost->acl_tail = NULL;
+
+		if (conn) {
+			bthost->acl_credits--;
+			conn->acl_outstanding++;
+			send_packet(bthost, pkt->data, pkt->len);
+		}
+
+		free(pkt);
+	}
+}
+
 static void send_acl(struct bthost *bthost, uint16_t handle, uint16_t cid,
 						const void *data, uint16_t len)
 {
 	struct bt_hci_acl_hdr *acl_hdr;
 	struct bt_l2cap_hdr *l2_hdr;
-	uint16_t pkt_len;
-	void *pkt_data;
-
-	pkt_len = 1 + sizeof(*acl_hdr) + sizeof(*l2_hdr) + len;
+	struct btconn *conn;
+	uint16_t pkt_len, frag_len, offset;
+	uint8_t flags = 0x00;
+	uint8_t *pkt_data;
 
-	pkt_data = malloc(pkt_len);
-	if (!pkt_data)
+	conn = bthost_find_conn(bthost, handle);
+	if (!conn)
 		return;
 
-	((uint8_t *) pkt_data)[0] = BT_H4_ACL_PKT;
+	/* Basic L2CAP header followed by the payload, fragmented below */
+	pkt_len = sizeof(*l2_hdr) + len;
+
+	frag_len = bthost->acl_mtu ? : pkt_len;
+	if (frag_len > pkt_len)
+		frag_len = pkt_len;
 
-	acl_hdr = pkt_data + 1;
-	acl_hdr->handle = acl_handle_pack(handle, 0);
-	acl_hdr->dlen = cpu_to_le16(len + sizeof(*l2_hdr));
+	pkt_data = malloc(1 + sizeof(*acl_hdr) + pkt_len);
+	if (!pkt_data)
+		return;
 
-	l2_hdr = pkt_data + 1 + sizeof(*acl_hdr);
+	l2_hdr = (void *) pkt_data + 1 + sizeof(*acl_hdr);
 	l2_hdr->cid = cpu_to_le16(cid);
 	l2_hdr->len = cpu_to_le16(len);
 
@@ -505,7 +593,24 @@ static void send_acl(struct bthost *bthost, uint16_t handle, uint16_t cid,
 		memcpy(pkt_data + 1 + sizeof(*acl_hdr) + sizeof(*l2_hdr),
 								data, len);
 
-	send_packet(bthost, pkt_data, pkt_len);
+	for (offset = 0; offset < pkt_len; offset += frag_len) {
+		uint16_t dlen = pkt_len - offset;
+		uint8_t *frag = pkt_data + offset;
+
+		if (dlen > frag_len)
+			dlen = frag_len;
+
+		/* Headers of a fragment overwrite the previous fragment */
+		frag[0] = BT_H4_ACL_PKT;
+
+		acl_hdr = (void *) frag + 1;
+		acl_hdr->handle = acl_handle_pack(handle, flags);
+		acl_hdr->dlen = cpu_to_le16(dlen);
+
+		send_acl_pkt(bthost, conn, frag, 1 + sizeof(*acl_hdr) + dlen);
+
+		flags = 0x01;
+	}
 
 	free(pkt_data);
 }
@@ -653,8 +758,8 @@ static void send_command(struct bthost *bthost, uint16_t opcode,
 		memcpy(pkt_data + 1 + sizeof(*hdr), data, len);
 
 	if (bthost->ncmd) {
-		send_packet(bthost, pkt_data, pkt_len);
 		bthost->ncmd--;
+		send_packet(bthost, pkt_data, pkt_len);
 	} else {
 		queue_command(bthost, pkt_data, pkt_len);
 	}
@@ -676,7 +781,6 @@ static void next_cmd(struct bthost *bthost)
 	if (!bthost->ncmd)
 		return;
 
-	send_packet(bthost, cmd->data, cmd->len);
 	bthost->ncmd--;
 
 	if (next)
@@ -686,6 +790,8 @@ static void next_cmd(struct bthost *bthost)
 
 	cmd_q->head = next;
 
+	send_packet(bthost, cmd->data, cmd->len);
+
 	free(cmd);
 }
 
@@ -703,6 +809,22 @@ static void read_bd_addr_complete(struct bthost *bthost, const void *data,
 	memcpy(bthost->bdaddr, ev->bdaddr, 6);
 }
 
+static void read_buffer_size_complete(struct bthost *bthost,
+					const void *data, uint8_t len)
+{
+	const struct bt_hci_rsp_read_buffer_size *ev = data;
+
+	if (len < sizeof(*ev))
+		return;
+
+	if (ev->status || !ev->acl_max_pkt)
+		return;
+
+	bthost->acl_mtu = le16_to_cpu(ev->acl_mtu);
+	bthost->acl_max_pkt = le16_to_cpu(ev->acl_max_pkt);
+	bthost->acl_credits = bthost->acl_max_pkt;
+}
+
 static void evt_cmd_complete(struct bthost *bthost, const void *data,
 								uint8_t len)
 {
@@ -725,6 +847,9 @@ static void evt_cmd_complete(struct bthost *bthost, const void *data,
 	case BT_HCI_CMD_READ_BD_ADDR:
 		read_bd_addr_complete(bthost, param, len - sizeof(*ev));
 		break;
+	case BT_HCI_CMD_READ_BUFFER_SIZE:
+		read_buffer_size_complete(bthost, param, len - sizeof(*ev));
+		break;
 	case BT_HCI_CMD_WRITE_SCAN_ENABLE:
 		break;
 	case BT_HCI_CMD_LE_SET_ADV_ENABLE:
@@ -863,6 +988,7 @@ static void evt_disconn_complete(struct bthost *bthost, const void *data,
 
 		if (conn->handle == handle) {
 			*curr = conn->next;
+			bthost->acl_credits += conn->acl_outstanding;
 			btconn_free(conn);
 		} else {
 			curr = &conn->next;
@@ -874,9 +1000,28 @@ static void evt_num_completed_packets(struct bthost *bthost, const void *data,
 								uint8_t len)
 {
 	const struct bt_hci_evt_num_completed_packets *ev = data;
+	const uint8_t *ptr = data + 1;
+	uint8_t i;
 
-	if (len < sizeof(*ev))
+	if (len < 1 || len < 1 + ev->num_handles * 4)
 		return;
+
+	for (i = 0; i < ev->num_handles; i++, ptr += 4) {
+		uint16_t handle = get_le16(ptr);
+		uint16_t count = get_le16(ptr + 2);
+		struct btconn *conn = bthost_find_conn(bthost, handle);
+
+		if (!conn)
+			continue;
+
+		if (count > conn->acl_outstanding)
+			count = conn->acl_outstanding;
+
+		conn->acl_outstanding -= count;
+		bthost->acl_credits += count;
+	}
+
+	next_acl(bthost);
 }
 
 static void evt_auth_complete(struct bthost *bthost, const void *data,
@@ -1943,35 +2088,20 @@ static void process_rfcomm(struct bthost *bthost, struct btconn *conn,
 	}
 }
 
-static void process_acl(struct bthost *bthost, const void *data, uint16_t len)
+static void process_l2cap(struct bthost *bthost, struct btconn *conn,
+					const void *data, uint16_t len)
 {
-	const struct bt_hci_acl_hdr *acl_hdr = data;
-	const struct bt_l2cap_hdr *l2_hdr = data + sizeof(*acl_hdr);
-	uint16_t handle, cid, acl_len, l2_len;
+	const struct bt_l2cap_hdr *l2_hdr = data;
 	struct cid_hook *hook;
-	struct btconn *conn;
 	struct l2conn *l2conn;
+	uint16_t cid, l2_len;
 	const void *l2_data;
 
-	if (len < sizeof(*acl_hdr) + sizeof(*l2_hdr))
-		return;
-
-	acl_len = le16_to_cpu(acl_hdr->dlen);
-	if (len != sizeof(*acl_hdr) + acl_len)
-		return;
-
-	handle = acl_handle(acl_hdr->handle);
-	conn = bthost_find_conn(bthost, handle);
-	if (!conn) {
-		printf("ACL data for unknown handle 0x%04x\n", handle);
-		return;
-	}
-
 	l2_len = le16_to_cpu(l2_hdr->len);
-	if (len - sizeof(*acl_hdr) != sizeof(*l2_hdr) + l2_len)
+	if (len != sizeof(*l2_hdr) + l2_len)
 		return;
 
-	l2_data = data + sizeof(*acl_hdr) + sizeof(*l2_hdr);
+	l2_data = data + sizeof(*l2_hdr);
 
 	cid = le16_to_cpu(l2_hdr->cid);
 
@@ -2002,6 +2132,81 @@ static void process_acl(struct bthost *bthost, const void *data, uint16_t len)
 	}
 }
 
+static void process_acl(struct bthost *bthost, const void *data, uint16_t len)
+{
+	const struct bt_hci_acl_hdr *acl_hdr = data;
+	const struct bt_l2cap_hdr *l2_hdr = data + sizeof(*acl_hdr);
+	uint16_t handle, acl_len, l2_len;
+	struct btconn *conn;
+	uint8_t flags;
+
+	if (len < sizeof(*acl_hdr))
+		return;
+
+	acl_len = le16_to_cpu(acl_hdr->dlen);
+	if (len != sizeof(*acl_hdr) + acl_len)
+		return;
+
+	handle = acl_handle(acl_hdr->handle);
+	flags = acl_flags(acl_hdr->handle);
+
+	conn = bthost_find_conn(bthost, handle);
+	if (!conn) {
+		printf("ACL data for unknown handle 0x%04x\n", handle);
+		return;
+	}
+
+	data += sizeof(*acl_hdr);
+
+	/* Continuation fragment */
+	if (flags & 0x01) {
+		if (!conn->recv_data ||
+				conn->recv_len + acl_len > conn->recv_size) {
+			printf("Unexpected ACL continuation fragment\n");
+			return;
+		}
+
+		memcpy(conn->recv_data + conn->recv_len, data, acl_len);
+		conn->recv_len += acl_len;
+
+		if (conn->recv_len < conn->recv_size)
+			return;
+
+		process_l2cap(bthost, conn, conn->recv_data, conn->recv_len);
+
+		free(conn->recv_data);
+		conn->recv_data = NULL;
+		return;
+	}
+
+	free(conn->recv_data);
+	conn->recv_data = NULL;
+
+	if (acl_len < sizeof(*l2_hdr))
+		return;
+
+	l2_len = le16_to_cpu(l2_hdr->len);
+
+	if (acl_len >= sizeof(*l2_hdr) + l2_len) {
+		process_l2cap(bthost, conn, data, acl_len);
+		return;
+	}
+
+	/* The reassembled frame has to fit the 16-bit lengths */
+	if (l2_len > UINT16_MAX - sizeof(*l2_hdr)) {
+		printf("L2CAP frame of %u bytes too long\n", l2_len);
+		return;
+	}
+
+	conn->recv_size = sizeof(*l2_hdr) + l2_len;
+	conn->recv_data = malloc(conn->recv_size);
+	if (!conn->recv_data)
+		return;
+
+	memcpy(conn->recv_data, data, acl_len);
+	conn->recv_len = acl_len;
+}
+
 void bthost_receive_h4(struct bthost *bthost, const void *data, uint16_t len)
 {
 	uint8_t pkt_type;
@@ -2186,6 +2391,8 @@ void bthost_start(struct bthost *bthost)
 	send_command(bthost, BT_HCI_CMD_RESET, NULL, 0);
 
 	send_command(bthost, BT_HCI_CMD_READ_BD_ADDR, NULL, 0);
+
+	send_command(bthost, BT_HCI_CMD_READ_BUFFER_SIZE, NULL, 0);
 }
 
 bool bthost_connect_rfcomm(struct bthost *bthost, uint16_t handle,
@@ -2253,6 +2460,7 @@ void bthost_send_rfcomm_data(struct bthost *bthost, uint16_t handle,
 {
 	struct btconn *conn;
 	struct rcconn *rcconn;
+	struct l2conn *l2conn;
 	struct rfcomm_hdr *hdr;
 	uint8_t *uih_frame;
 	uint16_t uih_len;
@@ -2265,6 +2473,10 @@ void bthost_send_rfcomm_data(struct bthost *bthost, uint16_t handle,
 	if (!rcconn)
 		return;
 
+	l2conn = btconn_find_l2cap_conn_by_scid(conn, rcconn->scid);
+	if (!l2conn)
+		return;
+
 	if (len > 127)
 		uih_len = len + sizeof(struct rfcomm_cmd) + sizeof(uint8_t);
 	else
@@ -2286,7 +2498,7 @@ void bthost_send_rfcomm_data(struct bthost *bthost, uint16_t handle,
 	}
 
 	uih_frame[uih_len - 1] = rfcomm_fcs((void *)hdr);
-	send_acl(bthost, handle, rcconn->scid, uih_frame, uih_len);
+	send_acl(bthost, handle, l2conn->dcid, uih_frame, uih_len);
 
 	free(uih_frame);
 }
@@ -29,6 +29,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
 #include <getopt.h>
 
 #include "monitor/mainloop.h"
@@ -36,6 +38,10 @@
 #include "vhci.h"
 #include "amp.h"
 #include "le.h"
+#include "btdev.h"
+
+/* Synthetic advertisers get addresses distinct from local controllers */
+#define ADVERTISER_ID 0xad00
 
 static void signal_callback(int signum, void *user_data)
 {
@@ -58,6 +64,9 @@ static void usage(void)
 		"\t-L                    Create LE only controller\n"
 		"\t-B                    Create BR/EDR only controller\n"
 		"\t-A                    Create AMP controller\n"
+		"\t-a <num>              Number of synthetic LE advertisers\n"
+		"\t-d <hex>              Advertising data of advertisers\n"
+		"\t-i <ms>               Advertising interval (0 = once)\n"
 		"\t-h, --help            Show help options\n");
 }
 
@@ -67,6 +76,9 @@ static const struct option main_options[] = {
 	{ "le",      no_argument,       NULL, 'L' },
 	{ "bredr",   no_argument,       NULL, 'B' },
 	{ "amp",     no_argument,       NULL, 'A' },
+	{ "advertisers",  required_argument, NULL, 'a' },
+	{ "adv-data",     required_argument, NULL, 'd' },
+	{ "adv-interval", required_argument, NULL, 'i' },
 	{ "letest",  optional_argument, NULL, 'U' },
 	{ "amptest", optional_argument, NULL, 'T' },
 	{ "version", no_argument,	NULL, 'v' },
@@ -74,6 +86,58 @@ static const struct option main_options[] = {
 	{ }
 };
 
+static int parse_adv_data(const char *str, uint8_t *data)
+{
+	size_t len = strlen(str);
+	size_t i;
+
+	if (len % 2 || len / 2 > 31)
+		return -1;
+
+	for (i = 0; i < len / 2; i++) {
+		unsigned int val;
+
+		if (sscanf(str + i * 2, "%2x", &val) != 1)
+			return -1;
+
+		data[i] = val;
+	}
+
+	return len / 2;
+}
+
+static bool create_advertiser(unsigned int num, const uint8_t *data,
+					int data_len, unsigned int interval)
+{
+	struct btdev *btdev;
+	uint8_t buf[31];
+
+	btdev = btdev_create(BTDEV_TYPE_LE, ADVERTISER_ID);
+	if (!btdev)
+		return false;
+
+	/* Default to LE only discoverable flags and a unique name */
+	if (data_len < 0) {
+		int len;
+
+		buf[0] = 0x02;
+		buf[1] = 0x01;
+		buf[2] = 0x06;
+
+		len = snprintf((char *) buf + 5, sizeof(buf) - 5,
+							"btvirt-%u", num);
+		buf[3] = len + 1;
+		buf[4] = 0x09;
+
+		data = buf;
+		data_len = 5 + len;
+	}
+
+	btdev_set_adv_data(btdev, data, data_len);
+
+	return btdev_set_adv_enable(btdev, true, interval);
+}
+
 int main(int argc, char *argv[])
 {
 	struct server *server1;
@@ -85,6 +149,10 @@ int main(int argc, char *argv[])
 	int letest_count = 0;
 	int amptest_count = 0;
 	int vhci_count = 0;
+	int adv_count = 0;
+	int adv_data_len = -1;
+	unsigned int adv_interval = 100;
+	uint8_t adv_data[31];
 	enum vhci_type vhci_type = VHCI_TYPE_BREDRLE;
 	sigset_t mask;
 	int i;
@@ -94,7 +162,7 @@ int main(int argc, char *argv[])
 	for (;;) {
 		int opt;
 
-		opt = getopt_long(argc, argv, "sl::LBAUTvh",
+		opt = getopt_long(argc, argv, "sl::LBAa:d:i:UTvh",
 						main_options, NULL);
 		if (opt < 0)
 			break;
@@ -118,6 +186,19 @@ int main(int argc, char *argv[])
 		case 'A':
 			vhci_type = VHCI_TYPE_AMP;
 			break;
+		case 'a':
+			adv_count = atoi(optarg);
+			break;
+		case 'd':
+			adv_data_len = parse_adv_data(optarg, adv_data);
+			if (adv_data_len < 0) {
+				fprintf(stderr, "Invalid advertising data\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'i':
+			adv_interval = atoi(optarg);
+			break;
 		case 'U':
 			if (optarg)
 				letest_count = atoi(optarg);
@@ -141,8 +222,8 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (letest_count < 1 && amptest_count < 1 &&
-					vhci_count < 1 && !server_enabled) {
+	if (letest_count < 1 && amptest_count < 1 && vhci_count < 1 &&
+					adv_count < 1 && !server_enabled) {
 		fprintf(stderr, "No emulator specified\n");
 		return EXIT_FAILURE;
 	}
@@ -185,6 +266,14 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	for (i = 0; i < adv_count; i++) {
+		if (!create_advertiser(i, adv_data, adv_data_len,
+							adv_interval)) {
+			fprintf(stderr, "Failed to create LE advertiser\n");
+			return EXIT_FAILURE;
+		}
+	}
+
 	if (server_enabled) {
 		server1 = server_open_unix(SERVER_TYPE_BREDRLE,
 						"/tmp/bt-server-bredrle");
@@ -45,6 +45,7 @@ struct GDBusClient {
 	guint watch;
 	guint added_watch;
 	guint removed_watch;
+	guint properties_watch;
 	GPtrArray *match_rules;
 	DBusPendingCall *pending_call;
 	DBusPendingCall *get_objects_call;
@@ -61,7 +62,8 @@ struct GDBusClient {
 	void *ready_data;
 	GDBusPropertyFunction property_changed;
 	void *user_data;
-	GList *proxy_list;
+	GQueue *proxy_list;
+	GHashTable *proxy_index;
 };
 
 struct GDBusProxy {
@@ -70,7 +72,6 @@ struct GDBusProxy {
 	char *obj_path;
 	char *interface;
 	GHashTable *prop_list;
-	guint watch;
 	GDBusPropertyFunction prop_func;
 	void *prop_data;
 	GDBusProxyFunction removed_func;
@@ -277,6 +278,43 @@ static void update_properties(GDBusProxy *proxy, DBusMessageIter *iter,
 	}
 }
 
+/*
+ * Proxies are kept in order of arrival, the index maps path and interface
+ * to the list link so lookups and removals don't walk the list.
+ */
+static guint proxy_hash(gconstpointer key)
+{
+	const GDBusProxy *proxy = key;
+
+	return g_str_hash(proxy->obj_path) * 33 + g_str_hash(proxy->interface);
+}
+
+static gboolean proxy_equal(gconstpointer a, gconstpointer b)
+{
+	const GDBusProxy *proxy1 = a, *proxy2 = b;
+
+	return g_str_equal(proxy1->interface, proxy2->interface) &&
+			g_str_equal(proxy1->obj_path, proxy2->obj_path);
+}
+
+static void proxy_list_add(GDBusClient *client, GDBusProxy *proxy)
+{
+	g_queue_push_tail(client->proxy_list, proxy);
+	g_hash_table_insert(client->proxy_index, proxy,
+				g_queue_peek_tail_link(client->proxy_list));
+}
+
+static GList *proxy_list_find(GDBusClient *client, const char *path,
+						const char *interface)
+{
+	GDBusProxy key;
+
+	key.obj_path = (char *) path;
+	key.interface = (char *) interface;
+
+	return g_hash_table_lookup(client->proxy_index, &key);
+}
+
 static void get_all_properties_reply(DBusPendingCall *call, void *user_data)
 {
 	GDBusProxy *proxy = user_data;
@@ -297,11 +335,11 @@ static void get_all_properties_reply(DBusPendingCall *call, void *user_data)
 	update_properties(proxy, &iter, FALSE);
 
 done:
-	if (g_list_find(client->proxy_list, proxy) == NULL) {
+	if (g_hash_table_lookup(client->proxy_index, proxy) == NULL) {
 		if (client->proxy_added)
 			client->proxy_added(proxy, client->user_data);
 
-		client->proxy_list = g_list_append(client->proxy_list, proxy);
+		proxy_list_add(client, proxy);
 	}
 
 	dbus_message_unref(reply);
@@ -344,25 +382,24 @@ static GDBusProxy *proxy_lookup(GDBusClient *client, const char *path,
 {
 	GList *list;
 
-	for (list = g_list_first(client->proxy_list); list;
-						list = g_list_next(list)) {
-		GDBusProxy *proxy = list->data;
-
-		if (g_str_equal(proxy->interface, interface) == TRUE &&
-				g_str_equal(proxy->obj_path, path) == TRUE)
-			return proxy;
-        }
+	list = proxy_list_find(client, path, interface);
+	if (list == NULL)
+		return NULL;
 
-	return NULL;
+	return list->data;
 }
 
 static gboolean properties_changed(DBusConnection *conn, DBusMessage *msg,
 							void *user_data)
 {
-	GDBusProxy *proxy = user_data;
-	GDBusClient *client = proxy->client;
+	GDBusClient *client = user_data;
+	GDBusProxy *proxy;
 	DBusMessageIter iter, entry;
-	const char *interface;
+	const char *path, *interface;
+
+	path = dbus_message_get_path(msg);
+	if (path == NULL)
+		return TRUE;
 
 	if (dbus_message_iter_init(msg, &iter) == FALSE)
 		return TRUE;
@@ -373,6 +410,10 @@ static gboolean properties_changed(DBusConnection *conn, DBusMessage *msg,
 	dbus_message_iter_get_basic(&iter, &interface);
 	dbus_message_iter_next(&iter);
 
+	proxy = proxy_lookup(client, path, interface);
+	if (proxy == NULL)
+		return TRUE;
+
 	update_properties(proxy, &iter, TRUE);
 
 	dbus_message_iter_next(&iter);
@@ -417,12 +458,6 @@ static GDBusProxy *proxy_new(GDBusClient *client, const char *path,
 
 	proxy->prop_list = g_hash_table_new_full(g_str_hash, g_str_equal,
 							NULL, prop_entry_free);
-	proxy->watch = g_dbus_add_properties_watch(client->dbus_conn,
-							client->service_name,
-							proxy->obj_path,
-							proxy->interface,
-							properties_changed,
-							proxy, NULL);
 
 	return g_dbus_proxy_ref(proxy);
 }
@@ -437,8 +472,6 @@ static void proxy_free(gpointer data)
 		if (client->proxy_removed)
 			client->proxy_removed(proxy, client->user_data);
 
-		g_dbus_remove_watch(client->dbus_conn, proxy->watch);
-
 		g_hash_table_remove_all(proxy->prop_list);
 
 		proxy->client = NULL;
@@ -453,20 +486,29 @@ static void proxy_free(gpointer data)
 static void proxy_remove(GDBusClient *client, const char *path,
 						const char *interface)
 {
+	GDBusProxy *proxy;
 	GList *list;
 
-	for (list = g_list_first(client->proxy_list); list;
-						list = g_list_next(list)) {
-		GDBusProxy *proxy = list->data;
+	list = proxy_list_find(client, path, interface);
+	if (list == NULL)
+		return;
 
-		if (g_str_equal(proxy->interface, interface) == TRUE &&
-				g_str_equal(proxy->obj_path, path) == TRUE) {
-			client->proxy_list =
-				g_list_delete_link(client->proxy_list, list);
-			proxy_free(proxy);
-			break;
-		}
-	}
+	proxy = list->data;
+
+	g_hash_table_remove(client->proxy_index, proxy);
+	g_queue_delete_link(client->proxy_list, list);
+
+	proxy_free(proxy);
+}
+
+static void proxy_list_free(GDBusClient *client)
+{
+	GDBusProxy *proxy;
+
+	g_hash_table_remove_all(client->proxy_index);
+
+	while ((proxy = g_queue_pop_head(client->proxy_list)))
+		proxy_free(proxy);
 }
 
 GDBusProxy *g_dbus_proxy_new(GDBusClient *client, const char *path,
@@ -917,8 +959,7 @@ static void refresh_properties(GDBusClient *client)
 {
 	GList *list;
 
-	for (list = g_list_first(client->proxy_list); list;
-						list = g_list_next(list)) {
+	for (list = client->proxy_list->head; list; list = list->next) {
 		GDBusProxy *proxy = list->data;
 
 		get_all_properties(proxy);
@@ -951,7 +992,7 @@ static void parse_properties(GDBusClient *client, const char *path,
 	if (client->proxy_added)
 		client->proxy_added(proxy, client->user_data);
 
-	client->proxy_list = g_list_append(client->proxy_list, proxy);
+	proxy_list_add(client, proxy);
 }
 
 static void parse_interfaces(GDBusClient *client, const char *path,
@@ -1156,8 +1197,7 @@ static void service_disconnect(DBusConnection *conn, void *user_data)
 {
 	GDBusClient *client = user_data;
 
-	g_list_free_full(client->proxy_list, proxy_free);
-	client->proxy_list = NULL;
+	proxy_list_free(client);
 
 	if (client->disconn_func) {
 		client->disconn_func(conn, client->disconn_data);
@@ -1216,6 +1256,8 @@ GDBusClient *g_dbus_client_new(DBusConnection *connection,
 	client->service_name = g_strdup(service);
 	client->base_path = g_strdup(path);
 	client->connected = FALSE;
+	client->proxy_list = g_queue_new();
+	client->proxy_index = g_hash_table_new(proxy_hash, proxy_equal);
 
 	client->match_rules = g_ptr_array_sized_new(1);
 	g_ptr_array_set_free_func(client->match_rules, g_free);
@@ -1236,6 +1278,12 @@ GDBusClient *g_dbus_client_new(DBusConnection *connection,
 						"InterfacesRemoved",
 						interfaces_removed,
 						client, NULL);
+	client->properties_watch = g_dbus_add_signal_watch(connection,
+						service, NULL,
+						DBUS_INTERFACE_PROPERTIES,
+						"PropertiesChanged",
+						properties_changed,
+						client, NULL);
 	g_ptr_array_add(client->match_rules, g_strdup_printf("type='signal',"
 				"sender='%s',path_namespace='%s'",
 				client->service_name, client->base_path));
@@ -1288,7 +1336,9 @@ void g_dbus_client_unref(GDBusClient *client)
 	dbus_connection_remove_filter(client->dbus_conn,
 						message_filter, client);
 
-	g_list_free_full(client->proxy_list, proxy_free);
+	proxy_list_free(client);
+	g_queue_free(client->proxy_list);
+	g_hash_table_destroy(client->proxy_index);
 
 	/*
 	 * Don't call disconn_func twice if disconnection
@@ -1300,6 +1350,7 @@ void g_dbus_client_unref(GDBusClient *client)
 	g_dbus_remove_watch(client->dbus_conn, client->watch);
 	g_dbus_remove_watch(client->dbus_conn, client->added_watch);
 	g_dbus_remove_watch(client->dbus_conn, client->removed_watch);
+	g_dbus_remove_watch(client->dbus_conn, client->properties_watch);
 
 	dbus_connection_unref(client->dbus_conn);
 
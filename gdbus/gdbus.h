@@ -217,6 +217,11 @@ struct GDBusSecurityTable {
 
 void g_dbus_set_flags(int flags);
 
+typedef void (* GDBusMethodTraceFunction) (DBusMessage *message,
+							gint64 usec);
+
+void g_dbus_set_method_trace(GDBusMethodTraceFunction function);
+
 gboolean g_dbus_register_interface(DBusConnection *connection,
 					const char *path, const char *name,
 					const GDBusMethodTable *methods,
@@ -85,6 +85,7 @@ struct property_data {
 };
 
 static int global_flags = 0;
+static GDBusMethodTraceFunction method_trace = NULL;
 static struct generic_data *root;
 static GSList *pending = NULL;
 
@@ -255,9 +256,16 @@ static DBusHandlerResult process_message(DBusConnection *connection,
 							void *iface_user_data)
 {
 	DBusMessage *reply;
+	gint64 start = 0;
+
+	if (method_trace)
+		start = g_get_monotonic_time();
 
 	reply = method->function(connection, message, iface_user_data);
 
+	if (method_trace)
+		method_trace(message, g_get_monotonic_time() - start);
+
 	if (method->flags & G_DBUS_METHOD_FLAG_NOREPLY) {
 		if (reply != NULL)
 			dbus_message_unref(reply);
@@ -1822,3 +1830,8 @@ void g_dbus_set_flags(int flags)
 {
 	global_flags = flags;
 }
+
+void g_dbus_set_method_trace(GDBusMethodTraceFunction function)
+{
+	method_trace = function;
+}
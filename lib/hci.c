@@ -33,6 +33,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <sys/param.h>
 #include <sys/uio.h>
@@ -44,6 +45,7 @@
 #include "bluetooth.h"
 #include "hci.h"
 #include "hci_lib.h"
+#include "hci_internal.h"
 
 #ifndef MIN
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
@@ -1242,6 +1244,465 @@ done:
 	return 0;
 }
 
+/*
+ * Asynchronous requests share one HCI socket and leave the waiting to
+ * the caller's own poll loop. Commands are sent right away, the kernel
+ * takes care of the controller's command flow control, and events are
+ * matched against the outstanding requests in the order they were sent
+ * using the same rules as hci_send_req().
+ */
+struct hci_async_req {
+	int id;
+	uint16_t opcode;
+	int event;
+	int status_seen;
+	bdaddr_t bdaddr;
+	int64_t deadline;
+	hci_async_func_t func;
+	void *user_data;
+	struct hci_async_req *next;
+};
+
+struct hci_async_handler {
+	int id;
+	int event;
+	hci_event_func_t func;
+	void *user_data;
+	struct hci_async_handler *next;
+};
+
+struct hci_async {
+	int dd;
+	struct hci_filter of;
+	struct hci_filter nf;
+	int filter;
+	int next_id;
+	int dispatching;
+	struct hci_async_req *reqs;
+	struct hci_async_handler *handlers;
+};
+
+static int64_t async_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int async_next_id(struct hci_async *as)
+{
+	if (as->next_id < 1)
+		as->next_id = 1;
+
+	return as->next_id++;
+}
+
+static int async_filter_event(struct hci_async *as, int event)
+{
+	if (!as->filter || hci_filter_test_event(event, &as->nf))
+		return 0;
+
+	hci_filter_set_event(event, &as->nf);
+
+	return setsockopt(as->dd, SOL_HCI, HCI_FILTER, &as->nf,
+							sizeof(as->nf));
+}
+
+struct hci_async *hci_async_new_full(int dd, int filter)
+{
+	struct hci_async *as;
+	socklen_t olen;
+
+	as = calloc(1, sizeof(*as));
+	if (!as)
+		return NULL;
+
+	as->dd = dd;
+	as->filter = filter;
+
+	if (!filter)
+		return as;
+
+	olen = sizeof(as->of);
+	if (getsockopt(dd, SOL_HCI, HCI_FILTER, &as->of, &olen) < 0)
+		goto failed;
+
+	hci_filter_clear(&as->nf);
+	hci_filter_set_ptype(HCI_EVENT_PKT, &as->nf);
+	hci_filter_set_event(EVT_CMD_STATUS, &as->nf);
+	hci_filter_set_event(EVT_CMD_COMPLETE, &as->nf);
+	hci_filter_set_event(EVT_LE_META_EVENT, &as->nf);
+
+	if (setsockopt(dd, SOL_HCI, HCI_FILTER, &as->nf, sizeof(as->nf)) < 0)
+		goto failed;
+
+	return as;
+
+failed:
+	free(as);
+	return NULL;
+}
+
+struct hci_async *hci_async_new(int dd)
+{
+	return hci_async_new_full(dd, 1);
+}
+
+void hci_async_free(struct hci_async *as)
+{
+	if (!as)
+		return;
+
+	while (as->reqs) {
+		struct hci_async_req *req = as->reqs;
+
+		as->reqs = req->next;
+		free(req);
+	}
+
+	while (as->handlers) {
+		struct hci_async_handler *handler = as->handlers;
+
+		as->handlers = handler->next;
+		free(handler);
+	}
+
+	if (as->filter)
+		setsockopt(as->dd, SOL_HCI, HCI_FILTER, &as->of,
+							sizeof(as->of));
+
+	free(as);
+}
+
+int hci_async_get_fd(struct hci_async *as)
+{
+	return as->dd;
+}
+
+int hci_async_send_req(struct hci_async *as, struct hci_request *r, int to,
+				hci_async_func_t func, void *user_data)
+{
+	struct hci_async_req *req, **last;
+
+	if (r->event != EVT_CMD_STATUS && r->event != EVT_CMD_COMPLETE &&
+					async_filter_event(as, r->event) < 0)
+		return -1;
+
+	req = calloc(1, sizeof(*req));
+	if (!req)
+		return -1;
+
+	req->opcode = htobs(cmd_opcode_pack(r->ogf, r->ocf));
+	req->event = r->event;
+	req->func = func;
+	req->user_data = user_data;
+
+	if (r->event == EVT_REMOTE_NAME_REQ_COMPLETE) {
+		remote_name_req_cp *cp = r->cparam;
+
+		bacpy(&req->bdaddr, &cp->bdaddr);
+	}
+
+	if (to > 0)
+		req->deadline = async_now() + to;
+
+	if (hci_send_cmd(as->dd, r->ogf, r->ocf, r->clen, r->cparam) < 0) {
+		free(req);
+		return -1;
+	}
+
+	req->id = async_next_id(as);
+
+	for (last = &as->reqs; *last; last = &(*last)->next);
+	*last = req;
+
+	return req->id;
+}
+
+int hci_async_cancel(struct hci_async *as, int id)
+{
+	struct hci_async_req **p;
+
+	for (p = &as->reqs; *p; p = &(*p)->next) {
+		struct hci_async_req *req = *p;
+
+		if (req->id != id)
+			continue;
+
+		*p = req->next;
+		free(req);
+		return 0;
+	}
+
+	errno = ENOENT;
+	return -1;
+}
+
+int hci_async_register(struct hci_async *as, int event, hci_event_func_t func,
+							void *user_data)
+{
+	struct hci_async_handler *handler, **last;
+
+	if (async_filter_event(as, event) < 0)
+		return -1;
+
+	handler = calloc(1, sizeof(*handler));
+	if (!handler)
+		return -1;
+
+	handler->id = async_next_id(as);
+	handler->event = event;
+	handler->func = func;
+	handler->user_data = user_data;
+
+	for (last = &as->handlers; *last; last = &(*last)->next);
+	*last = handler;
+
+	return handler->id;
+}
+
+static void async_purge_handlers(struct hci_async *as)
+{
+	struct hci_async_handler **p = &as->handlers;
+
+	while (*p) {
+		struct hci_async_handler *handler = *p;
+
+		if (handler->func) {
+			p = &handler->next;
+			continue;
+		}
+
+		*p = handler->next;
+		free(handler);
+	}
+}
+
+int hci_async_unregister(struct hci_async *as, int id)
+{
+	struct hci_async_handler *handler;
+
+	for (handler = as->handlers; handler; handler = handler->next) {
+		if (handler->id != id || !handler->func)
+			continue;
+
+		/* Freed once the handler list is no longer being walked */
+		handler->func = NULL;
+
+		if (!as->dispatching)
+			async_purge_handlers(as);
+
+		return 0;
+	}
+
+	errno = ENOENT;
+	return -1;
+}
+
+int hci_async_timeout(struct hci_async *as)
+{
+	struct hci_async_req *req;
+	int64_t now, first = -1;
+
+	for (req = as->reqs; req; req = req->next) {
+		if (req->deadline && (first < 0 || req->deadline < first))
+			first = req->deadline;
+	}
+
+	if (first < 0)
+		return -1;
+
+	now = async_now();
+
+	return first > now ? first - now : 0;
+}
+
+static void async_complete(struct hci_async *as, struct hci_async_req **p,
+				int err, const void *param, int len)
+{
+	struct hci_async_req *req = *p;
+
+	*p = req->next;
+
+	if (req->func)
+		req->func(err, param, len, req->user_data);
+
+	free(req);
+}
+
+static struct hci_async_req **async_find_expired(struct hci_async *as,
+								int64_t now)
+{
+	struct hci_async_req **p;
+
+	for (p = &as->reqs; *p; p = &(*p)->next) {
+		if ((*p)->deadline && (*p)->deadline <= now)
+			return p;
+	}
+
+	return NULL;
+}
+
+static struct hci_async_req **async_find(struct hci_async *as,
+					uint8_t evt, const unsigned char *ptr)
+{
+	struct hci_async_req **p;
+
+	for (p = &as->reqs; *p; p = &(*p)->next) {
+		struct hci_async_req *req = *p;
+		const evt_cmd_status *cs;
+		const evt_cmd_complete *cc;
+		const evt_remote_name_req_complete *rn;
+		const evt_le_meta_event *me;
+
+		switch (evt) {
+		case EVT_CMD_STATUS:
+			cs = (const void *) ptr;
+			if (cs->opcode == req->opcode && !req->status_seen)
+				return p;
+			break;
+		case EVT_CMD_COMPLETE:
+			cc = (const void *) ptr;
+			if (cc->opcode == req->opcode)
+				return p;
+			break;
+		case EVT_REMOTE_NAME_REQ_COMPLETE:
+			rn = (const void *) ptr;
+			if (req->event == evt && req->status_seen &&
+					!bacmp(&rn->bdaddr, &req->bdaddr))
+				return p;
+			break;
+		case EVT_LE_META_EVENT:
+			me = (const void *) ptr;
+			if (req->event == me->subevent && req->status_seen &&
+				cmd_opcode_ogf(btohs(req->opcode)) == OGF_LE_CTL)
+				return p;
+			break;
+		default:
+			if (req->event == evt && req->status_seen)
+				return p;
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static void async_event(struct hci_async *as, const unsigned char *buf,
+								int len)
+{
+	const hci_event_hdr *hdr = (const void *) (buf + 1);
+	const unsigned char *ptr = buf + (1 + HCI_EVENT_HDR_SIZE);
+	struct hci_async_handler *handler;
+	struct hci_async_req **p;
+	const evt_cmd_status *cs;
+
+	len -= (1 + HCI_EVENT_HDR_SIZE);
+	if (buf[0] != HCI_EVENT_PKT || len < 0 || len < hdr->plen)
+		return;
+
+	len = hdr->plen;
+
+	as->dispatching++;
+
+	for (handler = as->handlers; handler; handler = handler->next) {
+		if (handler->func && handler->event == hdr->evt)
+			handler->func(hdr->evt, ptr, len, handler->user_data);
+	}
+
+	as->dispatching--;
+
+	if (!as->dispatching)
+		async_purge_handlers(as);
+
+	switch (hdr->evt) {
+	case EVT_CMD_STATUS:
+		if (len < EVT_CMD_STATUS_SIZE)
+			return;
+		break;
+	case EVT_CMD_COMPLETE:
+		if (len < EVT_CMD_COMPLETE_SIZE)
+			return;
+		break;
+	case EVT_REMOTE_NAME_REQ_COMPLETE:
+		if (len < 1 + (int) sizeof(bdaddr_t))
+			return;
+		break;
+	case EVT_LE_META_EVENT:
+		if (len < EVT_LE_META_EVENT_SIZE)
+			return;
+		break;
+	}
+
+	p = async_find(as, hdr->evt, ptr);
+	if (!p)
+		return;
+
+	switch (hdr->evt) {
+	case EVT_CMD_STATUS:
+		cs = (const void *) ptr;
+
+		if ((*p)->event == EVT_CMD_STATUS) {
+			async_complete(as, p, 0, ptr, len);
+			break;
+		}
+
+		if (cs->status) {
+			async_complete(as, p, EIO, ptr, len);
+			break;
+		}
+
+		(*p)->status_seen = 1;
+		break;
+
+	case EVT_CMD_COMPLETE:
+		async_complete(as, p, 0, ptr + EVT_CMD_COMPLETE_SIZE,
+						len - EVT_CMD_COMPLETE_SIZE);
+		break;
+
+	case EVT_LE_META_EVENT:
+		async_complete(as, p, 0, ptr + 1, len - 1);
+		break;
+
+	default:
+		async_complete(as, p, 0, ptr, len);
+		break;
+	}
+}
+
+int hci_async_process(struct hci_async *as)
+{
+	unsigned char buf[HCI_MAX_EVENT_SIZE];
+	struct hci_async_req **p;
+	int64_t now;
+	int len;
+
+	while ((len = recv(as->dd, buf, sizeof(buf), MSG_DONTWAIT)) != 0) {
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -1;
+		}
+
+		async_event(as, buf, len);
+	}
+
+	/*
+	 * Callbacks may cancel or send requests, so search again from the
+	 * start of the list after each one.
+	 */
+	now = async_now();
+
+	while ((p = async_find_expired(as, now)))
+		async_complete(as, p, ETIMEDOUT, NULL, 0);
+
+	return 0;
+}
+
 int hci_create_connection(int dd, const bdaddr_t *bdaddr, uint16_t ptype,
 				uint16_t clkoffset, uint8_t rswitch,
 				uint16_t *handle, int to)
@@ -53,6 +53,37 @@ int hci_close_dev(int dd);
 int hci_send_cmd(int dd, uint16_t ogf, uint16_t ocf, uint8_t plen, void *param);
 int hci_send_req(int dd, struct hci_request *req, int timeout);
 
+/*
+ * Asynchronous requests for use with an external poll loop. Wait for
+ * POLLIN on hci_async_get_fd() with hci_async_timeout() as the timeout
+ * and call hci_async_process() when it returns. The callback gets zero
+ * or an errno value (EIO if the command failed, ETIMEDOUT) and the same
+ * parameters hci_send_req() would copy to rparam.
+ *
+ * Request and event callbacks may call hci_async_send_req(),
+ * hci_async_cancel(), hci_async_register() and hci_async_unregister(),
+ * also for the request or handler being called. They must not call
+ * hci_async_process() or hci_async_free().
+ */
+struct hci_async;
+
+typedef void (*hci_async_func_t)(int err, const void *param, int len,
+							void *user_data);
+typedef void (*hci_event_func_t)(int event, const void *param, int len,
+							void *user_data);
+
+struct hci_async *hci_async_new(int dd);
+void hci_async_free(struct hci_async *as);
+int hci_async_get_fd(struct hci_async *as);
+int hci_async_send_req(struct hci_async *as, struct hci_request *req,
+			int timeout, hci_async_func_t func, void *user_data);
+int hci_async_cancel(struct hci_async *as, int id);
+int hci_async_register(struct hci_async *as, int event, hci_event_func_t func,
+							void *user_data);
+int hci_async_unregister(struct hci_async *as, int id);
+int hci_async_timeout(struct hci_async *as);
+int hci_async_process(struct hci_async *as);
+
 int hci_create_connection(int dd, const bdaddr_t *bdaddr, uint16_t ptype, uint16_t clkoffset, uint8_t rswitch, uint16_t *handle, int to);
 int hci_disconnect(int dd, uint16_t handle, uint8_t reason, int to);
 
@@ -73,7 +73,10 @@ static uint128_t bluetooth_base_uuid = {
 static sdp_data_t *sdp_copy_seq(sdp_data_t *data);
 static int sdp_attr_add_new_with_length(sdp_record_t *rec,
 	uint16_t attr, uint8_t dtd, const void *value, uint32_t len);
-static int sdp_gen_buffer(sdp_buf_t *buf, sdp_data_t *d);
+static struct sdp_compact_record *compact_record(const sdp_record_t *rec);
+static sdp_data_t *compact_data_get(struct sdp_compact_record *c,
+							uint16_t attr);
+static void compact_unshare(sdp_record_t *rec);
 
 /* Message structure. */
 struct tupla {
@@ -586,8 +589,11 @@ static void extract_svclass_uuid(sdp_data_t *data, uuid_t *uuid)
 
 int sdp_attr_add(sdp_record_t *rec, uint16_t attr, sdp_data_t *d)
 {
-	sdp_data_t *p = sdp_data_get(rec, attr);
+	sdp_data_t *p;
 
+	compact_unshare(rec);
+
+	p = sdp_data_get(rec, attr);
 	if (p)
 		return -1;
 
@@ -602,8 +608,11 @@ int sdp_attr_add(sdp_record_t *rec, uint16_t attr, sdp_data_t *d)
 
 void sdp_attr_remove(sdp_record_t *rec, uint16_t attr)
 {
-	sdp_data_t *d = sdp_data_get(rec, attr);
+	sdp_data_t *d;
+
+	compact_unshare(rec);
 
+	d = sdp_data_get(rec, attr);
 	if (d)
 		rec->attrlist = sdp_list_remove(rec->attrlist, d);
 
@@ -676,22 +685,7 @@ void sdp_set_attrid(sdp_buf_t *buf, uint16_t attr)
 	buf->data_size += sizeof(uint16_t);
 }
 
-static int get_data_size(sdp_buf_t *buf, sdp_data_t *sdpdata)
-{
-	sdp_data_t *d;
-	int n = 0;
-
-	for (d = sdpdata->val.dataseq; d; d = d->next) {
-		if (buf->data)
-			n += sdp_gen_pdu(buf, d);
-		else
-			n += sdp_gen_buffer(buf, d);
-	}
-
-	return n;
-}
-
-static int sdp_get_data_size(sdp_buf_t *buf, sdp_data_t *d)
+static uint32_t sdp_get_data_size(sdp_data_t *d)
 {
 	uint32_t data_size = 0;
 	uint8_t dtd = d->dtd;
@@ -738,16 +732,6 @@ static int sdp_get_data_size(sdp_buf_t *buf, sdp_data_t *d)
 	case SDP_URL_STR32:
 		data_size = d->unitSize - sizeof(uint8_t);
 		break;
-	case SDP_SEQ8:
-	case SDP_SEQ16:
-	case SDP_SEQ32:
-		data_size = get_data_size(buf, d);
-		break;
-	case SDP_ALT8:
-	case SDP_ALT16:
-	case SDP_ALT32:
-		data_size = get_data_size(buf, d);
-		break;
 	case SDP_UUID16:
 		data_size = sizeof(uint16_t);
 		break;
@@ -764,95 +748,132 @@ static int sdp_get_data_size(sdp_buf_t *buf, sdp_data_t *d)
 	return data_size;
 }
 
-static int sdp_gen_buffer(sdp_buf_t *buf, sdp_data_t *d)
+/*
+ * Data elements are serialized in two linear passes. sdp_calc_size() walks
+ * the tree once, bottom-up, promoting SDP_SEQ8 to SDP_SEQ16 where the
+ * content doesn't fit and recording the content size of every sequence in
+ * visiting order. sdp_emit() then walks the tree in the same order and
+ * writes it into a buffer known to be large enough.
+ */
+struct sdp_size_cache {
+	uint32_t *sizes;
+	unsigned int count;
+	unsigned int alloc;
+	unsigned int pos;
+};
+
+static int size_cache_add(struct sdp_size_cache *cache)
 {
-	int orig = buf->buf_size;
+	if (cache->count == cache->alloc) {
+		unsigned int alloc = cache->alloc ? cache->alloc * 2 : 16;
+		uint32_t *sizes;
 
-	if (buf->buf_size == 0 && d->dtd == 0) {
-		/* create initial sequence */
-		buf->buf_size += sizeof(uint8_t);
+		sizes = realloc(cache->sizes, alloc * sizeof(*sizes));
+		if (!sizes)
+			return -ENOMEM;
 
-		/* reserve space for sequence size */
-		buf->buf_size += sizeof(uint8_t);
+		cache->sizes = sizes;
+		cache->alloc = alloc;
 	}
 
-	/* attribute length */
-	buf->buf_size += sizeof(uint8_t) + sizeof(uint16_t);
+	return cache->count++;
+}
 
-	buf->buf_size += sdp_get_data_type_size(d->dtd);
-	buf->buf_size += sdp_get_data_size(buf, d);
+static int sdp_calc_size(struct sdp_size_cache *cache, sdp_data_t *d,
+								uint32_t *size)
+{
+	uint32_t data_size = 0;
+	sdp_data_t *child;
+	int idx, err;
+
+	switch (d->dtd) {
+	case SDP_SEQ8:
+	case SDP_SEQ16:
+	case SDP_SEQ32:
+	case SDP_ALT8:
+	case SDP_ALT16:
+	case SDP_ALT32:
+		idx = size_cache_add(cache);
+		if (idx < 0)
+			return idx;
 
-	if (buf->buf_size > UCHAR_MAX && d->dtd == SDP_SEQ8)
-		buf->buf_size += sizeof(uint8_t);
+		for (child = d->val.dataseq; child; child = child->next) {
+			uint32_t child_size;
 
-	return buf->buf_size - orig;
-}
+			err = sdp_calc_size(cache, child, &child_size);
+			if (err < 0)
+				return err;
 
-int sdp_gen_pdu(sdp_buf_t *buf, sdp_data_t *d)
-{
-	uint32_t pdu_size, data_size;
-	unsigned char *src = NULL, is_seq = 0, is_alt = 0;
-	uint16_t u16;
-	uint32_t u32;
-	uint64_t u64;
-	uint128_t u128;
-	uint8_t *seqp = buf->data + buf->data_size;
-	uint32_t orig_data_size = buf->data_size;
+			data_size += child_size;
+		}
 
-recalculate:
-	pdu_size = sdp_get_data_type_size(d->dtd);
-	buf->data_size += pdu_size;
+		if (data_size > UCHAR_MAX && d->dtd == SDP_SEQ8)
+			d->dtd = SDP_SEQ16;
 
-	data_size = sdp_get_data_size(buf, d);
-	if (data_size > UCHAR_MAX && d->dtd == SDP_SEQ8) {
-		buf->data_size = orig_data_size;
-		d->dtd = SDP_SEQ16;
-		goto recalculate;
+		cache->sizes[idx] = data_size;
+		break;
+	default:
+		data_size = sdp_get_data_size(d);
+		break;
 	}
 
-	*seqp = d->dtd;
+	*size = sdp_get_data_type_size(d->dtd) + data_size;
+
+	return 0;
+}
+
+static uint8_t *sdp_emit(struct sdp_size_cache *cache, sdp_data_t *d,
+								uint8_t *ptr)
+{
+	uint8_t *hdr = ptr;
+	uint32_t data_size;
+	uint128_t u128;
+	sdp_data_t *child;
+
+	*ptr = d->dtd;
+	ptr += sdp_get_data_type_size(d->dtd);
 
 	switch (d->dtd) {
-	case SDP_DATA_NIL:
-		break;
 	case SDP_UINT8:
-		src = &d->val.uint8;
-		break;
-	case SDP_UINT16:
-		u16 = htons(d->val.uint16);
-		src = (unsigned char *) &u16;
-		break;
-	case SDP_UINT32:
-		u32 = htonl(d->val.uint32);
-		src = (unsigned char *) &u32;
-		break;
-	case SDP_UINT64:
-		u64 = hton64(d->val.uint64);
-		src = (unsigned char *) &u64;
-		break;
-	case SDP_UINT128:
-		hton128(&d->val.uint128, &u128);
-		src = (unsigned char *) &u128;
+		*ptr++ = d->val.uint8;
 		break;
 	case SDP_INT8:
 	case SDP_BOOL:
-		src = (unsigned char *) &d->val.int8;
+		*ptr++ = d->val.int8;
+		break;
+	case SDP_UINT16:
+		bt_put_be16(d->val.uint16, ptr);
+		ptr += sizeof(uint16_t);
 		break;
 	case SDP_INT16:
-		u16 = htons(d->val.int16);
-		src = (unsigned char *) &u16;
+		bt_put_be16(d->val.int16, ptr);
+		ptr += sizeof(uint16_t);
+		break;
+	case SDP_UINT32:
+		bt_put_be32(d->val.uint32, ptr);
+		ptr += sizeof(uint32_t);
 		break;
 	case SDP_INT32:
-		u32 = htonl(d->val.int32);
-		src = (unsigned char *) &u32;
+		bt_put_be32(d->val.int32, ptr);
+		ptr += sizeof(uint32_t);
+		break;
+	case SDP_UINT64:
+		bt_put_be64(d->val.uint64, ptr);
+		ptr += sizeof(uint64_t);
 		break;
 	case SDP_INT64:
-		u64 = hton64(d->val.int64);
-		src = (unsigned char *) &u64;
+		bt_put_be64(d->val.int64, ptr);
+		ptr += sizeof(uint64_t);
+		break;
+	case SDP_UINT128:
+		hton128(&d->val.uint128, &u128);
+		memcpy(ptr, &u128, sizeof(u128));
+		ptr += sizeof(u128);
 		break;
 	case SDP_INT128:
 		hton128(&d->val.int128, &u128);
-		src = (unsigned char *) &u128;
+		memcpy(ptr, &u128, sizeof(u128));
+		ptr += sizeof(u128);
 		break;
 	case SDP_TEXT_STR8:
 	case SDP_TEXT_STR16:
@@ -860,80 +881,161 @@ recalculate:
 	case SDP_URL_STR8:
 	case SDP_URL_STR16:
 	case SDP_URL_STR32:
-		src = (unsigned char *) d->val.str;
-		sdp_set_seq_len(seqp, data_size);
+		data_size = sdp_get_data_size(d);
+		sdp_set_seq_len(hdr, data_size);
+		if (d->val.str)
+			memcpy(ptr, d->val.str, data_size);
+		else
+			memset(ptr, 0, data_size);
+		ptr += data_size;
 		break;
 	case SDP_SEQ8:
 	case SDP_SEQ16:
 	case SDP_SEQ32:
-		is_seq = 1;
-		sdp_set_seq_len(seqp, data_size);
-		break;
 	case SDP_ALT8:
 	case SDP_ALT16:
 	case SDP_ALT32:
-		is_alt = 1;
-		sdp_set_seq_len(seqp, data_size);
+		sdp_set_seq_len(hdr, cache->sizes[cache->pos++]);
+		for (child = d->val.dataseq; child; child = child->next)
+			ptr = sdp_emit(cache, child, ptr);
 		break;
 	case SDP_UUID16:
-		u16 = htons(d->val.uuid.value.uuid16);
-		src = (unsigned char *) &u16;
+		bt_put_be16(d->val.uuid.value.uuid16, ptr);
+		ptr += sizeof(uint16_t);
 		break;
 	case SDP_UUID32:
-		u32 = htonl(d->val.uuid.value.uuid32);
-		src = (unsigned char *) &u32;
+		bt_put_be32(d->val.uuid.value.uuid32, ptr);
+		ptr += sizeof(uint32_t);
 		break;
 	case SDP_UUID128:
-		src = (unsigned char *) &d->val.uuid.value.uuid128;
+		memcpy(ptr, &d->val.uuid.value.uuid128, sizeof(uint128_t));
+		ptr += sizeof(uint128_t);
 		break;
 	default:
 		break;
 	}
 
-	if (!is_seq && !is_alt) {
-		if (src && buf->buf_size >= buf->data_size + data_size) {
-			memcpy(buf->data + buf->data_size, src, data_size);
-			buf->data_size += data_size;
-		} else if (d->dtd != SDP_DATA_NIL) {
-			SDPDBG("Gen PDU : Can't copy from invalid source or dest");
-		}
+	return ptr;
+}
+
+/* Encodes d into a new buffer, leaving reserve bytes free at its start */
+static int sdp_gen_alloc(sdp_buf_t *buf, sdp_data_t *d, uint32_t reserve)
+{
+	struct sdp_size_cache cache;
+	uint32_t size;
+	int err;
+
+	memset(buf, 0, sizeof(sdp_buf_t));
+	memset(&cache, 0, sizeof(cache));
+
+	err = sdp_calc_size(&cache, d, &size);
+	if (err < 0)
+		goto done;
+
+	buf->data = malloc(reserve + size);
+	if (!buf->data) {
+		err = -ENOMEM;
+		goto done;
 	}
 
-	pdu_size += data_size;
+	buf->buf_size = reserve + size;
+	buf->data_size = sdp_emit(&cache, d, buf->data + reserve) - buf->data;
 
-	return pdu_size;
+done:
+	free(cache.sizes);
+	return err;
 }
 
-static void sdp_attr_pdu(void *value, void *udata)
+int sdp_gen_pdu(sdp_buf_t *buf, sdp_data_t *d)
 {
-	sdp_append_to_pdu((sdp_buf_t *)udata, (sdp_data_t *)value);
-}
+	struct sdp_size_cache cache;
+	uint32_t size;
+	uint8_t *end;
 
-static void sdp_attr_size(void *value, void *udata)
-{
-	sdp_gen_buffer((sdp_buf_t *)udata, (sdp_data_t *)value);
+	memset(&cache, 0, sizeof(cache));
+
+	if (sdp_calc_size(&cache, d, &size) < 0) {
+		free(cache.sizes);
+		return -ENOMEM;
+	}
+
+	if (buf->data_size + size > buf->buf_size) {
+		SDPDBG("Gen PDU : %u bytes don't fit in buffer", size);
+		free(cache.sizes);
+		return -ENOSPC;
+	}
+
+	end = sdp_emit(&cache, d, buf->data + buf->data_size);
+	buf->data_size = end - buf->data;
+
+	free(cache.sizes);
+
+	return size;
 }
 
 int sdp_gen_record_pdu(const sdp_record_t *rec, sdp_buf_t *buf)
 {
+	struct sdp_size_cache cache;
+	sdp_list_t *l;
+	uint32_t size, len = 0;
+	uint8_t dtd, *ptr;
+
 	memset(buf, 0, sizeof(sdp_buf_t));
-	sdp_list_foreach(rec->attrlist, sdp_attr_size, buf);
+	memset(&cache, 0, sizeof(cache));
+
+	for (l = rec->attrlist; l; l = l->next) {
+		if (sdp_calc_size(&cache, l->data, &size) < 0) {
+			free(cache.sizes);
+			return -ENOMEM;
+		}
+
+		len += sizeof(uint8_t) + sizeof(uint16_t) + size;
+	}
 
+	/* Same sequence header sdp_append_to_buf() would end up with */
+	if (len + 2 * sizeof(uint8_t) <= UCHAR_MAX)
+		dtd = SDP_SEQ8;
+	else if (len + sizeof(uint8_t) + sizeof(uint16_t) <= USHRT_MAX)
+		dtd = SDP_SEQ16;
+	else
+		dtd = SDP_SEQ32;
+
+	buf->buf_size = sdp_get_data_type_size(dtd) + len;
 	buf->data = malloc(buf->buf_size);
-	if (!buf->data)
+	if (!buf->data) {
+		free(cache.sizes);
 		return -ENOMEM;
-	buf->data_size = 0;
-	memset(buf->data, 0, buf->buf_size);
+	}
 
-	sdp_list_foreach(rec->attrlist, sdp_attr_pdu, buf);
+	ptr = buf->data;
+	*ptr = dtd;
+	sdp_set_seq_len(ptr, len);
+	ptr += sdp_get_data_type_size(dtd);
+
+	for (l = rec->attrlist; l; l = l->next) {
+		sdp_data_t *d = l->data;
+
+		*ptr++ = SDP_UINT16;
+		bt_put_be16(d->attrId, ptr);
+		ptr += sizeof(uint16_t);
+
+		ptr = sdp_emit(&cache, d, ptr);
+	}
+
+	buf->data_size = ptr - buf->data;
+
+	free(cache.sizes);
 
 	return 0;
 }
 
 void sdp_attr_replace(sdp_record_t *rec, uint16_t attr, sdp_data_t *d)
 {
-	sdp_data_t *p = sdp_data_get(rec, attr);
+	sdp_data_t *p;
 
+	compact_unshare(rec);
+
+	p = sdp_data_get(rec, attr);
 	if (p) {
 		rec->attrlist = sdp_list_remove(rec->attrlist, p);
 		sdp_data_free(p);
@@ -973,6 +1075,9 @@ void sdp_data_free(sdp_data_t *d)
 	case SDP_SEQ8:
 	case SDP_SEQ16:
 	case SDP_SEQ32:
+	case SDP_ALT8:
+	case SDP_ALT16:
+	case SDP_ALT32:
 		data_seq_free(d);
 		break;
 	case SDP_URL_STR8:
@@ -1279,8 +1384,10 @@ static sdp_data_t *extract_seq(const void *p, int bufsize, int *len,
 	*len = sdp_extract_seqtype(p, bufsize, &d->dtd, &seqlen);
 	SDPDBG("Sequence Type : 0x%x length : 0x%x", d->dtd, seqlen);
 
-	if (*len == 0)
-		return d;
+	if (*len == 0) {
+		free(d);
+		return NULL;
+	}
 
 	if (*len > bufsize) {
 		SDPERR("Packet not big enough to hold sequence.");
@@ -1575,10 +1682,517 @@ static void sdp_copy_attrlist(void *value, void *udata)
 							data->dtd, val, len);
 }
 
+/*
+ * Compact records keep the sdp_record_t, the attribute list, every data
+ * element and string and the UUID pattern in one allocation. They look
+ * like any other record to readers; attributes are stored in an array
+ * sorted by ID, so sdp_data_get() can use a binary search. Functions in
+ * this file that modify a record turn it back into a regular one first.
+ */
+#define SDP_COMPACT_MAGIC	0x53445043
+
+#define COMPACT_ALIGN(size)	(((size) + 7) & ~((size_t) 7))
+
+struct sdp_compact_record {
+	sdp_record_t rec;
+	uint32_t magic;
+	unsigned int num_attrs;
+	unsigned int num_nodes;
+	unsigned int num_pattern;
+	size_t size;
+	size_t nodes_offset;
+	size_t pattern_offset;
+	size_t uuids_offset;
+	size_t strings_offset;
+	sdp_list_t attrs[0];
+};
+
+struct compact_count {
+	unsigned int attrs;
+	unsigned int nodes;
+	unsigned int uuids;
+	size_t strings;
+};
+
+struct compact_builder {
+	sdp_data_t *node;
+	uuid_t *uuids;
+	unsigned int num_uuids;
+	char *str;
+};
+
+static struct sdp_compact_record *compact_record(const sdp_record_t *rec)
+{
+	struct sdp_compact_record *c = (struct sdp_compact_record *) rec;
+
+	/* Only look past the record once it points into the same block */
+	if (!rec->attrlist || rec->attrlist != c->attrs)
+		return NULL;
+
+	if (c->magic != SDP_COMPACT_MAGIC)
+		return NULL;
+
+	return c;
+}
+
+/*
+ * Returns the encoded length of the data element at p, or -1 if it isn't
+ * fully contained in bufsize bytes. Only element layouts that
+ * sdp_extract_attr() parses the same way are accepted.
+ */
+static int compact_scan(const uint8_t *p, int bufsize,
+						struct compact_count *count)
+{
+	int hdr, len, off, n;
+	uint8_t dtd;
+
+	if (bufsize < (int) sizeof(uint8_t))
+		return -1;
+
+	count->nodes++;
+
+	switch (*p) {
+	case SDP_DATA_NIL:
+		return sizeof(uint8_t);
+	case SDP_BOOL:
+	case SDP_INT8:
+	case SDP_UINT8:
+		len = sizeof(uint8_t);
+		break;
+	case SDP_INT16:
+	case SDP_UINT16:
+		len = sizeof(uint16_t);
+		break;
+	case SDP_INT32:
+	case SDP_UINT32:
+		len = sizeof(uint32_t);
+		break;
+	case SDP_INT64:
+	case SDP_UINT64:
+		len = sizeof(uint64_t);
+		break;
+	case SDP_INT128:
+	case SDP_UINT128:
+		len = sizeof(uint128_t);
+		break;
+	case SDP_UUID16:
+		count->uuids++;
+		len = sizeof(uint16_t);
+		break;
+	case SDP_UUID32:
+		count->uuids++;
+		len = sizeof(uint32_t);
+		break;
+	case SDP_UUID128:
+		count->uuids++;
+		len = sizeof(uint128_t);
+		break;
+	case SDP_TEXT_STR8:
+	case SDP_URL_STR8:
+		if (bufsize < 2)
+			return -1;
+		len = p[1];
+		if (len > bufsize - 2)
+			return -1;
+		count->strings += len + 1;
+		return 2 + len;
+	case SDP_TEXT_STR16:
+	case SDP_URL_STR16:
+		if (bufsize < 3)
+			return -1;
+		len = bt_get_be16(p + 1);
+		if (len > bufsize - 3)
+			return -1;
+		count->strings += len + 1;
+		return 3 + len;
+	case SDP_SEQ8:
+	case SDP_SEQ16:
+	case SDP_SEQ32:
+	case SDP_ALT8:
+	case SDP_ALT16:
+	case SDP_ALT32:
+		hdr = sdp_extract_seqtype(p, bufsize, &dtd, &len);
+		if (!hdr || len < 0 || len > bufsize - hdr)
+			return -1;
+
+		for (off = 0; off < len; off += n) {
+			n = compact_scan(p + hdr + off, len - off, count);
+			if (n < 0)
+				return -1;
+		}
+
+		return hdr + len;
+	default:
+		return -1;
+	}
+
+	if (len > bufsize - 1)
+		return -1;
+
+	return 1 + len;
+}
+
+static void compact_add_uuid(struct compact_builder *b, const uuid_t *uuid)
+{
+	uuid_t *uuid128 = &b->uuids[b->num_uuids++];
+
+	switch (uuid->type) {
+	case SDP_UUID16:
+		sdp_uuid16_to_uuid128(uuid128, uuid);
+		break;
+	case SDP_UUID32:
+		sdp_uuid32_to_uuid128(uuid128, uuid);
+		break;
+	default:
+		*uuid128 = *uuid;
+		break;
+	}
+}
+
+/* Builds an element already validated by compact_scan() */
+static sdp_data_t *compact_build(struct compact_builder *b, const uint8_t *p,
+								int *len)
+{
+	sdp_data_t *d = b->node++;
+	sdp_data_t *prev = NULL;
+	int hdr, seqlen, off, n;
+
+	d->dtd = *p;
+
+	switch (d->dtd) {
+	case SDP_DATA_NIL:
+		*len = sizeof(uint8_t);
+		break;
+	case SDP_BOOL:
+	case SDP_INT8:
+	case SDP_UINT8:
+		d->val.uint8 = p[1];
+		*len = 1 + sizeof(uint8_t);
+		break;
+	case SDP_INT16:
+	case SDP_UINT16:
+		d->val.uint16 = bt_get_be16(p + 1);
+		*len = 1 + sizeof(uint16_t);
+		break;
+	case SDP_INT32:
+	case SDP_UINT32:
+		d->val.uint32 = bt_get_be32(p + 1);
+		*len = 1 + sizeof(uint32_t);
+		break;
+	case SDP_INT64:
+	case SDP_UINT64:
+		d->val.uint64 = bt_get_be64(p + 1);
+		*len = 1 + sizeof(uint64_t);
+		break;
+	case SDP_INT128:
+	case SDP_UINT128:
+		ntoh128((uint128_t *) (p + 1), &d->val.uint128);
+		*len = 1 + sizeof(uint128_t);
+		break;
+	case SDP_UUID16:
+	case SDP_UUID32:
+	case SDP_UUID128:
+		*len = 0;
+		sdp_uuid_extract(p, INT_MAX, &d->val.uuid, len);
+		compact_add_uuid(b, &d->val.uuid);
+		break;
+	case SDP_TEXT_STR8:
+	case SDP_URL_STR8:
+	case SDP_TEXT_STR16:
+	case SDP_URL_STR16:
+		if (d->dtd == SDP_TEXT_STR8 || d->dtd == SDP_URL_STR8) {
+			hdr = 2;
+			n = p[1];
+		} else {
+			hdr = 3;
+			n = bt_get_be16(p + 1);
+		}
+
+		d->val.str = b->str;
+		d->unitSize = n + sizeof(uint8_t);
+		memcpy(b->str, p + hdr, n);
+		b->str[n] = '\0';
+		b->str += n + 1;
+		*len = hdr + n;
+		break;
+	default:
+		hdr = sdp_extract_seqtype(p, INT_MAX, &d->dtd, &seqlen);
+
+		for (off = 0; off < seqlen; off += n) {
+			sdp_data_t *child = compact_build(b, p + hdr + off, &n);
+
+			if (prev)
+				prev->next = child;
+			else
+				d->val.dataseq = child;
+			prev = child;
+		}
+
+		*len = hdr + seqlen;
+		break;
+	}
+
+	return d;
+}
+
+/*
+ * Checks the record at buf and counts what it needs. Returns the offset of
+ * the first attribute or 0 for anything sdp_extract_pdu() should handle.
+ */
+static int compact_scan_record(const uint8_t *buf, int bufsize, int *seqlen,
+						struct compact_count *count)
+{
+	int scanned, off, n;
+	uint16_t attr, last = 0;
+	uint8_t dtd;
+
+	scanned = sdp_extract_seqtype(buf, bufsize, &dtd, seqlen);
+	if (!scanned || *seqlen < 0 || *seqlen > bufsize - scanned)
+		return 0;
+
+	if (dtd != SDP_SEQ8 && dtd != SDP_SEQ16 && dtd != SDP_SEQ32)
+		return 0;
+
+	for (off = 0; off < *seqlen; off += n) {
+		const uint8_t *p = buf + scanned + off;
+
+		if (*seqlen - off < 3 || p[0] != SDP_UINT16)
+			return 0;
+
+		/* Duplicated or unsorted IDs are left to sdp_attr_replace() */
+		attr = bt_get_be16(p + 1);
+		if (count->attrs && attr <= last)
+			return 0;
+
+		n = compact_scan(p + 3, *seqlen - off - 3, count);
+		if (n < 0)
+			return 0;
+
+		n += 3;
+		last = attr;
+		count->attrs++;
+	}
+
+	return scanned;
+}
+
+sdp_record_t *sdp_extract_pdu_compact(const uint8_t *buf, int bufsize,
+								int *scanned)
+{
+	struct sdp_compact_record *c;
+	struct compact_count count;
+	struct compact_builder b;
+	sdp_list_t *pattern;
+	size_t size;
+	int off, seqlen, hdr, n;
+	unsigned int i;
+
+	/* Each element takes at least a byte, which bounds the sizes below */
+	if (bufsize <= 0 || (size_t) bufsize > SIZE_MAX / 128)
+		return sdp_extract_pdu(buf, bufsize, scanned);
+
+	memset(&count, 0, sizeof(count));
+
+	hdr = compact_scan_record(buf, bufsize, &seqlen, &count);
+	if (!hdr || !count.attrs)
+		return sdp_extract_pdu(buf, bufsize, scanned);
+
+	size = COMPACT_ALIGN(sizeof(*c) + count.attrs * sizeof(sdp_list_t));
+	size += COMPACT_ALIGN(count.nodes * sizeof(sdp_data_t));
+	size += COMPACT_ALIGN(count.uuids * sizeof(sdp_list_t));
+	size += COMPACT_ALIGN(count.uuids * sizeof(uuid_t));
+	size += count.strings;
+
+	c = malloc(size);
+	if (!c)
+		return NULL;
+
+	memset(c, 0, size);
+	c->magic = SDP_COMPACT_MAGIC;
+	c->size = size;
+	c->num_attrs = count.attrs;
+	c->num_nodes = count.nodes;
+	c->nodes_offset = COMPACT_ALIGN(sizeof(*c) +
+					count.attrs * sizeof(sdp_list_t));
+	c->pattern_offset = c->nodes_offset +
+			COMPACT_ALIGN(count.nodes * sizeof(sdp_data_t));
+	c->uuids_offset = c->pattern_offset +
+			COMPACT_ALIGN(count.uuids * sizeof(sdp_list_t));
+	c->strings_offset = c->uuids_offset +
+			COMPACT_ALIGN(count.uuids * sizeof(uuid_t));
+
+	c->rec.handle = 0xffffffff;
+
+	b.node = (void *) ((uint8_t *) c + c->nodes_offset);
+	b.uuids = (void *) ((uint8_t *) c + c->uuids_offset);
+	b.num_uuids = 0;
+	b.str = (char *) c + c->strings_offset;
+
+	for (i = 0, off = 0; off < seqlen; i++, off += n) {
+		const uint8_t *p = buf + hdr + off;
+		sdp_data_t *data;
+
+		data = compact_build(&b, p + 3, &n);
+		data->attrId = bt_get_be16(p + 1);
+		n += 3;
+
+		if (data->attrId == SDP_ATTR_RECORD_HANDLE)
+			c->rec.handle = data->val.uint32;
+
+		if (data->attrId == SDP_ATTR_SVCLASS_ID_LIST)
+			extract_svclass_uuid(data, &c->rec.svclass);
+
+		c->attrs[i].data = data;
+		if (i > 0)
+			c->attrs[i - 1].next = &c->attrs[i];
+	}
+
+	c->rec.attrlist = c->attrs;
+
+	/* Same sorted set of 128 bit UUIDs sdp_pattern_add_uuid() builds */
+	qsort(b.uuids, b.num_uuids, sizeof(uuid_t), sdp_uuid128_cmp);
+
+	pattern = (void *) ((uint8_t *) c + c->pattern_offset);
+
+	for (i = 0; i < b.num_uuids; i++) {
+		if (c->num_pattern && !sdp_uuid128_cmp(&b.uuids[i],
+				pattern[c->num_pattern - 1].data))
+			continue;
+
+		pattern[c->num_pattern].data = &b.uuids[i];
+		if (c->num_pattern > 0)
+			pattern[c->num_pattern - 1].next =
+						&pattern[c->num_pattern];
+		c->num_pattern++;
+	}
+
+	if (c->num_pattern)
+		c->rec.pattern = pattern;
+
+	*scanned = hdr + seqlen;
+
+	return &c->rec;
+}
+
+static sdp_data_t *compact_data_get(struct sdp_compact_record *c,
+							uint16_t attr)
+{
+	unsigned int lo = 0, hi = c->num_attrs;
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+		sdp_data_t *d = c->attrs[mid].data;
+
+		if (d->attrId == attr)
+			return d;
+
+		if (d->attrId < attr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return NULL;
+}
+
+#define COMPACT_RELOCATE(ptr, delta) \
+	do {								\
+		if (ptr)						\
+			(ptr) = (void *) ((uintptr_t) (ptr) + (delta));	\
+	} while (0)
+
+static sdp_record_t *compact_copy(struct sdp_compact_record *c)
+{
+	struct sdp_compact_record *cpy;
+	uintptr_t delta;
+	sdp_data_t *nodes;
+	sdp_list_t *pattern;
+	unsigned int i;
+
+	cpy = malloc(c->size);
+	if (!cpy)
+		return NULL;
+
+	memcpy(cpy, c, c->size);
+
+	/* Every pointer in the block points into the block itself */
+	delta = (uintptr_t) cpy - (uintptr_t) c;
+
+	COMPACT_RELOCATE(cpy->rec.attrlist, delta);
+	COMPACT_RELOCATE(cpy->rec.pattern, delta);
+
+	for (i = 0; i < cpy->num_attrs; i++) {
+		COMPACT_RELOCATE(cpy->attrs[i].next, delta);
+		COMPACT_RELOCATE(cpy->attrs[i].data, delta);
+	}
+
+	nodes = (void *) ((uint8_t *) cpy + cpy->nodes_offset);
+
+	for (i = 0; i < cpy->num_nodes; i++) {
+		sdp_data_t *d = &nodes[i];
+
+		COMPACT_RELOCATE(d->next, delta);
+
+		switch (d->dtd) {
+		case SDP_SEQ8:
+		case SDP_SEQ16:
+		case SDP_SEQ32:
+		case SDP_ALT8:
+		case SDP_ALT16:
+		case SDP_ALT32:
+			COMPACT_RELOCATE(d->val.dataseq, delta);
+			break;
+		case SDP_TEXT_STR8:
+		case SDP_TEXT_STR16:
+		case SDP_URL_STR8:
+		case SDP_URL_STR16:
+			COMPACT_RELOCATE(d->val.str, delta);
+			break;
+		}
+	}
+
+	pattern = (void *) ((uint8_t *) cpy + cpy->pattern_offset);
+
+	for (i = 0; i < cpy->num_pattern; i++) {
+		COMPACT_RELOCATE(pattern[i].next, delta);
+		COMPACT_RELOCATE(pattern[i].data, delta);
+	}
+
+	return &cpy->rec;
+}
+
+/*
+ * Turns a compact record into a regular one before it gets modified. The
+ * block stays allocated, as it also holds the sdp_record_t, and is freed
+ * with the record.
+ */
+static void compact_unshare(sdp_record_t *rec)
+{
+	struct sdp_compact_record *c = compact_record(rec);
+	sdp_list_t *attrlist, *pattern;
+
+	if (!c)
+		return;
+
+	attrlist = rec->attrlist;
+	pattern = rec->pattern;
+
+	c->magic = 0;
+	rec->attrlist = NULL;
+	rec->pattern = NULL;
+
+	sdp_list_foreach(pattern, sdp_copy_pattern, rec);
+	sdp_list_foreach(attrlist, sdp_copy_attrlist, rec);
+}
+
 sdp_record_t *sdp_copy_record(sdp_record_t *rec)
 {
+	struct sdp_compact_record *c = compact_record(rec);
 	sdp_record_t *cpy;
 
+	if (c)
+		return compact_copy(c);
+
 	cpy = sdp_record_alloc();
 
 	cpy->handle = rec->handle;
@@ -1667,6 +2281,11 @@ void sdp_data_print(sdp_data_t *d)
 
 sdp_data_t *sdp_data_get(const sdp_record_t *rec, uint16_t attrId)
 {
+	struct sdp_compact_record *c = compact_record(rec);
+
+	if (c)
+		return compact_data_get(c, attrId);
+
 	if (rec->attrlist) {
 		sdp_data_t sdpTemplate;
 		sdp_list_t *p;
@@ -2868,14 +3487,12 @@ void sdp_append_to_pdu(sdp_buf_t *pdu, sdp_data_t *d)
 {
 	sdp_buf_t append;
 
-	memset(&append, 0, sizeof(sdp_buf_t));
-	sdp_gen_buffer(&append, d);
-	append.data = malloc(append.buf_size);
-	if (!append.data)
+	if (sdp_gen_alloc(&append, d, sizeof(uint8_t) + sizeof(uint16_t)) < 0)
 		return;
 
-	sdp_set_attrid(&append, d->attrId);
-	sdp_gen_pdu(&append, d);
+	append.data[0] = SDP_UINT16;
+	bt_put_be16(d->attrId, append.data + 1);
+
 	sdp_append_to_buf(pdu, append.data, append.data_size);
 	free(append.data);
 }
@@ -3209,6 +3826,11 @@ sdp_record_t *sdp_record_alloc(void)
  */
 void sdp_record_free(sdp_record_t *rec)
 {
+	if (compact_record(rec)) {
+		free(rec);
+		return;
+	}
+
 	sdp_list_free(rec->attrlist, (sdp_free_func_t) sdp_data_free);
 	sdp_list_free(rec->pattern, free);
 	free(rec);
@@ -3216,7 +3838,11 @@ void sdp_record_free(sdp_record_t *rec)
 
 void sdp_pattern_add_uuid(sdp_record_t *rec, uuid_t *uuid)
 {
-	uuid_t *uuid128 = sdp_uuid_to_uuid128(uuid);
+	uuid_t *uuid128;
+
+	compact_unshare(rec);
+
+	uuid128 = sdp_uuid_to_uuid128(uuid);
 
 	SDPDBG("Elements in target pattern : %d", sdp_list_len(rec->pattern));
 	SDPDBG("Trying to add : 0x%lx", (unsigned long) uuid128);
@@ -3308,11 +3934,7 @@ static int gen_dataseq_pdu(uint8_t *dst, const sdp_list_t *seq, uint8_t dtd)
 		return -ENOMEM;
 	}
 
-	memset(&buf, 0, sizeof(sdp_buf_t));
-	sdp_gen_buffer(&buf, dataseq);
-	buf.data = malloc(buf.buf_size);
-
-	if (!buf.data) {
+	if (sdp_gen_alloc(&buf, dataseq, 0) < 0) {
 		sdp_data_free(dataseq);
 		free(types);
 		free(values);
@@ -3320,7 +3942,7 @@ static int gen_dataseq_pdu(uint8_t *dst, const sdp_list_t *seq, uint8_t dtd)
 	}
 
 	SDPDBG("Data Seq : 0x%p", seq);
-	seqlen = sdp_gen_pdu(&buf, dataseq);
+	seqlen = buf.data_size;
 	SDPDBG("Copying : %d", buf.data_size);
 	memcpy(dst, buf.data, buf.data_size);
 
@@ -601,6 +601,14 @@ int sdp_set_supp_feat(sdp_record_t *rec, const sdp_list_t *sf);
 int sdp_get_supp_feat(const sdp_record_t *rec, sdp_list_t **seqp);
 
 sdp_record_t *sdp_extract_pdu(const uint8_t *pdata, int bufsize, int *scanned);
+
+/*
+ * Same as sdp_extract_pdu() but allocates the whole record in one block,
+ * which is released by sdp_record_free(). Such records must only be
+ * modified through the sdp_attr_* and sdp_set_* functions.
+ */
+sdp_record_t *sdp_extract_pdu_compact(const uint8_t *pdata, int bufsize,
+								int *scanned);
 sdp_record_t *sdp_copy_record(sdp_record_t *rec);
 
 void sdp_data_print(sdp_data_t *data);
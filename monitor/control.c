@@ -32,6 +32,8 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <inttypes.h>
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -42,6 +44,7 @@
 
 #include "src/shared/util.h"
 #include "src/shared/btsnoop.h"
+#include "src/trace.h"
 #include "mainloop.h"
 #include "display.h"
 #include "packet.h"
@@ -1007,6 +1010,162 @@ void control_reader(const char *path)
 	btsnoop_unref(btsnoop_file);
 }
 
+static const char *trace_event_str(uint16_t event)
+{
+	switch (event) {
+	case BTD_TRACE_MGMT_EVENT:
+		return "MGMT Event";
+	case BTD_TRACE_MGMT_COMMAND:
+		return "MGMT Command";
+	case BTD_TRACE_ATT_IN:
+		return "ATT In";
+	case BTD_TRACE_ATT_OUT:
+		return "ATT Out";
+	case BTD_TRACE_DBUS_METHOD:
+		return "D-Bus Method";
+	case BTD_TRACE_STORAGE_WRITE:
+		return "Storage Write";
+	}
+
+	return "Unknown";
+}
+
+static void daemon_record(const struct btd_trace_record *rec)
+{
+	char index[12], latency[24];
+
+	if (rec->index == BTD_TRACE_INDEX_NONE)
+		index[0] = '\0';
+	else
+		sprintf(index, " hci%u", rec->index);
+
+	if (rec->latency)
+		sprintf(latency, " (%u usec)", rec->latency);
+	else
+		latency[0] = '\0';
+
+	printf("@ bluetoothd %" PRIu64 ".%06" PRIu64 "%s: %s",
+				rec->time / 1000000, rec->time % 1000000,
+				index, trace_event_str(rec->event));
+
+	switch (rec->event) {
+	case BTD_TRACE_MGMT_EVENT:
+		printf(" 0x%4.4x len %u", rec->arg[0], rec->arg[1]);
+		break;
+	case BTD_TRACE_MGMT_COMMAND:
+		printf(" 0x%4.4x status 0x%2.2x len %u", rec->arg[0],
+						rec->arg[1], rec->arg[2]);
+		break;
+	case BTD_TRACE_ATT_IN:
+	case BTD_TRACE_ATT_OUT:
+		printf(" opcode 0x%2.2x len %u", rec->arg[0], rec->arg[1]);
+		break;
+	case BTD_TRACE_DBUS_METHOD:
+		printf(" %.*s", (int) sizeof(rec->name), rec->name);
+		break;
+	case BTD_TRACE_STORAGE_WRITE:
+		printf(" len %u", rec->arg[0]);
+		break;
+	}
+
+	printf("%s\n", latency);
+}
+
+static void daemon_histogram(const struct btd_trace_histogram *hist)
+{
+	int i;
+
+	printf("@ bluetoothd: %s latency: %u samples avg %" PRIu64
+				" usec max %u usec\n",
+				trace_event_str(hist->event), hist->count,
+				hist->total / (hist->count ? hist->count : 1),
+				hist->max);
+
+	for (i = 0; i < BTD_TRACE_BUCKETS; i++) {
+		if (!hist->bucket[i])
+			continue;
+
+		if (i == BTD_TRACE_BUCKETS - 1)
+			printf("        >= %-9u usec: %u\n", 1U << (i - 1),
+							hist->bucket[i]);
+		else
+			printf("        <  %-9u usec: %u\n", 1U << i,
+							hist->bucket[i]);
+	}
+}
+
+static void daemon_callback(int fd, uint32_t events, void *user_data)
+{
+	uint8_t buf[sizeof(struct btd_trace_hdr) + 256];
+	const struct btd_trace_hdr *hdr = (void *) buf;
+	const void *data = buf + sizeof(*hdr);
+	ssize_t len;
+
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		printf("--- bluetoothd trace closed ---\n");
+		mainloop_remove_fd(fd);
+		return;
+	}
+
+	while (1) {
+		len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (len < (ssize_t) sizeof(*hdr))
+			break;
+
+		if (len < (ssize_t) sizeof(*hdr) + hdr->len)
+			continue;
+
+		switch (hdr->type) {
+		case BTD_TRACE_TYPE_RECORD:
+			if (hdr->len >= sizeof(struct btd_trace_record))
+				daemon_record(data);
+			break;
+		case BTD_TRACE_TYPE_HISTOGRAM:
+			if (hdr->len >= sizeof(struct btd_trace_histogram))
+				daemon_histogram(data);
+			break;
+		case BTD_TRACE_TYPE_DROPPED:
+			if (hdr->len >= sizeof(struct btd_trace_dropped))
+				printf("@ bluetoothd: %u records dropped\n",
+					((const struct btd_trace_dropped *)
+								data)->count);
+			break;
+		}
+	}
+}
+
+int control_daemon(void)
+{
+	struct sockaddr_un addr;
+	socklen_t len;
+	int fd;
+
+	fd = socket(PF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("Failed to open trace socket");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path + 1, BTD_TRACE_SOCKET);
+	len = offsetof(struct sockaddr_un, sun_path) + 1 +
+						strlen(BTD_TRACE_SOCKET);
+
+	if (connect(fd, (struct sockaddr *) &addr, len) < 0) {
+		perror("Failed to connect bluetoothd trace socket");
+		close(fd);
+		return -1;
+	}
+
+	if (mainloop_add_fd(fd, EPOLLIN, daemon_callback, NULL, NULL) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return 0;
+}
+
 int control_tracing(void)
 {
 	packet_add_filter(PACKET_FILTER_SHOW_INDEX);
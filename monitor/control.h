@@ -28,5 +28,6 @@ void control_writer(const char *path);
 void control_reader(const char *path);
 void control_server(const char *path);
 int control_tracing(void);
+int control_daemon(void);
 
 void control_message(uint16_t opcode, const void *data, uint16_t size);
@@ -28,6 +28,7 @@
 
 #include <stdio.h>
 #include <ctype.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
@@ -65,6 +66,7 @@ static void usage(void)
 		"\t-T, --date             Show time and date information\n"
 		"\t-S, --sco              Dump SCO traffic\n"
 		"\t-E, --ellisys [ip]     Send Ellisys HCI Injection\n"
+		"\t-D, --daemon           Show bluetoothd tracepoints\n"
 		"\t-h, --help             Show help options\n");
 }
 
@@ -78,6 +80,7 @@ static const struct option main_options[] = {
 	{ "date",    no_argument,       NULL, 'T' },
 	{ "sco",     no_argument,	NULL, 'S' },
 	{ "ellisys", required_argument, NULL, 'E' },
+	{ "daemon",  no_argument,       NULL, 'D' },
 	{ "todo",    no_argument,       NULL, '#' },
 	{ "version", no_argument,       NULL, 'v' },
 	{ "help",    no_argument,       NULL, 'h' },
@@ -93,6 +96,7 @@ int main(int argc, char *argv[])
 	const char *ellisys_server = NULL;
 	unsigned short ellisys_port = 0;
 	const char *str;
+	bool daemon_trace = false;
 	int exit_status;
 	sigset_t mask;
 
@@ -103,7 +107,7 @@ int main(int argc, char *argv[])
 	for (;;) {
 		int opt;
 
-		opt = getopt_long(argc, argv, "r:w:a:s:i:tTSE:vh",
+		opt = getopt_long(argc, argv, "r:w:a:s:i:tTSE:Dvh",
 						main_options, NULL);
 		if (opt < 0)
 			break;
@@ -148,6 +152,9 @@ int main(int argc, char *argv[])
 			ellisys_server = optarg;
 			ellisys_port = 24352;
 			break;
+		case 'D':
+			daemon_trace = true;
+			break;
 		case '#':
 			packet_todo();
 			lmp_todo();
@@ -207,6 +214,9 @@ int main(int argc, char *argv[])
 	if (control_tracing() < 0)
 		return EXIT_FAILURE;
 
+	if (daemon_trace && control_daemon() < 0)
+		return EXIT_FAILURE;
+
 	exit_status = mainloop_run();
 
 	keys_cleanup();
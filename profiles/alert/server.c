@@ -322,47 +322,6 @@ static void watcher_disconnect(DBusConnection *conn, void *user_data)
 	g_slist_foreach(alert_adapters, update_supported_categories, NULL);
 }
 
-static gboolean is_notifiable_device(struct btd_device *device, uint16_t ccc)
-{
-	char *filename;
-	GKeyFile *key_file;
-	char handle[6];
-	char *str;
-	uint16_t val;
-	gboolean result;
-
-	sprintf(handle, "%hu", ccc);
-
-	filename = btd_device_get_storage_path(device, "ccc");
-	if (!filename) {
-		warn("Unable to get ccc storage path for device");
-		return FALSE;
-	}
-
-	key_file = g_key_file_new();
-	g_key_file_load_from_file(key_file, filename, 0, NULL);
-
-	str = g_key_file_get_string(key_file, handle, "Value", NULL);
-	if (!str) {
-		result = FALSE;
-		goto end;
-	}
-
-	val = strtol(str, NULL, 16);
-	if (!(val & 0x0001)) {
-		result = FALSE;
-		goto end;
-	}
-
-	result = TRUE;
-end:
-	g_free(str);
-	g_free(filename);
-	g_key_file_free(key_file);
-
-	return result;
-}
-
 static void destroy_notify_callback(guint8 status, const guint8 *pdu, guint16 len,
 							gpointer user_data)
 {
@@ -424,16 +383,12 @@ end:
 	g_free(cb);
 }
 
-static void filter_devices_notify(struct btd_device *device, void *user_data)
+static void notify_subscriber(struct btd_device *device, uint16_t ccc,
+							void *user_data)
 {
 	struct notify_data *notify_data = user_data;
-	struct alert_adapter *al_adapter = notify_data->al_adapter;
-	enum notify_type type = notify_data->type;
 	struct notify_callback *cb;
 
-	if (!is_notifiable_device(device, al_adapter->hnd_ccc[type]))
-		return;
-
 	cb = g_new0(struct notify_callback, 1);
 	cb->notify_data = notify_data;
 	cb->device = btd_device_ref(device);
@@ -452,8 +407,9 @@ static void notify_devices(struct alert_adapter *al_adapter,
 	notify_data->value = g_memdup(value, len);
 	notify_data->len = len;
 
-	btd_adapter_for_each_device(al_adapter->adapter, filter_devices_notify,
-					notify_data);
+	attrib_foreach_subscriber(al_adapter->adapter, al_adapter->hnd_ccc[type],
+					GATT_CLIENT_CHARAC_CFG_NOTIF_BIT,
+					notify_subscriber, notify_data);
 }
 
 static void pasp_notification(enum notify_type type)
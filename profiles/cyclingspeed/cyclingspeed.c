@@ -38,6 +38,7 @@
 #include "src/dbus-common.h"
 #include "src/shared/util.h"
 #include "src/error.h"
+#include "src/notify-stream.h"
 #include "attrib/gattrib.h"
 #include "attrib/att.h"
 #include "attrib/gatt.h"
@@ -112,6 +113,8 @@ struct csc {
 	uint8_t			*locations;
 
 	struct controlpoint_req	*pending_req;
+
+	GSList			*streams;
 };
 
 struct watcher {
@@ -269,12 +272,20 @@ static void destroy_csc(gpointer user_data)
 		g_attrib_unref(csc->attrib);
 	}
 
+	g_slist_free_full(csc->streams,
+				(GDestroyNotify) notify_stream_free);
+
 	btd_device_unref(csc->dev);
 	g_free(csc->svc_range);
 	g_free(csc->locations);
 	g_free(csc);
 }
 
+static bool measurement_wanted(struct csc *csc)
+{
+	return csc->cadapter->watchers != NULL || csc->streams != NULL;
+}
+
 static void char_write_cb(guint8 status, const guint8 *pdu, guint16 len,
 							gpointer user_data)
 {
@@ -438,7 +449,7 @@ static void discover_desc_cb(guint8 status, GSList *descs, gpointer user_data)
 	if (g_strcmp0(ch->uuid, CSC_MEASUREMENT_UUID) == 0) {
 		ch->csc->measurement_ccc_handle = desc->handle;
 
-		if (g_slist_length(ch->csc->cadapter->watchers) == 0) {
+		if (!measurement_wanted(ch->csc)) {
 			put_le16(0x0000, attr_val);
 			msg = g_strdup("Disable measurement");
 		} else {
@@ -581,6 +592,7 @@ static void measurement_notify_handler(const uint8_t *pdu, uint16_t len,
 							gpointer user_data)
 {
 	struct csc *csc = user_data;
+	GSList *l;
 
 	/* should be at least opcode (1b) + handle (2b) */
 	if (len < 3) {
@@ -588,7 +600,12 @@ static void measurement_notify_handler(const uint8_t *pdu, uint16_t len,
 		return;
 	}
 
-	process_measurement(csc, pdu + 3, len - 3);
+	/* Streams get the characteristic value as is */
+	for (l = csc->streams; l; l = l->next)
+		notify_stream_send(l->data, pdu + 3, len - 3);
+
+	if (csc->cadapter->watchers != NULL)
+		process_measurement(csc, pdu + 3, len - 3);
 }
 
 static void controlpoint_property_reply(struct controlpoint_req *req,
@@ -810,7 +827,7 @@ static void disable_measurement(gpointer data, gpointer user_data)
 	uint8_t value[2];
 	char *msg;
 
-	if (csc->attrib == NULL || !handle)
+	if (csc->attrib == NULL || !handle || csc->streams != NULL)
 		return;
 
 	put_le16(0x0000, value);
@@ -1154,10 +1171,46 @@ static DBusMessage *set_cumulative_wheel_rev(DBusConnection *conn,
 	return NULL;
 }
 
+static void stream_closed(struct notify_stream *stream, void *user_data)
+{
+	struct csc *csc = user_data;
+
+	csc->streams = g_slist_remove(csc->streams, stream);
+	notify_stream_free(stream);
+
+	if (!measurement_wanted(csc))
+		disable_measurement(csc, NULL);
+}
+
+static DBusMessage *acquire_measurement(DBusConnection *conn,
+						DBusMessage *msg, void *data)
+{
+	struct csc *csc = data;
+	struct notify_stream *stream;
+	DBusMessage *reply;
+	bool enable = !measurement_wanted(csc);
+
+	stream = notify_stream_acquire(msg, stream_closed, csc, &reply);
+	if (stream == NULL)
+		return reply;
+
+	csc->streams = g_slist_prepend(csc->streams, stream);
+
+	if (enable)
+		enable_measurement(csc, NULL);
+
+	DBG("cycling stream acquired by %s", dbus_message_get_sender(msg));
+
+	return reply;
+}
+
 static const GDBusMethodTable cyclingspeed_device_methods[] = {
 	{ GDBUS_ASYNC_METHOD("SetCumulativeWheelRevolutions",
 				GDBUS_ARGS({ "value", "u" }), NULL,
 						set_cumulative_wheel_rev) },
+	{ GDBUS_METHOD("AcquireMeasurement",
+			GDBUS_ARGS({ "options", "a{sv}" }),
+			GDBUS_ARGS({ "fd", "h" }), acquire_measurement) },
 	{ }
 };
 
@@ -38,6 +38,7 @@
 #include "src/shared/util.h"
 #include "src/service.h"
 #include "src/error.h"
+#include "src/notify-stream.h"
 #include "attrib/gattrib.h"
 #include "attrib/att.h"
 #include "attrib/gatt.h"
@@ -74,6 +75,8 @@ struct heartrate {
 
 	gboolean			has_location;
 	uint8_t				location;
+
+	GSList				*streams;
 };
 
 struct watcher {
@@ -202,11 +205,19 @@ static void destroy_heartrate(gpointer user_data)
 		g_attrib_unref(hr->attrib);
 	}
 
+	g_slist_free_full(hr->streams,
+				(GDestroyNotify) notify_stream_free);
+
 	btd_device_unref(hr->dev);
 	g_free(hr->svc_range);
 	g_free(hr);
 }
 
+static bool measurement_wanted(struct heartrate *hr)
+{
+	return hr->hradapter->watchers != NULL || hr->streams != NULL;
+}
+
 static void remove_watcher(gpointer user_data)
 {
 	struct watcher *watcher = user_data;
@@ -381,6 +392,7 @@ static void process_measurement(struct heartrate *hr, const uint8_t *pdu,
 static void notify_handler(const uint8_t *pdu, uint16_t len, gpointer user_data)
 {
 	struct heartrate *hr = user_data;
+	GSList *l;
 
 	/* should be at least opcode (1b) + handle (2b) */
 	if (len < 3) {
@@ -388,7 +400,12 @@ static void notify_handler(const uint8_t *pdu, uint16_t len, gpointer user_data)
 		return;
 	}
 
-	process_measurement(hr, pdu + 3, len - 3);
+	/* Streams get the characteristic value as is */
+	for (l = hr->streams; l; l = l->next)
+		notify_stream_send(l->data, pdu + 3, len - 3);
+
+	if (hr->hradapter->watchers != NULL)
+		process_measurement(hr, pdu + 3, len - 3);
 }
 
 static void discover_ccc_cb(uint8_t status, GSList *descs, void *user_data)
@@ -409,7 +426,7 @@ static void discover_ccc_cb(uint8_t status, GSList *descs, void *user_data)
 
 	hr->measurement_ccc_handle = desc->handle;
 
-	if (g_slist_length(hr->hradapter->watchers) == 0) {
+	if (!measurement_wanted(hr)) {
 		put_le16(0x0000, attr_val);
 		msg = g_strdup("Disable measurement");
 	} else {
@@ -504,7 +521,7 @@ static void disable_measurement(gpointer data, gpointer user_data)
 	uint8_t value[2];
 	char *msg;
 
-	if (hr->attrib == NULL || !handle)
+	if (hr->attrib == NULL || !handle || hr->streams != NULL)
 		return;
 
 	put_le16(0x0000, value);
@@ -691,8 +708,44 @@ static DBusMessage *hrcp_reset(DBusConnection *conn, DBusMessage *msg,
 	return dbus_message_new_method_return(msg);
 }
 
+static void stream_closed(struct notify_stream *stream, void *user_data)
+{
+	struct heartrate *hr = user_data;
+
+	hr->streams = g_slist_remove(hr->streams, stream);
+	notify_stream_free(stream);
+
+	if (!measurement_wanted(hr))
+		disable_measurement(hr, NULL);
+}
+
+static DBusMessage *acquire_measurement(DBusConnection *conn,
+						DBusMessage *msg, void *data)
+{
+	struct heartrate *hr = data;
+	struct notify_stream *stream;
+	DBusMessage *reply;
+	bool enable = !measurement_wanted(hr);
+
+	stream = notify_stream_acquire(msg, stream_closed, hr, &reply);
+	if (stream == NULL)
+		return reply;
+
+	hr->streams = g_slist_prepend(hr->streams, stream);
+
+	if (enable)
+		enable_measurement(hr, NULL);
+
+	DBG("heartrate stream acquired by %s", dbus_message_get_sender(msg));
+
+	return reply;
+}
+
 static const GDBusMethodTable heartrate_device_methods[] = {
 	{ GDBUS_METHOD("Reset", NULL, NULL, hrcp_reset) },
+	{ GDBUS_METHOD("AcquireMeasurement",
+			GDBUS_ARGS({ "options", "a{sv}" }),
+			GDBUS_ARGS({ "fd", "h" }), acquire_measurement) },
 	{ }
 };
 
@@ -69,6 +69,8 @@
 #include "attrib/gatt.h"
 #include "attrib-server.h"
 #include "eir.h"
+#include "discovery-report.h"
+#include "trace.h"
 
 #define ADAPTER_INTERFACE	"org.bluez.Adapter1"
 
@@ -130,6 +132,7 @@ struct watch_client {
 	struct btd_adapter *adapter;
 	char *owner;
 	guint watch;
+	struct discovery_report *report;
 };
 
 struct service_auth {
@@ -387,6 +390,7 @@ static void store_adapter_info(struct btd_adapter *adapter)
 	char *str;
 	gsize length = 0;
 	gboolean discoverable;
+	uint64_t start;
 
 	key_file = g_key_file_new();
 
@@ -419,7 +423,10 @@ static void store_adapter_info(struct btd_adapter *adapter)
 	create_file(filename, S_IRUSR | S_IWUSR);
 
 	str = g_key_file_to_data(key_file, &length, NULL);
+	start = btd_trace_begin();
 	g_file_set_contents(filename, str, length, NULL);
+	btd_trace_end(start, BTD_TRACE_STORAGE_WRITE,
+				btd_adapter_get_index(adapter), length, 0, 0);
 	g_free(str);
 
 	g_key_file_free(key_file);
@@ -1572,6 +1579,42 @@ static int compare_sender(gconstpointer a, gconstpointer b)
 	return g_strcmp0(client->owner, sender);
 }
 
+/*
+ * Clients using StartDiscoveryReports get found devices batched to their
+ * reporter and don't need device objects for every advertiser in range.
+ */
+static bool discovery_has_sessions(struct btd_adapter *adapter)
+{
+	GSList *l;
+
+	for (l = adapter->discovery_list; l; l = l->next) {
+		struct watch_client *client = l->data;
+
+		if (!client->report)
+			return true;
+	}
+
+	return false;
+}
+
+static void report_found_device(struct btd_adapter *adapter,
+					const bdaddr_t *bdaddr,
+					uint8_t bdaddr_type, int8_t rssi,
+					const struct eir_data *eir,
+					struct btd_device *dev)
+{
+	const char *path = dev ? device_get_path(dev) : NULL;
+	GSList *l;
+
+	for (l = adapter->discovery_list; l; l = l->next) {
+		struct watch_client *client = l->data;
+
+		if (client->report)
+			discovery_report_device(client->report, bdaddr,
+						bdaddr_type, rssi, eir, path);
+	}
+}
+
 static void invalidate_rssi(gpointer a)
 {
 	struct btd_device *dev = a;
@@ -1616,6 +1659,9 @@ static void discovery_destroy(void *user_data)
 	adapter->discovery_list = g_slist_remove(adapter->discovery_list,
 								client);
 
+	if (client->report)
+		discovery_report_free(client->report);
+
 	g_free(client->owner);
 	g_free(client);
 
@@ -1685,12 +1731,13 @@ static void discovery_disconnect(DBusConnection *conn, void *user_data)
 				stop_discovery_complete, adapter, NULL);
 }
 
-static DBusMessage *start_discovery(DBusConnection *conn,
-					DBusMessage *msg, void *user_data)
+static DBusMessage *add_discovery_client(struct btd_adapter *adapter,
+							DBusMessage *msg,
+							bool report)
 {
-	struct btd_adapter *adapter = user_data;
 	const char *sender = dbus_message_get_sender(msg);
 	struct watch_client *client;
+	DBusMessage *reply = NULL;
 	GSList *list;
 
 	DBG("sender %s", sender);
@@ -1709,6 +1756,14 @@ static DBusMessage *start_discovery(DBusConnection *conn,
 
 	client = g_new0(struct watch_client, 1);
 
+	if (report) {
+		client->report = discovery_report_new(msg, &reply);
+		if (!client->report) {
+			g_free(client);
+			return reply;
+		}
+	}
+
 	client->adapter = adapter;
 	client->owner = g_strdup(sender);
 	client->watch = g_dbus_add_disconnect_watch(dbus_conn, sender,
@@ -1728,6 +1783,18 @@ static DBusMessage *start_discovery(DBusConnection *conn,
 	return dbus_message_new_method_return(msg);
 }
 
+static DBusMessage *start_discovery(DBusConnection *conn,
+					DBusMessage *msg, void *user_data)
+{
+	return add_discovery_client(user_data, msg, false);
+}
+
+static DBusMessage *start_discovery_reports(DBusConnection *conn,
+					DBusMessage *msg, void *user_data)
+{
+	return add_discovery_client(user_data, msg, true);
+}
+
 static DBusMessage *stop_discovery(DBusConnection *conn,
 					DBusMessage *msg, void *user_data)
 {
@@ -2239,6 +2306,9 @@ static DBusMessage *remove_device(DBusConnection *conn,
 
 static const GDBusMethodTable adapter_methods[] = {
 	{ GDBUS_METHOD("StartDiscovery", NULL, NULL, start_discovery) },
+	{ GDBUS_METHOD("StartDiscoveryReports",
+			GDBUS_ARGS({ "reporter", "o" }, { "options", "a{sv}" }),
+			NULL, start_discovery_reports) },
 	{ GDBUS_METHOD("StopDiscovery", NULL, NULL, stop_discovery) },
 	{ GDBUS_ASYNC_METHOD("RemoveDevice",
 			GDBUS_ARGS({ "device", "o" }), NULL, remove_device) },
@@ -4411,13 +4481,18 @@ static void update_found_devices(struct btd_adapter *adapter,
 	ba2str(bdaddr, addr);
 
 	dev = btd_adapter_find_device(adapter, bdaddr, bdaddr_type);
+
+	if (adapter->discovery_list && (dev || discoverable))
+		report_found_device(adapter, bdaddr, bdaddr_type, rssi,
+							&eir_data, dev);
+
 	if (!dev) {
 		/*
-		 * If no client has requested discovery or the device is
-		 * not marked as discoverable, then do not create new
-		 * device objects.
+		 * If no client has requested regular discovery or the
+		 * device is not marked as discoverable, then do not create
+		 * new device objects.
 		 */
-		if (!adapter->discovery_list || !discoverable) {
+		if (!discovery_has_sessions(adapter) || !discoverable) {
 			eir_data_free(&eir_data);
 			return;
 		}
@@ -4447,10 +4522,10 @@ static void update_found_devices(struct btd_adapter *adapter,
 		device_store_cached_name(dev, eir_data.name);
 
 	/*
-	 * If no client has requested discovery, then only update
+	 * If no client has requested regular discovery, then only update
 	 * already paired devices (skip temporary ones).
 	 */
-	if (device_is_temporary(dev) && !adapter->discovery_list) {
+	if (device_is_temporary(dev) && !discovery_has_sessions(adapter)) {
 		eir_data_free(&eir_data);
 		return;
 	}
@@ -5593,6 +5668,7 @@ static void store_link_key(struct btd_adapter *adapter,
 	char key_str[33];
 	char *str;
 	int i;
+	uint64_t start;
 
 	ba2str(btd_adapter_get_address(adapter), adapter_addr);
 	ba2str(device_get_address(device), device_addr);
@@ -5615,7 +5691,10 @@ static void store_link_key(struct btd_adapter *adapter,
 	create_file(filename, S_IRUSR | S_IWUSR);
 
 	str = g_key_file_to_data(key_file, &length, NULL);
+	start = btd_trace_begin();
 	g_file_set_contents(filename, str, length, NULL);
+	btd_trace_end(start, BTD_TRACE_STORAGE_WRITE,
+				btd_adapter_get_index(adapter), length, 0, 0);
 	g_free(str);
 
 	g_key_file_free(key_file);
@@ -5682,6 +5761,7 @@ static void store_longtermkey(const bdaddr_t *local, const bdaddr_t *peer,
 	gsize length = 0;
 	char *str;
 	int i;
+	uint64_t start;
 
 	if (master != 0x00 && master != 0x01) {
 		error("Unsupported LTK type %u", master);
@@ -5716,7 +5796,10 @@ static void store_longtermkey(const bdaddr_t *local, const bdaddr_t *peer,
 	create_file(filename, S_IRUSR | S_IWUSR);
 
 	str = g_key_file_to_data(key_file, &length, NULL);
+	start = btd_trace_begin();
 	g_file_set_contents(filename, str, length, NULL);
+	btd_trace_end(start, BTD_TRACE_STORAGE_WRITE,
+				BTD_TRACE_INDEX_NONE, length, 0, 0);
 	g_free(str);
 
 	g_key_file_free(key_file);
@@ -5800,6 +5883,7 @@ static void store_csrk(const bdaddr_t *local, const bdaddr_t *peer,
 	gsize length = 0;
 	char *str;
 	int i;
+	uint64_t start;
 
 	if (master == 0x00)
 		group = "LocalSignatureKey";
@@ -5827,7 +5911,10 @@ static void store_csrk(const bdaddr_t *local, const bdaddr_t *peer,
 	create_file(filename, S_IRUSR | S_IWUSR);
 
 	str = g_key_file_to_data(key_file, &length, NULL);
+	start = btd_trace_begin();
 	g_file_set_contents(filename, str, length, NULL);
+	btd_trace_end(start, BTD_TRACE_STORAGE_WRITE,
+				BTD_TRACE_INDEX_NONE, length, 0, 0);
 	g_free(str);
 
 	g_key_file_free(key_file);
@@ -5881,6 +5968,7 @@ static void store_irk(struct btd_adapter *adapter, const bdaddr_t *peer,
 	char str[33];
 	size_t length = 0;
 	int i;
+	uint64_t start;
 
 	ba2str(&adapter->bdaddr, adapter_addr);
 	ba2str(peer, device_addr);
@@ -5900,7 +5988,10 @@ static void store_irk(struct btd_adapter *adapter, const bdaddr_t *peer,
 	create_file(filename, S_IRUSR | S_IWUSR);
 
 	store_data = g_key_file_to_data(key_file, &length, NULL);
+	start = btd_trace_begin();
 	g_file_set_contents(filename, store_data, length, NULL);
+	btd_trace_end(start, BTD_TRACE_STORAGE_WRITE,
+				btd_adapter_get_index(adapter), length, 0, 0);
 	g_free(store_data);
 
 	g_key_file_free(key_file);
@@ -6921,6 +7012,17 @@ static void mgmt_debug(const char *str, void *user_data)
 	info("%s%s", prefix, str);
 }
 
+static void mgmt_trace(uint16_t event, uint16_t opcode, uint16_t index,
+				uint8_t status, uint16_t length, uint32_t usec,
+				void *user_data)
+{
+	if (event == MGMT_EV_CMD_COMPLETE || event == MGMT_EV_CMD_STATUS)
+		btd_trace_latency(BTD_TRACE_MGMT_COMMAND, index, usec,
+						opcode, status, length);
+	else
+		btd_trace(BTD_TRACE_MGMT_EVENT, index, event, length, 0);
+}
+
 int adapter_init(void)
 {
 	dbus_conn = btd_get_dbus_connection();
@@ -6934,6 +7036,8 @@ int adapter_init(void)
 	if (getenv("MGMT_DEBUG"))
 		mgmt_set_debug(mgmt_master, mgmt_debug, "mgmt: ", NULL);
 
+	mgmt_set_trace(mgmt_master, mgmt_trace, NULL);
+
 	DBG("sending read version command");
 
 	if (mgmt_send(mgmt_master, MGMT_OP_READ_VERSION,
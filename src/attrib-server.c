@@ -50,6 +50,7 @@
 #include "attrib/att-database.h"
 #include "textfile.h"
 #include "storage.h"
+#include "trace.h"
 
 #include "attrib-server.h"
 
@@ -61,10 +62,24 @@ struct gatt_server {
 	GIOChannel *le_io;
 	uint32_t gatt_sdp_handle;
 	uint32_t gap_sdp_handle;
-	GList *database;
+	GPtrArray *database;	/* sorted by handle */
 	GSList *clients;
 	uint16_t name_handle;
 	uint16_t appearance_handle;
+	GHashTable *ccc;
+	guint ccc_flush_id;
+};
+
+/*
+ * Client Characteristic Configuration values of all known peers, indexed
+ * by handle. The ccc files are read once when the index is first used and
+ * modified entries are written back from an idle callback.
+ */
+struct ccc_sub {
+	bdaddr_t bdaddr;
+	uint8_t bdaddr_type;
+	uint16_t value;
+	bool dirty;
 };
 
 struct gatt_channel {
@@ -128,9 +143,264 @@ static void channel_free(struct gatt_channel *channel)
 	g_free(channel);
 }
 
+static void ccc_list_free(gpointer key, gpointer value, gpointer user_data)
+{
+	g_slist_free_full(value, g_free);
+}
+
+static struct ccc_sub *ccc_find(struct gatt_server *server, uint16_t handle,
+				const bdaddr_t *bdaddr, uint8_t bdaddr_type)
+{
+	GSList *l;
+
+	l = g_hash_table_lookup(server->ccc, GUINT_TO_POINTER(handle));
+	for (; l; l = g_slist_next(l)) {
+		struct ccc_sub *sub = l->data;
+
+		if (sub->bdaddr_type == bdaddr_type &&
+					bacmp(&sub->bdaddr, bdaddr) == 0)
+			return sub;
+	}
+
+	return NULL;
+}
+
+static struct ccc_sub *ccc_set(struct gatt_server *server,
+					struct btd_device *device,
+					uint16_t handle, uint16_t value)
+{
+	const bdaddr_t *bdaddr = device_get_address(device);
+	uint8_t bdaddr_type = btd_device_get_bdaddr_type(device);
+	struct ccc_sub *sub;
+	GSList *l;
+
+	sub = ccc_find(server, handle, bdaddr, bdaddr_type);
+	if (!sub) {
+		sub = g_new0(struct ccc_sub, 1);
+		bacpy(&sub->bdaddr, bdaddr);
+		sub->bdaddr_type = bdaddr_type;
+
+		l = g_hash_table_lookup(server->ccc, GUINT_TO_POINTER(handle));
+		l = g_slist_prepend(l, sub);
+		g_hash_table_replace(server->ccc, GUINT_TO_POINTER(handle), l);
+	}
+
+	sub->value = value;
+
+	return sub;
+}
+
+static void load_device_ccc(struct btd_device *device, void *user_data)
+{
+	struct gatt_server *server = user_data;
+	GKeyFile *key_file;
+	char *filename;
+	char **groups, **group;
+
+	filename = btd_device_get_storage_path(device, "ccc");
+	if (!filename)
+		return;
+
+	key_file = g_key_file_new();
+
+	if (!g_key_file_load_from_file(key_file, filename, 0, NULL))
+		goto done;
+
+	groups = g_key_file_get_groups(key_file, NULL);
+
+	for (group = groups; *group; group++) {
+		unsigned int handle, config;
+		char *str;
+
+		if (sscanf(*group, "%u", &handle) != 1 || handle > UINT16_MAX)
+			continue;
+
+		str = g_key_file_get_string(key_file, *group, "Value", NULL);
+		if (str && sscanf(str, "%04X", &config) == 1)
+			ccc_set(server, device, handle, config);
+
+		g_free(str);
+	}
+
+	g_strfreev(groups);
+
+done:
+	g_key_file_free(key_file);
+	g_free(filename);
+}
+
+static GHashTable *ccc_index(struct gatt_server *server)
+{
+	if (server->ccc)
+		return server->ccc;
+
+	/* Lists change in place, replacing one must not free it */
+	server->ccc = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	btd_adapter_for_each_device(server->adapter, load_device_ccc, server);
+
+	DBG("%u CCC handles in use", g_hash_table_size(server->ccc));
+
+	return server->ccc;
+}
+
+/* The ccc file of one device, written once per flush */
+struct ccc_file {
+	bdaddr_t bdaddr;
+	uint8_t bdaddr_type;
+	char *filename;
+	GKeyFile *key_file;
+};
+
+static struct ccc_file *ccc_file_get(struct gatt_server *server,
+					GSList **files, const struct ccc_sub *sub)
+{
+	struct btd_device *device;
+	struct ccc_file *file;
+	char *filename;
+	GSList *l;
+
+	for (l = *files; l; l = g_slist_next(l)) {
+		file = l->data;
+
+		if (file->bdaddr_type == sub->bdaddr_type &&
+				bacmp(&file->bdaddr, &sub->bdaddr) == 0)
+			return file;
+	}
+
+	device = btd_adapter_find_device(server->adapter, &sub->bdaddr,
+							sub->bdaddr_type);
+	if (!device)
+		return NULL;
+
+	filename = btd_device_get_storage_path(device, "ccc");
+	if (!filename) {
+		warn("Unable to get ccc storage path for device");
+		return NULL;
+	}
+
+	file = g_new0(struct ccc_file, 1);
+	bacpy(&file->bdaddr, &sub->bdaddr);
+	file->bdaddr_type = sub->bdaddr_type;
+	file->filename = filename;
+	file->key_file = g_key_file_new();
+	g_key_file_load_from_file(file->key_file, filename, 0, NULL);
+
+	*files = g_slist_prepend(*files, file);
+
+	return file;
+}
+
+static void ccc_file_store(gpointer data, gpointer user_data)
+{
+	struct ccc_file *file = data;
+	struct gatt_server *server = user_data;
+	char *str;
+	gsize length = 0;
+	uint64_t start;
+
+	str = g_key_file_to_data(file->key_file, &length, NULL);
+	if (length > 0) {
+		create_file(file->filename, S_IRUSR | S_IWUSR);
+		start = btd_trace_begin();
+		g_file_set_contents(file->filename, str, length, NULL);
+		btd_trace_end(start, BTD_TRACE_STORAGE_WRITE,
+			btd_adapter_get_index(server->adapter), length, 0, 0);
+	}
+
+	g_free(str);
+	g_free(file->filename);
+	g_key_file_free(file->key_file);
+	g_free(file);
+}
+
+static gboolean ccc_flush(gpointer user_data)
+{
+	struct gatt_server *server = user_data;
+	GHashTableIter iter;
+	gpointer key, value;
+	GSList *files = NULL;
+
+	server->ccc_flush_id = 0;
+
+	g_hash_table_iter_init(&iter, server->ccc);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		GSList *l;
+
+		for (l = value; l; l = g_slist_next(l)) {
+			struct ccc_sub *sub = l->data;
+			struct ccc_file *file;
+			char group[6], str[5];
+
+			if (!sub->dirty)
+				continue;
+
+			sub->dirty = false;
+
+			file = ccc_file_get(server, &files, sub);
+			if (!file)
+				continue;
+
+			sprintf(group, "%hu", GPOINTER_TO_UINT(key));
+			sprintf(str, "%hX", sub->value);
+			g_key_file_set_string(file->key_file, group, "Value",
+									str);
+		}
+	}
+
+	g_slist_foreach(files, ccc_file_store, server);
+	g_slist_free(files);
+
+	return FALSE;
+}
+
+static void ccc_remove_device(struct gatt_server *server,
+				const bdaddr_t *bdaddr, uint8_t bdaddr_type)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	if (!server->ccc)
+		return;
+
+	g_hash_table_iter_init(&iter, server->ccc);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		GSList *l, *next;
+
+		for (l = value; l; l = next) {
+			struct ccc_sub *sub = l->data;
+
+			next = g_slist_next(l);
+
+			if (sub->bdaddr_type != bdaddr_type ||
+					bacmp(&sub->bdaddr, bdaddr))
+				continue;
+
+			value = g_slist_delete_link(value, l);
+			g_free(sub);
+		}
+
+		/* The list head may have changed, leave the table in sync */
+		if (value)
+			g_hash_table_iter_replace(&iter, value);
+		else
+			g_hash_table_iter_remove(&iter);
+	}
+}
+
 static void gatt_server_free(struct gatt_server *server)
 {
-	g_list_free_full(server->database, attrib_free);
+	if (server->ccc_flush_id) {
+		g_source_remove(server->ccc_flush_id);
+		ccc_flush(server);
+	}
+
+	if (server->ccc) {
+		g_hash_table_foreach(server->ccc, ccc_list_free, NULL);
+		g_hash_table_destroy(server->ccc);
+	}
+
+	g_ptr_array_free(server->database, TRUE);
 
 	if (server->l2cap_io != NULL) {
 		g_io_channel_shutdown(server->l2cap_io, FALSE, NULL);
@@ -247,38 +517,65 @@ static sdp_record_t *server_record_new(uuid_t *uuid, uint16_t start, uint16_t en
 	return record;
 }
 
-static int handle_cmp(gconstpointer a, gconstpointer b)
+#define db_attr(server, i) \
+	((struct attribute *) g_ptr_array_index((server)->database, (i)))
+
+/* Index of the first attribute whose handle isn't lower than handle */
+static unsigned int db_lookup(struct gatt_server *server, uint16_t handle)
 {
-	const struct attribute *attrib = a;
-	uint16_t handle = GPOINTER_TO_UINT(b);
+	unsigned int lo = 0, hi = server->database->len;
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
 
-	return attrib->handle - handle;
+		if (db_attr(server, mid)->handle < handle)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
 }
 
-static int attribute_cmp(gconstpointer a1, gconstpointer a2)
+static struct attribute *db_find(struct gatt_server *server, uint16_t handle)
 {
-	const struct attribute *attrib1 = a1;
-	const struct attribute *attrib2 = a2;
+	unsigned int i = db_lookup(server, handle);
+
+	if (i < server->database->len && db_attr(server, i)->handle == handle)
+		return db_attr(server, i);
+
+	return NULL;
+}
+
+static void db_insert(struct gatt_server *server, unsigned int i,
+							struct attribute *a)
+{
+	GPtrArray *database = server->database;
+
+	g_ptr_array_add(database, NULL);
 
-	return attrib1->handle - attrib2->handle;
+	memmove(&database->pdata[i + 1], &database->pdata[i],
+				(database->len - 1 - i) * sizeof(gpointer));
+	database->pdata[i] = a;
 }
 
 static struct attribute *find_svc_range(struct gatt_server *server,
 					uint16_t start, uint16_t *end)
 {
 	struct attribute *attrib;
-	guint h = start;
-	GList *l;
+	unsigned int i;
 
 	if (end == NULL)
 		return NULL;
 
-	l = g_list_find_custom(server->database, GUINT_TO_POINTER(h),
-								handle_cmp);
-	if (!l)
+	i = db_lookup(server, start);
+	if (i == server->database->len)
 		return NULL;
 
-	attrib = l->data;
+	attrib = db_attr(server, i);
+
+	if (attrib->handle != start)
+		return NULL;
 
 	if (bt_uuid_cmp(&attrib->uuid, &prim_uuid) != 0 &&
 			bt_uuid_cmp(&attrib->uuid, &snd_uuid) != 0)
@@ -286,8 +583,8 @@ static struct attribute *find_svc_range(struct gatt_server *server,
 
 	*end = start;
 
-	for (l = l->next; l; l = l->next) {
-		struct attribute *a = l->data;
+	for (i++; i < server->database->len; i++) {
+		struct attribute *a = db_attr(server, i);
 
 		if (bt_uuid_cmp(&a->uuid, &prim_uuid) == 0 ||
 				bt_uuid_cmp(&a->uuid, &snd_uuid) == 0)
@@ -350,12 +647,12 @@ static struct attribute *attrib_db_add_new(struct gatt_server *server,
 				const uint8_t *value, size_t len)
 {
 	struct attribute *a;
-	guint h = handle;
+	unsigned int i;
 
 	DBG("handle=0x%04x", handle);
 
-	if (g_list_find_custom(server->database, GUINT_TO_POINTER(h),
-								handle_cmp))
+	i = db_lookup(server, handle);
+	if (i < server->database->len && db_attr(server, i)->handle == handle)
 		return NULL;
 
 	a = g_new0(struct attribute, 1);
@@ -366,8 +663,7 @@ static struct attribute *attrib_db_add_new(struct gatt_server *server,
 	a->read_req = read_req;
 	a->write_req = write_req;
 
-	server->database = g_list_insert_sorted(server->database, a,
-								attribute_cmp);
+	db_insert(server, i, a);
 
 	return a;
 }
@@ -414,7 +710,8 @@ static uint16_t read_by_group(struct gatt_channel *channel, uint16_t start,
 	struct attribute *a;
 	struct group_elem *cur, *old = NULL;
 	GSList *l, *groups;
-	GList *dl, *database;
+	GPtrArray *database = channel->server->database;
+	unsigned int n, num = 0, max = 0;
 	uint16_t length, last_handle, last_size = 0;
 	uint8_t status;
 	int i;
@@ -434,13 +731,10 @@ static uint16_t read_by_group(struct gatt_channel *channel, uint16_t start,
 					ATT_ECODE_UNSUPP_GRP_TYPE, pdu, len);
 
 	last_handle = end;
-	database = channel->server->database;
-	for (dl = database, groups = NULL, cur = NULL; dl; dl = dl->next) {
+	n = db_lookup(channel->server, start);
+	for (groups = NULL, cur = NULL; n < database->len; n++) {
 
-		a = dl->data;
-
-		if (a->handle < start)
-			continue;
+		a = g_ptr_array_index(database, n);
 
 		if (a->handle >= end)
 			break;
@@ -459,7 +753,8 @@ static uint16_t read_by_group(struct gatt_channel *channel, uint16_t start,
 			continue;
 		}
 
-		if (last_size && (last_size != a->len))
+		/* Stop at a new group once the response is full */
+		if (last_size && (last_size != a->len || num == max))
 			break;
 
 		status = att_check_reqs(channel, ATT_OP_READ_BY_GROUP_REQ,
@@ -482,6 +777,10 @@ static uint16_t read_by_group(struct gatt_channel *channel, uint16_t start,
 
 		/* Attribute Grouping Type found */
 		groups = g_slist_append(groups, cur);
+		num++;
+
+		if (last_size == 0)
+			max = (len - 2) / (a->len + 4);
 
 		last_size = a->len;
 		old = cur;
@@ -492,7 +791,7 @@ static uint16_t read_by_group(struct gatt_channel *channel, uint16_t start,
 		return enc_error_resp(ATT_OP_READ_BY_GROUP_REQ, start,
 					ATT_ECODE_ATTR_NOT_FOUND, pdu, len);
 
-	if (dl == NULL)
+	if (n == database->len)
 		cur->end = a->handle;
 	else
 		cur->end = last_handle;
@@ -533,7 +832,8 @@ static uint16_t read_by_type(struct gatt_channel *channel, uint16_t start,
 {
 	struct att_data_list *adl;
 	GSList *l, *types;
-	GList *dl, *database;
+	GPtrArray *database = channel->server->database;
+	unsigned int n, max = 0;
 	struct attribute *a;
 	uint16_t num, length;
 	uint8_t status;
@@ -543,13 +843,10 @@ static uint16_t read_by_type(struct gatt_channel *channel, uint16_t start,
 		return enc_error_resp(ATT_OP_READ_BY_TYPE_REQ, start,
 					ATT_ECODE_INVALID_HANDLE, pdu, len);
 
-	database = channel->server->database;
-	for (dl = database, length = 0, types = NULL; dl; dl = dl->next) {
+	n = db_lookup(channel->server, start);
+	for (length = 0, num = 0, types = NULL; n < database->len; n++) {
 
-		a = dl->data;
-
-		if (a->handle < start)
-			continue;
+		a = g_ptr_array_index(database, n);
 
 		if (a->handle > end)
 			break;
@@ -557,6 +854,10 @@ static uint16_t read_by_type(struct gatt_channel *channel, uint16_t start,
 		if (bt_uuid_cmp(&a->uuid, uuid)  != 0)
 			continue;
 
+		/* No need to read values that don't fit in the response */
+		if (num > 0 && num == max)
+			break;
+
 		status = att_check_reqs(channel, ATT_OP_READ_BY_TYPE_REQ,
 								a->read_req);
 
@@ -571,20 +872,20 @@ static uint16_t read_by_type(struct gatt_channel *channel, uint16_t start,
 		}
 
 		/* All elements must have the same length */
-		if (length == 0)
+		if (length == 0) {
 			length = a->len;
-		else if (a->len != length)
+			max = (len - 2) / MIN(len - 2, length + 2);
+		} else if (a->len != length)
 			break;
 
 		types = g_slist_append(types, a);
+		num++;
 	}
 
 	if (types == NULL)
 		return enc_error_resp(ATT_OP_READ_BY_TYPE_REQ, start,
 					ATT_ECODE_ATTR_NOT_FOUND, pdu, len);
 
-	num = g_slist_length(types);
-
 	/* Handle length plus attribute value length */
 	length += 2;
 
@@ -622,7 +923,8 @@ static uint16_t find_info(struct gatt_channel *channel, uint16_t start,
 	struct attribute *a;
 	struct att_data_list *adl;
 	GSList *l, *info;
-	GList *dl, *database;
+	GPtrArray *database = channel->server->database;
+	unsigned int n, max = 0;
 	uint8_t format, last_type = BT_UUID_UNSPEC;
 	uint16_t length, num;
 	int i;
@@ -631,20 +933,19 @@ static uint16_t find_info(struct gatt_channel *channel, uint16_t start,
 		return enc_error_resp(ATT_OP_FIND_INFO_REQ, start,
 					ATT_ECODE_INVALID_HANDLE, pdu, len);
 
-	database = channel->server->database;
-	for (dl = database, info = NULL, num = 0; dl; dl = dl->next) {
-		a = dl->data;
-
-		if (a->handle < start)
-			continue;
+	n = db_lookup(channel->server, start);
+	for (info = NULL, num = 0; n < database->len; n++) {
+		a = g_ptr_array_index(database, n);
 
 		if (a->handle > end)
 			break;
 
-		if (last_type == BT_UUID_UNSPEC)
+		if (last_type == BT_UUID_UNSPEC) {
 			last_type = a->uuid.type;
+			max = (len - 2) / (bt_uuid_len(&a->uuid) + 2);
+		}
 
-		if (a->uuid.type != last_type)
+		if (a->uuid.type != last_type || num == max)
 			break;
 
 		info = g_slist_append(info, a);
@@ -704,7 +1005,8 @@ static uint16_t find_by_type(struct gatt_channel *channel, uint16_t start,
 	struct attribute *a;
 	struct att_range *range;
 	GSList *matches;
-	GList *dl, *database;
+	GPtrArray *database = channel->server->database;
+	unsigned int n, num = 0;
 	uint16_t len;
 
 	if (start > end || start == 0x0000)
@@ -712,12 +1014,9 @@ static uint16_t find_by_type(struct gatt_channel *channel, uint16_t start,
 					ATT_ECODE_INVALID_HANDLE, opdu, mtu);
 
 	/* Searching first requested handle number */
-	database = channel->server->database;
-	for (dl = database, matches = NULL, range = NULL; dl; dl = dl->next) {
-		a = dl->data;
-
-		if (a->handle < start)
-			continue;
+	n = db_lookup(channel->server, start);
+	for (matches = NULL, range = NULL; n < database->len; n++) {
+		a = g_ptr_array_index(database, n);
 
 		if (a->handle > end)
 			break;
@@ -726,6 +1025,10 @@ static uint16_t find_by_type(struct gatt_channel *channel, uint16_t start,
 		if ((bt_uuid_cmp(&a->uuid, uuid) == 0) && (a->len == vlen) &&
 					(memcmp(a->data, value, vlen) == 0)) {
 
+			/* Response full, the last range is complete */
+			if (num == (mtu - 1) / 4)
+				break;
+
 			range = g_new0(struct att_range, 1);
 			range->start = a->handle;
 			/* It is allowed to have end group handle the same as
@@ -733,6 +1036,7 @@ static uint16_t find_by_type(struct gatt_channel *channel, uint16_t start,
 			range->end = a->handle;
 
 			matches = g_slist_append(matches, range);
+			num++;
 		} else if (range) {
 			/* Update the last found handle or reset the pointer
 			 * to track that a new group started: Primary or
@@ -756,38 +1060,22 @@ static uint16_t find_by_type(struct gatt_channel *channel, uint16_t start,
 	return len;
 }
 
-static int read_device_ccc(struct btd_device *device, uint16_t handle,
+static int read_device_ccc(struct gatt_server *server,
+				struct btd_device *device, uint16_t handle,
 				uint16_t *value)
 {
-	char *filename;
-	GKeyFile *key_file;
-	char group[6];
-	char *str;
-	unsigned int config;
-	int err = 0;
-
-	filename = btd_device_get_storage_path(device, "ccc");
-	if (!filename) {
-		warn("Unable to get ccc storage path for device");
-		return -ENOENT;
-	}
+	struct ccc_sub *sub;
 
-	key_file = g_key_file_new();
-	g_key_file_load_from_file(key_file, filename, 0, NULL);
+	ccc_index(server);
 
-	sprintf(group, "%hu", handle);
-
-	str = g_key_file_get_string(key_file, group, "Value", NULL);
-	if (!str || sscanf(str, "%04X", &config) != 1)
-		err = -ENOENT;
-	else
-		*value = config;
+	sub = ccc_find(server, handle, device_get_address(device),
+					btd_device_get_bdaddr_type(device));
+	if (!sub)
+		return -ENOENT;
 
-	g_free(str);
-	g_free(filename);
-	g_key_file_free(key_file);
+	*value = sub->value;
 
-	return err;
+	return 0;
 }
 
 static uint16_t read_value(struct gatt_channel *channel, uint16_t handle,
@@ -795,20 +1083,16 @@ static uint16_t read_value(struct gatt_channel *channel, uint16_t handle,
 {
 	struct attribute *a;
 	uint8_t status;
-	GList *l;
 	uint16_t cccval;
-	guint h = handle;
 
-	l = g_list_find_custom(channel->server->database,
-					GUINT_TO_POINTER(h), handle_cmp);
-	if (!l)
+	a = db_find(channel->server, handle);
+	if (!a)
 		return enc_error_resp(ATT_OP_READ_REQ, handle,
 					ATT_ECODE_INVALID_HANDLE, pdu, len);
 
-	a = l->data;
-
 	if (bt_uuid_cmp(&ccc_uuid, &a->uuid) == 0 &&
-		read_device_ccc(channel->device, handle, &cccval) == 0) {
+		read_device_ccc(channel->server, channel->device, handle,
+							&cccval) == 0) {
 		uint8_t config[2];
 
 		put_le16(cccval, config);
@@ -832,24 +1116,20 @@ static uint16_t read_blob(struct gatt_channel *channel, uint16_t handle,
 {
 	struct attribute *a;
 	uint8_t status;
-	GList *l;
 	uint16_t cccval;
-	guint h = handle;
 
-	l = g_list_find_custom(channel->server->database,
-					GUINT_TO_POINTER(h), handle_cmp);
-	if (!l)
+	a = db_find(channel->server, handle);
+	if (!a)
 		return enc_error_resp(ATT_OP_READ_BLOB_REQ, handle,
 					ATT_ECODE_INVALID_HANDLE, pdu, len);
 
-	a = l->data;
-
 	if (a->len <= offset)
 		return enc_error_resp(ATT_OP_READ_BLOB_REQ, handle,
 					ATT_ECODE_INVALID_OFFSET, pdu, len);
 
 	if (bt_uuid_cmp(&ccc_uuid, &a->uuid) == 0 &&
-		read_device_ccc(channel->device, handle, &cccval) == 0) {
+		read_device_ccc(channel->server, channel->device, handle,
+							&cccval) == 0) {
 		uint8_t config[2];
 
 		put_le16(cccval, config);
@@ -875,17 +1155,12 @@ static uint16_t write_value(struct gatt_channel *channel, uint16_t handle,
 {
 	struct attribute *a;
 	uint8_t status;
-	GList *l;
-	guint h = handle;
 
-	l = g_list_find_custom(channel->server->database,
-					GUINT_TO_POINTER(h), handle_cmp);
-	if (!l)
+	a = db_find(channel->server, handle);
+	if (!a)
 		return enc_error_resp(ATT_OP_WRITE_REQ, handle,
 				ATT_ECODE_INVALID_HANDLE, pdu, len);
 
-	a = l->data;
-
 	status = att_check_reqs(channel, ATT_OP_WRITE_REQ, a->write_req);
 	if (status)
 		return enc_error_resp(ATT_OP_WRITE_REQ, handle, status, pdu,
@@ -904,12 +1179,9 @@ static uint16_t write_value(struct gatt_channel *channel, uint16_t handle,
 							status, pdu, len);
 		}
 	} else {
-		uint16_t cccval = get_le16(value);
+		struct gatt_server *server = channel->server;
+		struct ccc_sub *sub;
 		char *filename;
-		GKeyFile *key_file;
-		char group[6], value[5];
-		char *data;
-		gsize length = 0;
 
 		filename = btd_device_get_storage_path(channel->device, "ccc");
 		if (!filename) {
@@ -919,22 +1191,16 @@ static uint16_t write_value(struct gatt_channel *channel, uint16_t handle,
 						pdu, len);
 		}
 
-		key_file = g_key_file_new();
-		g_key_file_load_from_file(key_file, filename, 0, NULL);
+		g_free(filename);
 
-		sprintf(group, "%hu", handle);
-		sprintf(value, "%hX", cccval);
-		g_key_file_set_string(key_file, group, "Value", value);
+		ccc_index(server);
 
-		data = g_key_file_to_data(key_file, &length, NULL);
-		if (length > 0) {
-			create_file(filename, S_IRUSR | S_IWUSR);
-			g_file_set_contents(filename, data, length, NULL);
-		}
+		sub = ccc_set(server, channel->device, handle,
+							get_le16(value));
+		sub->dirty = true;
 
-		g_free(data);
-		g_free(filename);
-		g_key_file_free(key_file);
+		if (!server->ccc_flush_id)
+			server->ccc_flush_id = g_idle_add(ccc_flush, server);
 	}
 
 	return enc_write_resp(pdu);
@@ -992,9 +1258,13 @@ static void channel_handler(const uint8_t *ipdu, uint16_t len,
 	uint8_t status = 0;
 	size_t vlen;
 	uint8_t *value = g_attrib_get_buffer(channel->attrib, &vlen);
+	uint16_t index = btd_adapter_get_index(channel->server->adapter);
+	uint64_t received = btd_trace_begin();
 
 	DBG("op 0x%02x", ipdu[0]);
 
+	btd_trace(BTD_TRACE_ATT_IN, index, ipdu[0], len, 0);
+
 	if (len > vlen) {
 		error("Too much data on ATT socket");
 		status = ATT_ECODE_INVALID_PDU;
@@ -1114,6 +1384,8 @@ done:
 								channel->mtu);
 
 	g_attrib_send(channel->attrib, 0, opdu, length, NULL, NULL, NULL);
+
+	btd_trace_end(received, BTD_TRACE_ATT_OUT, index, opdu[0], length, 0);
 }
 
 GAttrib *attrib_from_device(struct btd_device *device)
@@ -1182,6 +1454,8 @@ guint attrib_channel_attach(GAttrib *attrib)
 	if (!device_is_bonded(device, bdaddr_type)) {
 		char *filename;
 
+		ccc_remove_device(server, &dst, bdaddr_type);
+
 		filename = btd_device_get_storage_path(device, "ccc");
 		if (filename) {
 			unlink(filename);
@@ -1364,6 +1638,7 @@ int btd_adapter_gatt_server_start(struct btd_adapter *adapter)
 
 	server = g_new0(struct gatt_server, 1);
 	server->adapter = btd_adapter_ref(adapter);
+	server->database = g_ptr_array_new_with_free_func(attrib_free);
 
 	addr = btd_adapter_get_address(server->adapter);
 
@@ -1421,6 +1696,46 @@ void btd_adapter_gatt_server_stop(struct btd_adapter *adapter)
 	gatt_server_free(server);
 }
 
+void attrib_remove_device(struct btd_adapter *adapter, const bdaddr_t *bdaddr,
+							uint8_t bdaddr_type)
+{
+	GSList *l;
+
+	l = g_slist_find_custom(servers, adapter, adapter_cmp);
+	if (l == NULL)
+		return;
+
+	ccc_remove_device(l->data, bdaddr, bdaddr_type);
+}
+
+void attrib_foreach_subscriber(struct btd_adapter *adapter, uint16_t handle,
+					uint16_t mask, attrib_ccc_func_t func,
+					void *user_data)
+{
+	struct gatt_server *server;
+	GSList *l;
+
+	l = g_slist_find_custom(servers, adapter, adapter_cmp);
+	if (l == NULL)
+		return;
+
+	server = l->data;
+
+	l = g_hash_table_lookup(ccc_index(server), GUINT_TO_POINTER(handle));
+	for (; l; l = g_slist_next(l)) {
+		struct ccc_sub *sub = l->data;
+		struct btd_device *device;
+
+		if (!(sub->value & mask))
+			continue;
+
+		device = btd_adapter_find_device(adapter, &sub->bdaddr,
+							sub->bdaddr_type);
+		if (device)
+			func(device, sub->value, user_data);
+	}
+}
+
 uint32_t attrib_create_sdp(struct btd_adapter *adapter, uint16_t handle,
 							const char *name)
 {
@@ -1442,19 +1757,19 @@ static uint16_t find_uuid16_avail(struct btd_adapter *adapter, uint16_t nitems)
 {
 	struct gatt_server *server;
 	uint16_t handle;
+	unsigned int i;
 	GSList *l;
-	GList *dl;
 
 	l = g_slist_find_custom(servers, adapter, adapter_cmp);
 	if (l == NULL)
 		return 0;
 
 	server = l->data;
-	if (server->database == NULL)
+	if (server->database->len == 0)
 		return 0x0001;
 
-	for (dl = server->database, handle = 0x0001; dl; dl = dl->next) {
-		struct attribute *a = dl->data;
+	for (i = 0, handle = 0x0001; i < server->database->len; i++) {
+		struct attribute *a = db_attr(server, i);
 
 		if ((bt_uuid_cmp(&a->uuid, &prim_uuid) == 0 ||
 				bt_uuid_cmp(&a->uuid, &snd_uuid) == 0) &&
@@ -1484,7 +1799,7 @@ static uint16_t find_uuid128_avail(struct btd_adapter *adapter, uint16_t nitems)
 {
 	uint16_t handle = 0, end = 0xffff;
 	struct gatt_server *server;
-	GList *dl;
+	unsigned int i;
 	GSList *l;
 
 	l = g_slist_find_custom(servers, adapter, adapter_cmp);
@@ -1492,11 +1807,11 @@ static uint16_t find_uuid128_avail(struct btd_adapter *adapter, uint16_t nitems)
 		return 0;
 
 	server = l->data;
-	if (server->database == NULL)
+	if (server->database->len == 0)
 		return 0xffff - nitems + 1;
 
-	for (dl = g_list_last(server->database); dl; dl = dl->prev) {
-		struct attribute *a = dl->data;
+	for (i = server->database->len; i > 0; i--) {
+		struct attribute *a = db_attr(server, i - 1);
 
 		if (handle == 0)
 			handle = a->handle;
@@ -1567,8 +1882,6 @@ int attrib_db_update(struct btd_adapter *adapter, uint16_t handle,
 	struct gatt_server *server;
 	struct attribute *a;
 	GSList *l;
-	GList *dl;
-	guint h = handle;
 
 	l = g_slist_find_custom(servers, adapter, adapter_cmp);
 	if (l == NULL)
@@ -1578,13 +1891,10 @@ int attrib_db_update(struct btd_adapter *adapter, uint16_t handle,
 
 	DBG("handle=0x%04x", handle);
 
-	dl = g_list_find_custom(server->database, GUINT_TO_POINTER(h),
-								handle_cmp);
-	if (dl == NULL)
+	a = db_find(server, handle);
+	if (a == NULL)
 		return -ENOENT;
 
-	a = dl->data;
-
 	a->data = g_try_realloc(a->data, len);
 	if (len && a->data == NULL)
 		return -ENOMEM;
@@ -1604,10 +1914,8 @@ int attrib_db_update(struct btd_adapter *adapter, uint16_t handle,
 int attrib_db_del(struct btd_adapter *adapter, uint16_t handle)
 {
 	struct gatt_server *server;
-	struct attribute *a;
+	unsigned int i;
 	GSList *l;
-	GList *dl;
-	guint h = handle;
 
 	l = g_slist_find_custom(servers, adapter, adapter_cmp);
 	if (l == NULL)
@@ -1617,15 +1925,12 @@ int attrib_db_del(struct btd_adapter *adapter, uint16_t handle)
 
 	DBG("handle=0x%04x", handle);
 
-	dl = g_list_find_custom(server->database, GUINT_TO_POINTER(h),
-								handle_cmp);
-	if (dl == NULL)
+	i = db_lookup(server, handle);
+	if (i == server->database->len || db_attr(server, i)->handle != handle)
 		return -ENOENT;
 
-	a = dl->data;
-	server->database = g_list_remove(server->database, a);
-	g_free(a->data);
-	g_free(a);
+	/* Frees the attribute */
+	g_ptr_array_remove_index(server->database, i);
 
 	return 0;
 }
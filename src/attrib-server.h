@@ -40,3 +40,14 @@ void attrib_free_sdp(struct btd_adapter *adapter, uint32_t sdp_handle);
 GAttrib *attrib_from_device(struct btd_device *device);
 guint attrib_channel_attach(GAttrib *attrib);
 gboolean attrib_channel_detach(GAttrib *attrib, guint id);
+
+/* Forgets the CCC values of a device whose storage is removed */
+void attrib_remove_device(struct btd_adapter *adapter, const bdaddr_t *bdaddr,
+							uint8_t bdaddr_type);
+
+/* Calls func for known devices whose CCC value at handle matches mask */
+typedef void (*attrib_ccc_func_t) (struct btd_device *device, uint16_t value,
+							void *user_data);
+void attrib_foreach_subscriber(struct btd_adapter *adapter, uint16_t handle,
+					uint16_t mask, attrib_ccc_func_t func,
+					void *user_data);
@@ -34,6 +34,7 @@
 #include <errno.h>
 #include <dirent.h>
 #include <time.h>
+#include <inttypes.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/sdp.h>
@@ -65,9 +66,13 @@
 #include "textfile.h"
 #include "storage.h"
 #include "attrib-server.h"
+#include "trace.h"
+#include "src/shared/att-types.h"
 
 #define IO_CAPABILITY_NOINPUTNOOUTPUT	0x03
 
+#define ATT_STATS_INTERFACE	"org.bluez.AttStatistics1"
+
 #define DISCONNECT_TIMER	2
 #define DISCOVERY_TIMER		1
 
@@ -121,6 +126,9 @@ struct browse_req {
 	int reconnect_attempt;
 	guint listener_id;
 	uint16_t sdp_flags;
+	sdp_list_t *cached;		/* Records served from the cache */
+	guint cache_id;
+	guint discover_id;		/* Attribute discovery */
 };
 
 struct included_search {
@@ -171,6 +179,8 @@ struct btd_device {
 	bool		le;
 	bool		pending_paired;		/* "Paired" waiting for SDP */
 	bool		svc_refreshed;
+	bool		records_stale;		/* Cached records outdated */
+	bool		records_cached;		/* Services from cached records */
 	GSList		*svc_callbacks;
 	GSList		*eir_uuids;
 	char		name[MAX_NAME_LENGTH + 1];
@@ -185,6 +195,7 @@ struct btd_device {
 	struct btd_adapter	*adapter;
 	GSList		*uuids;
 	GSList		*primaries;		/* List of primary services */
+	struct gatt_cache *gatt_cache;		/* Attributes of bonded device */
 	GSList		*services;		/* List of btd_service */
 	GSList		*pending;		/* Pending services */
 	GSList		*watches;		/* List of disconnect_data */
@@ -308,6 +319,7 @@ static gboolean store_device_info_cb(gpointer user_data)
 	char class[9];
 	char **uuids = NULL;
 	gsize length = 0;
+	uint64_t start;
 
 	device->store_id = 0;
 
@@ -379,7 +391,10 @@ static gboolean store_device_info_cb(gpointer user_data)
 	create_file(filename, S_IRUSR | S_IWUSR);
 
 	str = g_key_file_to_data(key_file, &length, NULL);
+	start = btd_trace_begin();
 	g_file_set_contents(filename, str, length, NULL);
+	btd_trace_end(start, BTD_TRACE_STORAGE_WRITE,
+			btd_adapter_get_index(device->adapter), length, 0, 0);
 	g_free(str);
 
 	g_key_file_free(key_file);
@@ -423,6 +438,7 @@ void device_store_cached_name(struct btd_device *dev, const char *name)
 	GKeyFile *key_file;
 	char *data;
 	gsize length = 0;
+	uint64_t start;
 
 	if (device_address_is_private(dev)) {
 		warn("Can't store name for private addressed device %s",
@@ -441,7 +457,10 @@ void device_store_cached_name(struct btd_device *dev, const char *name)
 	g_key_file_set_string(key_file, "General", "Name", name);
 
 	data = g_key_file_to_data(key_file, &length, NULL);
+	start = btd_trace_begin();
 	g_file_set_contents(filename, data, length, NULL);
+	btd_trace_end(start, BTD_TRACE_STORAGE_WRITE,
+			btd_adapter_get_index(dev->adapter), length, 0, 0);
 	g_free(data);
 
 	g_key_file_free(key_file);
@@ -456,6 +475,10 @@ static void browse_request_free(struct browse_req *req)
 	g_slist_free_full(req->profiles_added, g_free);
 	if (req->records)
 		sdp_list_free(req->records, (sdp_free_func_t) sdp_record_free);
+	if (req->cached)
+		sdp_list_free(req->cached, (sdp_free_func_t) sdp_record_free);
+	if (req->cache_id)
+		g_source_remove(req->cache_id);
 
 	g_free(req);
 }
@@ -481,6 +504,8 @@ static void attio_cleanup(struct btd_device *device)
 	if (device->attrib) {
 		GAttrib *attrib = device->attrib;
 		device->attrib = NULL;
+		g_dbus_unregister_interface(dbus_conn, device->path,
+							ATT_STATS_INTERFACE);
 		g_attrib_cancel_all(attrib);
 		g_attrib_unref(attrib);
 	}
@@ -499,6 +524,81 @@ static void browse_request_cancel(struct browse_req *req)
 	browse_request_free(req);
 }
 
+static void records_filename(struct btd_device *device, char *filename)
+{
+	char local[18], peer[18];
+
+	ba2str(btd_adapter_get_address(device->adapter), local);
+	ba2str(&device->bdaddr, peer);
+
+	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/%s/records", local, peer);
+	filename[PATH_MAX] = '\0';
+}
+
+static void store_records(struct btd_device *device)
+{
+	char filename[PATH_MAX + 1];
+
+	if (device->temporary)
+		return;
+
+	records_filename(device, filename);
+
+	if (!device->tmp_records) {
+		unlink(filename);
+		return;
+	}
+
+	if (records_to_file(filename, device->class, device->tmp_records) < 0)
+		error("Unable to store service records of %s", device->path);
+	else
+		device->records_stale = false;
+}
+
+/*
+ * Cached records are used instead of browsing until the remote tells us
+ * something changed, or the device is paired again.
+ */
+static void invalidate_records(struct btd_device *device)
+{
+	char filename[PATH_MAX + 1];
+
+	if (device->records_stale)
+		return;
+
+	DBG("%s", device->path);
+
+	device->records_stale = true;
+
+	records_filename(device, filename);
+	unlink(filename);
+}
+
+static sdp_list_t *read_cached_records(struct btd_device *device)
+{
+	char filename[PATH_MAX + 1];
+	sdp_list_t *recs;
+	uint32_t class = 0;
+
+	if (device->temporary || device->records_stale)
+		return NULL;
+
+	records_filename(device, filename);
+
+	recs = records_from_file(filename, &class);
+	if (!recs)
+		return NULL;
+
+	/* Class changed while we were not around */
+	if (class && device->class && class != device->class) {
+		sdp_list_free(recs, (sdp_free_func_t) sdp_record_free);
+		invalidate_records(device);
+		return NULL;
+	}
+
+	return recs;
+}
+
 static void svc_dev_remove(gpointer user_data)
 {
 	struct svc_callback *cb = user_data;
@@ -523,6 +623,8 @@ static void device_free(gpointer user_data)
 
 	attio_cleanup(device);
 
+	gatt_cache_unref(device->gatt_cache);
+
 	if (device->tmp_records)
 		sdp_list_free(device->tmp_records,
 					(sdp_free_func_t) sdp_record_free);
@@ -1252,7 +1354,20 @@ void device_add_eir_uuids(struct btd_device *dev, GSList *uuids)
 	GSList *l;
 	bool added = false;
 
-	if (dev->bredr_state.svc_resolved || dev->le_state.svc_resolved)
+	if (dev->bredr_state.svc_resolved) {
+		/* A service missing in the last browse means it changed */
+		for (l = uuids; l != NULL; l = l->next) {
+			if (!g_slist_find_custom(dev->uuids, l->data,
+							bt_uuid_strcmp)) {
+				invalidate_records(dev);
+				break;
+			}
+		}
+
+		return;
+	}
+
+	if (dev->le_state.svc_resolved)
 		return;
 
 	for (l = uuids; l != NULL; l = l->next) {
@@ -1375,6 +1490,12 @@ static DBusMessage *connect_profiles(struct btd_device *dev, uint8_t bdaddr_type
 
 	dev->pending = create_pending_list(dev, uuid);
 	if (!dev->pending) {
+		/* The cached records may predate the service, ask the remote */
+		if (dev->records_cached) {
+			invalidate_records(dev);
+			goto resolve_services;
+		}
+
 		if (dev->svc_refreshed) {
 			if (find_service_with_state(dev->services,
 						BTD_SERVICE_STATE_CONNECTED))
@@ -2190,21 +2311,135 @@ next:
 		store_device_info(device);
 }
 
+static bool value_to_uuid(const char *str, char *dst)
+{
+	char *uuid_str, tmp[3];
+	uuid_t uuid;
+	int i;
+
+	switch (strlen(str)) {
+	case 4:
+		uuid.type = SDP_UUID16;
+		sscanf(str, "%04hx", &uuid.value.uuid16);
+		break;
+	case 8:
+		uuid.type = SDP_UUID32;
+		sscanf(str, "%08x", &uuid.value.uuid32);
+		break;
+	case 32:
+		uuid.type = SDP_UUID128;
+		memset(tmp, 0, sizeof(tmp));
+		for (i = 0; i < 16; i++) {
+			memcpy(tmp, str + (i * 2), 2);
+			uuid.value.uuid128.data[i] =
+					(uint8_t) strtol(tmp, NULL, 16);
+		}
+		break;
+	default:
+		return false;
+	}
+
+	uuid_str = bt_uuid2string(&uuid);
+	if (!uuid_str)
+		return false;
+
+	memcpy(dst, uuid_str, MAX_LEN_UUID_STR);
+	free(uuid_str);
+
+	return true;
+}
+
+static bool load_att_char(struct gatt_cache *cache, GKeyFile *key_file,
+							const char *group)
+{
+	struct gatt_char chr;
+	char *str;
+	bool ret;
+
+	memset(&chr, 0, sizeof(chr));
+	chr.handle = atoi(group);
+	chr.properties = g_key_file_get_integer(key_file, group, "Properties",
+									NULL);
+	chr.value_handle = g_key_file_get_integer(key_file, group,
+							"ValueHandle", NULL);
+
+	str = g_key_file_get_string(key_file, group, "Value", NULL);
+	if (!str)
+		return false;
+
+	ret = chr.value_handle && value_to_uuid(str, chr.uuid);
+	if (ret)
+		gatt_cache_add_char(cache, &chr);
+
+	g_free(str);
+
+	return ret;
+}
+
+static bool load_att_included(struct gatt_cache *cache, GKeyFile *key_file,
+							const char *group)
+{
+	struct gatt_included incl;
+	char *str;
+	bool ret;
+
+	memset(&incl, 0, sizeof(incl));
+	incl.handle = atoi(group);
+	incl.range.start = g_key_file_get_integer(key_file, group,
+						"StartGroupHandle", NULL);
+	incl.range.end = g_key_file_get_integer(key_file, group,
+						"EndGroupHandle", NULL);
+
+	str = g_key_file_get_string(key_file, group, "Value", NULL);
+	if (!str)
+		return false;
+
+	ret = incl.range.start && value_to_uuid(str, incl.uuid);
+	if (ret)
+		gatt_cache_add_included(cache, &incl);
+
+	g_free(str);
+
+	return ret;
+}
+
+static bool handles_in_range(const uint16_t *handles, unsigned int count,
+					uint16_t start, uint16_t end)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		if (handles[i] >= start && handles[i] <= end)
+			return true;
+	}
+
+	return false;
+}
+
 static void load_att_info(struct btd_device *device, const char *local,
 				const char *peer)
 {
 	char filename[PATH_MAX + 1];
 	GKeyFile *key_file;
-	char *prim_uuid, *str;
-	char **groups, **handle, *service_uuid;
+	char *prim_uuid, *incl_uuid, *char_uuid, *str;
+	char **groups, **handle;
 	struct gatt_primary *prim;
+	struct gatt_cache *cache;
+	bool cached = false, broken = false;
+	uint16_t *handles;
+	unsigned int count = 0;
 	uuid_t uuid;
-	char tmp[3];
-	int i;
+	GSList *l;
 
 	sdp_uuid16_create(&uuid, GATT_PRIM_SVC_UUID);
 	prim_uuid = bt_uuid2string(&uuid);
 
+	sdp_uuid16_create(&uuid, GATT_INCLUDE_UUID);
+	incl_uuid = bt_uuid2string(&uuid);
+
+	sdp_uuid16_create(&uuid, GATT_CHARAC_UUID);
+	char_uuid = bt_uuid2string(&uuid);
+
 	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/%s/attributes", local,
 			peer);
 	filename[PATH_MAX] = '\0';
@@ -2212,8 +2447,12 @@ static void load_att_info(struct btd_device *device, const char *local,
 	key_file = g_key_file_new();
 	g_key_file_load_from_file(key_file, filename, 0, NULL);
 	groups = g_key_file_get_groups(key_file, NULL);
+	handles = g_new0(uint16_t, g_strv_length(groups));
+
+	cache = gatt_cache_new();
 
 	for (handle = groups; *handle; handle++) {
+		struct gatt_desc desc;
 		gboolean uuid_ok;
 		int end;
 
@@ -2221,7 +2460,26 @@ static void load_att_info(struct btd_device *device, const char *local,
 		if (!str)
 			continue;
 
+		/* Every group is an attribute, the cache knows all of them */
+		memset(&desc, 0, sizeof(desc));
+		desc.handle = atoi(*handle);
+		g_strlcpy(desc.uuid, str, sizeof(desc.uuid));
+		gatt_cache_add_desc(cache, &desc);
+
 		uuid_ok = g_str_equal(str, prim_uuid);
+
+		if (!uuid_ok) {
+			cached = true;
+			handles[count++] = desc.handle;
+
+			if (g_str_equal(str, char_uuid))
+				broken |= !load_att_char(cache, key_file,
+								*handle);
+			else if (g_str_equal(str, incl_uuid))
+				broken |= !load_att_included(cache, key_file,
+								*handle);
+		}
+
 		g_free(str);
 
 		if (!uuid_ok)
@@ -2242,41 +2500,45 @@ static void load_att_info(struct btd_device *device, const char *local,
 		prim->range.start = atoi(*handle);
 		prim->range.end = end;
 
-		switch (strlen(str)) {
-		case 4:
-			uuid.type = SDP_UUID16;
-			sscanf(str, "%04hx", &uuid.value.uuid16);
-		break;
-		case 8:
-			uuid.type = SDP_UUID32;
-			sscanf(str, "%08x", &uuid.value.uuid32);
-			break;
-		case 32:
-			uuid.type = SDP_UUID128;
-			memset(tmp, 0, sizeof(tmp));
-			for (i = 0; i < 16; i++) {
-				memcpy(tmp, str + (i * 2), 2);
-				uuid.value.uuid128.data[i] =
-						(uint8_t) strtol(tmp, NULL, 16);
-			}
-			break;
-		default:
+		if (!value_to_uuid(str, prim->uuid)) {
 			g_free(str);
 			g_free(prim);
 			continue;
 		}
 
-		service_uuid = bt_uuid2string(&uuid);
-		memcpy(prim->uuid, service_uuid, MAX_LEN_UUID_STR);
-		free(service_uuid);
 		g_free(str);
 
 		device->primaries = g_slist_append(device->primaries, prim);
+		gatt_cache_add_primary(cache, prim);
+	}
+
+	/*
+	 * Services stored without any of their attributes, like the ones found
+	 * over BR/EDR, were not discovered and can't be answered from the cache.
+	 */
+	for (l = device->primaries; l; l = l->next) {
+		prim = l->data;
+
+		if (prim->range.start < prim->range.end &&
+				!handles_in_range(handles, count,
+						prim->range.start + 1,
+						prim->range.end))
+			gatt_cache_add_missing(cache, prim->range.start + 1,
+							prim->range.end);
 	}
 
+	/* Files written before the cache existed only have services */
+	if (cached && !broken)
+		device->gatt_cache = gatt_cache_ref(cache);
+
+	gatt_cache_unref(cache);
+
+	g_free(handles);
 	g_strfreev(groups);
 	g_key_file_free(key_file);
 	free(prim_uuid);
+	free(incl_uuid);
+	free(char_uuid);
 }
 
 static struct btd_device *device_new(struct btd_adapter *adapter,
@@ -2433,6 +2695,9 @@ void device_set_class(struct btd_device *device, uint32_t class)
 
 	DBG("%s 0x%06X", device->path, class);
 
+	if (device->class)
+		invalidate_records(device);
+
 	device->class = class;
 
 	store_device_info(device);
@@ -2616,6 +2881,10 @@ static void device_remove_stored(struct btd_device *device)
 	filename[PATH_MAX] = '\0';
 	delete_folder_tree(filename);
 
+	/* The ccc file is gone, so are the subscriptions kept in memory */
+	attrib_remove_device(device->adapter, &device->bdaddr,
+							device->bdaddr_type);
+
 	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/cache/%s", adapter_addr,
 			device_addr);
 	filename[PATH_MAX] = '\0';
@@ -3008,7 +3277,7 @@ static void update_bredr_services(struct browse_req *req, sdp_list_t *recs)
 	ba2str(btd_adapter_get_address(device->adapter), srcaddr);
 	ba2str(&device->bdaddr, dstaddr);
 
-	if (!device->temporary) {
+	if (!device->temporary && !req->cached) {
 		snprintf(sdp_file, PATH_MAX, STORAGEDIR "/%s/cache/%s",
 							srcaddr, dstaddr);
 		sdp_file[PATH_MAX] = '\0';
@@ -3203,6 +3472,11 @@ static void search_cb(sdp_list_t *recs, int err, gpointer user_data)
 	device->tmp_records = req->records;
 	req->records = NULL;
 
+	if (!req->cached)
+		store_records(device);
+
+	device->records_cached = req->cached != NULL;
+
 	if (!req->profiles_added) {
 		DBG("%s: No service update", addr);
 		goto send_reply;
@@ -3256,6 +3530,31 @@ done:
 	search_cb(recs, err, user_data);
 }
 
+static void uuid_to_value(const char *str, char *value)
+{
+	uuid_t uuid;
+	int i;
+
+	bt_string2uuid(&uuid, str);
+	sdp_uuid128_to_uuid(&uuid);
+
+	switch (uuid.type) {
+	case SDP_UUID16:
+		sprintf(value, "%4.4X", uuid.value.uuid16);
+		break;
+	case SDP_UUID32:
+		sprintf(value, "%8.8X", uuid.value.uuid32);
+		break;
+	case SDP_UUID128:
+		for (i = 0; i < 16; i++)
+			sprintf(value + (i * 2), "%2.2X",
+					uuid.value.uuid128.data[i]);
+		break;
+	default:
+		value[0] = '\0';
+	}
+}
+
 static void store_services(struct btd_device *device)
 {
 	struct btd_adapter *adapter = device->adapter;
@@ -3291,28 +3590,10 @@ static void store_services(struct btd_device *device)
 	for (l = device->primaries; l; l = l->next) {
 		struct gatt_primary *primary = l->data;
 		char handle[6], uuid_str[33];
-		int i;
 
 		sprintf(handle, "%hu", primary->range.start);
 
-		bt_string2uuid(&uuid, primary->uuid);
-		sdp_uuid128_to_uuid(&uuid);
-
-		switch (uuid.type) {
-		case SDP_UUID16:
-			sprintf(uuid_str, "%4.4X", uuid.value.uuid16);
-			break;
-		case SDP_UUID32:
-			sprintf(uuid_str, "%8.8X", uuid.value.uuid32);
-			break;
-		case SDP_UUID128:
-			for (i = 0; i < 16; i++)
-				sprintf(uuid_str + (i * 2), "%2.2X",
-						uuid.value.uuid128.data[i]);
-			break;
-		default:
-			uuid_str[0] = '\0';
-		}
+		uuid_to_value(primary->uuid, uuid_str);
 
 		g_key_file_set_string(key_file, handle, "UUID", prim_uuid);
 		g_key_file_set_string(key_file, handle, "Value", uuid_str);
@@ -3331,6 +3612,99 @@ static void store_services(struct btd_device *device)
 	g_key_file_free(key_file);
 }
 
+/*
+ * Adds the rest of the discovered attributes to the services written by
+ * store_services(), one group per attribute handle like the service
+ * declarations.
+ */
+static void store_gatt_cache(struct btd_device *device, GSList *includes,
+					GSList *chars, GSList *descs)
+{
+	struct btd_adapter *adapter = device->adapter;
+	char filename[PATH_MAX + 1];
+	char src_addr[18], dst_addr[18];
+	char *incl_uuid, *char_uuid;
+	GKeyFile *key_file;
+	uuid_t uuid;
+	GSList *l;
+	char *data;
+	gsize length = 0;
+	uint64_t start;
+
+	ba2str(btd_adapter_get_address(adapter), src_addr);
+	ba2str(&device->bdaddr, dst_addr);
+
+	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/%s/attributes", src_addr,
+								dst_addr);
+	filename[PATH_MAX] = '\0';
+
+	sdp_uuid16_create(&uuid, GATT_INCLUDE_UUID);
+	incl_uuid = bt_uuid2string(&uuid);
+
+	sdp_uuid16_create(&uuid, GATT_CHARAC_UUID);
+	char_uuid = bt_uuid2string(&uuid);
+
+	key_file = g_key_file_new();
+	g_key_file_load_from_file(key_file, filename, 0, NULL);
+
+	for (l = includes; l; l = l->next) {
+		struct gatt_included *incl = l->data;
+		char handle[6], uuid_str[33];
+
+		sprintf(handle, "%hu", incl->handle);
+		uuid_to_value(incl->uuid, uuid_str);
+
+		g_key_file_set_string(key_file, handle, "UUID", incl_uuid);
+		g_key_file_set_string(key_file, handle, "Value", uuid_str);
+		g_key_file_set_integer(key_file, handle, "StartGroupHandle",
+							incl->range.start);
+		g_key_file_set_integer(key_file, handle, "EndGroupHandle",
+							incl->range.end);
+	}
+
+	for (l = chars; l; l = l->next) {
+		struct gatt_char *chr = l->data;
+		char handle[6], uuid_str[33];
+
+		sprintf(handle, "%hu", chr->handle);
+		uuid_to_value(chr->uuid, uuid_str);
+
+		g_key_file_set_string(key_file, handle, "UUID", char_uuid);
+		g_key_file_set_string(key_file, handle, "Value", uuid_str);
+		g_key_file_set_integer(key_file, handle, "Properties",
+							chr->properties);
+		g_key_file_set_integer(key_file, handle, "ValueHandle",
+							chr->value_handle);
+	}
+
+	for (l = descs; l; l = l->next) {
+		struct gatt_desc *desc = l->data;
+		char handle[6];
+
+		sprintf(handle, "%hu", desc->handle);
+
+		/* Declarations are already stored with their values */
+		if (g_key_file_has_group(key_file, handle))
+			continue;
+
+		g_key_file_set_string(key_file, handle, "UUID", desc->uuid);
+	}
+
+	data = g_key_file_to_data(key_file, &length, NULL);
+	if (length > 0) {
+		create_file(filename, S_IRUSR | S_IWUSR);
+		start = btd_trace_begin();
+		g_file_set_contents(filename, data, length, NULL);
+		btd_trace_end(start, BTD_TRACE_STORAGE_WRITE,
+				btd_adapter_get_index(adapter), length, 0, 0);
+	}
+
+	free(incl_uuid);
+	free(char_uuid);
+	g_free(data);
+	g_key_file_free(key_file);
+}
+
 static bool device_get_auto_connect(struct btd_device *device)
 {
 	if (device->disable_auto_connect)
@@ -3464,6 +3838,59 @@ static void send_le_browse_response(struct browse_req *req)
 	g_dbus_send_reply(dbus_conn, msg, DBUS_TYPE_INVALID);
 }
 
+/*
+ * Included services are registered as services of their own, like the
+ * primary services they are included from.
+ */
+static GSList *discovered_services(const struct gatt_discovery *disc)
+{
+	GSList *services = NULL;
+	GSList *l;
+
+	for (l = disc->primaries; l; l = l->next)
+		services = g_slist_append(services,
+				g_memdup(l->data, sizeof(struct gatt_primary)));
+
+	for (l = disc->includes; l; l = l->next) {
+		struct gatt_included *incl = l->data;
+		struct gatt_primary *prim;
+
+		if (g_slist_find_custom(services, &incl->range,
+						service_by_range_cmp))
+			continue;
+
+		prim = g_new0(struct gatt_primary, 1);
+		memcpy(prim->uuid, incl->uuid, sizeof(prim->uuid));
+		memcpy(&prim->range, &incl->range, sizeof(prim->range));
+
+		services = g_slist_append(services, prim);
+	}
+
+	return services;
+}
+
+static struct gatt_cache *discovered_cache(const struct gatt_discovery *disc)
+{
+	struct gatt_cache *cache;
+	GSList *l;
+
+	cache = gatt_cache_new();
+
+	for (l = disc->primaries; l; l = l->next)
+		gatt_cache_add_primary(cache, l->data);
+
+	for (l = disc->includes; l; l = l->next)
+		gatt_cache_add_included(cache, l->data);
+
+	for (l = disc->chars; l; l = l->next)
+		gatt_cache_add_char(cache, l->data);
+
+	for (l = disc->attributes; l; l = l->next)
+		gatt_cache_add_desc(cache, l->data);
+
+	return cache;
+}
+
 static void find_included_cb(uint8_t status, GSList *includes, void *user_data)
 {
 	struct included_search *search = user_data;
@@ -3582,6 +4009,139 @@ static void primary_cb(uint8_t status, GSList *services, void *user_data)
 	find_included_services(req, services);
 }
 
+static void discover_all_cb(uint8_t status, const struct gatt_discovery *disc,
+							void *user_data)
+{
+	struct browse_req *req = user_data;
+	struct btd_device *device = req->device;
+
+	DBG("status %u", status);
+
+	req->discover_id = 0;
+
+	/* Services are still worth having without the rest */
+	if (status) {
+		error("Attribute discovery failed: %s (%d)",
+					att_ecode2str(status), status);
+
+		if (device->attrib && gatt_discover_primary(device->attrib,
+						NULL, primary_cb, req))
+			return;
+
+		send_le_browse_response(req);
+		device->browse = NULL;
+		browse_request_free(req);
+		return;
+	}
+
+	DBG("%u attributes in %u round trips, %" PRId64 " us, mtu %u",
+				g_slist_length(disc->attributes),
+				disc->round_trips, disc->elapsed, disc->mtu);
+
+	/* The whole database was discovered again, drop the old cache */
+	if (device->gatt_cache) {
+		if (device->attrib)
+			gatt_cache_detach(device->attrib);
+
+		gatt_cache_unref(device->gatt_cache);
+		device->gatt_cache = NULL;
+	}
+
+	register_all_services(req, discovered_services(disc));
+
+	store_gatt_cache(device, disc->includes, disc->chars,
+							disc->attributes);
+
+	device->gatt_cache = discovered_cache(disc);
+
+	if (device->attrib && device_is_bonded(device, device->bdaddr_type))
+		gatt_cache_attach(device->attrib, device->gatt_cache);
+}
+
+/*
+ * Bonded devices get every attribute discovered in one pass which fills
+ * their cache, others only need the services. The MTU is left to the GATT
+ * profile which exchanges it on connection.
+ */
+static void browse_gatt(struct browse_req *req)
+{
+	struct btd_device *device = req->device;
+
+	if (device_is_bonded(device, device->bdaddr_type) &&
+					!device_address_is_private(device))
+		req->discover_id = gatt_discover_all(device->attrib, 0,
+							discover_all_cb, req);
+
+	if (req->discover_id)
+		return;
+
+	gatt_discover_primary(device->attrib, NULL, primary_cb, req);
+}
+
+static DBusMessage *get_att_stats(DBusConnection *conn, DBusMessage *msg,
+							void *user_data)
+{
+	struct btd_device *device = user_data;
+	struct bt_att_stats stats;
+	DBusMessageIter iter, dict;
+	DBusMessage *reply;
+	uint32_t *rtt = stats.rtt;
+	uint32_t rtt_avg;
+
+	if (!g_attrib_get_stats(device->attrib, &stats))
+		return btd_error_not_connected(msg);
+
+	rtt_avg = stats.rtt_count ? stats.rtt_total / stats.rtt_count : 0;
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply)
+		return NULL;
+
+	dbus_message_iter_init_append(reply, &iter);
+
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING, &dict);
+
+	dict_append_entry(&dict, "TxBytes", DBUS_TYPE_UINT64, &stats.tx_bytes);
+	dict_append_entry(&dict, "RxBytes", DBUS_TYPE_UINT64, &stats.rx_bytes);
+	dict_append_entry(&dict, "TxPDUs", DBUS_TYPE_UINT32, &stats.tx_pdus);
+	dict_append_entry(&dict, "RxPDUs", DBUS_TYPE_UINT32, &stats.rx_pdus);
+	dict_append_entry(&dict, "Requests", DBUS_TYPE_UINT32, &stats.requests);
+	dict_append_entry(&dict, "Errors", DBUS_TYPE_UINT32, &stats.errors);
+	dict_append_entry(&dict, "Timeouts", DBUS_TYPE_UINT32, &stats.timeouts);
+	dict_append_entry(&dict, "Cached", DBUS_TYPE_UINT32, &stats.cached);
+	dict_append_entry(&dict, "Notifications", DBUS_TYPE_UINT32,
+							&stats.notifications);
+	dict_append_entry(&dict, "Indications", DBUS_TYPE_UINT32,
+							&stats.indications);
+	dict_append_entry(&dict, "Queued", DBUS_TYPE_UINT32, &stats.queued);
+	dict_append_entry(&dict, "MaxQueued", DBUS_TYPE_UINT32,
+							&stats.max_queued);
+	dict_append_entry(&dict, "RoundTrips", DBUS_TYPE_UINT32,
+							&stats.rtt_count);
+	dict_append_entry(&dict, "RoundTripMin", DBUS_TYPE_UINT32,
+							&stats.rtt_min);
+	dict_append_entry(&dict, "RoundTripMax", DBUS_TYPE_UINT32,
+							&stats.rtt_max);
+	dict_append_entry(&dict, "RoundTripAverage", DBUS_TYPE_UINT32,
+								&rtt_avg);
+	dict_append_array(&dict, "RoundTripHistogram", DBUS_TYPE_UINT32,
+						&rtt, BT_ATT_STATS_RTT_BUCKETS);
+
+	dbus_message_iter_close_container(&iter, &dict);
+
+	return reply;
+}
+
+static const GDBusMethodTable att_stats_methods[] = {
+	{ GDBUS_METHOD("GetStatistics", NULL,
+				GDBUS_ARGS({ "statistics", "a{sv}" }),
+				get_att_stats) },
+	{ }
+};
+
 bool device_attach_attrib(struct btd_device *dev, GIOChannel *io)
 {
 	GAttrib *attrib;
@@ -3603,6 +4163,12 @@ bool device_attach_attrib(struct btd_device *dev, GIOChannel *io)
 	dev->cleanup_id = g_io_add_watch(io, G_IO_HUP,
 					attrib_disconnected_cb, dev);
 
+	if (!g_dbus_register_interface(dbus_conn, dev->path,
+					ATT_STATS_INTERFACE, att_stats_methods,
+					NULL, NULL, dev, NULL))
+		error("Unable to register %s interface for %s",
+						ATT_STATS_INTERFACE, dev->path);
+
 	/*
 	 * Remove the device from the connect_list and give the passive
 	 * scanning another chance to be restarted in case there are
@@ -3610,6 +4176,9 @@ bool device_attach_attrib(struct btd_device *dev, GIOChannel *io)
 	 */
 	adapter_connect_list_remove(dev->adapter, dev);
 
+	if (dev->gatt_cache && device_is_bonded(dev, dev->bdaddr_type))
+		gatt_cache_attach(dev->attrib, dev->gatt_cache);
+
 	g_slist_foreach(dev->attios, attio_connected, dev->attrib);
 
 	return true;
@@ -3770,8 +4339,7 @@ static void att_browse_cb(gpointer user_data)
 	struct att_callbacks *attcb = user_data;
 	struct btd_device *device = attcb->user_data;
 
-	gatt_discover_primary(device->attrib, NULL, primary_cb,
-							device->browse);
+	browse_gatt(device->browse);
 }
 
 static int device_browse_primary(struct btd_device *device, DBusMessage *msg)
@@ -3789,7 +4357,7 @@ static int device_browse_primary(struct btd_device *device, DBusMessage *msg)
 	device->browse = req;
 
 	if (device->attrib) {
-		gatt_discover_primary(device->attrib, NULL, primary_cb, req);
+		browse_gatt(req);
 		goto done;
 	}
 
@@ -3858,6 +4426,32 @@ static uint16_t get_sdp_flags(struct btd_device *device)
 	return 0;
 }
 
+static gboolean browse_cached(gpointer user_data)
+{
+	struct browse_req *req = user_data;
+
+	req->cache_id = 0;
+
+	DBG("%s: using cached records", req->device->path);
+
+	search_cb(req->cached, 0, req);
+
+	return FALSE;
+}
+
+static void browse_set_msg(struct browse_req *req, DBusMessage *msg)
+{
+	const char *sender = dbus_message_get_sender(msg);
+
+	req->msg = dbus_message_ref(msg);
+	/* Track the request owner to cancel it
+	 * automatically if the owner exits */
+	req->listener_id = g_dbus_add_disconnect_watch(dbus_conn,
+						sender,
+						discover_services_req_exit,
+						req, NULL);
+}
+
 static int device_browse_sdp(struct btd_device *device, DBusMessage *msg)
 {
 	struct btd_adapter *adapter = device->adapter;
@@ -3870,6 +4464,19 @@ static int device_browse_sdp(struct btd_device *device, DBusMessage *msg)
 
 	req = g_new0(struct browse_req, 1);
 	req->device = device;
+
+	/* Complete from the main loop like a real browse would */
+	req->cached = read_cached_records(device);
+	if (req->cached) {
+		req->cache_id = g_idle_add(browse_cached, req);
+		device->browse = req;
+
+		if (msg)
+			browse_set_msg(req, msg);
+
+		return 0;
+	}
+
 	sdp_uuid16_create(&uuid, uuid_list[req->search_uuid++]);
 
 	req->sdp_flags = get_sdp_flags(device);
@@ -3884,17 +4491,8 @@ static int device_browse_sdp(struct btd_device *device, DBusMessage *msg)
 
 	device->browse = req;
 
-	if (msg) {
-		const char *sender = dbus_message_get_sender(msg);
-
-		req->msg = dbus_message_ref(msg);
-		/* Track the request owner to cancel it
-		 * automatically if the owner exits */
-		req->listener_id = g_dbus_add_disconnect_watch(dbus_conn,
-						sender,
-						discover_services_req_exit,
-						req, NULL);
-	}
+	if (msg)
+		browse_set_msg(req, msg);
 
 	return err;
 }
@@ -4212,9 +4810,11 @@ void device_bonding_complete(struct btd_device *device, uint8_t bdaddr_type,
 			device->discov_timer = 0;
 		}
 
-		if (bdaddr_type == BDADDR_BREDR)
+		if (bdaddr_type == BDADDR_BREDR) {
+			/* Pairing again refreshes the records */
+			invalidate_records(device);
 			device_browse_sdp(device, bonding->msg);
-		else
+		} else
 			device_browse_primary(device, bonding->msg);
 
 		bonding_request_free(bonding);
@@ -4688,6 +5288,7 @@ GSList *btd_device_get_primaries(struct btd_device *device)
 void btd_device_gatt_set_service_changed(struct btd_device *device,
 						uint16_t start, uint16_t end)
 {
+	struct browse_req *req;
 	GSList *l;
 
 	for (l = device->primaries; l; l = g_slist_next(l)) {
@@ -4697,6 +5298,25 @@ void btd_device_gatt_set_service_changed(struct btd_device *device,
 			prim->changed = TRUE;
 	}
 
+	/* Rebrowsing stores the services again, dropping the old cache */
+	if (device->gatt_cache) {
+		if (device->attrib)
+			gatt_cache_detach(device->attrib);
+
+		gatt_cache_unref(device->gatt_cache);
+		device->gatt_cache = NULL;
+	}
+
+	/* A discovery in progress may have seen the old database, restart it */
+	req = device->browse;
+	if (req && req->discover_id) {
+		gatt_discover_all_cancel(device->attrib, req->discover_id);
+		req->discover_id = 0;
+
+		browse_gatt(req);
+		return;
+	}
+
 	device_browse_primary(device, NULL);
 }
 
@@ -4735,6 +5355,10 @@ static sdp_list_t *read_device_records(struct btd_device *device)
 	ba2str(btd_adapter_get_address(device->adapter), local);
 	ba2str(&device->bdaddr, peer);
 
+	recs = read_cached_records(device);
+	if (recs)
+		return recs;
+
 	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/cache/%s", local, peer);
 	filename[PATH_MAX] = '\0';
 
@@ -4800,6 +5424,8 @@ void btd_device_unref(struct btd_device *device)
 
 	DBG("Freeing device %s", device->path);
 
+	g_dbus_unregister_interface(dbus_conn, device->path,
+							ATT_STATS_INTERFACE);
 	g_dbus_unregister_interface(dbus_conn, device->path, DEVICE_INTERFACE);
 }
 
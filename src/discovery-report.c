@@ -0,0 +1,495 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2014  Intel Corporation. All rights reserved.
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/sdp.h>
+
+#include <glib.h>
+#include <dbus/dbus.h>
+#include <gdbus/gdbus.h>
+
+#include "lib/uuid.h"
+#include "log.h"
+#include "error.h"
+#include "dbus-common.h"
+#include "uuid-helper.h"
+#include "eir.h"
+#include "discovery-report.h"
+
+#define REPORT_INTERFACE	"org.bluez.DiscoveryReport1"
+
+#define DEFAULT_INTERVAL	1000
+#define MIN_INTERVAL		100
+
+#define RSSI_ANY		-128
+
+/* Devices not seen for this many intervals are forgotten */
+#define EXPIRE_INTERVALS	10
+
+/* Fields to include in the next report besides address and RSSI */
+#define REPORT_DEVICE		(1 << 0)
+#define REPORT_NAME		(1 << 1)
+#define REPORT_CLASS		(1 << 2)
+#define REPORT_APPEARANCE	(1 << 3)
+#define REPORT_TX_POWER		(1 << 4)
+#define REPORT_UUIDS		(1 << 5)
+
+struct report_entry {
+	bdaddr_t bdaddr;
+	uint8_t bdaddr_type;
+	int8_t rssi;
+	int8_t tx_power;
+	uint32_t class;
+	uint16_t appearance;
+	char *name;
+	char *path;
+	GSList *uuids;
+	uint8_t changed;
+	bool pending;
+	gint64 last_seen;
+};
+
+struct discovery_report {
+	char *owner;
+	char *path;
+	uint16_t interval;
+	int8_t rssi;
+	GSList *uuids;			/* filter, empty means any */
+	GHashTable *entries;
+	gint64 last_expire;
+	GSList *pending;		/* entries seen in this window */
+	guint timeout;
+	unsigned int reports;
+	unsigned int seen;
+};
+
+static guint entry_hash(gconstpointer key)
+{
+	const struct report_entry *entry = key;
+	const uint8_t *b = entry->bdaddr.b;
+
+	return (b[0] | b[1] << 8 | b[2] << 16 | b[3] << 24) ^
+					(b[4] | b[5] << 8) ^ entry->bdaddr_type;
+}
+
+static gboolean entry_equal(gconstpointer a, gconstpointer b)
+{
+	const struct report_entry *entry1 = a, *entry2 = b;
+
+	return entry1->bdaddr_type == entry2->bdaddr_type &&
+			!bacmp(&entry1->bdaddr, &entry2->bdaddr);
+}
+
+static void entry_free(gpointer data)
+{
+	struct report_entry *entry = data;
+
+	g_slist_free_full(entry->uuids, g_free);
+	g_free(entry->name);
+	g_free(entry->path);
+	g_free(entry);
+}
+
+static void append_entry(DBusMessageIter *array, struct report_entry *entry)
+{
+	DBusMessageIter dict;
+	char addr[18], *str = addr;
+	const char *type;
+	int16_t rssi = entry->rssi;
+
+	ba2str(&entry->bdaddr, addr);
+	type = entry->bdaddr_type == BDADDR_LE_RANDOM ? "random" : "public";
+
+	dbus_message_iter_open_container(array, DBUS_TYPE_ARRAY,
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING, &dict);
+
+	dict_append_entry(&dict, "Address", DBUS_TYPE_STRING, &str);
+	dict_append_entry(&dict, "AddressType", DBUS_TYPE_STRING, &type);
+	dict_append_entry(&dict, "RSSI", DBUS_TYPE_INT16, &rssi);
+
+	if (entry->changed & REPORT_DEVICE)
+		dict_append_entry(&dict, "Device", DBUS_TYPE_OBJECT_PATH,
+								&entry->path);
+
+	if (entry->changed & REPORT_NAME)
+		dict_append_entry(&dict, "Name", DBUS_TYPE_STRING,
+								&entry->name);
+
+	if (entry->changed & REPORT_CLASS)
+		dict_append_entry(&dict, "Class", DBUS_TYPE_UINT32,
+								&entry->class);
+
+	if (entry->changed & REPORT_APPEARANCE)
+		dict_append_entry(&dict, "Appearance", DBUS_TYPE_UINT16,
+							&entry->appearance);
+
+	if (entry->changed & REPORT_TX_POWER) {
+		int16_t tx_power = entry->tx_power;
+
+		dict_append_entry(&dict, "TxPower", DBUS_TYPE_INT16,
+								&tx_power);
+	}
+
+	if (entry->changed & REPORT_UUIDS) {
+		char **uuids;
+		GSList *l;
+		int i;
+
+		uuids = g_new0(char *, g_slist_length(entry->uuids) + 1);
+		for (i = 0, l = entry->uuids; l; l = l->next, i++)
+			uuids[i] = l->data;
+
+		dict_append_array(&dict, "UUIDs", DBUS_TYPE_STRING, &uuids, i);
+
+		g_free(uuids);
+	}
+
+	dbus_message_iter_close_container(array, &dict);
+
+	entry->changed = 0;
+	entry->pending = false;
+}
+
+static gboolean report_flush(gpointer user_data)
+{
+	struct discovery_report *report = user_data;
+	DBusMessage *msg;
+	DBusMessageIter iter, array;
+	GSList *l;
+
+	report->timeout = 0;
+
+	msg = dbus_message_new_method_call(report->owner, report->path,
+						REPORT_INTERFACE, "Report");
+	if (msg == NULL) {
+		error("Couldn't allocate D-Bus message");
+		return FALSE;
+	}
+
+	dbus_message_set_no_reply(msg, TRUE);
+
+	dbus_message_iter_init_append(msg, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "a{sv}",
+								&array);
+
+	report->pending = g_slist_reverse(report->pending);
+
+	for (l = report->pending; l; l = l->next)
+		append_entry(&array, l->data);
+
+	dbus_message_iter_close_container(&iter, &array);
+
+	DBG("%s%s: %u devices (%u advertisements)", report->owner,
+				report->path, g_slist_length(report->pending),
+				report->seen);
+
+	g_slist_free(report->pending);
+	report->pending = NULL;
+	report->seen = 0;
+	report->reports++;
+
+	g_dbus_send_message(btd_get_dbus_connection(), msg);
+
+	return FALSE;
+}
+
+static bool match_uuids(struct discovery_report *report,
+						struct report_entry *entry)
+{
+	GSList *l;
+
+	if (report->uuids == NULL)
+		return true;
+
+	for (l = report->uuids; l; l = l->next) {
+		if (g_slist_find_custom(entry->uuids, l->data,
+						(GCompareFunc) strcasecmp))
+			return true;
+	}
+
+	return false;
+}
+
+static void update_entry(struct report_entry *entry,
+					const struct eir_data *eir,
+					const char *path)
+{
+	GSList *l;
+
+	if (path && g_strcmp0(entry->path, path) != 0) {
+		g_free(entry->path);
+		entry->path = g_strdup(path);
+		entry->changed |= REPORT_DEVICE;
+	}
+
+	if (eir->name && g_strcmp0(entry->name, eir->name) != 0 &&
+				(eir->name_complete || entry->name == NULL)) {
+		g_free(entry->name);
+		entry->name = g_strdup(eir->name);
+		entry->changed |= REPORT_NAME;
+	}
+
+	if (eir->class && eir->class != entry->class) {
+		entry->class = eir->class;
+		entry->changed |= REPORT_CLASS;
+	}
+
+	if (eir->appearance && eir->appearance != entry->appearance) {
+		entry->appearance = eir->appearance;
+		entry->changed |= REPORT_APPEARANCE;
+	}
+
+	if (eir->tx_power != 127 && eir->tx_power != entry->tx_power) {
+		entry->tx_power = eir->tx_power;
+		entry->changed |= REPORT_TX_POWER;
+	}
+
+	for (l = eir->services; l; l = l->next) {
+		if (g_slist_find_custom(entry->uuids, l->data,
+						(GCompareFunc) strcasecmp))
+			continue;
+
+		entry->uuids = g_slist_append(entry->uuids,
+							g_strdup(l->data));
+		entry->changed |= REPORT_UUIDS;
+	}
+}
+
+static gboolean entry_expired(gpointer key, gpointer value, gpointer user_data)
+{
+	struct report_entry *entry = value;
+	gint64 *deadline = user_data;
+
+	return !entry->pending && entry->last_seen < *deadline;
+}
+
+static void expire_entries(struct discovery_report *report, gint64 now)
+{
+	gint64 deadline = now - EXPIRE_INTERVALS * report->interval * 1000LL;
+	guint removed;
+
+	report->last_expire = now;
+
+	removed = g_hash_table_foreach_remove(report->entries, entry_expired,
+								&deadline);
+	if (removed)
+		DBG("%s%s: %u devices expired", report->owner, report->path,
+								removed);
+}
+
+void discovery_report_device(struct discovery_report *report,
+					const bdaddr_t *bdaddr,
+					uint8_t bdaddr_type, int8_t rssi,
+					const struct eir_data *eir,
+					const char *path)
+{
+	struct report_entry *entry, key;
+	gint64 now = g_get_monotonic_time();
+
+	/*
+	 * The table only grows here, so this is also where devices that
+	 * went away are dropped, at most once per interval.
+	 */
+	if (now - report->last_expire >= report->interval * 1000LL)
+		expire_entries(report, now);
+
+	bacpy(&key.bdaddr, bdaddr);
+	key.bdaddr_type = bdaddr_type;
+
+	entry = g_hash_table_lookup(report->entries, &key);
+	if (!entry) {
+		entry = g_new0(struct report_entry, 1);
+		bacpy(&entry->bdaddr, bdaddr);
+		entry->bdaddr_type = bdaddr_type;
+		entry->tx_power = 127;
+		g_hash_table_insert(report->entries, entry, entry);
+	}
+
+	report->seen++;
+	entry->last_seen = now;
+
+	/* Fields are tracked even while filtered out */
+	update_entry(entry, eir, path);
+	entry->rssi = rssi;
+
+	if (rssi < report->rssi || !match_uuids(report, entry))
+		return;
+
+	if (entry->pending)
+		return;
+
+	entry->pending = true;
+	report->pending = g_slist_prepend(report->pending, entry);
+
+	if (!report->timeout)
+		report->timeout = g_timeout_add(report->interval,
+							report_flush, report);
+}
+
+static int parse_uuids(DBusMessageIter *value, GSList **uuids)
+{
+	DBusMessageIter array;
+
+	if (dbus_message_iter_get_arg_type(value) != DBUS_TYPE_ARRAY)
+		return -EINVAL;
+
+	dbus_message_iter_recurse(value, &array);
+
+	while (dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_STRING) {
+		const char *uuid;
+		bt_uuid_t tmp;
+		char *str;
+
+		dbus_message_iter_get_basic(&array, &uuid);
+
+		str = bt_name2string(uuid);
+		if (str == NULL || bt_string_to_uuid(&tmp, str) < 0) {
+			g_free(str);
+			return -EINVAL;
+		}
+
+		*uuids = g_slist_append(*uuids, str);
+
+		dbus_message_iter_next(&array);
+	}
+
+	return 0;
+}
+
+static int parse_options(DBusMessageIter *args,
+					struct discovery_report *report)
+{
+	DBusMessageIter dict;
+
+	if (dbus_message_iter_get_arg_type(args) != DBUS_TYPE_ARRAY)
+		return -EINVAL;
+
+	dbus_message_iter_recurse(args, &dict);
+
+	while (dbus_message_iter_get_arg_type(&dict) == DBUS_TYPE_DICT_ENTRY) {
+		DBusMessageIter entry, value;
+		const char *key;
+
+		dbus_message_iter_recurse(&dict, &entry);
+		dbus_message_iter_get_basic(&entry, &key);
+
+		dbus_message_iter_next(&entry);
+		dbus_message_iter_recurse(&entry, &value);
+
+		if (strcasecmp(key, "Interval") == 0) {
+			if (dbus_message_iter_get_arg_type(&value) !=
+							DBUS_TYPE_UINT16)
+				return -EINVAL;
+
+			dbus_message_iter_get_basic(&value, &report->interval);
+			if (report->interval < MIN_INTERVAL)
+				return -EINVAL;
+		} else if (strcasecmp(key, "RSSI") == 0) {
+			int16_t rssi;
+
+			if (dbus_message_iter_get_arg_type(&value) !=
+							DBUS_TYPE_INT16)
+				return -EINVAL;
+
+			dbus_message_iter_get_basic(&value, &rssi);
+			if (rssi < RSSI_ANY || rssi > 20)
+				return -EINVAL;
+
+			report->rssi = rssi;
+		} else if (strcasecmp(key, "UUIDs") == 0) {
+			if (parse_uuids(&value, &report->uuids) < 0)
+				return -EINVAL;
+		}
+
+		dbus_message_iter_next(&dict);
+	}
+
+	return 0;
+}
+
+struct discovery_report *discovery_report_new(DBusMessage *msg,
+							DBusMessage **reply)
+{
+	struct discovery_report *report;
+	DBusMessageIter args;
+	const char *path;
+
+	if (!dbus_message_iter_init(msg, &args) ||
+			dbus_message_iter_get_arg_type(&args) !=
+							DBUS_TYPE_OBJECT_PATH) {
+		*reply = btd_error_invalid_args(msg);
+		return NULL;
+	}
+
+	dbus_message_iter_get_basic(&args, &path);
+	dbus_message_iter_next(&args);
+
+	report = g_new0(struct discovery_report, 1);
+	report->interval = DEFAULT_INTERVAL;
+	report->rssi = RSSI_ANY;
+
+	if (parse_options(&args, report) < 0) {
+		g_slist_free_full(report->uuids, g_free);
+		g_free(report);
+		*reply = btd_error_invalid_args(msg);
+		return NULL;
+	}
+
+	report->owner = g_strdup(dbus_message_get_sender(msg));
+	report->path = g_strdup(path);
+	report->entries = g_hash_table_new_full(entry_hash, entry_equal,
+							NULL, entry_free);
+
+	DBG("%s%s interval %u ms rssi %d", report->owner, report->path,
+					report->interval, report->rssi);
+
+	return report;
+}
+
+void discovery_report_free(struct discovery_report *report)
+{
+	DBG("%s%s: %u reports for %u devices", report->owner, report->path,
+			report->reports, g_hash_table_size(report->entries));
+
+	if (report->timeout)
+		g_source_remove(report->timeout);
+
+	g_slist_free(report->pending);
+	g_hash_table_destroy(report->entries);
+	g_slist_free_full(report->uuids, g_free);
+	g_free(report->owner);
+	g_free(report->path);
+	g_free(report);
+}
@@ -0,0 +1,40 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2014  Intel Corporation. All rights reserved.
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+struct discovery_report;
+
+/*
+ * Handles a D-Bus request with the object path of the client's reporter
+ * and an a{sv} options argument. Returns NULL with an error in *reply
+ * on failure.
+ */
+struct discovery_report *discovery_report_new(DBusMessage *msg,
+							DBusMessage **reply);
+void discovery_report_free(struct discovery_report *report);
+
+/* Path is the device object if there is one, NULL otherwise */
+void discovery_report_device(struct discovery_report *report,
+					const bdaddr_t *bdaddr,
+					uint8_t bdaddr_type, int8_t rssi,
+					const struct eir_data *eir,
+					const char *path);
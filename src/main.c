@@ -57,6 +57,7 @@
 #include "profile.h"
 #include "gatt.h"
 #include "systemd.h"
+#include "trace.h"
 
 #define BLUEZ_NAME "org.bluez"
 
@@ -435,6 +436,12 @@ static void disconnected_dbus(DBusConnection *conn, void *data)
 	g_main_loop_quit(event_loop);
 }
 
+static void trace_dbus_method(DBusMessage *msg, gint64 usec)
+{
+	btd_trace_name(BTD_TRACE_DBUS_METHOD, BTD_TRACE_INDEX_NONE,
+					dbus_message_get_member(msg), usec);
+}
+
 static int connect_dbus(void)
 {
 	DBusConnection *conn;
@@ -537,6 +544,8 @@ int main(int argc, char *argv[])
 
 	__btd_log_init(option_debug, option_detach);
 
+	btd_trace_init();
+
 	sd_notify(0, "STATUS=Starting up");
 
 	main_conf = load_config(CONFIGDIR "/main.conf");
@@ -552,6 +561,7 @@ int main(int argc, char *argv[])
 		gdbus_flags = G_DBUS_FLAG_ENABLE_EXPERIMENTAL;
 
 	g_dbus_set_flags(gdbus_flags);
+	g_dbus_set_method_trace(trace_dbus_method);
 
 	gatt_init();
 
@@ -635,6 +645,8 @@ int main(int argc, char *argv[])
 	if (watchdog > 0)
 		g_source_remove(watchdog);
 
+	btd_trace_cleanup();
+
 	__btd_log_cleanup();
 
 	return 0;
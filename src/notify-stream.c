@@ -0,0 +1,239 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2014  Intel Corporation. All rights reserved.
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+#include <dbus/dbus.h>
+
+#include "src/shared/util.h"
+#include "log.h"
+#include "error.h"
+#include "notify-stream.h"
+
+/* Largest attribute value plus its length prefix when batching */
+#define MAX_VALUE_LEN	512
+#define MAX_ENTRY_LEN	(2 + MAX_VALUE_LEN)
+#define MAX_BATCH	32
+
+struct notify_stream {
+	GIOChannel *io;
+	guint watch;
+	guint flush_id;
+	uint16_t batch;
+	uint16_t queued;
+	uint8_t *buf;
+	size_t len;
+	unsigned int dropped;
+	notify_stream_closed_t closed;
+	void *user_data;
+};
+
+static void stream_write(struct notify_stream *stream, const void *data,
+								size_t len)
+{
+	int fd = g_io_channel_unix_get_fd(stream->io);
+
+	if (send(fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL) >= 0)
+		return;
+
+	/* The client isn't keeping up, drop rather than stall the daemon */
+	if (stream->dropped++ == 0 || errno != EAGAIN)
+		DBG("stream %p: %s (%u dropped)", stream, strerror(errno),
+							stream->dropped);
+}
+
+static gboolean flush_batch(gpointer user_data)
+{
+	struct notify_stream *stream = user_data;
+
+	stream->flush_id = 0;
+
+	if (!stream->queued)
+		return FALSE;
+
+	stream_write(stream, stream->buf, stream->len);
+
+	stream->queued = 0;
+	stream->len = 0;
+
+	return FALSE;
+}
+
+static gboolean stream_hup(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	struct notify_stream *stream = user_data;
+
+	DBG("stream %p closed by client", stream);
+
+	stream->watch = 0;
+
+	if (stream->closed)
+		stream->closed(stream, stream->user_data);
+
+	return FALSE;
+}
+
+static int parse_options(DBusMessage *msg, uint16_t *batch)
+{
+	DBusMessageIter args, dict;
+
+	*batch = 1;
+
+	if (!dbus_message_iter_init(msg, &args))
+		return -EINVAL;
+
+	if (dbus_message_iter_get_arg_type(&args) != DBUS_TYPE_ARRAY)
+		return -EINVAL;
+
+	dbus_message_iter_recurse(&args, &dict);
+
+	while (dbus_message_iter_get_arg_type(&dict) == DBUS_TYPE_DICT_ENTRY) {
+		DBusMessageIter entry, value;
+		const char *key;
+
+		dbus_message_iter_recurse(&dict, &entry);
+		dbus_message_iter_get_basic(&entry, &key);
+
+		dbus_message_iter_next(&entry);
+		dbus_message_iter_recurse(&entry, &value);
+
+		if (strcasecmp(key, "Batch") == 0) {
+			if (dbus_message_iter_get_arg_type(&value) !=
+							DBUS_TYPE_UINT16)
+				return -EINVAL;
+
+			dbus_message_iter_get_basic(&value, batch);
+			if (*batch == 0 || *batch > MAX_BATCH)
+				return -EINVAL;
+		}
+
+		dbus_message_iter_next(&dict);
+	}
+
+	return 0;
+}
+
+struct notify_stream *notify_stream_acquire(DBusMessage *msg,
+					notify_stream_closed_t closed,
+					void *user_data, DBusMessage **reply)
+{
+	struct notify_stream *stream;
+	uint16_t batch;
+	int sv[2];
+
+	if (parse_options(msg, &batch) < 0) {
+		*reply = btd_error_invalid_args(msg);
+		return NULL;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+								0, sv) < 0) {
+		*reply = btd_error_failed(msg, strerror(errno));
+		return NULL;
+	}
+
+	stream = g_new0(struct notify_stream, 1);
+	stream->batch = batch;
+	stream->closed = closed;
+	stream->user_data = user_data;
+
+	if (batch > 1)
+		stream->buf = g_malloc(batch * MAX_ENTRY_LEN);
+
+	stream->io = g_io_channel_unix_new(sv[0]);
+	g_io_channel_set_close_on_unref(stream->io, TRUE);
+	stream->watch = g_io_add_watch(stream->io,
+					G_IO_HUP | G_IO_ERR | G_IO_NVAL,
+					stream_hup, stream);
+
+	*reply = dbus_message_new_method_return(msg);
+	dbus_message_append_args(*reply, DBUS_TYPE_UNIX_FD, &sv[1],
+							DBUS_TYPE_INVALID);
+
+	/* The message holds its own duplicate of the descriptor */
+	close(sv[1]);
+
+	DBG("stream %p batch %u", stream, batch);
+
+	return stream;
+}
+
+void notify_stream_free(struct notify_stream *stream)
+{
+	if (stream->flush_id)
+		g_source_remove(stream->flush_id);
+
+	if (stream->watch)
+		g_source_remove(stream->watch);
+
+	if (stream->dropped)
+		DBG("stream %p dropped %u values", stream, stream->dropped);
+
+	g_io_channel_shutdown(stream->io, FALSE, NULL);
+	g_io_channel_unref(stream->io);
+
+	g_free(stream->buf);
+	g_free(stream);
+}
+
+/*
+ * Without batching every value is a datagram of its own. Otherwise each
+ * value is prefixed by its 16 bit length and the values received in one
+ * main loop iteration share a datagram, up to the requested count.
+ */
+void notify_stream_send(struct notify_stream *stream, const uint8_t *value,
+								uint16_t len)
+{
+	if (len > MAX_VALUE_LEN)
+		len = MAX_VALUE_LEN;
+
+	if (stream->batch == 1) {
+		stream_write(stream, value, len);
+		return;
+	}
+
+	put_le16(len, stream->buf + stream->len);
+	memcpy(stream->buf + stream->len + 2, value, len);
+	stream->len += 2 + len;
+
+	if (++stream->queued == stream->batch) {
+		if (stream->flush_id)
+			g_source_remove(stream->flush_id);
+
+		flush_batch(stream);
+		return;
+	}
+
+	if (!stream->flush_id)
+		stream->flush_id = g_idle_add(flush_batch, stream);
+}
@@ -0,0 +1,40 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2014  Intel Corporation. All rights reserved.
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+struct notify_stream;
+
+typedef void (*notify_stream_closed_t) (struct notify_stream *stream,
+							void *user_data);
+
+/*
+ * Handles a D-Bus request with an a{sv} options argument by creating a
+ * stream and replying with the client end of its socket. Returns NULL
+ * with an error in *reply on failure.
+ */
+struct notify_stream *notify_stream_acquire(DBusMessage *msg,
+					notify_stream_closed_t closed,
+					void *user_data, DBusMessage **reply);
+void notify_stream_free(struct notify_stream *stream);
+
+void notify_stream_send(struct notify_stream *stream, const uint8_t *value,
+								uint16_t len);
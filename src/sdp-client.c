@@ -153,7 +153,7 @@ static void search_completed_cb(uint8_t type, uint16_t status,
 		int recsize;
 
 		recsize = 0;
-		rec = sdp_extract_pdu(rsp, bytesleft, &recsize);
+		rec = sdp_extract_pdu_compact(rsp, bytesleft, &recsize);
 		if (!rec)
 			break;
 
@@ -220,3 +220,51 @@ struct bt_att_notify_param {
 #define BT_ATT_ERROR_INSUFFICIENT_ENCRYPTION		0x0F
 #define BT_ATT_ERROR_UNSUPPORTED_GROUP_TYPE		0x10
 #define BT_ATT_ERROR_INSUFFICIENT_RESOURCES		0x11
+
+/*
+ * Per-bearer counters kept by the ATT implementations. Round trips are
+ * measured in microseconds from sending a request or indication to its
+ * response or confirmation, rtt[n] counts those that took less than
+ * 2^n ms and the last bucket all longer ones.
+ */
+#define BT_ATT_STATS_RTT_BUCKETS		16
+
+struct bt_att_stats {
+	uint64_t tx_bytes;
+	uint64_t rx_bytes;
+	uint32_t tx_pdus;
+	uint32_t rx_pdus;
+	uint32_t requests;
+	uint32_t errors;
+	uint32_t timeouts;
+	uint32_t cached;
+	uint32_t notifications;
+	uint32_t indications;
+	uint32_t queued;
+	uint32_t max_queued;
+	uint32_t rtt_count;
+	uint32_t rtt_min;
+	uint32_t rtt_max;
+	uint64_t rtt_total;
+	uint32_t rtt[BT_ATT_STATS_RTT_BUCKETS];
+};
+
+static inline void bt_att_stats_add_rtt(struct bt_att_stats *stats,
+								uint32_t usec)
+{
+	unsigned int n = 0;
+
+	while (n < BT_ATT_STATS_RTT_BUCKETS - 1 && usec >= (1000U << n))
+		n++;
+
+	stats->rtt[n]++;
+
+	if (!stats->rtt_count || usec < stats->rtt_min)
+		stats->rtt_min = usec;
+
+	if (usec > stats->rtt_max)
+		stats->rtt_max = usec;
+
+	stats->rtt_count++;
+	stats->rtt_total += usec;
+}
@@ -28,6 +28,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 
 #include "src/shared/io.h"
 #include "src/shared/queue.h"
@@ -71,6 +72,8 @@ struct bt_att {
 	bt_att_debug_func_t debug_callback;
 	bt_att_destroy_func_t debug_destroy;
 	void *debug_data;
+
+	struct bt_att_stats stats;
 };
 
 enum att_op_type {
@@ -140,8 +143,19 @@ struct att_send_op {
 	bt_att_request_func_t callback;
 	bt_att_destroy_func_t destroy;
 	void *user_data;
+	struct timespec sent;
 };
 
+static uint32_t elapsed_usec(const struct timespec *since)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - since->tv_sec) * 1000000 +
+				(now.tv_nsec - since->tv_nsec) / 1000;
+}
+
 static bool encode_mtu_req(struct att_send_op *op, const void *param,
 						uint16_t length, uint16_t mtu)
 {
@@ -312,6 +326,7 @@ static bool timeout_cb(void *user_data)
 		return false;
 
 	att->invalid = true;
+	att->stats.timeouts++;
 
 	util_debug(att->debug_callback, att->debug_data,
 				"Operation timed out: 0x%02x", op->opcode);
@@ -361,6 +376,9 @@ static bool can_write_data(struct io *io, void *user_data)
 	util_hexdump('<', op->pdu, bytes_written,
 					att->debug_callback, att->debug_data);
 
+	att->stats.tx_pdus++;
+	att->stats.tx_bytes += bytes_written;
+
 	/* Based on the operation type, set either the pending request or the
 	 * pending indication. If it came from the write queue, then there is
 	 * no need to keep it around.
@@ -377,6 +395,9 @@ static bool can_write_data(struct io *io, void *user_data)
 		return true;
 	}
 
+	att->stats.requests++;
+	clock_gettime(CLOCK_MONOTONIC, &op->sent);
+
 	timeout = new0(struct timeout_data, 1);
 	if (!timeout)
 		return true;
@@ -430,6 +451,11 @@ static bool request_complete(struct bt_att *att, uint8_t req_opcode,
 		return false;
 	}
 
+	bt_att_stats_add_rtt(&att->stats, elapsed_usec(&op->sent));
+
+	if (rsp_opcode == BT_ATT_OP_ERROR_RSP)
+		att->stats.errors++;
+
 	if (op->callback)
 		op->callback(rsp_opcode, param, len, op->user_data);
 
@@ -501,6 +527,28 @@ static void handle_rsp(struct bt_att *att, uint8_t opcode, uint8_t *pdu,
 						BT_ATT_OP_ERROR_RSP, NULL, 0);
 }
 
+static void handle_conf(struct bt_att *att, uint8_t *pdu, ssize_t pdu_len)
+{
+	struct att_send_op *op = att->pending_ind;
+
+	/* A confirmation has no parameters and answers the indication */
+	if (!op || pdu_len != 1) {
+		util_debug(att->debug_callback, att->debug_data,
+						"Unexpected confirmation");
+		return;
+	}
+
+	bt_att_stats_add_rtt(&att->stats, elapsed_usec(&op->sent));
+
+	if (op->callback)
+		op->callback(BT_ATT_OP_HANDLE_VAL_CONF, NULL, 0, op->user_data);
+
+	destroy_att_send_op(op);
+	att->pending_ind = NULL;
+
+	wakeup_writer(att);
+}
+
 static bool can_read_data(struct io *io, void *user_data)
 {
 	struct bt_att *att = user_data;
@@ -521,11 +569,22 @@ static bool can_read_data(struct io *io, void *user_data)
 	pdu = att->buf;
 	opcode = pdu[0];
 
+	att->stats.rx_pdus++;
+	att->stats.rx_bytes += bytes_read;
+
+	if (opcode == BT_ATT_OP_HANDLE_VAL_NOT)
+		att->stats.notifications++;
+	else if (opcode == BT_ATT_OP_HANDLE_VAL_IND)
+		att->stats.indications++;
+
 	/* Act on the received PDU based on the opcode type */
 	switch (get_op_type(opcode)) {
 	case ATT_OP_TYPE_RSP:
 		handle_rsp(att, opcode, pdu, bytes_read);
 		break;
+	case ATT_OP_TYPE_CONF:
+		handle_conf(att, pdu, bytes_read);
+		break;
 	default:
 		util_debug(att->debug_callback, att->debug_data,
 				"ATT opcode cannot be handled: 0x%02x", opcode);
@@ -689,6 +748,19 @@ bool bt_att_set_mtu(struct bt_att *att, uint16_t mtu)
 	return true;
 }
 
+bool bt_att_get_stats(struct bt_att *att, struct bt_att_stats *stats)
+{
+	if (!att || !stats)
+		return false;
+
+	*stats = att->stats;
+	stats->queued = queue_length(att->req_queue) +
+					queue_length(att->ind_queue) +
+					queue_length(att->write_queue);
+
+	return true;
+}
+
 bool bt_att_set_timeout_cb(struct bt_att *att, bt_att_timeout_func_t callback,
 						void *user_data,
 						bt_att_destroy_func_t destroy)
@@ -712,6 +784,7 @@ unsigned int bt_att_send(struct bt_att *att, uint8_t opcode,
 				bt_att_destroy_func_t destroy)
 {
 	struct att_send_op *op;
+	unsigned int queued;
 	bool result;
 
 	if (!att)
@@ -749,6 +822,11 @@ unsigned int bt_att_send(struct bt_att *att, uint8_t opcode,
 		return 0;
 	}
 
+	queued = queue_length(att->req_queue) + queue_length(att->ind_queue) +
+					queue_length(att->write_queue);
+	if (queued > att->stats.max_queued)
+		att->stats.max_queued = queued;
+
 	wakeup_writer(att);
 
 	return op->id;
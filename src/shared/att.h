@@ -51,6 +51,8 @@ bool bt_att_set_debug(struct bt_att *att, bt_att_debug_func_t callback,
 uint16_t bt_att_get_mtu(struct bt_att *att);
 bool bt_att_set_mtu(struct bt_att *att, uint16_t mtu);
 
+bool bt_att_get_stats(struct bt_att *att, struct bt_att_stats *stats);
+
 bool bt_att_set_timeout_cb(struct bt_att *att, bt_att_timeout_func_t callback,
 						void *user_data,
 						bt_att_destroy_func_t destroy);
@@ -29,6 +29,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 
 #include "lib/bluetooth.h"
 #include "lib/mgmt.h"
@@ -59,6 +60,8 @@ struct mgmt {
 	mgmt_debug_func_t debug_callback;
 	mgmt_destroy_func_t debug_destroy;
 	void *debug_data;
+	mgmt_trace_func_t trace_callback;
+	void *trace_data;
 };
 
 struct mgmt_request {
@@ -70,6 +73,7 @@ struct mgmt_request {
 	mgmt_request_func_t callback;
 	mgmt_destroy_func_t destroy;
 	void *user_data;
+	struct timespec sent;
 };
 
 struct mgmt_notify {
@@ -193,6 +197,9 @@ static bool can_write_data(struct io *io, void *user_data)
 	util_hexdump('<', request->buf, bytes_written,
 				mgmt->debug_callback, mgmt->debug_data);
 
+	if (mgmt->trace_callback)
+		clock_gettime(CLOCK_MONOTONIC, &request->sent);
+
 	queue_push_tail(mgmt->pending_list, request);
 
 	return false;
@@ -227,15 +234,35 @@ static bool match_request_opcode_index(const void *a, const void *b)
 					request->index == match->index;
 }
 
-static void request_complete(struct mgmt *mgmt, uint8_t status,
-					uint16_t opcode, uint16_t index,
-					uint16_t length, const void *param)
+static uint32_t elapsed_usec(const struct timespec *since)
+{
+	struct timespec now;
+
+	if (!since->tv_sec && !since->tv_nsec)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - since->tv_sec) * 1000000 +
+				(now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+static void request_complete(struct mgmt *mgmt, uint16_t event,
+					uint8_t status, uint16_t opcode,
+					uint16_t index, uint16_t length,
+					const void *param)
 {
 	struct opcode_index match = { .opcode = opcode, .index = index };
 	struct mgmt_request *request;
 
 	request = queue_remove_if(mgmt->pending_list,
 					match_request_opcode_index, &match);
+
+	if (mgmt->trace_callback)
+		mgmt->trace_callback(event, opcode, index, status, length,
+				request ? elapsed_usec(&request->sent) : 0,
+				mgmt->trace_data);
+
 	if (request) {
 		if (request->callback)
 			request->callback(status, length, param,
@@ -342,8 +369,8 @@ static bool can_read_data(struct io *io, void *user_data)
 				"[0x%04x] command 0x%04x complete: 0x%02x",
 						index, opcode, cc->status);
 
-		request_complete(mgmt, cc->status, opcode, index, length - 3,
-						mgmt->buf + MGMT_HDR_SIZE + 3);
+		request_complete(mgmt, event, cc->status, opcode, index,
+				length - 3, mgmt->buf + MGMT_HDR_SIZE + 3);
 		break;
 	case MGMT_EV_CMD_STATUS:
 		cs = mgmt->buf + MGMT_HDR_SIZE;
@@ -353,12 +380,17 @@ static bool can_read_data(struct io *io, void *user_data)
 				"[0x%04x] command 0x%02x status: 0x%02x",
 						index, opcode, cs->status);
 
-		request_complete(mgmt, cs->status, opcode, index, 0, NULL);
+		request_complete(mgmt, event, cs->status, opcode, index,
+								0, NULL);
 		break;
 	default:
 		util_debug(mgmt->debug_callback, mgmt->debug_data,
 				"[0x%04x] event 0x%04x", index, event);
 
+		if (mgmt->trace_callback)
+			mgmt->trace_callback(event, 0, index, 0, length, 0,
+							mgmt->trace_data);
+
 		process_notify(mgmt, event, index, length,
 						mgmt->buf + MGMT_HDR_SIZE);
 		break;
@@ -553,6 +585,18 @@ bool mgmt_set_debug(struct mgmt *mgmt, mgmt_debug_func_t callback,
 	return true;
 }
 
+bool mgmt_set_trace(struct mgmt *mgmt, mgmt_trace_func_t callback,
+							void *user_data)
+{
+	if (!mgmt)
+		return false;
+
+	mgmt->trace_callback = callback;
+	mgmt->trace_data = user_data;
+
+	return true;
+}
+
 bool mgmt_set_close_on_unref(struct mgmt *mgmt, bool do_close)
 {
 	if (!mgmt)
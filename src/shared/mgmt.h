@@ -43,6 +43,19 @@ bool mgmt_set_debug(struct mgmt *mgmt, mgmt_debug_func_t callback,
 
 bool mgmt_set_close_on_unref(struct mgmt *mgmt, bool do_close);
 
+/*
+ * Called for every event read from the socket. For command complete and
+ * status events, opcode is the command and usec the time since it was
+ * written, otherwise both are zero.
+ */
+typedef void (*mgmt_trace_func_t)(uint16_t event, uint16_t opcode,
+					uint16_t index, uint8_t status,
+					uint16_t length, uint32_t usec,
+					void *user_data);
+
+bool mgmt_set_trace(struct mgmt *mgmt, mgmt_trace_func_t callback,
+							void *user_data);
+
 typedef void (*mgmt_request_func_t)(uint8_t status, uint16_t length,
 					const void *param, void *user_data);
 
@@ -43,10 +43,20 @@
 #include <bluetooth/sdp_lib.h>
 
 #include "lib/uuid.h"
+#include "src/shared/util.h"
 #include "textfile.h"
 #include "uuid-helper.h"
 #include "storage.h"
 
+/*
+ * Binary cache of remote service records: a header with magic, version,
+ * record count and the device class at browse time, followed by each
+ * record PDU prefixed with its 16 bit length. All fields little endian.
+ */
+#define RECORDS_MAGIC		"BZSR"
+#define RECORDS_VERSION		1
+#define RECORDS_HDR_SIZE	16
+
 /* When all services should trust a remote device */
 #define GLOBAL_TRUST "[all]"
 
@@ -160,12 +170,116 @@ sdp_record_t *record_from_string(const char *str)
 		pdata[i] = (uint8_t) strtol(tmp, NULL, 16);
 	}
 
-	rec = sdp_extract_pdu(pdata, size, &len);
+	rec = sdp_extract_pdu_compact(pdata, size, &len);
 	g_free(pdata);
 
 	return rec;
 }
 
+int records_to_file(const char *filename, uint32_t class, sdp_list_t *recs)
+{
+	GByteArray *data;
+	uint8_t hdr[RECORDS_HDR_SIZE];
+	uint32_t count = 0;
+	sdp_list_t *seq;
+	gboolean ret;
+
+	data = g_byte_array_sized_new(1024);
+	g_byte_array_append(data, hdr, sizeof(hdr));
+
+	for (seq = recs; seq; seq = seq->next) {
+		sdp_record_t *rec = seq->data;
+		uint8_t len[2];
+		sdp_buf_t buf;
+
+		if (sdp_gen_record_pdu(rec, &buf) < 0)
+			continue;
+
+		if (buf.data_size > UINT16_MAX) {
+			free(buf.data);
+			continue;
+		}
+
+		put_le16(buf.data_size, len);
+		g_byte_array_append(data, len, sizeof(len));
+		g_byte_array_append(data, buf.data, buf.data_size);
+		free(buf.data);
+
+		count++;
+	}
+
+	memcpy(data->data, RECORDS_MAGIC, 4);
+	data->data[4] = RECORDS_VERSION;
+	memset(data->data + 5, 0, 3);
+	put_le32(count, data->data + 8);
+	put_le32(class, data->data + 12);
+
+	create_file(filename, S_IRUSR | S_IWUSR);
+	ret = g_file_set_contents(filename, (char *) data->data, data->len,
+									NULL);
+
+	g_byte_array_free(data, TRUE);
+
+	return ret ? 0 : -EIO;
+}
+
+sdp_list_t *records_from_file(const char *filename, uint32_t *class)
+{
+	sdp_list_t *recs = NULL;
+	uint32_t count;
+	gsize len, off;
+	gchar *contents;
+	uint8_t *data;
+
+	if (!g_file_get_contents(filename, &contents, &len, NULL))
+		return NULL;
+
+	data = (uint8_t *) contents;
+
+	if (len < RECORDS_HDR_SIZE || memcmp(data, RECORDS_MAGIC, 4) ||
+					data[4] != RECORDS_VERSION)
+		goto done;
+
+	count = get_le32(data + 8);
+
+	if (class)
+		*class = get_le32(data + 12);
+
+	for (off = RECORDS_HDR_SIZE; count > 0; count--) {
+		sdp_record_t *rec;
+		uint16_t size;
+		int scanned;
+
+		if (len - off < 2)
+			break;
+
+		size = get_le16(data + off);
+		off += 2;
+
+		if (len - off < size)
+			break;
+
+		rec = sdp_extract_pdu_compact(data + off, size, &scanned);
+		off += size;
+
+		if (!rec)
+			continue;
+
+		recs = sdp_list_append(recs, rec);
+	}
+
+	/* A truncated file is as good as none */
+	if (count > 0) {
+		sdp_list_free(recs, (sdp_free_func_t) sdp_record_free);
+		recs = NULL;
+	}
+
+done:
+	g_free(contents);
+
+	return recs;
+}
+
 sdp_record_t *find_record_in_list(sdp_list_t *recs, const char *uuid)
 {
 	sdp_list_t *seq;
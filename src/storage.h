@@ -27,3 +27,5 @@ int read_on_mode(const char *src, char *mode, int length);
 int read_local_name(const bdaddr_t *bdaddr, char *name);
 sdp_record_t *record_from_string(const char *str);
 sdp_record_t *find_record_in_list(sdp_list_t *recs, const char *uuid);
+int records_to_file(const char *filename, uint32_t class, sdp_list_t *recs);
+sdp_list_t *records_from_file(const char *filename, uint32_t *class);
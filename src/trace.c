@@ -0,0 +1,377 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2014  Intel Corporation. All rights reserved.
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <glib.h>
+
+#include "log.h"
+#include "trace.h"
+
+#define RING_SIZE	4096	/* must be a power of two */
+
+struct trace_client {
+	int fd;
+	guint watch;
+	guint out_watch;
+	uint64_t seq;			/* next record to send */
+	uint32_t dropped;
+};
+
+static struct btd_trace_record ring[RING_SIZE];
+static uint64_t ring_seq;
+static struct btd_trace_histogram histograms[BTD_TRACE_EVENT_MAX + 1];
+
+static GSList *clients;
+static guint server_watch;
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int send_packet(int fd, uint16_t type, const void *data, uint16_t len)
+{
+	struct btd_trace_hdr hdr = { .type = type, .len = len };
+	struct iovec iov[2];
+	struct msghdr msg;
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = (void *) data;
+	iov[1].iov_len = len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+
+	if (sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static void client_free(gpointer data)
+{
+	struct trace_client *client = data;
+
+	if (client->out_watch > 0)
+		g_source_remove(client->out_watch);
+
+	clients = g_slist_remove(clients, client);
+
+	DBG("fd %d", client->fd);
+
+	close(client->fd);
+	g_free(client);
+}
+
+static gboolean client_out(GIOChannel *io, GIOCondition cond,
+							gpointer user_data);
+
+static void client_flush(struct trace_client *client)
+{
+	int err;
+
+	if (ring_seq - client->seq > RING_SIZE) {
+		client->dropped += ring_seq - client->seq - RING_SIZE;
+		client->seq = ring_seq - RING_SIZE;
+	}
+
+	while (client->seq < ring_seq) {
+		if (client->dropped) {
+			struct btd_trace_dropped ev = {
+				.count = client->dropped
+			};
+
+			err = send_packet(client->fd, BTD_TRACE_TYPE_DROPPED,
+							&ev, sizeof(ev));
+			if (err < 0)
+				goto failed;
+
+			client->dropped = 0;
+		}
+
+		err = send_packet(client->fd, BTD_TRACE_TYPE_RECORD,
+				&ring[client->seq & (RING_SIZE - 1)],
+				sizeof(struct btd_trace_record));
+		if (err < 0)
+			goto failed;
+
+		client->seq++;
+	}
+
+	return;
+
+failed:
+	if (err != -EAGAIN) {
+		g_source_remove(client->watch);
+		return;
+	}
+
+	if (client->out_watch == 0) {
+		GIOChannel *io = g_io_channel_unix_new(client->fd);
+
+		client->out_watch = g_io_add_watch(io, G_IO_OUT, client_out,
+									client);
+		g_io_channel_unref(io);
+	}
+}
+
+static gboolean client_out(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	struct trace_client *client = user_data;
+
+	client->out_watch = 0;
+
+	client_flush(client);
+
+	return FALSE;
+}
+
+static void send_histograms(struct trace_client *client)
+{
+	uint16_t event;
+
+	for (event = 1; event <= BTD_TRACE_EVENT_MAX; event++) {
+		struct btd_trace_histogram *hist = &histograms[event];
+
+		if (!hist->count)
+			continue;
+
+		hist->event = event;
+
+		/* Histograms are a snapshot and can be asked for again */
+		send_packet(client->fd, BTD_TRACE_TYPE_HISTOGRAM, hist,
+							sizeof(*hist));
+	}
+}
+
+static gboolean client_event(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	struct trace_client *client = user_data;
+	uint8_t buf[16];
+
+	if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL))
+		return FALSE;
+
+	/* Any packet from the client is a request for histograms */
+	if (recv(client->fd, buf, sizeof(buf), MSG_DONTWAIT) <= 0)
+		return FALSE;
+
+	send_histograms(client);
+
+	return TRUE;
+}
+
+static void record(uint16_t event, uint16_t index, uint32_t latency,
+				const uint32_t *args, const char *name)
+{
+	struct btd_trace_record *rec = &ring[ring_seq & (RING_SIZE - 1)];
+	GSList *l;
+
+	rec->time = now_usec();
+	rec->event = event;
+	rec->index = index;
+	rec->latency = latency;
+
+	if (name)
+		strncpy(rec->name, name, sizeof(rec->name));
+	else
+		memcpy(rec->arg, args, sizeof(rec->arg));
+
+	ring_seq++;
+
+	for (l = clients; l;) {
+		struct trace_client *client = l->data;
+
+		l = l->next;
+
+		if (client->out_watch == 0)
+			client_flush(client);
+	}
+}
+
+static void histogram_add(uint16_t event, uint32_t latency)
+{
+	struct btd_trace_histogram *hist = &histograms[event];
+	unsigned int n = 0;
+
+	while (n < BTD_TRACE_BUCKETS - 1 && latency >= (1U << n))
+		n++;
+
+	hist->bucket[n]++;
+	hist->count++;
+	hist->total += latency;
+
+	if (latency > hist->max)
+		hist->max = latency;
+}
+
+void btd_trace(uint16_t event, uint16_t index, uint32_t arg1, uint32_t arg2,
+								uint32_t arg3)
+{
+	uint32_t args[4] = { arg1, arg2, arg3, 0 };
+
+	record(event, index, 0, args, NULL);
+}
+
+void btd_trace_name(uint16_t event, uint16_t index, const char *name,
+							uint32_t latency)
+{
+	record(event, index, latency, NULL, name);
+	histogram_add(event, latency);
+}
+
+uint64_t btd_trace_begin(void)
+{
+	return now_usec();
+}
+
+void btd_trace_latency(uint16_t event, uint16_t index, uint32_t latency,
+				uint32_t arg1, uint32_t arg2, uint32_t arg3)
+{
+	uint32_t args[4] = { arg1, arg2, arg3, 0 };
+
+	record(event, index, latency, args, NULL);
+	histogram_add(event, latency);
+}
+
+void btd_trace_end(uint64_t start, uint16_t event, uint16_t index,
+				uint32_t arg1, uint32_t arg2, uint32_t arg3)
+{
+	btd_trace_latency(event, index, now_usec() - start, arg1, arg2, arg3);
+}
+
+static gboolean server_accept(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	struct trace_client *client;
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	GIOChannel *cio;
+	int fd;
+
+	if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL)) {
+		server_watch = 0;
+		return FALSE;
+	}
+
+	fd = accept4(g_io_channel_unix_get_fd(io), NULL, NULL,
+						SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (fd < 0)
+		return TRUE;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+		close(fd);
+		return TRUE;
+	}
+
+	if (cred.uid != 0 && cred.uid != getuid()) {
+		warn("Rejected trace client with uid %u", cred.uid);
+		close(fd);
+		return TRUE;
+	}
+
+	client = g_new0(struct trace_client, 1);
+	client->fd = fd;
+	client->seq = ring_seq > RING_SIZE ? ring_seq - RING_SIZE : 0;
+
+	cio = g_io_channel_unix_new(fd);
+	client->watch = g_io_add_watch_full(cio, G_PRIORITY_DEFAULT,
+				G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+				client_event, client, client_free);
+	g_io_channel_unref(cio);
+
+	clients = g_slist_prepend(clients, client);
+
+	DBG("fd %d pid %u", fd, cred.pid);
+
+	send_histograms(client);
+	client_flush(client);
+
+	return TRUE;
+}
+
+void btd_trace_init(void)
+{
+	struct sockaddr_un addr;
+	socklen_t len;
+	GIOChannel *io;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd < 0) {
+		error("Failed to open trace socket: %s", strerror(errno));
+		return;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path + 1, BTD_TRACE_SOCKET);
+	len = offsetof(struct sockaddr_un, sun_path) + 1 +
+						strlen(BTD_TRACE_SOCKET);
+
+	if (bind(fd, (struct sockaddr *) &addr, len) < 0 ||
+							listen(fd, 5) < 0) {
+		error("Failed to bind trace socket: %s", strerror(errno));
+		close(fd);
+		return;
+	}
+
+	io = g_io_channel_unix_new(fd);
+	g_io_channel_set_close_on_unref(io, TRUE);
+	server_watch = g_io_add_watch(io, G_IO_IN | G_IO_ERR | G_IO_HUP |
+					G_IO_NVAL, server_accept, NULL);
+	g_io_channel_unref(io);
+}
+
+void btd_trace_cleanup(void)
+{
+	while (clients) {
+		struct trace_client *client = clients->data;
+
+		g_source_remove(client->watch);
+	}
+
+	if (server_watch > 0) {
+		g_source_remove(server_watch);
+		server_watch = 0;
+	}
+}
@@ -0,0 +1,95 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2014  Intel Corporation. All rights reserved.
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdint.h>
+
+/* Abstract socket name, the leading NUL is not part of the string */
+#define BTD_TRACE_SOCKET	"bluetoothd-trace"
+
+#define BTD_TRACE_MGMT_EVENT		0x0001	/* event, length */
+#define BTD_TRACE_MGMT_COMMAND		0x0002	/* opcode, status, length */
+#define BTD_TRACE_ATT_IN		0x0003	/* opcode, length */
+#define BTD_TRACE_ATT_OUT		0x0004	/* opcode, length */
+#define BTD_TRACE_DBUS_METHOD		0x0005	/* name */
+#define BTD_TRACE_STORAGE_WRITE		0x0006	/* length */
+#define BTD_TRACE_EVENT_MAX		0x0006
+
+#define BTD_TRACE_INDEX_NONE		0xffff
+
+#define BTD_TRACE_BUCKETS		24
+
+/*
+ * Wire format of the trace socket, a SOCK_SEQPACKET socket carrying one
+ * header and its payload per packet in host byte order.
+ */
+#define BTD_TRACE_TYPE_RECORD		0x01
+#define BTD_TRACE_TYPE_HISTOGRAM	0x02
+#define BTD_TRACE_TYPE_DROPPED		0x03
+
+struct btd_trace_hdr {
+	uint16_t type;
+	uint16_t len;
+} __attribute__((packed));
+
+struct btd_trace_record {
+	uint64_t time;			/* CLOCK_MONOTONIC in usec */
+	uint16_t event;
+	uint16_t index;
+	uint32_t latency;		/* usec, zero if not measured */
+	union {
+		uint32_t arg[4];
+		char name[16];		/* not NUL terminated if full */
+	};
+} __attribute__((packed));
+
+/* Bucket n counts latencies below 2^n usec, the last one all others */
+struct btd_trace_histogram {
+	uint16_t event;
+	uint32_t count;
+	uint64_t total;
+	uint32_t max;
+	uint32_t bucket[BTD_TRACE_BUCKETS];
+} __attribute__((packed));
+
+struct btd_trace_dropped {
+	uint32_t count;
+} __attribute__((packed));
+
+void btd_trace_init(void);
+void btd_trace_cleanup(void);
+
+void btd_trace(uint16_t event, uint16_t index, uint32_t arg1, uint32_t arg2,
+								uint32_t arg3);
+void btd_trace_name(uint16_t event, uint16_t index, const char *name,
+							uint32_t latency);
+
+/*
+ * Latency measurement for request and response pairs. The value returned
+ * by btd_trace_begin() is passed back to btd_trace_end() which records
+ * the event and adds the elapsed time to its histogram.
+ */
+uint64_t btd_trace_begin(void);
+void btd_trace_end(uint64_t start, uint16_t event, uint16_t index,
+				uint32_t arg1, uint32_t arg2, uint32_t arg3);
+void btd_trace_latency(uint16_t event, uint16_t index, uint32_t latency,
+				uint32_t arg1, uint32_t arg2, uint32_t arg3);
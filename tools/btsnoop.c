@@ -35,7 +35,9 @@
 #include <stdbool.h>
 #include <string.h>
 #include <getopt.h>
+#include <limits.h>
 #include <arpa/inet.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include "src/shared/btsnoop.h"
@@ -126,148 +128,523 @@ static int open_btsnoop(const char *path, uint32_t *type)
 	return fd;
 }
 
-#define MAX_MERGE 8
+#define OUTPUT_BUF_SIZE	(256 * 1024)
 
-static void command_merge(const char *output, int argc, char *argv[])
+/*
+ * Inputs are mapped instead of read so that the number of files is not
+ * limited by open descriptors and packets are used in place. Every packet
+ * is converted to the monitor format while it is current.
+ */
+struct input {
+	const char *path;
+	unsigned int seq;
+	const uint8_t *map;
+	size_t size;
+	size_t offset;
+	uint32_t type;
+	uint16_t index;
+	uint16_t num_index;
+	bool announce;
+	uint64_t ts;
+	uint16_t pkt_index;
+	uint16_t opcode;
+	const uint8_t *data;
+	uint32_t len;
+};
+
+struct output {
+	int fd;
+	uint8_t *buf;
+	size_t len;
+	bool failed;
+};
+
+static bool map_btsnoop(struct input *in, const char *path)
 {
-	struct btsnoop_pkt input_pkt[MAX_MERGE];
-	unsigned char buf[2048];
-	int output_fd, input_fd[MAX_MERGE], num_input = 0;
-	int i, select_input;
-	ssize_t len, written;
-	uint32_t toread, flags;
-	uint16_t index, opcode;
-
-	if (argc > MAX_MERGE) {
-		fprintf(stderr, "only up to %d files allowed\n", MAX_MERGE);
+	struct btsnoop_hdr hdr;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open_btsnoop(path, &in->type);
+	if (fd < 0)
+		return false;
+
+	if (fstat(fd, &st) < 0) {
+		perror("failed to get input file size");
+		close(fd);
+		return false;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		perror("failed to map input file");
+		return false;
+	}
+
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	in->path = path;
+	in->map = map;
+	in->size = st.st_size;
+	in->offset = sizeof(hdr);
+
+	switch (in->type) {
+	case BTSNOOP_TYPE_HCI:
+	case BTSNOOP_TYPE_UART:
+	case BTSNOOP_TYPE_MONITOR:
+		return true;
+	}
+
+	fprintf(stderr, "unsupported link data type %u\n", in->type);
+	munmap(map, st.st_size);
+	in->map = NULL;
+
+	return false;
+}
+
+static void unmap_btsnoop(struct input *in)
+{
+	if (in->map)
+		munmap((void *) in->map, in->size);
+
+	in->map = NULL;
+}
+
+/* Highest controller index used in a monitor file plus one */
+static uint16_t scan_indexes(const struct input *in)
+{
+	size_t offset = in->offset;
+	uint16_t num = 1;
+
+	while (offset + BTSNOOP_PKT_SIZE <= in->size) {
+		struct btsnoop_pkt pkt;
+		uint16_t index;
+
+		memcpy(&pkt, in->map + offset, BTSNOOP_PKT_SIZE);
+
+		index = be32toh(pkt.flags) >> 16;
+		if (index != 0xffff && index >= num)
+			num = index + 1;
+
+		offset += BTSNOOP_PKT_SIZE + be32toh(pkt.len);
+	}
+
+	return num;
+}
+
+static bool next_packet(struct input *in)
+{
+	struct btsnoop_pkt pkt;
+	uint32_t flags;
+
+next:
+	if (in->offset + BTSNOOP_PKT_SIZE > in->size)
+		return false;
+
+	memcpy(&pkt, in->map + in->offset, BTSNOOP_PKT_SIZE);
+
+	in->len = be32toh(pkt.len);
+	if (in->offset + BTSNOOP_PKT_SIZE + in->len > in->size) {
+		fprintf(stderr, "%s: truncated packet\n", in->path);
+		return false;
+	}
+
+	in->data = in->map + in->offset + BTSNOOP_PKT_SIZE;
+	in->offset += BTSNOOP_PKT_SIZE + in->len;
+	in->ts = be64toh(pkt.ts);
+	in->pkt_index = in->index;
+
+	flags = be32toh(pkt.flags);
+
+	switch (in->type) {
+	case BTSNOOP_TYPE_MONITOR:
+		in->opcode = flags & 0xffff;
+		if ((flags >> 16) == 0xffff)
+			in->pkt_index = 0xffff;
+		else
+			in->pkt_index += flags >> 16;
+		break;
+
+	case BTSNOOP_TYPE_HCI:
+		if (flags & 0x02)
+			in->opcode = (flags & 0x01) ?
+						BTSNOOP_OPCODE_EVENT_PKT :
+						BTSNOOP_OPCODE_COMMAND_PKT;
+		else
+			in->opcode = (flags & 0x01) ?
+						BTSNOOP_OPCODE_ACL_RX_PKT :
+						BTSNOOP_OPCODE_ACL_TX_PKT;
+		break;
+
+	case BTSNOOP_TYPE_UART:
+		if (in->len < 1)
+			goto next;
+
+		switch (in->data[0]) {
+		case 0x01:
+			in->opcode = BTSNOOP_OPCODE_COMMAND_PKT;
+			break;
+		case 0x02:
+			in->opcode = (flags & 0x01) ?
+						BTSNOOP_OPCODE_ACL_RX_PKT :
+						BTSNOOP_OPCODE_ACL_TX_PKT;
+			break;
+		case 0x03:
+			in->opcode = (flags & 0x01) ?
+						BTSNOOP_OPCODE_SCO_RX_PKT :
+						BTSNOOP_OPCODE_SCO_TX_PKT;
+			break;
+		case 0x04:
+			in->opcode = BTSNOOP_OPCODE_EVENT_PKT;
+			break;
+		default:
+			goto next;
+		}
+
+		in->data++;
+		in->len--;
+		break;
+	}
+
+	return true;
+}
+
+static bool output_open(struct output *out, const char *path)
+{
+	out->fd = create_btsnoop(path);
+	if (out->fd < 0)
+		return false;
+
+	out->buf = malloc(OUTPUT_BUF_SIZE);
+	out->len = 0;
+	out->failed = !out->buf;
+
+	return true;
+}
+
+static void output_write(struct output *out, const void *data, size_t len)
+{
+	const uint8_t *ptr = data;
+
+	while (len > 0 && !out->failed) {
+		ssize_t written = write(out->fd, ptr, len);
+
+		if (written < 0 && errno == EINTR)
+			continue;
+
+		if (written <= 0) {
+			perror("failed to write output file");
+			out->failed = true;
+			return;
+		}
+
+		ptr += written;
+		len -= written;
+	}
+}
+
+static void output_flush(struct output *out)
+{
+	output_write(out, out->buf, out->len);
+	out->len = 0;
+}
+
+static void output_packet(struct output *out, uint64_t ts, uint16_t index,
+				uint16_t opcode, const void *data, uint32_t len)
+{
+	struct btsnoop_pkt pkt;
+
+	pkt.size = htobe32(len);
+	pkt.len = htobe32(len);
+	pkt.flags = htobe32((index << 16) | opcode);
+	pkt.drops = 0;
+	pkt.ts = htobe64(ts);
+
+	if (out->len + BTSNOOP_PKT_SIZE + len > OUTPUT_BUF_SIZE)
+		output_flush(out);
+
+	if (BTSNOOP_PKT_SIZE + len > OUTPUT_BUF_SIZE) {
+		output_write(out, &pkt, BTSNOOP_PKT_SIZE);
+		output_write(out, data, len);
 		return;
 	}
 
+	memcpy(out->buf + out->len, &pkt, BTSNOOP_PKT_SIZE);
+	memcpy(out->buf + out->len + BTSNOOP_PKT_SIZE, data, len);
+	out->len += BTSNOOP_PKT_SIZE + len;
+}
+
+static bool output_close(struct output *out)
+{
+	bool ok;
+
+	if (out->fd < 0)
+		return false;
+
+	output_flush(out);
+	ok = !out->failed;
+
+	free(out->buf);
+	close(out->fd);
+	out->fd = -1;
+
+	return ok;
+}
+
+/*
+ * HCI and UART captures carry no controller information, announce them
+ * under the name of their file before the first packet.
+ */
+static void output_input_packet(struct output *out, struct input *in)
+{
+	if (in->announce) {
+		struct btsnoop_opcode_new_index ni;
+		const char *name = strrchr(in->path, '/');
+
+		memset(&ni, 0, sizeof(ni));
+		strncpy(ni.name, name ? name + 1 : in->path,
+						sizeof(ni.name) - 1);
+		ni.name[sizeof(ni.name) - 1] = '\0';
+
+		output_packet(out, in->ts, in->index,
+					BTSNOOP_OPCODE_NEW_INDEX,
+					&ni, sizeof(ni));
+		in->announce = false;
+	}
+
+	output_packet(out, in->ts, in->pkt_index, in->opcode, in->data,
+								in->len);
+}
+
+static bool input_before(const struct input *a, const struct input *b)
+{
+	if (a->ts != b->ts)
+		return a->ts < b->ts;
+
+	return a->seq < b->seq;
+}
+
+static void heap_sift_down(struct input **heap, unsigned int num,
+							unsigned int i)
+{
+	for (;;) {
+		unsigned int min = i, l = 2 * i + 1, r = 2 * i + 2;
+		struct input *tmp;
+
+		if (l < num && input_before(heap[l], heap[min]))
+			min = l;
+
+		if (r < num && input_before(heap[r], heap[min]))
+			min = r;
+
+		if (min == i)
+			return;
+
+		tmp = heap[i];
+		heap[i] = heap[min];
+		heap[min] = tmp;
+		i = min;
+	}
+}
+
+static void command_merge(const char *output, int argc, char *argv[])
+{
+	struct input *inputs, **heap;
+	struct output out;
+	unsigned int num_heap = 0, index = 0;
+	int i, num_input = 0;
+
+	inputs = calloc(argc, sizeof(*inputs));
+	heap = calloc(argc, sizeof(*heap));
+	if (!inputs || !heap) {
+		fprintf(stderr, "failed to allocate inputs\n");
+		goto done;
+	}
+
 	for (i = 0; i < argc; i++) {
-		uint32_t type;
-		int fd;
+		struct input *in = &inputs[i];
 
-		fd = open_btsnoop(argv[i], &type);
-		if (fd < 0)
+		if (!map_btsnoop(in, argv[i]))
 			break;
 
-		if (type != 1002) {
-			fprintf(stderr, "unsupported link data type %u\n",
-									type);
-			close(fd);
+		num_input++;
+
+		in->seq = i;
+		in->index = index;
+
+		if (in->type == BTSNOOP_TYPE_MONITOR)
+			in->num_index = scan_indexes(in);
+		else {
+			in->num_index = 1;
+			in->announce = true;
+		}
+
+		if (index + in->num_index >= 0xffff) {
+			fprintf(stderr, "too many controller indexes\n");
 			break;
 		}
 
-		input_fd[num_input++] = fd;
+		index += in->num_index;
+
+		printf("%s: index %u", argv[i], in->index);
+		if (in->num_index > 1)
+			printf("-%u", in->index + in->num_index - 1);
+		printf("\n");
 	}
 
 	if (num_input != argc) {
 		fprintf(stderr, "failed to open all input files\n");
-		goto close_input;
+		goto done;
 	}
 
-	output_fd = create_btsnoop(output);
-	if (output_fd < 0)
-		goto close_input;
+	if (!output_open(&out, output))
+		goto done;
 
 	for (i = 0; i < num_input; i++) {
-		len = read(input_fd[i], &input_pkt[i], BTSNOOP_PKT_SIZE);
-		if (len < 0 || len != BTSNOOP_PKT_SIZE) {
-			close(input_fd[i]);
-			input_fd[i] = -1;
-		}
+		if (!next_packet(&inputs[i]))
+			continue;
+
+		heap[num_heap++] = &inputs[i];
 	}
 
-next_packet:
-	select_input = -1;
+	for (i = num_heap / 2 - 1; i >= 0; i--)
+		heap_sift_down(heap, num_heap, i);
 
-	for (i = 0; i < num_input; i++) {
-		uint64_t ts;
+	while (num_heap > 0 && !out.failed) {
+		struct input *in = heap[0];
+
+		output_input_packet(&out, in);
+
+		if (!next_packet(in))
+			heap[0] = heap[--num_heap];
+
+		heap_sift_down(heap, num_heap, 0);
+	}
+
+	output_close(&out);
+
+done:
+	for (i = 0; i < num_input; i++)
+		unmap_btsnoop(&inputs[i]);
+
+	free(inputs);
+	free(heap);
+}
+
+/*
+ * Writes every controller index to its own monitor file, optionally
+ * limited to a time range in seconds relative to the first packet.
+ * Packets not bound to a controller are dropped.
+ */
+static void command_split(const char *input, const char *prefix, int index,
+						double start, double end)
+{
+	struct output *outputs = NULL;
+	unsigned int num_outputs = 0, i;
+	struct input in;
+	uint64_t first = 0;
+	bool first_set = false;
+
+	memset(&in, 0, sizeof(in));
+
+	if (!map_btsnoop(&in, input))
+		return;
 
-		if (input_fd[i] < 0)
+	in.announce = in.type != BTSNOOP_TYPE_MONITOR;
+
+	while (next_packet(&in)) {
+		struct output *out;
+		double ts;
+
+		if (!first_set) {
+			first = in.ts;
+			first_set = true;
+		}
+
+		ts = (in.ts - first) / 1000000.0;
+		if (ts < start)
 			continue;
 
-		if (select_input < 0) {
-			select_input = i;
+		if (end >= 0 && ts > end)
+			break;
+
+		if (in.pkt_index == 0xffff)
 			continue;
+
+		if (index >= 0 && in.pkt_index != index)
+			continue;
+
+		if (in.pkt_index >= num_outputs) {
+			struct output *tmp;
+
+			tmp = realloc(outputs, (in.pkt_index + 1) *
+							sizeof(*outputs));
+			if (!tmp) {
+				fprintf(stderr, "failed to allocate output\n");
+				break;
+			}
+
+			outputs = tmp;
+
+			for (i = num_outputs; i <= in.pkt_index; i++)
+				outputs[i].fd = -1;
+
+			num_outputs = in.pkt_index + 1;
 		}
 
-		ts = be64toh(input_pkt[i].ts);
+		out = &outputs[in.pkt_index];
 
-		if (ts < be64toh(input_pkt[select_input].ts))
-			select_input = i;
-	}
+		if (out->fd < 0) {
+			char path[PATH_MAX];
 
-	if (select_input < 0)
-		goto close_output;
+			snprintf(path, sizeof(path), "%s-hci%u.btsnoop",
+							prefix, in.pkt_index);
 
-	toread = be32toh(input_pkt[select_input].size);
-	flags = be32toh(input_pkt[select_input].flags);
+			if (!output_open(out, path))
+				break;
 
-	len = read(input_fd[select_input], buf, toread);
-	if (len < 0 || len != (ssize_t) toread) {
-		close(input_fd[select_input]);
-		input_fd[select_input] = -1;
-		goto next_packet;
+			printf("%s: index %u\n", path, in.pkt_index);
+		}
+
+		output_input_packet(out, &in);
 	}
 
-	written = input_pkt[select_input].size = htobe32(toread - 1);
-	written = input_pkt[select_input].len = htobe32(toread - 1);
+	for (i = 0; i < num_outputs; i++)
+		output_close(&outputs[i]);
 
-	switch (buf[0]) {
-	case 0x01:
-		opcode = BTSNOOP_OPCODE_COMMAND_PKT;
-		break;
-	case 0x02:
-		if (flags & 0x01)
-			opcode = BTSNOOP_OPCODE_ACL_RX_PKT;
-		else
-			opcode = BTSNOOP_OPCODE_ACL_TX_PKT;
-		break;
-	case 0x03:
-		if (flags & 0x01)
-			opcode = BTSNOOP_OPCODE_SCO_RX_PKT;
-		else
-			opcode = BTSNOOP_OPCODE_ACL_TX_PKT;
-		break;
-	case 0x04:
-		opcode = BTSNOOP_OPCODE_EVENT_PKT;
-		break;
-	default:
-		goto skip_write;
-	}
+	free(outputs);
+	unmap_btsnoop(&in);
+}
 
-	index = select_input;
-	input_pkt[select_input].flags = htobe32((index << 16) | opcode);
+static bool parse_range(const char *str, double *start, double *end)
+{
+	char *ptr;
 
-	written = write(output_fd, &input_pkt[select_input], BTSNOOP_PKT_SIZE);
-	if (written != BTSNOOP_PKT_SIZE) {
-		fprintf(stderr, "write of packet header failed\n");
-		goto close_output;
-	}
+	*start = 0;
+	*end = -1;
 
-	written = write(output_fd, buf + 1, toread - 1);
-	if (written != (ssize_t) toread - 1) {
-		fprintf(stderr, "write of packet data failed\n");
-		goto close_output;
+	if (*str != '-') {
+		*start = strtod(str, &ptr);
+		if (ptr == str || *start < 0)
+			return false;
+		str = ptr;
 	}
 
-skip_write:
-	len = read(input_fd[select_input],
-				&input_pkt[select_input], BTSNOOP_PKT_SIZE);
-	if (len < 0 || len != BTSNOOP_PKT_SIZE) {
-		close(input_fd[select_input]);
-		input_fd[select_input] = -1;
-	}
+	if (*str == '\0')
+		return true;
 
-	goto next_packet;
+	if (*str++ != '-')
+		return false;
 
-close_output:
-	close(output_fd);
+	if (*str == '\0')
+		return true;
 
-close_input:
-	for (i = 0; i < num_input; i++)
-		close(input_fd[i]);
+	*end = strtod(str, &ptr);
+
+	return ptr != str && *ptr == '\0' && *end >= *start;
 }
 
 static void command_extract_eir(const char *input)
@@ -515,12 +892,22 @@ static void usage(void)
 	printf("\tbtsnoop <command> [files]\n");
 	printf("commands:\n"
 		"\t-m, --merge <output>   Merge multiple btsnoop files\n"
+		"\t-s, --split <input>    Split btsnoop file by index\n"
 		"\t-e, --extract <input>  Extract data from btsnoop file\n"
 		"\t-h, --help             Show help options\n");
+	printf("options:\n"
+		"\t-o, --output <prefix>  Output prefix for split files\n"
+		"\t-i, --index <index>    Only split out given index\n"
+		"\t-r, --range <from-to>  Only split out time range (seconds)\n"
+		"\t-t, --type <type>      Extract type (eir, ad, sdp)\n");
 }
 
 static const struct option main_options[] = {
 	{ "merge",   required_argument, NULL, 'm' },
+	{ "split",   required_argument, NULL, 's' },
+	{ "output",  required_argument, NULL, 'o' },
+	{ "index",   required_argument, NULL, 'i' },
+	{ "range",   required_argument, NULL, 'r' },
 	{ "extract", required_argument, NULL, 'e' },
 	{ "type",    required_argument, NULL, 't' },
 	{ "version", no_argument,       NULL, 'v' },
@@ -528,7 +915,7 @@ static const struct option main_options[] = {
 	{ }
 };
 
-enum { INVALID, MERGE, EXTRACT };
+enum { INVALID, MERGE, SPLIT, EXTRACT };
 
 int main(int argc, char *argv[])
 {
@@ -536,11 +923,14 @@ int main(int argc, char *argv[])
 	const char *input_path = NULL;
 	const char *type = NULL;
 	unsigned short command = INVALID;
+	double start = 0, end = -1;
+	int index = -1;
 
 	for (;;) {
 		int opt;
 
-		opt = getopt_long(argc, argv, "m:e:t:vh", main_options, NULL);
+		opt = getopt_long(argc, argv, "m:s:o:i:r:e:t:vh",
+						main_options, NULL);
 		if (opt < 0)
 			break;
 
@@ -549,6 +939,26 @@ int main(int argc, char *argv[])
 			command = MERGE;
 			output_path = optarg;
 			break;
+		case 's':
+			command = SPLIT;
+			input_path = optarg;
+			break;
+		case 'o':
+			output_path = optarg;
+			break;
+		case 'i':
+			index = atoi(optarg);
+			if (index < 0 || index >= 0xffff) {
+				fprintf(stderr, "invalid index\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'r':
+			if (!parse_range(optarg, &start, &end)) {
+				fprintf(stderr, "invalid time range\n");
+				return EXIT_FAILURE;
+			}
+			break;
 		case 'e':
 			command = EXTRACT;
 			input_path = optarg;
@@ -577,6 +987,16 @@ int main(int argc, char *argv[])
 		command_merge(output_path, argc - optind, argv + optind);
 		break;
 
+	case SPLIT:
+		if (argc - optind > 0) {
+			fprintf(stderr, "extra arguments not allowed\n");
+			return EXIT_FAILURE;
+		}
+
+		command_split(input_path, output_path ? : input_path, index,
+								start, end);
+		break;
+
 	case EXTRACT:
 		if (argc - optind > 0) {
 			fprintf(stderr, "extra arguments not allowed\n");
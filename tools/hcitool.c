@@ -34,11 +34,14 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <getopt.h>
 #include <sys/param.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <signal.h>
+#include <time.h>
+#include <poll.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
@@ -2381,13 +2384,336 @@ failed:
 	snprintf(buf, buf_len, "(unknown)");
 }
 
-static int print_advertising_devices(int dd, uint8_t filter_type)
+struct le_device {
+	bdaddr_t bdaddr;
+	uint8_t bdaddr_type;
+	uint8_t evt_type;
+	unsigned long count;
+	unsigned long rssi_count;
+	long rssi_sum;
+	int8_t rssi_min;
+	int8_t rssi_max;
+	int8_t rssi_last;
+	char name[30];
+	uint8_t data_len;
+	uint8_t data[HCI_MAX_EIR_LENGTH];
+};
+
+/*
+ * Devices are kept in a growing array in the order they were first seen
+ * and found through an open addressing table of array indexes (0 meaning
+ * empty), so that looking up the sender of a report stays cheap even with
+ * thousands of advertisers around.
+ */
+struct le_scan {
+	struct le_device *devices;
+	unsigned int num_devices;
+	unsigned int max_devices;
+	unsigned int *table;
+	unsigned int table_size;
+	uint8_t filter_type;
+	int duplicates;
+	unsigned int summary;
+	unsigned long events;
+	unsigned long reports;
+	unsigned long last_reports;
+	struct timespec start;
+	struct timespec last;
+};
+
+/* RSSI value reported when the controller can't measure it */
+#define RSSI_UNAVAILABLE	127
+
+static double timespec_diff(const struct timespec *a,
+						const struct timespec *b)
+{
+	return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
+static unsigned int le_device_hash(const bdaddr_t *bdaddr, uint8_t type)
+{
+	unsigned int i, hash = 2166136261u;
+
+	for (i = 0; i < sizeof(*bdaddr); i++)
+		hash = (hash ^ bdaddr->b[i]) * 16777619;
+
+	return (hash ^ type) * 16777619;
+}
+
+static unsigned int *le_scan_slot(unsigned int *table, unsigned int size,
+					struct le_device *devices,
+					const bdaddr_t *bdaddr, uint8_t type)
+{
+	unsigned int i = le_device_hash(bdaddr, type) & (size - 1);
+
+	while (table[i]) {
+		struct le_device *dev = &devices[table[i] - 1];
+
+		if (dev->bdaddr_type == type && !bacmp(&dev->bdaddr, bdaddr))
+			break;
+
+		i = (i + 1) & (size - 1);
+	}
+
+	return &table[i];
+}
+
+static int le_scan_grow(struct le_scan *scan)
+{
+	unsigned int max = scan->max_devices ? scan->max_devices * 2 : 64;
+	unsigned int size = max * 2;
+	struct le_device *devices;
+	unsigned int *table, i;
+
+	table = calloc(size, sizeof(*table));
+	if (!table)
+		return -ENOMEM;
+
+	devices = realloc(scan->devices, max * sizeof(*devices));
+	if (!devices) {
+		free(table);
+		return -ENOMEM;
+	}
+
+	scan->devices = devices;
+	scan->max_devices = max;
+
+	for (i = 0; i < scan->num_devices; i++) {
+		struct le_device *dev = &devices[i];
+
+		*le_scan_slot(table, size, devices, &dev->bdaddr,
+						dev->bdaddr_type) = i + 1;
+	}
+
+	free(scan->table);
+	scan->table = table;
+	scan->table_size = size;
+
+	return 0;
+}
+
+static struct le_device *le_scan_lookup(struct le_scan *scan,
+				const le_advertising_info *info, int *new)
+{
+	struct le_device *dev;
+	unsigned int *slot;
+
+	*new = 0;
+
+	if (scan->num_devices == scan->max_devices && le_scan_grow(scan) < 0)
+		return NULL;
+
+	slot = le_scan_slot(scan->table, scan->table_size, scan->devices,
+					&info->bdaddr, info->bdaddr_type);
+	if (*slot)
+		return &scan->devices[*slot - 1];
+
+	dev = &scan->devices[scan->num_devices];
+	memset(dev, 0, sizeof(*dev));
+	bacpy(&dev->bdaddr, &info->bdaddr);
+	dev->bdaddr_type = info->bdaddr_type;
+	dev->rssi_min = INT8_MAX;
+	dev->rssi_max = INT8_MIN;
+	dev->rssi_last = RSSI_UNAVAILABLE;
+
+	*slot = ++scan->num_devices;
+	*new = 1;
+
+	return dev;
+}
+
+static void le_scan_free(struct le_scan *scan)
+{
+	free(scan->devices);
+	free(scan->table);
+}
+
+static void process_advertising_info(struct le_scan *scan,
+				const le_advertising_info *info, int8_t rssi)
+{
+	struct le_device *dev;
+	char name[30], addr[18];
+	int new, renamed;
+
+	if (!check_report_filter(scan->filter_type,
+					(le_advertising_info *) info))
+		return;
+
+	dev = le_scan_lookup(scan, info, &new);
+	if (!dev)
+		return;
+
+	dev->count++;
+	dev->evt_type = info->evt_type;
+	dev->rssi_last = rssi;
+
+	if (rssi != RSSI_UNAVAILABLE) {
+		if (rssi < dev->rssi_min)
+			dev->rssi_min = rssi;
+		if (rssi > dev->rssi_max)
+			dev->rssi_max = rssi;
+		dev->rssi_sum += rssi;
+		dev->rssi_count++;
+	}
+
+	dev->data_len = MIN(info->length, sizeof(dev->data));
+	memcpy(dev->data, info->data, dev->data_len);
+
+	memset(name, 0, sizeof(name));
+	eir_parse_name((uint8_t *) info->data, info->length, name,
+							sizeof(name) - 1);
+
+	/* Scan responses often carry the name missing from the first report */
+	renamed = strcmp(name, "(unknown)") && strcmp(name, dev->name);
+	if (renamed || new)
+		strcpy(dev->name, name);
+
+	if (scan->summary)
+		return;
+
+	/* Duplicates are printed as they come, like the controller sends them */
+	if (scan->duplicates) {
+		ba2str(&dev->bdaddr, addr);
+		printf("%s %s\n", addr, name);
+		return;
+	}
+
+	if (!new && !renamed)
+		return;
+
+	ba2str(&dev->bdaddr, addr);
+	printf("%s %s\n", addr, dev->name);
+}
+
+static void process_advertising_report(struct le_scan *scan,
+					const uint8_t *data, size_t len)
+{
+	uint8_t num_reports;
+
+	if (len < 1)
+		return;
+
+	num_reports = data[0];
+	data++;
+	len--;
+
+	scan->events++;
+
+	while (num_reports--) {
+		const le_advertising_info *info = (const void *) data;
+		size_t info_len;
+
+		if (len < LE_ADVERTISING_INFO_SIZE)
+			break;
+
+		/* Each report is followed by a one byte RSSI */
+		info_len = LE_ADVERTISING_INFO_SIZE + info->length + 1;
+		if (len < info_len)
+			break;
+
+		scan->reports++;
+
+		process_advertising_info(scan, info, data[info_len - 1]);
+
+		data += info_len;
+		len -= info_len;
+	}
+}
+
+static int le_device_cmp(const void *a, const void *b)
+{
+	const struct le_device *dev_a = *(const struct le_device **) a;
+	const struct le_device *dev_b = *(const struct le_device **) b;
+
+	if (dev_a->count != dev_b->count)
+		return dev_a->count < dev_b->count ? 1 : -1;
+
+	return bacmp(&dev_a->bdaddr, &dev_b->bdaddr);
+}
+
+static void print_scan_summary(struct le_scan *scan, int clear)
+{
+	struct le_device **sorted;
+	struct timespec now;
+	double elapsed, interval;
+	unsigned int i, j;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = timespec_diff(&now, &scan->start);
+	interval = timespec_diff(&now, &scan->last);
+
+	if (clear)
+		printf("\033[H\033[2J");
+
+	printf("%u devices, %lu reports in %lu events, %.1f s, "
+			"%.1f reports/s", scan->num_devices, scan->reports,
+			scan->events, elapsed,
+			elapsed > 0 ? scan->reports / elapsed : 0.0);
+
+	if (scan->summary && interval > 0)
+		printf(" (last %.1f s: %.1f reports/s)", interval,
+			(scan->reports - scan->last_reports) / interval);
+
+	printf("\n");
+
+	scan->last = now;
+	scan->last_reports = scan->reports;
+
+	if (!scan->summary || !scan->num_devices) {
+		fflush(stdout);
+		return;
+	}
+
+	sorted = malloc(scan->num_devices * sizeof(*sorted));
+	if (!sorted)
+		return;
+
+	for (i = 0; i < scan->num_devices; i++)
+		sorted[i] = &scan->devices[i];
+
+	qsort(sorted, scan->num_devices, sizeof(*sorted), le_device_cmp);
+
+	printf("%-17s %-4s %-4s %8s %16s %s\n", "Address", "Type", "Evt",
+					"Count", "RSSI min/avg/max", "Name");
+
+	for (i = 0; i < scan->num_devices; i++) {
+		struct le_device *dev = sorted[i];
+		char addr[18], rssi[20];
+
+		ba2str(&dev->bdaddr, addr);
+
+		if (dev->rssi_count)
+			snprintf(rssi, sizeof(rssi), "%d/%ld/%d",
+					dev->rssi_min,
+					dev->rssi_sum / (long) dev->rssi_count,
+					dev->rssi_max);
+		else
+			strcpy(rssi, "-");
+
+		printf("%s %-4s 0x%2.2x %8lu %16s %s\n", addr,
+				dev->bdaddr_type ? "rand" : "pub",
+				dev->evt_type, dev->count, rssi, dev->name);
+
+		printf("%17s ", "");
+		for (j = 0; j < dev->data_len; j++)
+			printf("%2.2x", dev->data[j]);
+		printf("\n");
+	}
+
+	fflush(stdout);
+	free(sorted);
+}
+
+static int print_advertising_devices(int dd, uint8_t filter_type,
+					int duplicates, unsigned int summary)
 {
 	unsigned char buf[HCI_MAX_EVENT_SIZE], *ptr;
 	struct hci_filter nf, of;
 	struct sigaction sa;
+	struct le_scan scan;
+	struct timespec next;
 	socklen_t olen;
-	int len;
+	int len, rcvbuf, clear;
 
 	olen = sizeof(of);
 	if (getsockopt(dd, SOL_HCI, HCI_FILTER, &of, &olen) < 0) {
@@ -2404,15 +2730,65 @@ static int print_advertising_devices(int dd, uint8_t filter_type)
 		return -1;
 	}
 
+	/* Give bursts of reports some room so the kernel doesn't drop them */
+	rcvbuf = 1024 * 1024;
+	setsockopt(dd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
 	memset(&sa, 0, sizeof(sa));
 	sa.sa_flags = SA_NOCLDSTOP;
 	sa.sa_handler = sigint_handler;
 	sigaction(SIGINT, &sa, NULL);
 
+	memset(&scan, 0, sizeof(scan));
+	scan.filter_type = filter_type;
+	scan.duplicates = duplicates;
+	scan.summary = summary;
+	clock_gettime(CLOCK_MONOTONIC, &scan.start);
+	scan.last = scan.start;
+
+	next = scan.start;
+	next.tv_sec += summary;
+
+	clear = summary && isatty(STDOUT_FILENO);
+
 	while (1) {
 		evt_le_meta_event *meta;
-		le_advertising_info *info;
-		char addr[18];
+		struct pollfd p;
+		int timeout = -1;
+
+		if (summary) {
+			struct timespec now;
+			double left;
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			left = timespec_diff(&next, &now);
+			if (left <= 0) {
+				print_scan_summary(&scan, clear);
+				next.tv_sec += summary;
+				continue;
+			}
+
+			timeout = left * 1000 + 1;
+		}
+
+		memset(&p, 0, sizeof(p));
+		p.fd = dd;
+		p.events = POLLIN;
+
+		len = poll(&p, 1, timeout);
+		if (len < 0) {
+			if (errno == EINTR && signal_received == SIGINT) {
+				len = 0;
+				goto done;
+			}
+
+			if (errno == EINTR)
+				continue;
+			goto done;
+		}
+
+		if (!len)
+			continue;
 
 		while ((len = read(dd, buf, sizeof(buf))) < 0) {
 			if (errno == EINTR && signal_received == SIGINT) {
@@ -2425,32 +2801,27 @@ static int print_advertising_devices(int dd, uint8_t filter_type)
 			goto done;
 		}
 
+		if (len < 1 + HCI_EVENT_HDR_SIZE + 1)
+			continue;
+
 		ptr = buf + (1 + HCI_EVENT_HDR_SIZE);
 		len -= (1 + HCI_EVENT_HDR_SIZE);
 
 		meta = (void *) ptr;
 
-		if (meta->subevent != 0x02)
-			goto done;
-
-		/* Ignoring multiple reports */
-		info = (le_advertising_info *) (meta->data + 1);
-		if (check_report_filter(filter_type, info)) {
-			char name[30];
-
-			memset(name, 0, sizeof(name));
-
-			ba2str(&info->bdaddr, addr);
-			eir_parse_name(info->data, info->length,
-							name, sizeof(name) - 1);
+		if (meta->subevent != EVT_LE_ADVERTISING_REPORT)
+			continue;
 
-			printf("%s %s\n", addr, name);
-		}
+		process_advertising_report(&scan, meta->data, len - 1);
 	}
 
 done:
 	setsockopt(dd, SOL_HCI, HCI_FILTER, &of, sizeof(of));
 
+	print_scan_summary(&scan, 0);
+
+	le_scan_free(&scan);
+
 	if (len < 0)
 		return -1;
 
@@ -2464,6 +2835,7 @@ static struct option lescan_options[] = {
 	{ "whitelist",	0, 0, 'w' },
 	{ "discovery",	1, 0, 'd' },
 	{ "duplicates",	0, 0, 'D' },
+	{ "summary",	2, 0, 's' },
 	{ 0, 0, 0, 0 }
 };
 
@@ -2474,7 +2846,9 @@ static const char *lescan_help =
 	"\tlescan [--whitelist] scan for address in the whitelist only\n"
 	"\tlescan [--discovery=g|l] enable general or limited discovery"
 		"procedure\n"
-	"\tlescan [--duplicates] don't filter duplicates\n";
+	"\tlescan [--duplicates] don't filter duplicates\n"
+	"\tlescan [--summary[=seconds]] show a device table refreshed every"
+		" seconds (default 1)\n";
 
 static void cmd_lescan(int dev_id, int argc, char **argv)
 {
@@ -2486,6 +2860,9 @@ static void cmd_lescan(int dev_id, int argc, char **argv)
 	uint16_t interval = htobs(0x0010);
 	uint16_t window = htobs(0x0010);
 	uint8_t filter_dup = 1;
+	unsigned int summary = 0;
+	char *end;
+	long val;
 
 	for_each_opt(opt, lescan_options, NULL) {
 		switch (opt) {
@@ -2511,6 +2888,22 @@ static void cmd_lescan(int dev_id, int argc, char **argv)
 		case 'D':
 			filter_dup = 0x00;
 			break;
+		case 's':
+			if (!optarg) {
+				summary = 1;
+				break;
+			}
+
+			errno = 0;
+			val = strtol(optarg, &end, 10);
+			if (errno || *end || end == optarg || val < 1 ||
+								val > INT_MAX) {
+				fprintf(stderr, "Invalid summary interval\n");
+				exit(1);
+			}
+
+			summary = val;
+			break;
 		default:
 			printf("%s", lescan_help);
 			return;
@@ -2542,7 +2935,7 @@ static void cmd_lescan(int dev_id, int argc, char **argv)
 
 	printf("LE Scan ...\n");
 
-	err = print_advertising_devices(dd, filter_type);
+	err = print_advertising_devices(dd, filter_type, !filter_dup, summary);
 	if (err < 0) {
 		perror("Could not receive advertising events");
 		exit(1);
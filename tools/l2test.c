@@ -48,6 +48,7 @@
 #include <bluetooth/l2cap.h>
 
 #include "src/shared/util.h"
+#include "tools/load.h"
 
 #define NIBBLE_TO_ASCII(c)  ((c) < 0x0a ? (c) + 0x30 : (c) + 0x57)
 
@@ -70,6 +71,8 @@ enum {
 	CSENDRECV,
 	INFOREQ,
 	PAIRING,
+	ECHO,
+	LOAD,
 };
 
 static unsigned char *buf;
@@ -125,6 +128,11 @@ static int rcvbuf = 0;
 static int chan_policy = -1;
 static int bdaddr_type = 0;
 
+/* Load mode */
+static unsigned int load_channels = 1;
+static int load_workload = LOAD_ECHO;
+static unsigned int load_rate = 0;
+
 struct lookup_table {
 	const char *name;
 	int flag;
@@ -1038,6 +1046,70 @@ static void send_and_recv_mode(int sk)
 	return;
 }
 
+static void echo_mode(int sk)
+{
+	int len, sent, ret;
+
+	syslog(LOG_INFO, "Echoing ...");
+
+	while ((len = recv(sk, buf, buffer_size, 0)) > 0) {
+		for (sent = 0; sent < len; sent += ret) {
+			ret = send(sk, buf + sent, len - sent, 0);
+			if (ret <= 0) {
+				syslog(LOG_ERR, "Send failed: %s (%d)",
+							strerror(errno), errno);
+				return;
+			}
+		}
+	}
+
+	if (len < 0)
+		syslog(LOG_ERR, "Read failed: %s (%d)", strerror(errno), errno);
+}
+
+static int load_connect(const char *peer, unsigned int index, uint16_t *mtu)
+{
+	struct l2cap_options opts;
+	int sk;
+
+	sk = do_connect((char *) peer);
+	if (sk < 0)
+		return -1;
+
+	if (socktype == SOCK_STREAM) {
+		*mtu = 0;
+		return sk;
+	}
+
+	/* Each write is one SDU, it has to fit the MTU of the peer */
+	if (getopts(sk, &opts, true) < 0) {
+		syslog(LOG_ERR, "Can't get L2CAP options: %s (%d)",
+							strerror(errno), errno);
+		close(sk);
+		return -1;
+	}
+
+	*mtu = opts.omtu;
+
+	return sk;
+}
+
+static void load_mode(int argc, char *argv[])
+{
+	struct load_config config;
+
+	memset(&config, 0, sizeof(config));
+	config.workload = load_workload;
+	config.channels = load_channels;
+	config.msg_size = data_size < 0 ? imtu : data_size;
+	config.rate = load_rate;
+	config.num_msgs = num_frames;
+	config.connect = load_connect;
+
+	if (load_run(&config, argc, argv) < 0)
+		exit(1);
+}
+
 static void reconnect_mode(char *svr)
 {
 	while (1) {
@@ -1300,7 +1372,9 @@ static void usage(void)
 		"\t-c connect, disconnect, connect, ...\n"
 		"\t-m multiple connects\n"
 		"\t-p trigger dedicated bonding\n"
-		"\t-z information request\n");
+		"\t-z information request\n"
+		"\t-e listen and echo received data\n"
+		"\t-l connect channels to all peers and run a load\n");
 
 	printf("Options:\n"
 		"\t[-b bytes] [-i device] [-P psm] [-J cid]\n"
@@ -1327,7 +1401,12 @@ static void usage(void)
 		"\t[-S] secure connection\n"
 		"\t[-M] become master\n"
 		"\t[-T] enable timestamps\n"
-		"\t[-V type] address type (help for list, default = bredr)\n");
+		"\t[-V type] address type (help for list, default = bredr)\n"
+		"\t[-j num] load channels per peer (default = 1)\n"
+		"\t[-g workload] load workload send, recv or echo "
+						"(default = echo)\n"
+		"\t[-f rate] load messages per second per channel "
+						"(default = unlimited)\n");
 }
 
 int main(int argc, char *argv[])
@@ -1337,7 +1416,7 @@ int main(int argc, char *argv[])
 
 	bacpy(&bdaddr, BDADDR_ANY);
 
-	while ((opt = getopt(argc, argv, "rdscuwmntqxyzpb:a:"
+	while ((opt = getopt(argc, argv, "rdscuwmntqxyzpelb:a:j:g:f:"
 		"i:P:I:O:J:B:N:L:W:C:D:X:F:Q:Z:Y:H:K:V:RUGAESMT")) != EOF) {
 		switch (opt) {
 		case 'r':
@@ -1404,6 +1483,35 @@ int main(int argc, char *argv[])
 			need_addr = 1;
 			break;
 
+		case 'e':
+			mode = ECHO;
+			break;
+
+		case 'l':
+			mode = LOAD;
+			need_addr = 1;
+			break;
+
+		case 'j':
+			load_channels = atoi(optarg);
+			if (!load_channels) {
+				usage();
+				exit(1);
+			}
+			break;
+
+		case 'g':
+			load_workload = load_parse_workload(optarg);
+			if (load_workload < 0) {
+				usage();
+				exit(1);
+			}
+			break;
+
+		case 'f':
+			load_rate = atoi(optarg);
+			break;
+
 		case 'b':
 			data_size = atoi(optarg);
 			break;
@@ -1648,6 +1756,14 @@ int main(int argc, char *argv[])
 		case PAIRING:
 			do_pairing(argv[optind]);
 			exit(0);
+
+		case ECHO:
+			do_listen(echo_mode);
+			break;
+
+		case LOAD:
+			load_mode(argc - optind, argv + optind);
+			break;
 	}
 
 	syslog(LOG_INFO, "Exit");
@@ -0,0 +1,572 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2014  Intel Corporation
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "src/shared/util.h"
+#include "tools/load.h"
+
+struct load_conn {
+	int fd;
+	const char *peer;
+	unsigned int index;
+	uint16_t mtu;
+
+	uint8_t *tx_buf;
+	uint32_t tx_seq;
+	size_t tx_off;
+	bool tx_active;
+	bool want_out;
+	uint64_t next_due;
+	long sent_msgs;
+	uint64_t tx_bytes;
+
+	uint8_t rx_hdr[LOAD_ECHO_HDR_SIZE];
+	size_t rx_off;
+	long recv_msgs;
+	uint64_t rx_bytes;
+	unsigned int outstanding;
+
+	uint32_t *rtt;
+	size_t rtt_len;
+	size_t rtt_size;
+
+	uint64_t end;
+	bool done;
+	bool failed;
+	bool closed;		/* Peer closed before num_msgs */
+};
+
+static const struct load_config *config;
+static struct load_conn *conns;
+static unsigned int num_conns;
+static unsigned int num_active;
+static uint8_t rx_buf[65536];
+static uint64_t interval;
+static volatile sig_atomic_t terminate;
+
+static const char *workloads[] = {
+	[LOAD_SEND] = "send",
+	[LOAD_RECV] = "recv",
+	[LOAD_ECHO] = "echo",
+};
+
+int load_parse_workload(const char *str)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+		if (!strcasecmp(workloads[i], str))
+			return i;
+	}
+
+	return -1;
+}
+
+static uint64_t get_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void sig_term(int sig)
+{
+	terminate = 1;
+}
+
+static void conn_finish(struct load_conn *conn, bool failed)
+{
+	if (conn->done)
+		return;
+
+	conn->done = true;
+	conn->failed = failed;
+	conn->end = get_time_us();
+	num_active--;
+
+	if (failed) {
+		close(conn->fd);
+		conn->fd = -1;
+	} else if (config->workload == LOAD_SEND) {
+		shutdown(conn->fd, SHUT_WR);
+	}
+}
+
+static void conn_update(int epfd, struct load_conn *conn, bool want_out)
+{
+	struct epoll_event ev;
+
+	if (conn->want_out == want_out || conn->fd < 0)
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | (want_out ? EPOLLOUT : 0);
+	ev.data.ptr = conn;
+
+	epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+	conn->want_out = want_out;
+}
+
+static bool conn_can_start(struct load_conn *conn, uint64_t now)
+{
+	if (conn->done || conn->tx_active || config->workload == LOAD_RECV)
+		return false;
+
+	if (config->num_msgs >= 0 && conn->sent_msgs >= config->num_msgs)
+		return false;
+
+	if (config->rate)
+		return now >= conn->next_due;
+
+	/* Without a rate echo is ping-pong, so the latency is meaningful */
+	if (config->workload == LOAD_ECHO)
+		return conn->outstanding == 0;
+
+	return true;
+}
+
+static void conn_start(struct load_conn *conn, uint64_t now)
+{
+	put_le32(conn->tx_seq++, conn->tx_buf);
+	put_le16(config->msg_size, conn->tx_buf + 4);
+
+	if (config->workload == LOAD_ECHO)
+		put_le64(now, conn->tx_buf + 6);
+
+	conn->tx_off = 0;
+	conn->tx_active = true;
+
+	if (!config->rate)
+		return;
+
+	/* Do not burst to catch up after a stall */
+	conn->next_due += interval;
+	if (conn->next_due + interval < now)
+		conn->next_due = now + interval;
+}
+
+static void conn_send(int epfd, struct load_conn *conn)
+{
+	uint64_t now = get_time_us();
+
+	while (!conn->done) {
+		size_t len;
+		ssize_t ret;
+
+		if (!conn->tx_active) {
+			if (!conn_can_start(conn, now))
+				break;
+
+			conn_start(conn, now);
+		}
+
+		len = config->msg_size - conn->tx_off;
+		if (conn->mtu && len > conn->mtu)
+			len = conn->mtu;
+
+		ret = send(conn->fd, conn->tx_buf + conn->tx_off, len,
+						MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				conn_update(epfd, conn, true);
+				return;
+			}
+
+			syslog(LOG_ERR, "Send failed: %s (%d)",
+							strerror(errno), errno);
+			conn_finish(conn, true);
+			return;
+		}
+
+		conn->tx_off += ret;
+		conn->tx_bytes += ret;
+
+		if (conn->tx_off < (size_t) config->msg_size)
+			continue;
+
+		conn->tx_active = false;
+		conn->sent_msgs++;
+		conn->outstanding++;
+
+		if (config->workload == LOAD_SEND && config->num_msgs >= 0 &&
+				conn->sent_msgs >= config->num_msgs)
+			conn_finish(conn, false);
+	}
+
+	conn_update(epfd, conn, false);
+}
+
+static void conn_message(struct load_conn *conn, uint64_t now)
+{
+	conn->recv_msgs++;
+
+	if (config->workload == LOAD_ECHO) {
+		uint64_t sent = get_le64(conn->rx_hdr + 6);
+
+		if (conn->outstanding)
+			conn->outstanding--;
+
+		if (conn->rtt_len == conn->rtt_size) {
+			size_t size = conn->rtt_size ? conn->rtt_size * 2 : 1024;
+			uint32_t *rtt;
+
+			rtt = realloc(conn->rtt, size * sizeof(*rtt));
+			if (rtt) {
+				conn->rtt = rtt;
+				conn->rtt_size = size;
+			}
+		}
+
+		if (conn->rtt_len < conn->rtt_size && now >= sent)
+			conn->rtt[conn->rtt_len++] = now - sent;
+	}
+
+	if (config->num_msgs >= 0 && conn->recv_msgs >= config->num_msgs)
+		conn_finish(conn, false);
+}
+
+static void conn_recv(int epfd, struct load_conn *conn)
+{
+	uint64_t now;
+	ssize_t len;
+	size_t off = 0;
+
+	len = recv(conn->fd, rx_buf, sizeof(rx_buf), MSG_DONTWAIT);
+	if (len < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+
+		syslog(LOG_ERR, "Read failed: %s (%d)", strerror(errno), errno);
+		conn_finish(conn, true);
+		return;
+	}
+
+	if (len == 0) {
+		if (!conn->done) {
+			conn->closed = true;
+			conn_finish(conn, false);
+		}
+
+		close(conn->fd);
+		conn->fd = -1;
+		return;
+	}
+
+	if (conn->done)
+		return;
+
+	now = get_time_us();
+	conn->rx_bytes += len;
+
+	/* Messages may be split or coalesced by stream sockets */
+	while (off < (size_t) len) {
+		size_t chunk = config->msg_size - conn->rx_off;
+
+		if (chunk > len - off)
+			chunk = len - off;
+
+		if (conn->rx_off < sizeof(conn->rx_hdr)) {
+			size_t hdr = sizeof(conn->rx_hdr) - conn->rx_off;
+
+			memcpy(conn->rx_hdr + conn->rx_off, rx_buf + off,
+						hdr < chunk ? hdr : chunk);
+		}
+
+		conn->rx_off += chunk;
+		off += chunk;
+
+		if (conn->rx_off < (size_t) config->msg_size)
+			continue;
+
+		conn->rx_off = 0;
+		conn_message(conn, now);
+
+		if (conn->done)
+			return;
+	}
+
+	conn_send(epfd, conn);
+}
+
+static int compare_rtt(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(const uint32_t *rtt, size_t len, unsigned int pct)
+{
+	return rtt[(len - 1) * pct / 100];
+}
+
+static void report(uint64_t start)
+{
+	double sum = 0, sum_sq = 0, min = 0, max = 0;
+	unsigned int i, n = 0;
+
+	for (i = 0; i < num_conns; i++) {
+		struct load_conn *conn = &conns[i];
+		uint64_t bytes;
+		double secs, rate;
+		char status[64];
+
+		secs = (conn->end - start) / 1000000.0;
+
+		if (config->workload == LOAD_SEND)
+			bytes = conn->tx_bytes;
+		else
+			bytes = conn->rx_bytes;
+
+		rate = secs > 0 ? bytes / secs / 1024.0 : 0;
+
+		if (conn->failed)
+			snprintf(status, sizeof(status), " (failed)");
+		else if (conn->closed)
+			snprintf(status, sizeof(status),
+					" (closed by peer after %ld messages)",
+					config->workload == LOAD_SEND ?
+					conn->sent_msgs : conn->recv_msgs);
+		else
+			status[0] = '\0';
+
+		if (!conn->rtt_len) {
+			syslog(LOG_INFO, "%s #%u: %llu bytes in %.2f sec, "
+					"%.2f kB/s%s", conn->peer, conn->index,
+					(unsigned long long) bytes, secs, rate,
+					status);
+		} else {
+			qsort(conn->rtt, conn->rtt_len, sizeof(*conn->rtt),
+								compare_rtt);
+
+			syslog(LOG_INFO, "%s #%u: %llu bytes in %.2f sec, "
+				"%.2f kB/s, rtt p50 %u p90 %u p99 %u max %u us%s",
+				conn->peer, conn->index,
+				(unsigned long long) bytes, secs, rate,
+				percentile(conn->rtt, conn->rtt_len, 50),
+				percentile(conn->rtt, conn->rtt_len, 90),
+				percentile(conn->rtt, conn->rtt_len, 99),
+				conn->rtt[conn->rtt_len - 1], status);
+		}
+
+		if (!n || rate < min)
+			min = rate;
+
+		if (rate > max)
+			max = rate;
+
+		sum += rate;
+		sum_sq += rate * rate;
+		n++;
+	}
+
+	/* Jain's fairness index, 1.0 when all channels get the same rate */
+	syslog(LOG_INFO, "%u channels: %.2f kB/s total, min %.2f max %.2f "
+				"kB/s, fairness %.3f", n, sum, min, max,
+				sum_sq > 0 ? sum * sum / (n * sum_sq) : 1.0);
+}
+
+int load_run(const struct load_config *cfg, int num_peers, char *peers[])
+{
+	struct epoll_event events[64];
+	struct sigaction sa;
+	uint64_t start, now;
+	unsigned int i;
+	int epfd, n, err = 0;
+	long j;
+
+	config = cfg;
+
+	if (config->msg_size < (config->workload == LOAD_ECHO ?
+				LOAD_ECHO_HDR_SIZE : LOAD_HDR_SIZE) ||
+				config->msg_size > UINT16_MAX) {
+		syslog(LOG_ERR, "Invalid message size %ld", config->msg_size);
+		return -1;
+	}
+
+	num_conns = num_peers * config->channels;
+	conns = calloc(num_conns, sizeof(*conns));
+	if (!conns) {
+		syslog(LOG_ERR, "Can't allocate load state");
+		return -1;
+	}
+
+	for (i = 0; i < num_conns; i++)
+		conns[i].fd = -1;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		syslog(LOG_ERR, "Can't create epoll: %s (%d)",
+							strerror(errno), errno);
+		free(conns);
+		return -1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sig_term;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	for (i = 0; i < num_conns; i++) {
+		struct load_conn *conn = &conns[i];
+		struct epoll_event ev;
+
+		conn->peer = peers[i / config->channels];
+		conn->index = i % config->channels;
+		conn->done = true;
+
+		conn->tx_buf = malloc(config->msg_size);
+		if (!conn->tx_buf) {
+			err = -1;
+			goto done;
+		}
+
+		for (j = LOAD_HDR_SIZE; j < config->msg_size; j++)
+			conn->tx_buf[j] = 0x7f;
+
+		conn->fd = config->connect(conn->peer, conn->index,
+								&conn->mtu);
+		if (conn->fd < 0) {
+			err = -1;
+			goto done;
+		}
+
+		fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = conn;
+
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &ev) < 0) {
+			syslog(LOG_ERR, "Can't add socket: %s (%d)",
+							strerror(errno), errno);
+			err = -1;
+			goto done;
+		}
+
+		if (terminate)
+			goto done;
+	}
+
+	syslog(LOG_INFO, "Running %s load on %u channels ...",
+					workloads[config->workload], num_conns);
+
+	interval = config->rate ? 1000000 / config->rate : 0;
+	start = get_time_us();
+	num_active = num_conns;
+
+	for (i = 0; i < num_conns; i++) {
+		conns[i].done = false;
+		conns[i].next_due = start;
+		conn_send(epfd, &conns[i]);
+	}
+
+	while (num_active > 0 && !terminate) {
+		int timeout = -1;
+
+		if (config->rate && config->workload != LOAD_RECV) {
+			uint64_t due = UINT64_MAX;
+
+			now = get_time_us();
+
+			for (i = 0; i < num_conns; i++) {
+				if (!conns[i].done && !conns[i].tx_active &&
+						conns[i].next_due < due)
+					due = conns[i].next_due;
+			}
+
+			if (due != UINT64_MAX)
+				timeout = due > now ? (due - now + 999) / 1000 : 0;
+		}
+
+		n = epoll_wait(epfd, events, 64, timeout);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			syslog(LOG_ERR, "Poll failed: %s (%d)",
+							strerror(errno), errno);
+			err = -1;
+			break;
+		}
+
+		for (j = 0; j < n; j++) {
+			struct load_conn *conn = events[j].data.ptr;
+
+			if (conn->fd < 0)
+				continue;
+
+			if (events[j].events & EPOLLIN)
+				conn_recv(epfd, conn);
+			else if (events[j].events & (EPOLLERR | EPOLLHUP))
+				conn_finish(conn, true);
+
+			if (conn->fd >= 0 && (events[j].events & EPOLLOUT))
+				conn_send(epfd, conn);
+		}
+
+		if (config->rate) {
+			for (i = 0; i < num_conns; i++)
+				conn_send(epfd, &conns[i]);
+		}
+	}
+
+	for (i = 0; i < num_conns; i++) {
+		if (!conns[i].done)
+			conn_finish(&conns[i], false);
+	}
+
+	report(start);
+
+done:
+	for (i = 0; i < num_conns; i++) {
+		if (conns[i].fd >= 0)
+			close(conns[i].fd);
+
+		free(conns[i].tx_buf);
+		free(conns[i].rtt);
+	}
+
+	close(epfd);
+	free(conns);
+
+	return err;
+}
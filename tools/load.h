@@ -0,0 +1,54 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2014  Intel Corporation
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdint.h>
+
+enum load_workload {
+	LOAD_SEND,
+	LOAD_RECV,
+	LOAD_ECHO,
+};
+
+/*
+ * Messages start with a 32 bit sequence number and a 16 bit length like
+ * the ones of the send modes, echo messages add a 64 bit timestamp.
+ */
+#define LOAD_HDR_SIZE		6
+#define LOAD_ECHO_HDR_SIZE	14
+
+/* Returns a connected socket, mtu 0 means no limit per write */
+typedef int (*load_connect_func_t) (const char *peer, unsigned int index,
+								uint16_t *mtu);
+
+struct load_config {
+	enum load_workload workload;
+	unsigned int channels;		/* per peer */
+	long msg_size;
+	unsigned int rate;		/* messages per second, 0 = unlimited */
+	long num_msgs;			/* per channel, -1 = until interrupted */
+	load_connect_func_t connect;
+};
+
+int load_parse_workload(const char *str);
+
+int load_run(const struct load_config *config, int num_peers, char *peers[]);
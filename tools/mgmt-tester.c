@@ -59,6 +59,7 @@ struct test_data {
 	struct hciemu *hciemu;
 	enum hciemu_type hciemu_type;
 	int unmet_conditions;
+	struct multi_state *multi;
 };
 
 static void mgmt_debug(const char *str, void *user_data)
@@ -3579,6 +3580,604 @@ static void test_command_generic_connect(const void *test_data)
 	bthost_hci_connect(bthost, master_bdaddr, addr_type);
 }
 
+/*
+ * Multi adapter load tests. Several emulated controllers share the one
+ * mgmt socket and each runs its own command sequence as fast as the
+ * replies come in. Every command is timed from mgmt_send() to its reply
+ * and, through the mgmt trace hook, from being written to the socket to
+ * its reply. The difference is time spent queued behind commands for
+ * other controllers.
+ */
+#define MULTI_MAX_ADAPTERS	8
+
+enum multi_op {
+	MULTI_OP_POWER,
+	MULTI_OP_DISCOVERY,
+	MULTI_OP_CONNECT,
+	MULTI_OP_MIXED,
+};
+
+struct multi_data {
+	unsigned int adapters;
+	unsigned int iterations;
+	enum multi_op op;
+};
+
+struct multi_stats {
+	uint16_t opcode;
+	GArray *total;
+	GArray *kernel;
+};
+
+struct multi_adapter {
+	struct hciemu *hciemu;
+	uint16_t index;
+	bool ready;
+	enum multi_op op;
+	unsigned int remaining;
+};
+
+struct multi_state {
+	struct mgmt *mgmt;
+	struct multi_adapter adapters[MULTI_MAX_ADAPTERS];
+	unsigned int num_adapters;
+	unsigned int num_pending;
+	gint64 start;
+	unsigned int commands;
+	struct multi_stats stats[4];
+};
+
+struct multi_cmd {
+	struct multi_adapter *adapter;
+	uint16_t opcode;
+	gint64 sent;
+};
+
+static const uint16_t multi_opcodes[] = {
+	MGMT_OP_SET_POWERED,
+	MGMT_OP_START_DISCOVERY,
+	MGMT_OP_STOP_DISCOVERY,
+	MGMT_OP_DISCONNECT,
+};
+
+static struct multi_adapter *multi_find_index(struct multi_state *multi,
+							uint16_t index)
+{
+	unsigned int i;
+
+	for (i = 0; i < multi->num_adapters; i++) {
+		if (multi->adapters[i].ready &&
+					multi->adapters[i].index == index)
+			return &multi->adapters[i];
+	}
+
+	return NULL;
+}
+
+static struct multi_stats *multi_get_stats(struct multi_state *multi,
+							uint16_t opcode)
+{
+	unsigned int i;
+
+	for (i = 0; i < G_N_ELEMENTS(multi->stats); i++) {
+		if (multi->stats[i].opcode == opcode)
+			return &multi->stats[i];
+	}
+
+	return NULL;
+}
+
+static void multi_trace(uint16_t event, uint16_t opcode, uint16_t index,
+				uint8_t status, uint16_t length, uint32_t usec,
+				void *user_data)
+{
+	struct multi_state *multi = user_data;
+	struct multi_stats *stats;
+
+	/* Only commands sent by the test itself, not its setup */
+	if (!usec || !multi->start)
+		return;
+
+	stats = multi_get_stats(multi, opcode);
+	if (stats)
+		g_array_append_val(stats->kernel, usec);
+}
+
+static void multi_read_info_callback(uint8_t status, uint16_t length,
+					const void *param, void *user_data)
+{
+	struct test_data *data = tester_get_data();
+	struct multi_state *multi = data->multi;
+	const struct mgmt_rp_read_info *rp = param;
+	uint16_t index = GPOINTER_TO_UINT(user_data);
+	unsigned int i;
+	char addr[18];
+
+	if (status || !param) {
+		tester_pre_setup_failed();
+		return;
+	}
+
+	ba2str(&rp->bdaddr, addr);
+
+	for (i = 0; i < multi->num_adapters; i++) {
+		struct multi_adapter *adapter = &multi->adapters[i];
+
+		if (adapter->ready || !adapter->hciemu)
+			continue;
+
+		if (strcmp(hciemu_get_address(adapter->hciemu), addr))
+			continue;
+
+		tester_print("Adapter %u is hci%u (%s)", i, index, addr);
+
+		adapter->index = index;
+		adapter->ready = true;
+
+		if (--multi->num_pending == 0)
+			tester_pre_setup_complete();
+
+		return;
+	}
+}
+
+static void multi_index_added_callback(uint16_t index, uint16_t length,
+					const void *param, void *user_data)
+{
+	struct test_data *data = tester_get_data();
+
+	mgmt_send(data->multi->mgmt, MGMT_OP_READ_INFO, index, 0, NULL,
+					multi_read_info_callback,
+					GUINT_TO_POINTER(index), NULL);
+}
+
+static void multi_free(struct multi_state *multi)
+{
+	unsigned int i;
+
+	for (i = 0; i < G_N_ELEMENTS(multi->stats); i++) {
+		g_array_free(multi->stats[i].total, TRUE);
+		g_array_free(multi->stats[i].kernel, TRUE);
+	}
+
+	mgmt_unref(multi->mgmt);
+	g_free(multi);
+}
+
+static void multi_index_removed_callback(uint16_t index, uint16_t length,
+					const void *param, void *user_data)
+{
+	struct test_data *data = tester_get_data();
+	struct multi_state *multi = data->multi;
+	struct multi_adapter *adapter;
+
+	adapter = multi_find_index(multi, index);
+	if (!adapter)
+		return;
+
+	adapter->ready = false;
+
+	mgmt_unregister_index(multi->mgmt, index);
+
+	if (--multi->num_pending > 0)
+		return;
+
+	multi_free(multi);
+	data->multi = NULL;
+
+	tester_post_teardown_complete();
+}
+
+static void multi_read_index_list_callback(uint8_t status, uint16_t length,
+					const void *param, void *user_data)
+{
+	struct test_data *data = tester_get_data();
+	const struct multi_data *test = data->test_data;
+	struct multi_state *multi = data->multi;
+	unsigned int i;
+
+	if (status || !param) {
+		tester_pre_setup_failed();
+		return;
+	}
+
+	mgmt_register(multi->mgmt, MGMT_EV_INDEX_ADDED, MGMT_INDEX_NONE,
+					multi_index_added_callback, NULL, NULL);
+
+	mgmt_register(multi->mgmt, MGMT_EV_INDEX_REMOVED, MGMT_INDEX_NONE,
+				multi_index_removed_callback, NULL, NULL);
+
+	multi->num_pending = test->adapters;
+
+	for (i = 0; i < test->adapters; i++) {
+		struct multi_adapter *adapter = &multi->adapters[i];
+
+		adapter->hciemu = hciemu_new(HCIEMU_TYPE_BREDRLE);
+		if (!adapter->hciemu) {
+			tester_warn("Failed to setup HCI emulation");
+			tester_pre_setup_failed();
+			return;
+		}
+
+		multi->num_adapters++;
+
+		if (test->op == MULTI_OP_MIXED)
+			adapter->op = i % MULTI_OP_MIXED;
+		else
+			adapter->op = test->op;
+
+		/* Power and discovery count commands, connect iterations */
+		if (adapter->op == MULTI_OP_CONNECT)
+			adapter->remaining = test->iterations;
+		else
+			adapter->remaining = test->iterations * 2;
+	}
+}
+
+static void multi_pre_setup(const void *test_data)
+{
+	struct test_data *data = tester_get_data();
+	struct multi_state *multi;
+	unsigned int i;
+
+	multi = g_new0(struct multi_state, 1);
+	data->multi = multi;
+
+	for (i = 0; i < G_N_ELEMENTS(multi->stats); i++) {
+		multi->stats[i].opcode = multi_opcodes[i];
+		multi->stats[i].total = g_array_new(FALSE, FALSE,
+							sizeof(uint32_t));
+		multi->stats[i].kernel = g_array_new(FALSE, FALSE,
+							sizeof(uint32_t));
+	}
+
+	multi->mgmt = mgmt_new_default();
+	if (!multi->mgmt) {
+		tester_warn("Failed to setup management interface");
+		tester_pre_setup_failed();
+		return;
+	}
+
+	if (tester_use_debug())
+		mgmt_set_debug(multi->mgmt, mgmt_debug, "mgmt: ", NULL);
+
+	mgmt_set_trace(multi->mgmt, multi_trace, multi);
+
+	mgmt_send(multi->mgmt, MGMT_OP_READ_INDEX_LIST, MGMT_INDEX_NONE, 0,
+				NULL, multi_read_index_list_callback,
+				NULL, NULL);
+}
+
+static void multi_post_teardown(const void *test_data)
+{
+	struct test_data *data = tester_get_data();
+	struct multi_state *multi = data->multi;
+	unsigned int i;
+
+	multi->num_pending = 0;
+
+	for (i = 0; i < multi->num_adapters; i++) {
+		struct multi_adapter *adapter = &multi->adapters[i];
+
+		if (adapter->ready)
+			multi->num_pending++;
+
+		hciemu_unref(adapter->hciemu);
+		adapter->hciemu = NULL;
+	}
+
+	if (multi->num_pending > 0)
+		return;
+
+	multi_free(multi);
+	data->multi = NULL;
+
+	tester_post_teardown_complete();
+}
+
+static void multi_setup_callback(uint8_t status, uint16_t length,
+					const void *param, void *user_data)
+{
+	struct test_data *data = tester_get_data();
+
+	if (status != MGMT_STATUS_SUCCESS) {
+		tester_setup_failed();
+		return;
+	}
+
+	if (--data->multi->num_pending == 0)
+		tester_setup_complete();
+}
+
+static void multi_connected(uint16_t index, uint16_t length,
+					const void *param, void *user_data);
+
+static void multi_setup(const void *test_data)
+{
+	struct test_data *data = tester_get_data();
+	struct multi_state *multi = data->multi;
+	uint8_t param = 0x01;
+	unsigned int i;
+
+	multi->num_pending = 0;
+
+	for (i = 0; i < multi->num_adapters; i++) {
+		struct multi_adapter *adapter = &multi->adapters[i];
+
+		mgmt_send(multi->mgmt, MGMT_OP_SET_LE, adapter->index,
+					sizeof(param), &param,
+					multi_setup_callback, NULL, NULL);
+		mgmt_send(multi->mgmt, MGMT_OP_SET_CONNECTABLE,
+					adapter->index, sizeof(param), &param,
+					multi_setup_callback, NULL, NULL);
+		multi->num_pending += 2;
+
+		if (adapter->op == MULTI_OP_POWER)
+			continue;
+
+		mgmt_register(multi->mgmt, MGMT_EV_DEVICE_CONNECTED,
+					adapter->index, multi_connected,
+					adapter, NULL);
+
+		mgmt_send(multi->mgmt, MGMT_OP_SET_POWERED, adapter->index,
+					sizeof(param), &param,
+					multi_setup_callback, NULL, NULL);
+		multi->num_pending++;
+	}
+}
+
+static void multi_adapter_next(struct multi_adapter *adapter);
+
+static void multi_cmd_complete(uint8_t status, uint16_t length,
+					const void *param, void *user_data)
+{
+	struct test_data *data = tester_get_data();
+	struct multi_cmd *cmd = user_data;
+	struct multi_stats *stats;
+	uint32_t usec;
+
+	if (status != MGMT_STATUS_SUCCESS) {
+		tester_warn("%s failed on hci%u: %s (0x%02x)",
+					mgmt_opstr(cmd->opcode),
+					cmd->adapter->index,
+					mgmt_errstr(status), status);
+		tester_test_failed();
+		return;
+	}
+
+	usec = g_get_monotonic_time() - cmd->sent;
+
+	stats = multi_get_stats(data->multi, cmd->opcode);
+	if (stats)
+		g_array_append_val(stats->total, usec);
+
+	data->multi->commands++;
+
+	multi_adapter_next(cmd->adapter);
+}
+
+static void multi_send(struct multi_adapter *adapter, uint16_t opcode,
+					uint16_t length, const void *param)
+{
+	struct test_data *data = tester_get_data();
+	struct multi_cmd *cmd;
+
+	cmd = g_new0(struct multi_cmd, 1);
+	cmd->adapter = adapter;
+	cmd->opcode = opcode;
+	cmd->sent = g_get_monotonic_time();
+
+	if (mgmt_send(data->multi->mgmt, opcode, adapter->index, length,
+				param, multi_cmd_complete, cmd, g_free))
+		return;
+
+	g_free(cmd);
+	tester_warn("Failed to send %s", mgmt_opstr(opcode));
+	tester_test_failed();
+}
+
+static void multi_connected(uint16_t index, uint16_t length,
+					const void *param, void *user_data)
+{
+	const struct mgmt_ev_device_connected *ev = param;
+	struct multi_adapter *adapter = user_data;
+	struct mgmt_cp_disconnect cp;
+
+	if (length < sizeof(*ev)) {
+		tester_test_failed();
+		return;
+	}
+
+	memcpy(&cp.addr, &ev->addr, sizeof(cp.addr));
+
+	multi_send(adapter, MGMT_OP_DISCONNECT, sizeof(cp), &cp);
+}
+
+static int multi_compare(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a;
+	uint32_t y = *(const uint32_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void multi_print(const char *label, GArray *samples)
+{
+	uint32_t *val = (uint32_t *) samples->data;
+	unsigned int i, n = samples->len, buckets[16];
+	uint64_t total = 0;
+	GString *str;
+
+	if (!n)
+		return;
+
+	qsort(val, n, sizeof(*val), multi_compare);
+
+	memset(buckets, 0, sizeof(buckets));
+
+	/* Bucket b counts latencies below 100 << b usec */
+	for (i = 0; i < n; i++) {
+		unsigned int b = 0;
+
+		while (b < G_N_ELEMENTS(buckets) - 1 && val[i] >= (100U << b))
+			b++;
+
+		buckets[b]++;
+		total += val[i];
+	}
+
+	tester_print("    %-6s min %u p50 %u p90 %u p99 %u max %u avg %u usec",
+				label, val[0], val[n / 2], val[n * 9 / 10],
+				val[n * 99 / 100], val[n - 1],
+				(unsigned int) (total / n));
+
+	str = g_string_new(NULL);
+
+	for (i = 0; i < G_N_ELEMENTS(buckets); i++) {
+		if (buckets[i])
+			g_string_append_printf(str, " <%uus:%u",
+							100U << i, buckets[i]);
+	}
+
+	tester_print("          %s", str->str);
+	g_string_free(str, TRUE);
+}
+
+static void multi_report(struct multi_state *multi)
+{
+	gint64 elapsed = g_get_monotonic_time() - multi->start;
+	unsigned int i;
+
+	tester_print("%u commands on %u adapters in %.1f ms (%.0f/s)",
+				multi->commands, multi->num_adapters,
+				elapsed / 1000.0,
+				multi->commands * 1000000.0 / MAX(elapsed, 1));
+
+	for (i = 0; i < G_N_ELEMENTS(multi->stats); i++) {
+		struct multi_stats *stats = &multi->stats[i];
+
+		if (!stats->total->len)
+			continue;
+
+		tester_print("  %s: %u", mgmt_opstr(stats->opcode),
+							stats->total->len);
+		multi_print("total", stats->total);
+		multi_print("kernel", stats->kernel);
+	}
+}
+
+static void multi_adapter_next(struct multi_adapter *adapter)
+{
+	struct test_data *data = tester_get_data();
+	struct multi_state *multi = data->multi;
+	uint8_t type = 0x07;
+	uint8_t param;
+	struct bthost *bthost;
+
+	if (!adapter->remaining) {
+		if (--multi->num_pending > 0)
+			return;
+
+		multi_report(multi);
+		tester_test_passed();
+		return;
+	}
+
+	switch (adapter->op) {
+	case MULTI_OP_POWER:
+		/* Even counts power on, odd ones power off again */
+		param = !(adapter->remaining-- % 2);
+		multi_send(adapter, MGMT_OP_SET_POWERED, sizeof(param),
+								&param);
+		break;
+	case MULTI_OP_DISCOVERY:
+		if (adapter->remaining-- % 2)
+			multi_send(adapter, MGMT_OP_STOP_DISCOVERY,
+							sizeof(type), &type);
+		else
+			multi_send(adapter, MGMT_OP_START_DISCOVERY,
+							sizeof(type), &type);
+		break;
+	case MULTI_OP_CONNECT:
+		/* Disconnected once Device Connected comes in */
+		adapter->remaining--;
+		bthost = hciemu_client_get_host(adapter->hciemu);
+		bthost_hci_connect(bthost,
+				hciemu_get_master_bdaddr(adapter->hciemu),
+				BDADDR_BREDR);
+		break;
+	case MULTI_OP_MIXED:
+		break;
+	}
+}
+
+static void test_multi(const void *test_data)
+{
+	struct test_data *data = tester_get_data();
+	struct multi_state *multi = data->multi;
+	unsigned int i;
+
+	multi->num_pending = multi->num_adapters;
+	multi->start = g_get_monotonic_time();
+
+	for (i = 0; i < multi->num_adapters; i++)
+		multi_adapter_next(&multi->adapters[i]);
+}
+
+#define test_multi_adapter(name, data) \
+	do { \
+		struct test_data *user; \
+		user = calloc(1, sizeof(struct test_data)); \
+		if (!user) \
+			break; \
+		user->test_data = data; \
+		tester_add_full(name, data, \
+				multi_pre_setup, multi_setup, test_multi, \
+				NULL, multi_post_teardown, 60, user, free); \
+	} while (0)
+
+static const struct multi_data multi_power_test_4 = {
+	.adapters = 4,
+	.iterations = 10,
+	.op = MULTI_OP_POWER,
+};
+
+static const struct multi_data multi_power_test_8 = {
+	.adapters = 8,
+	.iterations = 10,
+	.op = MULTI_OP_POWER,
+};
+
+static const struct multi_data multi_discovery_test_4 = {
+	.adapters = 4,
+	.iterations = 20,
+	.op = MULTI_OP_DISCOVERY,
+};
+
+static const struct multi_data multi_discovery_test_8 = {
+	.adapters = 8,
+	.iterations = 20,
+	.op = MULTI_OP_DISCOVERY,
+};
+
+static const struct multi_data multi_connect_test_4 = {
+	.adapters = 4,
+	.iterations = 10,
+	.op = MULTI_OP_CONNECT,
+};
+
+static const struct multi_data multi_connect_test_8 = {
+	.adapters = 8,
+	.iterations = 10,
+	.op = MULTI_OP_CONNECT,
+};
+
+static const struct multi_data multi_mixed_test_8 = {
+	.adapters = 8,
+	.iterations = 10,
+	.op = MULTI_OP_MIXED,
+};
+
 int main(int argc, char *argv[])
 {
 	tester_init(&argc, &argv);
@@ -4187,5 +4786,20 @@ int main(int argc, char *argv[])
 				&get_conn_info_ncon_test, NULL,
 				test_command_generic);
 
+	test_multi_adapter("Multi Adapter - Power Cycle 4",
+						&multi_power_test_4);
+	test_multi_adapter("Multi Adapter - Power Cycle 8",
+						&multi_power_test_8);
+	test_multi_adapter("Multi Adapter - Discovery 4",
+						&multi_discovery_test_4);
+	test_multi_adapter("Multi Adapter - Discovery 8",
+						&multi_discovery_test_8);
+	test_multi_adapter("Multi Adapter - Connect 4",
+						&multi_connect_test_4);
+	test_multi_adapter("Multi Adapter - Connect 8",
+						&multi_connect_test_8);
+	test_multi_adapter("Multi Adapter - Mixed 8",
+						&multi_mixed_test_8);
+
 	return tester_run();
 }
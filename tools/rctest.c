@@ -48,6 +48,7 @@
 #include <bluetooth/sdp_lib.h>
 
 #include "src/shared/util.h"
+#include "tools/load.h"
 
 /* Test modes */
 enum {
@@ -60,6 +61,8 @@ enum {
 	CRECV,
 	LSEND,
 	AUTO,
+	ECHO,
+	LOAD,
 };
 
 static unsigned char *buf;
@@ -94,6 +97,11 @@ static int timestamp = 0;
 static int defer_setup = 0;
 static int priority = -1;
 
+/* Load mode */
+static unsigned int load_channels = 1;
+static int load_workload = LOAD_ECHO;
+static unsigned int load_rate = 0;
+
 static float tv2fl(struct timeval tv)
 {
 	return (float)tv.tv_sec + (float)(tv.tv_usec/1000000.0);
@@ -596,6 +604,58 @@ static void send_mode(int sk)
 		syslog(LOG_INFO, "Done");
 }
 
+static void echo_mode(int sk)
+{
+	int len, sent, ret;
+
+	syslog(LOG_INFO, "Echoing ...");
+
+	while ((len = recv(sk, buf, data_size, 0)) > 0) {
+		for (sent = 0; sent < len; sent += ret) {
+			ret = send(sk, buf + sent, len - sent, 0);
+			if (ret <= 0) {
+				syslog(LOG_ERR, "Send failed: %s (%d)",
+							strerror(errno), errno);
+				return;
+			}
+		}
+	}
+
+	if (len < 0)
+		syslog(LOG_ERR, "Read failed: %s (%d)", strerror(errno), errno);
+}
+
+/* Channels to the same peer use consecutive RFCOMM channel numbers */
+static int load_connect(const char *peer, unsigned int index, uint16_t *mtu)
+{
+	uint8_t base = channel;
+	int sk;
+
+	channel += index;
+	sk = do_connect(peer);
+	channel = base;
+
+	*mtu = 0;
+
+	return sk;
+}
+
+static void load_mode(int argc, char *argv[])
+{
+	struct load_config config;
+
+	memset(&config, 0, sizeof(config));
+	config.workload = load_workload;
+	config.channels = load_channels;
+	config.msg_size = data_size;
+	config.rate = load_rate;
+	config.num_msgs = num_frames;
+	config.connect = load_connect;
+
+	if (load_run(&config, argc, argv) < 0)
+		exit(1);
+}
+
 static void reconnect_mode(char *svr)
 {
 	while(1) {
@@ -677,7 +737,9 @@ static void usage(void)
 		"\t-n connect and be silent\n"
 		"\t-c connect, disconnect, connect, ...\n"
 		"\t-m multiple connects\n"
-		"\t-a automated test (receive hcix as parameter)\n");
+		"\t-a automated test (receive hcix as parameter)\n"
+		"\t-e listen and echo received data\n"
+		"\t-l connect channels to all peers and run a load\n");
 
 	printf("Options:\n"
 		"\t[-b bytes] [-i device] [-P channel] [-U uuid]\n"
@@ -693,7 +755,13 @@ static void usage(void)
 		"\t[-E] request encryption\n"
 		"\t[-S] secure connection\n"
 		"\t[-M] become master\n"
-		"\t[-T] enable timestamps\n");
+		"\t[-T] enable timestamps\n"
+		"\t[-j num] load channels per peer, on consecutive "
+						"channels (default = 1)\n"
+		"\t[-g workload] load workload send, recv or echo "
+						"(default = echo)\n"
+		"\t[-f rate] load messages per second per channel "
+						"(default = unlimited)\n");
 }
 
 int main(int argc, char *argv[])
@@ -704,7 +772,7 @@ int main(int argc, char *argv[])
 	bacpy(&bdaddr, BDADDR_ANY);
 	bacpy(&auto_bdaddr, BDADDR_ANY);
 
-	while ((opt=getopt(argc,argv,"rdscuwmna:b:i:P:U:B:O:N:MAESL:W:C:D:Y:T")) != EOF) {
+	while ((opt=getopt(argc,argv,"rdscuwmnela:b:i:P:U:B:O:N:MAESL:W:C:D:Y:Tj:g:f:")) != EOF) {
 		switch (opt) {
 		case 'r':
 			mode = RECV;
@@ -752,6 +820,35 @@ int main(int argc, char *argv[])
 				str2ba(optarg, &auto_bdaddr);
 			break;
 
+		case 'e':
+			mode = ECHO;
+			break;
+
+		case 'l':
+			mode = LOAD;
+			need_addr = 1;
+			break;
+
+		case 'j':
+			load_channels = atoi(optarg);
+			if (!load_channels) {
+				usage();
+				exit(1);
+			}
+			break;
+
+		case 'g':
+			load_workload = load_parse_workload(optarg);
+			if (load_workload < 0) {
+				usage();
+				exit(1);
+			}
+			break;
+
+		case 'f':
+			load_rate = atoi(optarg);
+			break;
+
 		case 'b':
 			data_size = atoi(optarg);
 			break;
@@ -899,6 +996,14 @@ int main(int argc, char *argv[])
 		case AUTO:
 			automated_send_recv();
 			break;
+
+		case ECHO:
+			do_listen(echo_mode);
+			break;
+
+		case LOAD:
+			load_mode(argc - optind, argv + optind);
+			break;
 	}
 
 	syslog(LOG_INFO, "Exit");
@@ -0,0 +1,524 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2014  Intel Corporation. All rights reserved.
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+
+#include "lib/bluetooth.h"
+#include "lib/sdp.h"
+#include "lib/sdp_lib.h"
+#include "lib/uuid.h"
+#include "btio/btio.h"
+#include "src/adapter.h"
+#include "src/device.h"
+#include "src/shared/util.h"
+#include "attrib/gattrib.h"
+#include "attrib/att.h"
+#include "attrib/gatt.h"
+#include "attrib/att-database.h"
+#include "src/attrib-server.h"
+#include "unit/btio-stub.h"
+
+#define SERVICE_UUID_BASE	0xa000
+#define CHARS_PER_SERVICE	4
+#define HANDLES_PER_SERVICE	(1 + CHARS_PER_SERVICE * 3)
+
+struct context {
+	GMainLoop *main_loop;
+	GAttrib *client;
+	GAttrib *server;
+	unsigned int services;
+	uint16_t *handles;
+	int64_t elapsed;
+	unsigned int round_trips;
+};
+
+/*
+ * Just enough of the daemon for the attribute server to run on top of a
+ * socketpair, with a single adapter and a single bonded LE device.
+ */
+static int adapter_stub;
+static int device_stub;
+static const bdaddr_t local_addr = { { 0x01, 0x00, 0x00, 0x00, 0x00, 0x00 } };
+static const bdaddr_t remote_addr = { { 0x02, 0x00, 0x00, 0x00, 0x00, 0x00 } };
+static GSList *records;
+static char *ccc_path;
+static unsigned int ccc_writes;
+
+static struct btd_adapter *test_adapter =
+				(struct btd_adapter *) &adapter_stub;
+static struct btd_device *test_device = (struct btd_device *) &device_stub;
+
+struct btd_adapter *btd_adapter_ref(struct btd_adapter *a)
+{
+	return a;
+}
+
+void btd_adapter_unref(struct btd_adapter *a)
+{
+}
+
+const bdaddr_t *btd_adapter_get_address(struct btd_adapter *a)
+{
+	return &local_addr;
+}
+
+uint16_t btd_adapter_get_index(struct btd_adapter *a)
+{
+	return 0;
+}
+
+struct btd_adapter *adapter_find(const bdaddr_t *sba)
+{
+	return test_adapter;
+}
+
+struct btd_device *btd_adapter_find_device(struct btd_adapter *a,
+							const bdaddr_t *dst,
+							uint8_t dst_type)
+{
+	return test_device;
+}
+
+struct btd_device *btd_adapter_get_device(struct btd_adapter *a,
+							const bdaddr_t *addr,
+							uint8_t addr_type)
+{
+	return test_device;
+}
+
+void btd_adapter_for_each_device(struct btd_adapter *a,
+			void (*cb)(struct btd_device *device, void *data),
+			void *data)
+{
+}
+
+int adapter_service_add(struct btd_adapter *a, sdp_record_t *rec)
+{
+	rec->handle = g_slist_length(records) + 0x10000;
+	records = g_slist_prepend(records, rec);
+
+	return 0;
+}
+
+void adapter_service_remove(struct btd_adapter *a, uint32_t handle)
+{
+}
+
+struct btd_device *btd_device_ref(struct btd_device *d)
+{
+	return d;
+}
+
+void btd_device_unref(struct btd_device *d)
+{
+}
+
+struct btd_adapter *device_get_adapter(struct btd_device *d)
+{
+	return test_adapter;
+}
+
+const bdaddr_t *device_get_address(struct btd_device *d)
+{
+	return &remote_addr;
+}
+
+uint8_t btd_device_get_bdaddr_type(struct btd_device *d)
+{
+	return BDADDR_LE_PUBLIC;
+}
+
+bool device_is_bonded(struct btd_device *d, uint8_t bdaddr_type)
+{
+	return true;
+}
+
+char *btd_device_get_storage_path(struct btd_device *d,
+							const char *filename)
+{
+	return g_strdup(ccc_path);
+}
+
+bool device_attach_attrib(struct btd_device *dev, GIOChannel *io)
+{
+	return false;
+}
+
+int create_file(const char *filename, const mode_t mode)
+{
+	ccc_writes++;
+
+	return 0;
+}
+
+GIOChannel *bt_io_listen(BtIOConnect connect, BtIOConfirm confirm,
+				gpointer user_data, GDestroyNotify destroy,
+				GError **err, BtIOOption opt1, ...)
+{
+	int sv[2];
+
+	g_assert(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0,
+								sv) == 0);
+	close(sv[1]);
+
+	return g_io_channel_unix_new(sv[0]);
+}
+
+static uint16_t add_service(unsigned int index)
+{
+	uint16_t svc = SERVICE_UUID_BASE + index;
+	uint16_t handle, h;
+	uint8_t atval[5];
+	bt_uuid_t uuid;
+	int i;
+
+	bt_uuid16_create(&uuid, svc);
+	handle = attrib_db_find_avail(test_adapter, &uuid,
+							HANDLES_PER_SERVICE);
+	g_assert(handle != 0);
+
+	bt_uuid16_create(&uuid, GATT_PRIM_SVC_UUID);
+	put_le16(svc, atval);
+	g_assert(attrib_db_add(test_adapter, handle, &uuid, ATT_NONE,
+					ATT_NOT_PERMITTED, atval, 2));
+
+	for (i = 0, h = handle + 1; i < CHARS_PER_SERVICE; i++, h += 3) {
+		bt_uuid16_create(&uuid, GATT_CHARAC_UUID);
+		atval[0] = GATT_CHR_PROP_READ | GATT_CHR_PROP_NOTIFY;
+		put_le16(h + 1, &atval[1]);
+		put_le16(svc + i, &atval[3]);
+		g_assert(attrib_db_add(test_adapter, h, &uuid, ATT_NONE,
+					ATT_NOT_PERMITTED, atval, 5));
+
+		bt_uuid16_create(&uuid, svc + i);
+		g_assert(attrib_db_add(test_adapter, h + 1, &uuid, ATT_NONE,
+					ATT_NOT_PERMITTED, atval, 2));
+
+		bt_uuid16_create(&uuid, GATT_CLIENT_CHARAC_CFG_UUID);
+		put_le16(0x0000, atval);
+		g_assert(attrib_db_add(test_adapter, h + 2, &uuid, ATT_NONE,
+						ATT_AUTHENTICATION, atval, 2));
+	}
+
+	return handle;
+}
+
+static struct context *create_context(unsigned int services)
+{
+	struct context *context = g_new0(struct context, 1);
+	GIOChannel *channel;
+	unsigned int i;
+	int sv[2];
+
+	context->main_loop = g_main_loop_new(NULL, FALSE);
+	context->services = services;
+	context->handles = g_new0(uint16_t, services);
+
+	g_assert(btd_adapter_gatt_server_start(test_adapter) == 0);
+
+	for (i = 0; i < services; i++)
+		context->handles[i] = add_service(i);
+
+	g_assert(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0,
+								sv) == 0);
+
+	channel = g_io_channel_unix_new(sv[0]);
+	g_io_channel_set_close_on_unref(channel, TRUE);
+	context->server = g_attrib_new(channel);
+	g_io_channel_unref(channel);
+
+	g_assert(attrib_channel_attach(context->server) > 0);
+
+	channel = g_io_channel_unix_new(sv[1]);
+	g_io_channel_set_close_on_unref(channel, TRUE);
+	context->client = g_attrib_new(channel);
+	g_io_channel_unref(channel);
+
+	return context;
+}
+
+static void destroy_context(struct context *context)
+{
+	g_attrib_unref(context->client);
+	g_attrib_unref(context->server);
+
+	btd_adapter_gatt_server_stop(test_adapter);
+
+	g_slist_free_full(records, (GDestroyNotify) sdp_record_free);
+	records = NULL;
+
+	g_main_loop_unref(context->main_loop);
+	g_free(context->handles);
+	g_free(context);
+}
+
+static void discover_all_cb(uint8_t status, const struct gatt_discovery *disc,
+							void *user_data)
+{
+	struct context *context = user_data;
+	unsigned int primaries = 0, chars = 0, attributes = 0;
+	GSList *l;
+
+	g_assert(status == 0);
+
+	for (l = disc->primaries; l; l = l->next) {
+		struct gatt_primary *prim = l->data;
+
+		if (strtoul(prim->uuid, NULL, 16) < SERVICE_UUID_BASE)
+			continue;
+
+		g_assert(prim->range.end - prim->range.start + 1 ==
+							HANDLES_PER_SERVICE);
+		primaries++;
+	}
+
+	for (l = disc->chars; l; l = l->next) {
+		struct gatt_char *chr = l->data;
+
+		if (strtoul(chr->uuid, NULL, 16) >= SERVICE_UUID_BASE) {
+			g_assert(chr->value_handle == chr->handle + 1);
+			chars++;
+		}
+	}
+
+	attributes = g_slist_length(disc->attributes);
+
+	g_assert(primaries == context->services);
+	g_assert(chars == context->services * CHARS_PER_SERVICE);
+	g_assert(attributes >= context->services * HANDLES_PER_SERVICE);
+
+	context->elapsed = disc->elapsed;
+	context->round_trips = disc->round_trips;
+
+	g_main_loop_quit(context->main_loop);
+}
+
+static void run_discover_all(struct context *context, uint16_t mtu)
+{
+	g_assert(gatt_discover_all(context->client, mtu, discover_all_cb,
+								context));
+
+	g_main_loop_run(context->main_loop);
+}
+
+static void test_discover(void)
+{
+	struct context *context = create_context(20);
+
+	run_discover_all(context, 0);
+
+	destroy_context(context);
+}
+
+static void read_cb(guint8 status, const guint8 *pdu, guint16 len,
+							gpointer user_data)
+{
+	struct context *context = user_data;
+	uint8_t value[2];
+
+	g_assert(status == 0);
+	g_assert(dec_read_resp(pdu, len, value, sizeof(value)) == 2);
+	g_assert(get_le16(value) == SERVICE_UUID_BASE + 2);
+
+	g_main_loop_quit(context->main_loop);
+}
+
+static void invalid_cb(guint8 status, const guint8 *pdu, guint16 len,
+							gpointer user_data)
+{
+	struct context *context = user_data;
+
+	g_assert(status == ATT_ECODE_INVALID_HANDLE);
+
+	g_main_loop_quit(context->main_loop);
+}
+
+static void test_read(void)
+{
+	struct context *context = create_context(3);
+	uint16_t start = context->handles[2];
+
+	g_assert(gatt_read_char(context->client, start, read_cb, context));
+	g_main_loop_run(context->main_loop);
+
+	g_assert(attrib_db_del(test_adapter, start) == 0);
+	g_assert(attrib_db_del(test_adapter, start) == -ENOENT);
+
+	g_assert(gatt_read_char(context->client, start, invalid_cb, context));
+	g_main_loop_run(context->main_loop);
+
+	destroy_context(context);
+}
+
+static void ccc_read_cb(guint8 status, const guint8 *pdu, guint16 len,
+							gpointer user_data)
+{
+	struct context *context = user_data;
+	uint8_t value[2];
+
+	g_assert(status == 0);
+	g_assert(dec_read_resp(pdu, len, value, sizeof(value)) == 2);
+	g_assert(get_le16(value) == 0x0002);
+
+	g_main_loop_quit(context->main_loop);
+}
+
+static void count_subscriber(struct btd_device *device, uint16_t value,
+							void *user_data)
+{
+	unsigned int *count = user_data;
+
+	g_assert(device == test_device);
+	g_assert(value == 0x0002);
+
+	(*count)++;
+}
+
+static gboolean quit_idle(gpointer user_data)
+{
+	struct context *context = user_data;
+
+	g_main_loop_quit(context->main_loop);
+
+	return FALSE;
+}
+
+static void test_ccc(void)
+{
+	struct context *context;
+	GKeyFile *key_file;
+	uint8_t value[2];
+	char **groups;
+	char *group, *str;
+	unsigned int count = 0;
+	int fd, i;
+
+	ccc_path = g_strdup("/tmp/test-attrib-server-XXXXXX");
+	fd = mkstemp(ccc_path);
+	g_assert(fd >= 0);
+	close(fd);
+
+	btio_stub.sec_level = BT_IO_SEC_MEDIUM;
+	ccc_writes = 0;
+
+	context = create_context(3);
+
+	/* Writes arriving together are stored with one file write */
+	for (i = 0; i < 3; i++) {
+		put_le16(i == 1 ? 0x0002 : 0x0001, value);
+		g_assert(gatt_write_cmd(context->client,
+					context->handles[i] + 3, value,
+					sizeof(value), NULL, NULL));
+	}
+
+	g_idle_add_full(G_PRIORITY_LOW, quit_idle, context, NULL);
+	g_main_loop_run(context->main_loop);
+
+	g_assert_cmpuint(ccc_writes, ==, 1);
+
+	key_file = g_key_file_new();
+	g_assert(g_key_file_load_from_file(key_file, ccc_path, 0, NULL));
+
+	groups = g_key_file_get_groups(key_file, NULL);
+	g_assert_cmpuint(g_strv_length(groups), ==, 3);
+	g_strfreev(groups);
+
+	group = g_strdup_printf("%u", context->handles[1] + 3);
+	str = g_key_file_get_string(key_file, group, "Value", NULL);
+	g_assert_cmpstr(str, ==, "2");
+	g_free(str);
+	g_free(group);
+
+	g_key_file_free(key_file);
+
+	g_assert(gatt_read_char(context->client, context->handles[1] + 3,
+						ccc_read_cb, context));
+	g_main_loop_run(context->main_loop);
+
+	attrib_foreach_subscriber(test_adapter, context->handles[1] + 3,
+					0x0002, count_subscriber, &count);
+	g_assert_cmpuint(count, ==, 1);
+
+	/* A removed device is no longer a subscriber */
+	attrib_remove_device(test_adapter, &remote_addr, BDADDR_LE_PUBLIC);
+
+	attrib_foreach_subscriber(test_adapter, context->handles[1] + 3,
+					0x0002, count_subscriber, &count);
+	g_assert_cmpuint(count, ==, 1);
+
+	destroy_context(context);
+
+	unlink(ccc_path);
+	g_free(ccc_path);
+	ccc_path = NULL;
+	btio_stub.sec_level = BT_IO_SEC_LOW;
+}
+
+static void test_benchmark(void)
+{
+	static const unsigned int sizes[] = { 10, 100, 1000 };
+	unsigned int i;
+
+	for (i = 0; i < G_N_ELEMENTS(sizes); i++) {
+		struct context *context = create_context(sizes[i]);
+		gint64 start = g_get_monotonic_time();
+
+		run_discover_all(context, 185);
+
+		g_test_message("%4u services %5u attributes: %u round trips "
+				"in %.1f ms (setup %.1f ms)", sizes[i],
+				sizes[i] * HANDLES_PER_SERVICE,
+				context->round_trips,
+				context->elapsed / 1000.0,
+				(g_get_monotonic_time() - start -
+						context->elapsed) / 1000.0);
+
+		destroy_context(context);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+	bacpy(&btio_stub.src, &local_addr);
+	bacpy(&btio_stub.dst, &remote_addr);
+	btio_stub.imtu = ATT_MAX_VALUE_LEN;
+
+	g_test_add_func("/attrib-server/discover", test_discover);
+	g_test_add_func("/attrib-server/read", test_read);
+	g_test_add_func("/attrib-server/ccc", test_ccc);
+	g_test_add_func("/attrib-server/benchmark", test_benchmark);
+
+	return g_test_run();
+}
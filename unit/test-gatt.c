@@ -0,0 +1,815 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2014  Intel Corporation. All rights reserved.
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+
+#include "lib/bluetooth.h"
+#include "lib/uuid.h"
+#include "src/shared/util.h"
+#include "btio/btio.h"
+#include "attrib/att.h"
+#include "attrib/gattrib.h"
+#include "attrib/gatt.h"
+
+#define SERVER_MTU	185
+
+struct test_data {
+	unsigned int services;
+	unsigned int chars;
+	unsigned int descs;
+	bool uuid128;
+	bool includes;
+	bool missing;		/* includes point past the database */
+	uint16_t mtu;
+	unsigned int cancel;	/* request during which discovery is cancelled */
+	unsigned int latency;	/* microseconds per request */
+};
+
+struct test_attr {
+	uint16_t handle;
+	bt_uuid_t type;
+	uint16_t end;		/* group end of service declarations */
+	uint8_t value[21];
+	uint16_t len;
+};
+
+struct context {
+	GMainLoop *main_loop;
+	const struct test_data *data;
+	GAttrib *attrib;
+	int fd;
+	guint source;
+	struct test_attr *db;
+	unsigned int db_len;
+	uint16_t mtu;
+	unsigned int requests;
+	guint discover_id;
+
+	/* Legacy procedure chain */
+	GSList *services;
+	GSList *current;
+	GSList *chars;
+	unsigned int num_includes;
+	unsigned int num_chars;
+	unsigned int num_attrs;
+	gint64 start;
+};
+
+static void put_uuid(const bt_uuid_t *uuid, uint8_t *dst)
+{
+	if (uuid->type == BT_UUID16)
+		put_le16(uuid->value.u16, dst);
+	else
+		bswap_128(&uuid->value.u128, dst);
+}
+
+static void make_uuid(bool uuid128, uint16_t value, bt_uuid_t *uuid)
+{
+	uint128_t u128;
+
+	if (!uuid128) {
+		bt_uuid16_create(uuid, value);
+		return;
+	}
+
+	memset(&u128, 0xa5, sizeof(u128));
+	put_be16(value, &u128.data[2]);
+	bt_uuid128_create(uuid, u128);
+}
+
+static struct test_attr *add_attr(struct context *context, uint16_t type)
+{
+	struct test_attr *attr = &context->db[context->db_len];
+
+	attr->handle = ++context->db_len;
+	bt_uuid16_create(&attr->type, type);
+
+	return attr;
+}
+
+/* Services with characteristics, each one followed by its descriptors */
+static void build_db(struct context *context)
+{
+	const struct test_data *data = context->data;
+	struct test_attr *svc, *first = NULL;
+	unsigned int s, c, d, size;
+
+	size = data->services * (2 + data->chars * (2 + data->descs));
+	context->db = g_new0(struct test_attr, size);
+
+	for (s = 0; s < data->services; s++) {
+		bt_uuid_t uuid;
+
+		svc = add_attr(context, GATT_PRIM_SVC_UUID);
+		make_uuid(data->uuid128, 0x1800 + s, &uuid);
+		put_uuid(&uuid, svc->value);
+		svc->len = bt_uuid_len(&uuid);
+
+		if (!first)
+			first = svc;
+		else if (data->includes) {
+			struct test_attr *incl;
+
+			incl = add_attr(context, GATT_INCLUDE_UUID);
+			put_le16(first->handle, &incl->value[0]);
+			put_le16(first->end, &incl->value[2]);
+			incl->len = 4;
+
+			/* Nothing to read the 128-bit UUID from */
+			if (data->missing) {
+				put_le16(0xfff0, &incl->value[0]);
+				put_le16(0xffff, &incl->value[2]);
+			} else if (first->len == 2) {
+				memcpy(&incl->value[4], first->value, 2);
+				incl->len = 6;
+			}
+		}
+
+		for (c = 0; c < data->chars; c++) {
+			struct test_attr *chr, *value;
+
+			make_uuid(data->uuid128, 0x2a00 + s * 16 + c, &uuid);
+
+			chr = add_attr(context, GATT_CHARAC_UUID);
+			value = add_attr(context, 0);
+			value->type = uuid;
+			value->len = 1;
+
+			chr->value[0] = GATT_CHR_PROP_READ;
+			put_le16(value->handle, &chr->value[1]);
+			put_uuid(&uuid, &chr->value[3]);
+			chr->len = 3 + bt_uuid_len(&uuid);
+
+			for (d = 0; d < data->descs; d++) {
+				struct test_attr *desc;
+
+				desc = add_attr(context, 0x2900 + d);
+				desc->len = 2;
+			}
+		}
+
+		svc->end = context->db_len;
+	}
+}
+
+static struct test_attr *find_attr(struct context *context, uint16_t handle)
+{
+	if (handle == 0 || handle > context->db_len)
+		return NULL;
+
+	return &context->db[handle - 1];
+}
+
+static uint16_t error_rsp(uint8_t opcode, uint16_t handle, uint8_t *rsp)
+{
+	return enc_error_resp(opcode, handle, ATT_ECODE_ATTR_NOT_FOUND, rsp,
+							ATT_DEFAULT_LE_MTU);
+}
+
+/*
+ * Group and type reads return as many attributes of the same value length
+ * as fit the MTU, like any server would.
+ */
+static uint16_t read_by_type(struct context *context, const uint8_t *pdu,
+						uint16_t len, uint8_t *rsp)
+{
+	bool group = pdu[0] == ATT_OP_READ_BY_GROUP_REQ;
+	uint16_t start, end, w = 2, elen = 0, h;
+	bt_uuid_t type;
+
+	if (group)
+		dec_read_by_grp_req(pdu, len, &start, &end, &type);
+	else
+		dec_read_by_type_req(pdu, len, &start, &end, &type);
+
+	for (h = start; h <= end && h <= context->db_len; h++) {
+		struct test_attr *attr = find_attr(context, h);
+		uint16_t alen = (group ? 4 : 2) + attr->len;
+
+		if (bt_uuid_cmp(&attr->type, &type))
+			continue;
+
+		if (!elen)
+			elen = alen;
+		else if (elen != alen)
+			break;
+
+		if (w + elen > context->mtu)
+			break;
+
+		put_le16(h, &rsp[w]);
+		if (group) {
+			put_le16(attr->end, &rsp[w + 2]);
+			memcpy(&rsp[w + 4], attr->value, attr->len);
+		} else
+			memcpy(&rsp[w + 2], attr->value, attr->len);
+
+		w += elen;
+	}
+
+	if (!elen)
+		return error_rsp(pdu[0], start, rsp);
+
+	rsp[0] = group ? ATT_OP_READ_BY_GROUP_RESP : ATT_OP_READ_BY_TYPE_RESP;
+	rsp[1] = elen;
+
+	return w;
+}
+
+static uint16_t find_info(struct context *context, const uint8_t *pdu,
+						uint16_t len, uint8_t *rsp)
+{
+	uint16_t start, end, w = 2, elen = 0, h;
+
+	dec_find_info_req(pdu, len, &start, &end);
+
+	for (h = start; h <= end && h <= context->db_len; h++) {
+		struct test_attr *attr = find_attr(context, h);
+		uint16_t alen = 2 + bt_uuid_len(&attr->type);
+
+		if (!elen)
+			elen = alen;
+		else if (elen != alen)
+			break;
+
+		if (w + elen > context->mtu)
+			break;
+
+		put_le16(h, &rsp[w]);
+		put_uuid(&attr->type, &rsp[w + 2]);
+		w += elen;
+	}
+
+	if (!elen)
+		return error_rsp(pdu[0], start, rsp);
+
+	rsp[0] = ATT_OP_FIND_INFO_RESP;
+	rsp[1] = elen == 4 ? ATT_FIND_INFO_RESP_FMT_16BIT :
+					ATT_FIND_INFO_RESP_FMT_128BIT;
+
+	return w;
+}
+
+static uint16_t handle_request(struct context *context, const uint8_t *pdu,
+						uint16_t len, uint8_t *rsp)
+{
+	struct test_attr *attr;
+	uint16_t mtu, handle;
+
+	switch (pdu[0]) {
+	case ATT_OP_MTU_REQ:
+		g_assert(dec_mtu_req(pdu, len, &mtu));
+		context->mtu = MIN(mtu, SERVER_MTU);
+		return enc_mtu_resp(SERVER_MTU, rsp, SERVER_MTU);
+	case ATT_OP_READ_BY_GROUP_REQ:
+	case ATT_OP_READ_BY_TYPE_REQ:
+		return read_by_type(context, pdu, len, rsp);
+	case ATT_OP_FIND_INFO_REQ:
+		return find_info(context, pdu, len, rsp);
+	case ATT_OP_READ_REQ:
+		g_assert(dec_read_req(pdu, len, &handle));
+		attr = find_attr(context, handle);
+		if (!attr)
+			return error_rsp(pdu[0], handle, rsp);
+		return enc_read_resp(attr->value, attr->len, rsp,
+								context->mtu);
+	}
+
+	g_assert_not_reached();
+
+	return 0;
+}
+
+static gboolean server_handler(GIOChannel *channel, GIOCondition cond,
+							gpointer user_data)
+{
+	struct context *context = user_data;
+	uint8_t pdu[SERVER_MTU], rsp[SERVER_MTU];
+	ssize_t len;
+	uint16_t rlen;
+
+	if (cond & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
+		context->source = 0;
+		return FALSE;
+	}
+
+	len = read(context->fd, pdu, sizeof(pdu));
+	g_assert(len > 0);
+
+	context->requests++;
+
+	if (context->requests == context->data->cancel)
+		g_assert(gatt_discover_all_cancel(context->attrib,
+						context->discover_id));
+
+	rlen = handle_request(context, pdu, len, rsp);
+	g_assert(rlen > 0 && rlen <= context->mtu);
+
+	/* Every request costs one round trip on the air */
+	if (context->data->latency)
+		g_usleep(context->data->latency);
+
+	g_assert(write(context->fd, rsp, rlen) == rlen);
+
+	return TRUE;
+}
+
+static struct context *create_context(const struct test_data *data)
+{
+	struct context *context = g_new0(struct context, 1);
+	GIOChannel *channel;
+	int sv[2];
+
+	context->main_loop = g_main_loop_new(NULL, FALSE);
+	context->data = data;
+	context->mtu = ATT_DEFAULT_LE_MTU;
+
+	build_db(context);
+
+	g_assert(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0,
+								sv) == 0);
+
+	channel = g_io_channel_unix_new(sv[0]);
+	g_io_channel_set_close_on_unref(channel, TRUE);
+
+	context->attrib = g_attrib_new(channel);
+	g_assert(context->attrib);
+
+	g_io_channel_unref(channel);
+
+	context->fd = sv[1];
+
+	channel = g_io_channel_unix_new(sv[1]);
+	g_io_channel_set_close_on_unref(channel, TRUE);
+	g_io_channel_set_encoding(channel, NULL, NULL);
+	g_io_channel_set_buffered(channel, FALSE);
+
+	context->source = g_io_add_watch(channel,
+				G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
+				server_handler, context);
+	g_assert(context->source > 0);
+
+	g_io_channel_unref(channel);
+
+	return context;
+}
+
+static void destroy_context(struct context *context)
+{
+	if (context->source > 0)
+		g_source_remove(context->source);
+
+	g_attrib_unref(context->attrib);
+
+	g_slist_free_full(context->services, g_free);
+	g_slist_free_full(context->chars, g_free);
+
+	g_main_loop_unref(context->main_loop);
+
+	g_free(context->db);
+	g_free(context);
+}
+
+static void check_discovery(struct context *context,
+					const struct gatt_discovery *disc)
+{
+	const struct test_data *data = context->data;
+	unsigned int includes = 0;
+	GSList *l;
+
+	if (data->includes && !data->missing && data->services > 1)
+		includes = data->services - 1;
+
+	g_assert(g_slist_length(disc->primaries) == data->services);
+	g_assert(g_slist_length(disc->includes) == includes);
+	g_assert(g_slist_length(disc->chars) ==
+					data->services * data->chars);
+	g_assert(g_slist_length(disc->attributes) == context->db_len);
+
+	for (l = disc->attributes; l; l = l->next) {
+		struct gatt_desc *desc = l->data;
+		struct test_attr *attr = find_attr(context, desc->handle);
+		bt_uuid_t uuid;
+
+		g_assert(attr);
+		g_assert(bt_string_to_uuid(&uuid, desc->uuid) == 0);
+		g_assert(bt_uuid_cmp(&uuid, &attr->type) == 0);
+	}
+
+	for (l = disc->includes; l; l = l->next) {
+		struct gatt_included *incl = l->data;
+		struct gatt_primary *prim = disc->primaries->data;
+
+		g_assert(incl->range.start == prim->range.start);
+		g_assert(incl->range.end == prim->range.end);
+		g_assert(!strcmp(incl->uuid, prim->uuid));
+	}
+
+	g_assert(disc->round_trips == context->requests);
+}
+
+static void discover_all_cb(uint8_t status, const struct gatt_discovery *disc,
+							void *user_data)
+{
+	struct context *context = user_data;
+
+	g_assert(!context->data->cancel);
+	g_assert(status == 0);
+	g_assert(disc);
+
+	check_discovery(context, disc);
+
+	if (context->data->mtu)
+		g_assert(disc->mtu == MIN(context->data->mtu, SERVER_MTU));
+	else
+		g_assert(disc->mtu == ATT_DEFAULT_LE_MTU);
+
+	g_test_message("discover all: %u attributes, MTU %u, %u round trips, "
+				"%.1f ms", context->db_len, disc->mtu,
+				disc->round_trips, disc->elapsed / 1000.0);
+
+	g_main_loop_quit(context->main_loop);
+}
+
+static void run_discover_all(struct context *context)
+{
+	g_assert(gatt_discover_all(context->attrib, context->data->mtu,
+						discover_all_cb, context));
+
+	g_main_loop_run(context->main_loop);
+}
+
+static void test_discover_all(gconstpointer data)
+{
+	struct context *context = create_context(data);
+
+	run_discover_all(context);
+
+	destroy_context(context);
+}
+
+static gboolean quit_timeout(gpointer user_data)
+{
+	struct context *context = user_data;
+
+	g_main_loop_quit(context->main_loop);
+
+	return FALSE;
+}
+
+static void test_cancel(gconstpointer data)
+{
+	struct context *context = create_context(data);
+
+	context->discover_id = gatt_discover_all(context->attrib, 0,
+						discover_all_cb, context);
+	g_assert(context->discover_id);
+
+	g_timeout_add(100, quit_timeout, context);
+	g_main_loop_run(context->main_loop);
+
+	/* Nothing was sent after the request being answered */
+	g_assert_cmpuint(context->requests, ==, context->data->cancel);
+	g_assert(!gatt_discover_all_cancel(context->attrib,
+						context->discover_id));
+
+	destroy_context(context);
+}
+
+static void cache_char_cb(uint8_t status, GSList *chars, void *user_data)
+{
+	struct context *context = user_data;
+
+	context->num_chars = g_slist_length(chars);
+
+	g_main_loop_quit(context->main_loop);
+}
+
+static void test_cache_missing(gconstpointer data)
+{
+	struct context *context = create_context(data);
+	struct gatt_cache *cache = gatt_cache_new();
+
+	g_assert(gatt_cache_attach(context->attrib, cache));
+
+	/* An empty cache knows there is nothing */
+	g_assert(gatt_discover_char(context->attrib, 0x0001, 0xffff, NULL,
+						cache_char_cb, context));
+	g_main_loop_run(context->main_loop);
+
+	g_assert_cmpuint(context->requests, ==, 0);
+	g_assert_cmpuint(context->num_chars, ==, 0);
+
+	/* Unless some of the range wasn't discovered */
+	gatt_cache_add_missing(cache, 0x0002, context->db_len);
+
+	g_assert(gatt_discover_char(context->attrib, 0x0001, 0xffff, NULL,
+						cache_char_cb, context));
+	g_main_loop_run(context->main_loop);
+
+	g_assert_cmpuint(context->requests, >, 0);
+	g_assert_cmpuint(context->num_chars, ==,
+				context->data->services * context->data->chars);
+
+	gatt_cache_detach(context->attrib);
+	gatt_cache_unref(cache);
+
+	destroy_context(context);
+}
+
+/*
+ * The strict request/response chain of the per service procedures, as
+ * profiles and the device browsing use them.
+ */
+static void legacy_next_desc(struct context *context);
+
+static void legacy_desc_cb(uint8_t status, GSList *descs, void *user_data)
+{
+	struct context *context = user_data;
+
+	g_assert(status == 0 || status == ATT_ECODE_ATTR_NOT_FOUND);
+
+	context->num_attrs += g_slist_length(descs);
+	context->current = context->current->next;
+
+	legacy_next_desc(context);
+}
+
+static void legacy_next_desc(struct context *context)
+{
+	struct gatt_char *chr, *next;
+	struct gatt_primary *prim;
+	uint16_t end = 0xffff;
+	GSList *l;
+
+	if (!context->current) {
+		g_test_message("legacy: %u attributes, %u round trips, "
+				"%.1f ms", context->db_len, context->requests,
+				(g_get_monotonic_time() - context->start) /
+									1000.0);
+
+		g_assert(context->num_chars ==
+				context->data->services * context->data->chars);
+		g_main_loop_quit(context->main_loop);
+		return;
+	}
+
+	chr = context->current->data;
+
+	if (context->current->next) {
+		next = context->current->next->data;
+		end = next->handle - 1;
+	}
+
+	for (l = context->services; l; l = l->next) {
+		prim = l->data;
+
+		if (chr->handle >= prim->range.start &&
+					chr->handle <= prim->range.end)
+			end = MIN(end, prim->range.end);
+	}
+
+	if (chr->value_handle >= end) {
+		context->current = context->current->next;
+		legacy_next_desc(context);
+		return;
+	}
+
+	g_assert(gatt_discover_desc(context->attrib, chr->value_handle + 1,
+					end, NULL, legacy_desc_cb, context));
+}
+
+static void legacy_next_char(struct context *context);
+
+static void legacy_char_cb(uint8_t status, GSList *chars, void *user_data)
+{
+	struct context *context = user_data;
+	GSList *l;
+
+	g_assert(status == 0 || status == ATT_ECODE_ATTR_NOT_FOUND);
+
+	for (l = chars; l; l = l->next)
+		context->chars = g_slist_append(context->chars,
+				g_memdup(l->data, sizeof(struct gatt_char)));
+
+	context->num_chars += g_slist_length(chars);
+	context->current = context->current->next;
+
+	legacy_next_char(context);
+}
+
+static void legacy_next_char(struct context *context)
+{
+	struct gatt_primary *prim;
+
+	if (!context->current) {
+		context->current = context->chars;
+		legacy_next_desc(context);
+		return;
+	}
+
+	prim = context->current->data;
+
+	g_assert(gatt_discover_char(context->attrib, prim->range.start,
+					prim->range.end, NULL, legacy_char_cb,
+					context));
+}
+
+static void legacy_next_included(struct context *context);
+
+static void legacy_included_cb(uint8_t status, GSList *includes,
+							void *user_data)
+{
+	struct context *context = user_data;
+
+	g_assert(status == 0);
+
+	context->num_includes += g_slist_length(includes);
+	context->current = context->current->next;
+
+	legacy_next_included(context);
+}
+
+static void legacy_next_included(struct context *context)
+{
+	struct gatt_primary *prim;
+
+	if (!context->current) {
+		context->current = context->services;
+		legacy_next_char(context);
+		return;
+	}
+
+	prim = context->current->data;
+
+	g_assert(gatt_find_included(context->attrib, prim->range.start,
+					prim->range.end, legacy_included_cb,
+					context));
+}
+
+static void legacy_primary_cb(uint8_t status, GSList *services,
+							void *user_data)
+{
+	struct context *context = user_data;
+	GSList *l;
+
+	g_assert(status == 0);
+
+	for (l = services; l; l = l->next)
+		context->services = g_slist_append(context->services,
+				g_memdup(l->data, sizeof(struct gatt_primary)));
+
+	context->current = context->services;
+
+	legacy_next_included(context);
+}
+
+static void run_legacy(struct context *context)
+{
+	context->start = g_get_monotonic_time();
+
+	g_assert(gatt_discover_primary(context->attrib, NULL,
+						legacy_primary_cb, context));
+
+	g_main_loop_run(context->main_loop);
+}
+
+static void test_benchmark(gconstpointer data)
+{
+	struct context *context;
+	unsigned int legacy;
+
+	context = create_context(data);
+	run_legacy(context);
+	legacy = context->requests;
+	destroy_context(context);
+
+	context = create_context(data);
+	run_discover_all(context);
+	g_assert(context->requests < legacy);
+	destroy_context(context);
+}
+
+static const struct test_data small_16 = {
+	.services = 3,
+	.chars = 4,
+	.descs = 1,
+};
+
+static const struct test_data small_128 = {
+	.services = 3,
+	.chars = 4,
+	.descs = 2,
+	.uuid128 = true,
+	.includes = true,
+};
+
+static const struct test_data includes_16 = {
+	.services = 4,
+	.chars = 2,
+	.includes = true,
+};
+
+static const struct test_data missing_128 = {
+	.services = 3,
+	.chars = 2,
+	.descs = 1,
+	.uuid128 = true,
+	.includes = true,
+	.missing = true,
+};
+
+static const struct test_data cancel_16 = {
+	.services = 3,
+	.chars = 4,
+	.descs = 1,
+	.cancel = 3,
+};
+
+static const struct test_data no_descs_mtu = {
+	.services = 6,
+	.chars = 8,
+	.mtu = 517,
+};
+
+static const struct test_data mtu_128 = {
+	.services = 5,
+	.chars = 6,
+	.descs = 1,
+	.uuid128 = true,
+	.includes = true,
+	.mtu = 185,
+};
+
+static const struct test_data bench_default = {
+	.services = 12,
+	.chars = 6,
+	.descs = 1,
+	.latency = 1000,
+};
+
+static const struct test_data bench_mtu = {
+	.services = 12,
+	.chars = 6,
+	.descs = 1,
+	.mtu = 185,
+	.latency = 1000,
+};
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_data_func("/gatt/discover_all/16bit", &small_16,
+							test_discover_all);
+	g_test_add_data_func("/gatt/discover_all/128bit", &small_128,
+							test_discover_all);
+	g_test_add_data_func("/gatt/discover_all/includes", &includes_16,
+							test_discover_all);
+	g_test_add_data_func("/gatt/discover_all/missing_include",
+					&missing_128, test_discover_all);
+	g_test_add_data_func("/gatt/discover_all/no_descriptors",
+					&no_descs_mtu, test_discover_all);
+	g_test_add_data_func("/gatt/discover_all/mtu", &mtu_128,
+							test_discover_all);
+	g_test_add_data_func("/gatt/discover_all/cancel", &cancel_16,
+								test_cancel);
+	g_test_add_data_func("/gatt/cache/missing", &small_16,
+							test_cache_missing);
+	g_test_add_data_func("/gatt/benchmark/default_mtu", &bench_default,
+							test_benchmark);
+	g_test_add_data_func("/gatt/benchmark/mtu", &bench_mtu,
+							test_benchmark);
+
+	return g_test_run();
+}
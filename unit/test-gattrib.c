@@ -0,0 +1,355 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2014  Intel Corporation. All rights reserved.
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+
+#include "lib/bluetooth.h"
+#include "lib/uuid.h"
+#include "src/shared/util.h"
+#include "src/shared/att-types.h"
+#include "btio/btio.h"
+#include "attrib/att.h"
+#include "attrib/gattrib.h"
+
+#define BENCH_HANDLES		256
+#define BENCH_NOTIFICATIONS	100000
+
+struct context {
+	GMainLoop *main_loop;
+	GAttrib *attrib;
+	int fd;
+	GString *log;
+	unsigned int expected;
+	guint ids[2];
+
+	/* Benchmark */
+	guint source;
+	unsigned int sent;
+	unsigned int received;
+};
+
+struct handler {
+	struct context *context;
+	char name;
+};
+
+static struct context *create_context(void)
+{
+	struct context *context = g_new0(struct context, 1);
+	GIOChannel *channel;
+	int sv[2];
+
+	context->main_loop = g_main_loop_new(NULL, FALSE);
+	context->log = g_string_new(NULL);
+
+	g_assert(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0,
+								sv) == 0);
+
+	channel = g_io_channel_unix_new(sv[0]);
+	g_io_channel_set_close_on_unref(channel, TRUE);
+
+	context->attrib = g_attrib_new(channel);
+	g_assert(context->attrib);
+
+	g_io_channel_unref(channel);
+
+	context->fd = sv[1];
+
+	return context;
+}
+
+static void destroy_context(struct context *context)
+{
+	if (context->source > 0)
+		g_source_remove(context->source);
+
+	g_attrib_unref(context->attrib);
+
+	close(context->fd);
+
+	g_string_free(context->log, TRUE);
+	g_main_loop_unref(context->main_loop);
+	g_free(context);
+}
+
+static void send_pdu(struct context *context, uint8_t opcode, uint16_t handle)
+{
+	uint8_t pdu[5];
+
+	pdu[0] = opcode;
+	put_le16(handle, &pdu[1]);
+	put_le16(0xbeef, &pdu[3]);
+
+	g_assert(write(context->fd, pdu, sizeof(pdu)) == sizeof(pdu));
+}
+
+static void log_event(const guint8 *pdu, guint16 len, gpointer user_data)
+{
+	struct handler *handler = user_data;
+	struct context *context = handler->context;
+
+	g_assert(len == 5);
+
+	g_string_append_c(context->log, handler->name);
+
+	if (context->log->len == context->expected)
+		g_main_loop_quit(context->main_loop);
+}
+
+static guint register_handler(struct context *context, struct handler *h,
+					char name, uint8_t opcode, uint16_t handle)
+{
+	h->context = context;
+	h->name = name;
+
+	return g_attrib_register(context->attrib, opcode, handle, log_event,
+								h, NULL);
+}
+
+static void test_routing(void)
+{
+	struct context *context = create_context();
+	struct handler h[6];
+
+	register_handler(context, &h[0], 'a', ATT_OP_HANDLE_NOTIFY, 0x0010);
+	register_handler(context, &h[1], 'b', GATTRIB_ALL_EVENTS,
+							GATTRIB_ALL_HANDLES);
+	register_handler(context, &h[2], 'c', ATT_OP_HANDLE_NOTIFY,
+							GATTRIB_ALL_HANDLES);
+	register_handler(context, &h[3], 'd', ATT_OP_HANDLE_NOTIFY, 0x0020);
+	register_handler(context, &h[4], 'e', ATT_OP_HANDLE_IND, 0x0010);
+	register_handler(context, &h[5], 'f', ATT_OP_HANDLE_NOTIFY, 0x0010);
+
+	/* All PDUs are queued before GAttrib gets to read any of them */
+	send_pdu(context, ATT_OP_HANDLE_NOTIFY, 0x0010);
+	send_pdu(context, ATT_OP_HANDLE_NOTIFY, 0x0020);
+	send_pdu(context, ATT_OP_HANDLE_NOTIFY, 0x0030);
+	send_pdu(context, ATT_OP_HANDLE_IND, 0x0010);
+
+	context->expected = strlen("abcfbcdbcbe");
+
+	g_main_loop_run(context->main_loop);
+
+	g_assert_cmpstr(context->log->str, ==, "abcfbcdbcbe");
+
+	destroy_context(context);
+}
+
+static void unregister_event(const guint8 *pdu, guint16 len,
+							gpointer user_data)
+{
+	struct handler *handler = user_data;
+	struct context *context = handler->context;
+
+	g_string_append_c(context->log, handler->name);
+
+	g_assert(g_attrib_unregister(context->attrib, context->ids[0]));
+	g_assert(g_attrib_unregister(context->attrib, context->ids[1]));
+}
+
+static void test_unregister(void)
+{
+	struct context *context = create_context();
+	struct handler h[3];
+
+	h[0].context = context;
+	h[0].name = 'a';
+	context->ids[0] = g_attrib_register(context->attrib,
+					ATT_OP_HANDLE_NOTIFY, 0x0010,
+					unregister_event, &h[0], NULL);
+
+	context->ids[1] = register_handler(context, &h[1], 'b',
+					ATT_OP_HANDLE_NOTIFY, 0x0010);
+	register_handler(context, &h[2], 'c', GATTRIB_ALL_EVENTS,
+							GATTRIB_ALL_HANDLES);
+
+	send_pdu(context, ATT_OP_HANDLE_NOTIFY, 0x0010);
+	send_pdu(context, ATT_OP_HANDLE_NOTIFY, 0x0010);
+
+	context->expected = strlen("acc");
+
+	g_main_loop_run(context->main_loop);
+
+	g_assert_cmpstr(context->log->str, ==, "acc");
+
+	destroy_context(context);
+}
+
+static gboolean reply_request(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	struct context *context = user_data;
+	uint8_t buf[ATT_DEFAULT_LE_MTU];
+	uint8_t rsp[] = { ATT_OP_READ_RESP, 0x01, 0x02 };
+
+	g_assert(read(context->fd, buf, sizeof(buf)) == 3);
+	g_assert(buf[0] == ATT_OP_READ_REQ);
+
+	send_pdu(context, ATT_OP_HANDLE_NOTIFY, 0x0010);
+	g_assert(write(context->fd, rsp, sizeof(rsp)) == sizeof(rsp));
+
+	context->source = 0;
+
+	return FALSE;
+}
+
+static void read_result(guint8 status, const guint8 *pdu, guint16 len,
+							gpointer user_data)
+{
+	struct context *context = user_data;
+
+	g_assert(status == 0);
+
+	g_main_loop_quit(context->main_loop);
+}
+
+static void test_stats(void)
+{
+	struct context *context = create_context();
+	struct bt_att_stats stats;
+	GIOChannel *channel;
+	uint8_t req[] = { ATT_OP_READ_REQ, 0x10, 0x00 };
+
+	g_assert(g_attrib_get_stats(context->attrib, &stats));
+	g_assert(stats.tx_pdus == 0 && stats.rx_pdus == 0);
+
+	channel = g_io_channel_unix_new(context->fd);
+	context->source = g_io_add_watch(channel, G_IO_IN, reply_request,
+								context);
+	g_io_channel_unref(channel);
+
+	g_assert(g_attrib_send(context->attrib, 0, req, sizeof(req),
+					read_result, context, NULL) > 0);
+
+	g_assert(g_attrib_get_stats(context->attrib, &stats));
+	g_assert(stats.queued == 1 && stats.max_queued == 1);
+
+	g_main_loop_run(context->main_loop);
+
+	g_assert(g_attrib_get_stats(context->attrib, &stats));
+	g_assert(stats.tx_pdus == 1 && stats.tx_bytes == sizeof(req));
+	g_assert(stats.rx_pdus == 2 && stats.rx_bytes == 5 + 3);
+	g_assert(stats.requests == 1 && stats.notifications == 1);
+	g_assert(stats.errors == 0 && stats.timeouts == 0);
+	g_assert(stats.queued == 0);
+	g_assert(stats.rtt_count == 1);
+	g_assert(stats.rtt_min == stats.rtt_max);
+	g_assert(stats.rtt_total == stats.rtt_max);
+
+	destroy_context(context);
+}
+
+static void count_event(const guint8 *pdu, guint16 len, gpointer user_data)
+{
+	struct context *context = user_data;
+
+	if (++context->received == BENCH_NOTIFICATIONS)
+		g_main_loop_quit(context->main_loop);
+}
+
+static gboolean bench_write(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	struct context *context = user_data;
+	uint8_t pdu[23];
+
+	memset(pdu, 0, sizeof(pdu));
+	pdu[0] = ATT_OP_HANDLE_NOTIFY;
+
+	while (context->sent < BENCH_NOTIFICATIONS) {
+		put_le16(context->sent % BENCH_HANDLES + 1, &pdu[1]);
+
+		if (write(context->fd, pdu, sizeof(pdu)) < 0) {
+			g_assert(errno == EAGAIN);
+			return TRUE;
+		}
+
+		context->sent++;
+	}
+
+	context->source = 0;
+
+	return FALSE;
+}
+
+static void test_benchmark(void)
+{
+	struct context *context = create_context();
+	GIOChannel *channel;
+	gint64 start, elapsed;
+	uint16_t handle;
+
+	/* A device with many subscribed characteristics */
+	for (handle = 1; handle <= BENCH_HANDLES; handle++)
+		g_attrib_register(context->attrib, ATT_OP_HANDLE_NOTIFY,
+					handle, count_event, context, NULL);
+
+	g_attrib_register(context->attrib, ATT_OP_HANDLE_IND,
+				GATTRIB_ALL_HANDLES, count_event, context,
+				NULL);
+
+	fcntl(context->fd, F_SETFL, fcntl(context->fd, F_GETFL) | O_NONBLOCK);
+
+	channel = g_io_channel_unix_new(context->fd);
+	context->source = g_io_add_watch(channel, G_IO_OUT, bench_write,
+								context);
+	g_io_channel_unref(channel);
+
+	start = g_get_monotonic_time();
+
+	g_main_loop_run(context->main_loop);
+
+	elapsed = g_get_monotonic_time() - start;
+
+	g_assert(context->received == BENCH_NOTIFICATIONS);
+
+	g_test_message("%u notifications over %u handles in %.1f ms "
+			"(%.0f/s)", context->received, BENCH_HANDLES,
+			elapsed / 1000.0,
+			context->received * 1000000.0 / MAX(elapsed, 1));
+
+	destroy_context(context);
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/gattrib/routing", test_routing);
+	g_test_add_func("/gattrib/unregister", test_unregister);
+	g_test_add_func("/gattrib/stats", test_stats);
+	g_test_add_func("/gattrib/benchmark", test_benchmark);
+
+	return g_test_run();
+}
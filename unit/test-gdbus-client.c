@@ -30,8 +30,13 @@
 
 #define SERVICE_NAME "org.bluez.unit.test-gdbus-client"
 #define SERVICE_NAME1 "org.bluez.unit.test-gdbus-client1"
+#define SERVICE_NAME2 "org.bluez.unit.test-gdbus-client2"
 #define SERVICE_PATH "/org/bluez/unit/test_gdbus_client"
 
+#define MANY_OBJECTS 20000
+
+#define DBUS_INTERFACE_OBJECT_MANAGER "org.freedesktop.DBus.ObjectManager"
+
 struct context {
 	GMainLoop *main_loop;
 	DBusConnection *dbus_conn;
@@ -40,6 +45,10 @@ struct context {
 	void *data;
 	gboolean client_ready;
 	guint timeout_source;
+	DBusConnection *service_conn;
+	unsigned int proxies;
+	unsigned int changes;
+	gint64 start;
 };
 
 static const GDBusMethodTable methods[] = {
@@ -1016,6 +1025,241 @@ static void client_ready(void)
 	destroy_context(context);
 }
 
+static void many_proxy_added(GDBusProxy *proxy, void *user_data)
+{
+	struct context *context = user_data;
+
+	context->proxies++;
+}
+
+static void many_proxy_removed(GDBusProxy *proxy, void *user_data)
+{
+	struct context *context = user_data;
+
+	g_assert(context->proxies > 0);
+
+	if (--context->proxies > 0)
+		return;
+
+	if (g_test_verbose())
+		g_print("%u proxies removed in %.1f ms\n", MANY_OBJECTS,
+			(g_get_monotonic_time() - context->start) / 1000.0);
+
+	g_main_loop_quit(context->main_loop);
+}
+
+static void many_property_changed(GDBusProxy *proxy, const char *name,
+					DBusMessageIter *iter, void *user_data)
+{
+	struct context *context = user_data;
+	const char *string;
+
+	g_assert(g_strcmp0(g_dbus_proxy_get_path(proxy),
+					SERVICE_PATH "/obj42") == 0);
+	g_assert(g_strcmp0(name, "String") == 0);
+
+	dbus_message_iter_get_basic(iter, &string);
+	g_assert(g_strcmp0(string, "changed") == 0);
+
+	context->changes++;
+}
+
+static void append_object(DBusMessageIter *array, const char *path,
+							const char *value)
+{
+	DBusMessageIter entry, ifaces, iface, props;
+	const char *interface = SERVICE_NAME2;
+
+	dbus_message_iter_open_container(array, DBUS_TYPE_DICT_ENTRY, NULL,
+									&entry);
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_OBJECT_PATH, &path);
+
+	dbus_message_iter_open_container(&entry, DBUS_TYPE_ARRAY,
+							"{sa{sv}}", &ifaces);
+	dbus_message_iter_open_container(&ifaces, DBUS_TYPE_DICT_ENTRY, NULL,
+									&iface);
+	dbus_message_iter_append_basic(&iface, DBUS_TYPE_STRING, &interface);
+
+	dbus_message_iter_open_container(&iface, DBUS_TYPE_ARRAY, "{sv}",
+									&props);
+	dict_append_entry(&props, "String", DBUS_TYPE_STRING, &value);
+	dbus_message_iter_close_container(&iface, &props);
+
+	dbus_message_iter_close_container(&ifaces, &iface);
+	dbus_message_iter_close_container(&entry, &ifaces);
+	dbus_message_iter_close_container(array, &entry);
+}
+
+/*
+ * Stands in for an object manager with many objects, registering them
+ * with g_dbus_register_interface would mostly measure the service side.
+ */
+static DBusHandlerResult many_objects_filter(DBusConnection *conn,
+					DBusMessage *msg, void *user_data)
+{
+	DBusMessage *reply;
+	DBusMessageIter iter, array;
+	unsigned int i;
+
+	if (!dbus_message_is_method_call(msg, DBUS_INTERFACE_OBJECT_MANAGER,
+							"GetManagedObjects"))
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+	reply = dbus_message_new_method_return(msg);
+	g_assert(reply != NULL);
+
+	dbus_message_iter_init_append(reply, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+						"{oa{sa{sv}}}", &array);
+
+	for (i = 0; i < MANY_OBJECTS; i++) {
+		char *path = g_strdup_printf(SERVICE_PATH "/obj%u", i);
+
+		append_object(&array, path, "value");
+		g_free(path);
+	}
+
+	dbus_message_iter_close_container(&iter, &array);
+
+	g_assert(dbus_connection_send(conn, reply, NULL));
+	dbus_message_unref(reply);
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static void emit_property_changed(DBusConnection *conn, const char *path)
+{
+	DBusMessage *signal;
+	DBusMessageIter iter, dict;
+	const char *interface = SERVICE_NAME2;
+	const char *value = "changed";
+
+	signal = dbus_message_new_signal(path, DBUS_INTERFACE_PROPERTIES,
+							"PropertiesChanged");
+	g_assert(signal != NULL);
+
+	dbus_message_iter_init_append(signal, &iter);
+	dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &interface);
+
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}",
+									&dict);
+	dict_append_entry(&dict, "String", DBUS_TYPE_STRING, &value);
+	dbus_message_iter_close_container(&iter, &dict);
+
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "s", &dict);
+	dbus_message_iter_close_container(&iter, &dict);
+
+	g_assert(dbus_connection_send(conn, signal, NULL));
+	dbus_message_unref(signal);
+}
+
+static void emit_interfaces_removed(DBusConnection *conn, const char *path)
+{
+	DBusMessage *signal;
+	DBusMessageIter iter, array;
+	const char *interface = SERVICE_NAME2;
+
+	signal = dbus_message_new_signal("/", DBUS_INTERFACE_OBJECT_MANAGER,
+							"InterfacesRemoved");
+	g_assert(signal != NULL);
+
+	dbus_message_iter_init_append(signal, &iter);
+	dbus_message_iter_append_basic(&iter, DBUS_TYPE_OBJECT_PATH, &path);
+
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "s", &array);
+	dbus_message_iter_append_basic(&array, DBUS_TYPE_STRING, &interface);
+	dbus_message_iter_close_container(&iter, &array);
+
+	g_assert(dbus_connection_send(conn, signal, NULL));
+	dbus_message_unref(signal);
+}
+
+static void many_ready(GDBusClient *client, void *user_data)
+{
+	struct context *context = user_data;
+	GDBusProxy *proxy;
+	DBusMessageIter iter;
+	const char *string;
+	unsigned int i;
+
+	g_assert(context->proxies == MANY_OBJECTS);
+
+	if (g_test_verbose())
+		g_print("%u proxies added in %.1f ms\n", MANY_OBJECTS,
+			(g_get_monotonic_time() - context->start) / 1000.0);
+
+	/* Existing proxies are returned instead of creating new ones */
+	proxy = g_dbus_proxy_new(client, SERVICE_PATH "/obj42",
+							SERVICE_NAME2);
+	g_assert(proxy != NULL);
+	g_assert(g_dbus_proxy_get_property(proxy, "String", &iter));
+
+	dbus_message_iter_get_basic(&iter, &string);
+	g_assert(g_strcmp0(string, "value") == 0);
+
+	g_dbus_proxy_unref(proxy);
+
+	emit_property_changed(context->service_conn,
+						SERVICE_PATH "/obj42");
+
+	context->start = g_get_monotonic_time();
+
+	for (i = 0; i < MANY_OBJECTS; i++) {
+		char *path = g_strdup_printf(SERVICE_PATH "/obj%u", i);
+
+		emit_interfaces_removed(context->service_conn, path);
+		g_free(path);
+	}
+}
+
+static void client_many_objects(void)
+{
+	struct context *context = create_context();
+	DBusConnection *conn;
+
+	if (context == NULL)
+		return;
+
+	conn = g_dbus_setup_private(DBUS_BUS_SESSION, SERVICE_NAME2, NULL);
+	g_assert(conn != NULL);
+
+	/* Avoid D-Bus library calling _exit() before next test finishes. */
+	dbus_connection_set_exit_on_disconnect(conn, FALSE);
+	g_assert(dbus_connection_add_filter(conn, many_objects_filter,
+							context, NULL));
+	context->service_conn = conn;
+
+	context->start = g_get_monotonic_time();
+
+	context->dbus_client = g_dbus_client_new(context->dbus_conn,
+						SERVICE_NAME2, SERVICE_PATH);
+
+	g_dbus_client_set_ready_watch(context->dbus_client, many_ready,
+								context);
+	g_dbus_client_set_proxy_handlers(context->dbus_client,
+						many_proxy_added,
+						many_proxy_removed,
+						many_property_changed,
+						context);
+
+	context->timeout_source = g_timeout_add_seconds(60, timeout_test,
+								context);
+
+	g_main_loop_run(context->main_loop);
+
+	/* The property change is delivered before any removal */
+	g_assert(context->changes == 1);
+
+	g_dbus_client_unref(context->dbus_client);
+
+	dbus_connection_remove_filter(conn, many_objects_filter, context);
+	dbus_connection_flush(conn);
+	dbus_connection_close(conn);
+	dbus_connection_unref(conn);
+
+	destroy_context(context);
+}
+
 int main(int argc, char *argv[])
 {
 	g_test_init(&argc, &argv, NULL);
@@ -1055,5 +1299,7 @@ int main(int argc, char *argv[])
 
 	g_test_add_func("/gdbus/client_ready", client_ready);
 
+	g_test_add_func("/gdbus/client_many_objects", client_many_objects);
+
 	return g_test_run();
 }
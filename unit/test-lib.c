@@ -28,10 +28,17 @@
 
 #include <glib.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <errno.h>
+#include <sys/socket.h>
 
 #include "src/shared/util.h"
 
+#include "lib/bluetooth.h"
+#include "lib/hci.h"
+#include "lib/hci_lib.h"
+#include "lib/hci_internal.h"
 #include "lib/sdp.h"
 #include "lib/sdp_lib.h"
 
@@ -453,6 +460,268 @@ static void test_sdp_get_server_ver(void)
 	sdp_record_free(rec);
 }
 
+struct async_context {
+	struct hci_async *as;
+	int fd;
+	int cancel_id;
+	GString *log;
+};
+
+static struct async_context *create_async_context(void)
+{
+	struct async_context *context = g_new0(struct async_context, 1);
+	int sv[2];
+
+	g_assert(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0,
+								sv) == 0);
+
+	/* A socketpair has no HCI_FILTER option */
+	context->as = hci_async_new_full(sv[0], 0);
+	g_assert(context->as);
+	g_assert(hci_async_get_fd(context->as) == sv[0]);
+
+	context->fd = sv[1];
+	context->log = g_string_new(NULL);
+
+	return context;
+}
+
+static void destroy_async_context(struct async_context *context)
+{
+	int fd = hci_async_get_fd(context->as);
+
+	hci_async_free(context->as);
+
+	close(fd);
+	close(context->fd);
+
+	g_string_free(context->log, TRUE);
+	g_free(context);
+}
+
+static void expect_command(struct async_context *context, uint16_t ogf,
+								uint16_t ocf)
+{
+	uint8_t buf[HCI_MAX_ACL_SIZE];
+	hci_command_hdr *hdr = (void *) (buf + 1);
+
+	g_assert(read(context->fd, buf, sizeof(buf)) > HCI_COMMAND_HDR_SIZE);
+	g_assert(buf[0] == HCI_COMMAND_PKT);
+	g_assert(btohs(hdr->opcode) == cmd_opcode_pack(ogf, ocf));
+}
+
+static void send_event(struct async_context *context, uint8_t evt,
+					const void *param, uint8_t plen)
+{
+	uint8_t buf[HCI_MAX_EVENT_SIZE];
+	hci_event_hdr *hdr = (void *) (buf + 1);
+
+	buf[0] = HCI_EVENT_PKT;
+	hdr->evt = evt;
+	hdr->plen = plen;
+	memcpy(buf + 1 + HCI_EVENT_HDR_SIZE, param, plen);
+
+	g_assert(write(context->fd, buf, 1 + HCI_EVENT_HDR_SIZE + plen) ==
+					1 + HCI_EVENT_HDR_SIZE + plen);
+}
+
+static void send_cmd_complete(struct async_context *context, uint16_t ogf,
+			uint16_t ocf, const void *param, uint8_t plen)
+{
+	uint8_t buf[HCI_MAX_EVENT_SIZE];
+	evt_cmd_complete *cc = (void *) buf;
+
+	cc->ncmd = 1;
+	cc->opcode = htobs(cmd_opcode_pack(ogf, ocf));
+	memcpy(buf + EVT_CMD_COMPLETE_SIZE, param, plen);
+
+	send_event(context, EVT_CMD_COMPLETE, buf,
+					EVT_CMD_COMPLETE_SIZE + plen);
+}
+
+static void send_cmd_status(struct async_context *context, uint16_t ogf,
+					uint16_t ocf, uint8_t status)
+{
+	evt_cmd_status cs;
+
+	cs.status = status;
+	cs.ncmd = 1;
+	cs.opcode = htobs(cmd_opcode_pack(ogf, ocf));
+
+	send_event(context, EVT_CMD_STATUS, &cs, sizeof(cs));
+}
+
+static void log_result(int err, const void *param, int len, void *user_data)
+{
+	struct async_context *context = user_data;
+
+	g_string_append_printf(context->log, "%d:%d:%02x ", err, len,
+					len > 0 ? ((const uint8_t *) param)[0] : 0);
+}
+
+static void log_result_cancel(int err, const void *param, int len,
+							void *user_data)
+{
+	struct async_context *context = user_data;
+
+	log_result(err, param, len, user_data);
+
+	g_assert(hci_async_cancel(context->as, context->cancel_id) == 0);
+}
+
+static void log_event(int event, const void *param, int len,
+							void *user_data)
+{
+	struct async_context *context = user_data;
+
+	g_string_append_printf(context->log, "e%02x ", event);
+}
+
+static void test_hci_async_complete(void)
+{
+	struct async_context *context = create_async_context();
+	struct hci_request rq;
+	uint8_t bdaddr_rp[1 + 6] = { 0x00, 0x01 };
+	uint8_t version_rp[9] = { 0x00, 0x06 };
+
+	memset(&rq, 0, sizeof(rq));
+	rq.ogf = OGF_INFO_PARAM;
+	rq.ocf = OCF_READ_BD_ADDR;
+	rq.event = EVT_CMD_COMPLETE;
+	g_assert(hci_async_send_req(context->as, &rq, 0, log_result,
+							context) > 0);
+
+	rq.ocf = OCF_READ_LOCAL_VERSION;
+	g_assert(hci_async_send_req(context->as, &rq, 1000, log_result,
+							context) > 0);
+	g_assert(hci_async_timeout(context->as) > 0);
+
+	expect_command(context, OGF_INFO_PARAM, OCF_READ_BD_ADDR);
+	expect_command(context, OGF_INFO_PARAM, OCF_READ_LOCAL_VERSION);
+
+	/* Both commands are outstanding, answer them in reverse order */
+	send_cmd_complete(context, OGF_INFO_PARAM, OCF_READ_LOCAL_VERSION,
+					version_rp, sizeof(version_rp));
+	send_cmd_complete(context, OGF_INFO_PARAM, OCF_READ_BD_ADDR,
+					bdaddr_rp, sizeof(bdaddr_rp));
+
+	g_assert(hci_async_process(context->as) == 0);
+
+	g_assert_cmpstr(context->log->str, ==, "0:9:00 0:7:00 ");
+	g_assert(hci_async_timeout(context->as) == -1);
+
+	destroy_async_context(context);
+}
+
+static void test_hci_async_event(void)
+{
+	struct async_context *context = create_async_context();
+	struct hci_request rq;
+	remote_name_req_cp cp;
+	evt_remote_name_req_complete rn;
+	inquiry_cp inq;
+	uint8_t result[] = { 0x01, 0x02, 0x03 };
+	int id;
+
+	id = hci_async_register(context->as, EVT_INQUIRY_RESULT, log_event,
+								context);
+	g_assert(id > 0);
+
+	memset(&cp, 0, sizeof(cp));
+	str2ba("00:11:22:33:44:55", &cp.bdaddr);
+
+	memset(&rq, 0, sizeof(rq));
+	rq.ogf = OGF_LINK_CTL;
+	rq.ocf = OCF_REMOTE_NAME_REQ;
+	rq.event = EVT_REMOTE_NAME_REQ_COMPLETE;
+	rq.cparam = &cp;
+	rq.clen = REMOTE_NAME_REQ_CP_SIZE;
+	g_assert(hci_async_send_req(context->as, &rq, 0, log_result,
+							context) > 0);
+
+	memset(&inq, 0, sizeof(inq));
+	rq.ocf = OCF_INQUIRY;
+	rq.event = EVT_INQUIRY_COMPLETE;
+	rq.cparam = &inq;
+	rq.clen = INQUIRY_CP_SIZE;
+	g_assert(hci_async_send_req(context->as, &rq, 0, log_result,
+							context) > 0);
+
+	expect_command(context, OGF_LINK_CTL, OCF_REMOTE_NAME_REQ);
+	expect_command(context, OGF_LINK_CTL, OCF_INQUIRY);
+
+	send_cmd_status(context, OGF_LINK_CTL, OCF_REMOTE_NAME_REQ, 0x00);
+	send_cmd_status(context, OGF_LINK_CTL, OCF_INQUIRY, 0x00);
+	send_event(context, EVT_INQUIRY_RESULT, result, sizeof(result));
+
+	/* A name for another device doesn't complete the request */
+	memset(&rn, 0, sizeof(rn));
+	str2ba("00:11:22:33:44:66", &rn.bdaddr);
+	send_event(context, EVT_REMOTE_NAME_REQ_COMPLETE, &rn, sizeof(rn));
+
+	g_assert(hci_async_process(context->as) == 0);
+	g_assert_cmpstr(context->log->str, ==, "e02 ");
+
+	bacpy(&rn.bdaddr, &cp.bdaddr);
+	send_event(context, EVT_REMOTE_NAME_REQ_COMPLETE, &rn, sizeof(rn));
+
+	g_assert(hci_async_unregister(context->as, id) == 0);
+	send_event(context, EVT_INQUIRY_RESULT, result, sizeof(result));
+	send_event(context, EVT_INQUIRY_COMPLETE, result, 1);
+
+	g_assert(hci_async_process(context->as) == 0);
+	g_assert_cmpstr(context->log->str, ==, "e02 0:255:00 0:1:01 ");
+
+	destroy_async_context(context);
+}
+
+static void test_hci_async_failure(void)
+{
+	struct async_context *context = create_async_context();
+	struct hci_request rq;
+	int id;
+
+	memset(&rq, 0, sizeof(rq));
+	rq.ogf = OGF_LINK_CTL;
+	rq.ocf = OCF_INQUIRY;
+	rq.event = EVT_INQUIRY_COMPLETE;
+	g_assert(hci_async_send_req(context->as, &rq, 0, log_result,
+							context) > 0);
+
+	/* Cancelled requests are not called back */
+	id = hci_async_send_req(context->as, &rq, 0, log_result, context);
+	g_assert(id > 0);
+	g_assert(hci_async_cancel(context->as, id) == 0);
+	g_assert(hci_async_cancel(context->as, id) < 0 && errno == ENOENT);
+
+	send_cmd_status(context, OGF_LINK_CTL, OCF_INQUIRY, 0x0c);
+	g_assert(hci_async_process(context->as) == 0);
+	g_assert_cmpstr(context->log->str, ==, "5:4:0c ");
+
+	g_assert(hci_async_send_req(context->as, &rq, 1, log_result,
+							context) > 0);
+	usleep(2000);
+	g_assert(hci_async_timeout(context->as) == 0);
+	g_assert(hci_async_process(context->as) == 0);
+	g_assert_cmpstr(context->log->str, ==, "5:4:0c 110:0:00 ");
+
+	/* Timeout callbacks can cancel the request before them in the list */
+	context->cancel_id = hci_async_send_req(context->as, &rq, 0,
+							log_result, context);
+	g_assert(context->cancel_id > 0);
+	g_assert(hci_async_send_req(context->as, &rq, 1, log_result_cancel,
+							context) > 0);
+	g_assert(hci_async_send_req(context->as, &rq, 1, log_result,
+							context) > 0);
+	usleep(2000);
+	g_assert(hci_async_process(context->as) == 0);
+	g_assert_cmpstr(context->log->str, ==,
+				"5:4:0c 110:0:00 110:0:00 110:0:00 ");
+	g_assert(hci_async_timeout(context->as) == -1);
+
+	destroy_async_context(context);
+}
+
 int main(int argc, char *argv[])
 {
 	g_test_init(&argc, &argv, NULL);
@@ -488,5 +757,9 @@ int main(int argc, char *argv[])
 
 	g_test_add_func("/lib/sdp_get_server_ver", test_sdp_get_server_ver);
 
+	g_test_add_func("/lib/hci_async/complete", test_hci_async_complete);
+	g_test_add_func("/lib/hci_async/event", test_hci_async_event);
+	g_test_add_func("/lib/hci_async/failure", test_hci_async_failure);
+
 	return g_test_run();
 }
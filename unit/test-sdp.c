@@ -28,6 +28,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <sys/socket.h>
 
 #include <glib.h>
@@ -788,8 +789,586 @@ static void test_sdp_de_attr(gconstpointer data)
 	sdp_data_free(d);
 }
 
+/*
+ * Reference encoder: the recursive serializer libbluetooth used before
+ * sdp_gen_pdu() became a two pass one. It is kept here only to check that
+ * the output of the library stays byte for byte identical.
+ */
+static int ref_type_size(uint8_t dtd)
+{
+	switch (dtd) {
+	case SDP_SEQ8:
+	case SDP_TEXT_STR8:
+	case SDP_URL_STR8:
+	case SDP_ALT8:
+		return 2;
+	case SDP_SEQ16:
+	case SDP_TEXT_STR16:
+	case SDP_URL_STR16:
+	case SDP_ALT16:
+		return 3;
+	case SDP_SEQ32:
+	case SDP_TEXT_STR32:
+	case SDP_URL_STR32:
+	case SDP_ALT32:
+		return 5;
+	}
+
+	return 1;
+}
+
+static int ref_gen_buffer(sdp_buf_t *buf, sdp_data_t *d);
+static int ref_gen_pdu(sdp_buf_t *buf, sdp_data_t *d);
+
+static int ref_data_size(sdp_buf_t *buf, sdp_data_t *d)
+{
+	sdp_data_t *child;
+	int n = 0;
+
+	switch (d->dtd) {
+	case SDP_UINT8:
+	case SDP_INT8:
+	case SDP_BOOL:
+		return 1;
+	case SDP_UINT16:
+	case SDP_INT16:
+	case SDP_UUID16:
+		return 2;
+	case SDP_UINT32:
+	case SDP_INT32:
+	case SDP_UUID32:
+		return 4;
+	case SDP_UINT64:
+	case SDP_INT64:
+		return 8;
+	case SDP_UINT128:
+	case SDP_INT128:
+	case SDP_UUID128:
+		return 16;
+	case SDP_TEXT_STR8:
+	case SDP_TEXT_STR16:
+	case SDP_TEXT_STR32:
+	case SDP_URL_STR8:
+	case SDP_URL_STR16:
+	case SDP_URL_STR32:
+		return d->unitSize - 1;
+	case SDP_SEQ8:
+	case SDP_SEQ16:
+	case SDP_SEQ32:
+	case SDP_ALT8:
+	case SDP_ALT16:
+	case SDP_ALT32:
+		for (child = d->val.dataseq; child; child = child->next) {
+			if (buf->data)
+				n += ref_gen_pdu(buf, child);
+			else
+				n += ref_gen_buffer(buf, child);
+		}
+		return n;
+	}
+
+	return 0;
+}
+
+static int ref_gen_buffer(sdp_buf_t *buf, sdp_data_t *d)
+{
+	int orig = buf->buf_size;
+
+	if (buf->buf_size == 0 && d->dtd == 0)
+		buf->buf_size += 2;
+
+	buf->buf_size += 3;
+	buf->buf_size += ref_type_size(d->dtd);
+	buf->buf_size += ref_data_size(buf, d);
+
+	if (buf->buf_size > UCHAR_MAX && d->dtd == SDP_SEQ8)
+		buf->buf_size += 1;
+
+	return buf->buf_size - orig;
+}
+
+static int ref_gen_pdu(sdp_buf_t *buf, sdp_data_t *d)
+{
+	uint8_t *seqp = buf->data + buf->data_size;
+	uint32_t orig_data_size = buf->data_size;
+	uint32_t pdu_size, data_size;
+	uint8_t value[16];
+
+recalculate:
+	pdu_size = ref_type_size(d->dtd);
+	buf->data_size += pdu_size;
+
+	data_size = ref_data_size(buf, d);
+	if (data_size > UCHAR_MAX && d->dtd == SDP_SEQ8) {
+		buf->data_size = orig_data_size;
+		d->dtd = SDP_SEQ16;
+		goto recalculate;
+	}
+
+	*seqp = d->dtd;
+
+	switch (d->dtd) {
+	case SDP_UINT8:
+	case SDP_INT8:
+	case SDP_BOOL:
+		value[0] = d->val.uint8;
+		break;
+	case SDP_UINT16:
+	case SDP_INT16:
+		put_be16(d->val.uint16, value);
+		break;
+	case SDP_UUID16:
+		put_be16(d->val.uuid.value.uuid16, value);
+		break;
+	case SDP_UINT32:
+	case SDP_INT32:
+		put_be32(d->val.uint32, value);
+		break;
+	case SDP_UUID32:
+		put_be32(d->val.uuid.value.uuid32, value);
+		break;
+	case SDP_UINT64:
+	case SDP_INT64:
+		put_be64(d->val.uint64, value);
+		break;
+	case SDP_UINT128:
+	case SDP_INT128:
+		hton128(&d->val.uint128, (uint128_t *) value);
+		break;
+	case SDP_UUID128:
+		memcpy(value, &d->val.uuid.value.uuid128, 16);
+		break;
+	case SDP_TEXT_STR8:
+	case SDP_TEXT_STR16:
+	case SDP_TEXT_STR32:
+	case SDP_URL_STR8:
+	case SDP_URL_STR16:
+	case SDP_URL_STR32:
+		sdp_set_seq_len(seqp, data_size);
+		memcpy(buf->data + buf->data_size, d->val.str, data_size);
+		buf->data_size += data_size;
+		return pdu_size + data_size;
+	case SDP_SEQ8:
+	case SDP_SEQ16:
+	case SDP_SEQ32:
+	case SDP_ALT8:
+	case SDP_ALT16:
+	case SDP_ALT32:
+		sdp_set_seq_len(seqp, data_size);
+		return pdu_size + data_size;
+	}
+
+	memcpy(buf->data + buf->data_size, value, data_size);
+	buf->data_size += data_size;
+
+	return pdu_size + data_size;
+}
+
+static void ref_gen_record_pdu(const sdp_record_t *rec, sdp_buf_t *buf)
+{
+	sdp_list_t *l;
+
+	memset(buf, 0, sizeof(sdp_buf_t));
+
+	for (l = rec->attrlist; l; l = l->next)
+		ref_gen_buffer(buf, l->data);
+
+	/* The estimate above could miss the record sequence header */
+	buf->buf_size += 5;
+	buf->data = g_malloc0(buf->buf_size);
+
+	for (l = rec->attrlist; l; l = l->next) {
+		sdp_data_t *d = l->data;
+		sdp_buf_t append;
+
+		memset(&append, 0, sizeof(sdp_buf_t));
+		ref_gen_buffer(&append, d);
+		append.data = g_malloc(append.buf_size);
+
+		sdp_set_attrid(&append, d->attrId);
+		ref_gen_pdu(&append, d);
+		sdp_append_to_buf(buf, append.data, append.data_size);
+		g_free(append.data);
+	}
+}
+
+struct test_data_gen {
+	unsigned int seed;
+	unsigned int attrs;
+	unsigned int depth;
+	unsigned int width;
+	unsigned int rounds;
+	bool full;
+};
+
+#define define_test_gen(name, _seed, _attrs, _depth, _width) \
+	do {								\
+		static struct test_data_gen data;			\
+		data.seed = _seed;					\
+		data.attrs = _attrs;					\
+		data.depth = _depth;					\
+		data.width = _width;					\
+		g_test_add_data_func("/sdp/GEN/" name, &data,		\
+						test_sdp_gen_record);	\
+	} while (0)
+
+static struct test_data_gen gen_random_tests[32];
+
+#define define_bench_gen(name, _attrs, _depth, _width, _rounds) \
+	do {								\
+		static struct test_data_gen data;			\
+		data.seed = 1;						\
+		data.attrs = _attrs;					\
+		data.depth = _depth;					\
+		data.width = _width;					\
+		data.rounds = _rounds;					\
+		data.full = true;					\
+		g_test_add_data_func("/sdp/GEN/benchmark/" name, &data,	\
+						test_sdp_gen_bench);	\
+	} while (0)
+
+#define define_test_compact(name, _seed, _attrs, _depth, _width) \
+	do {								\
+		static struct test_data_gen data;			\
+		data.seed = _seed;					\
+		data.attrs = _attrs;					\
+		data.depth = _depth;					\
+		data.width = _width;					\
+		g_test_add_data_func("/sdp/COMPACT/" name, &data,	\
+						test_sdp_compact);	\
+	} while (0)
+
+#define define_bench_compact(name, _attrs, _depth, _width, _rounds) \
+	do {								\
+		static struct test_data_gen data;			\
+		data.seed = 1;						\
+		data.attrs = _attrs;					\
+		data.depth = _depth;					\
+		data.width = _width;					\
+		data.rounds = _rounds;					\
+		data.full = true;					\
+		g_test_add_data_func("/sdp/COMPACT/benchmark/" name,	\
+					&data, test_sdp_compact_bench);	\
+	} while (0)
+
+static unsigned int gen_random(unsigned int *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+
+	return *seed >> 16;
+}
+
+/* Full trees have sequences of width elements down to the given depth */
+static sdp_data_t *gen_element(unsigned int *seed, unsigned int depth,
+					unsigned int width, bool full)
+{
+	static const uint8_t types[] = {
+		SDP_DATA_NIL, SDP_UINT8, SDP_UINT16, SDP_UINT32, SDP_UINT64,
+		SDP_UINT128, SDP_INT8, SDP_INT16, SDP_INT32, SDP_INT64,
+		SDP_INT128, SDP_BOOL, SDP_UUID16, SDP_UUID32, SDP_UUID128,
+		SDP_TEXT_STR8, SDP_URL_STR8,
+	};
+	uint8_t value[16], str[300];
+	sdp_data_t *seq = NULL;
+	unsigned int i, count;
+	uint8_t dtd;
+
+	if (depth > 0 && (full || gen_random(seed) % 3 == 0)) {
+		count = full ? width : gen_random(seed) % (width + 1);
+
+		for (i = 0; i < count; i++)
+			seq = sdp_seq_append(seq, gen_element(seed, depth - 1,
+								width, full));
+
+		/* Only SDP_SEQ8 gets promoted when the content is too long */
+		dtd = gen_random(seed) % 4 ? SDP_SEQ8 : SDP_ALT16;
+
+		return sdp_data_alloc(dtd, seq);
+	}
+
+	for (i = 0; i < sizeof(value); i++)
+		value[i] = gen_random(seed);
+
+	dtd = types[gen_random(seed) % G_N_ELEMENTS(types)];
+
+	if (dtd == SDP_TEXT_STR8 || dtd == SDP_URL_STR8) {
+		unsigned int len = gen_random(seed) % sizeof(str);
+
+		for (i = 0; i < len; i++)
+			str[i] = 'a' + gen_random(seed) % 26;
+
+		if (len > UCHAR_MAX)
+			dtd++;
+
+		return sdp_data_alloc_with_length(dtd, str, len);
+	}
+
+	return sdp_data_alloc(dtd, value);
+}
+
+static sdp_record_t *gen_record(const struct test_data_gen *test)
+{
+	sdp_record_t *rec = sdp_record_alloc();
+	unsigned int seed = test->seed;
+	unsigned int i;
+
+	for (i = 0; i < test->attrs; i++)
+		sdp_attr_replace(rec, 0x0200 + i * 3,
+				gen_element(&seed, test->depth, test->width,
+								test->full));
+
+	return rec;
+}
+
+static void test_sdp_gen_record(gconstpointer data)
+{
+	const struct test_data_gen *test = data;
+	sdp_record_t *rec, *ref_rec;
+	sdp_buf_t buf, ref_buf;
+	sdp_list_t *l, *ref_l;
+
+	rec = gen_record(test);
+	ref_rec = gen_record(test);
+
+	g_assert(sdp_gen_record_pdu(rec, &buf) == 0);
+	ref_gen_record_pdu(ref_rec, &ref_buf);
+
+	if (g_test_verbose())
+		util_hexdump('>', buf.data, buf.data_size, sdp_debug, "");
+
+	g_assert_cmpuint(buf.data_size, ==, ref_buf.data_size);
+	g_assert(memcmp(buf.data, ref_buf.data, buf.data_size) == 0);
+
+	/* Sequences get promoted the same way as well */
+	for (l = rec->attrlist, ref_l = ref_rec->attrlist; l && ref_l;
+					l = l->next, ref_l = ref_l->next) {
+		sdp_data_t *d = l->data;
+		sdp_buf_t pdu, ref_pdu;
+
+		memset(&pdu, 0, sizeof(pdu));
+		pdu.buf_size = USHRT_MAX;
+		pdu.data = g_malloc0(pdu.buf_size);
+
+		memset(&ref_pdu, 0, sizeof(ref_pdu));
+		ref_pdu.buf_size = USHRT_MAX;
+		ref_pdu.data = g_malloc0(ref_pdu.buf_size);
+
+		sdp_append_to_pdu(&pdu, d);
+		ref_gen_pdu(&ref_pdu, ref_l->data);
+
+		g_assert_cmpuint(d->dtd, ==, ((sdp_data_t *) ref_l->data)->dtd);
+		g_assert(pdu.data_size > ref_pdu.data_size);
+		g_assert(memcmp(pdu.data + pdu.data_size - ref_pdu.data_size,
+				ref_pdu.data, ref_pdu.data_size) == 0);
+
+		g_free(pdu.data);
+		g_free(ref_pdu.data);
+	}
+
+	free(buf.data);
+	g_free(ref_buf.data);
+	sdp_record_free(rec);
+	sdp_record_free(ref_rec);
+}
+
+/*
+ * Every round encodes freshly built records, as sdpd and bluetoothd do, so
+ * that the cost of growing sequences past 255 bytes is included.
+ */
+static void test_sdp_gen_bench(gconstpointer data)
+{
+	const struct test_data_gen *test = data;
+	gint64 start, cur = 0, ref = 0;
+	sdp_record_t *rec;
+	sdp_buf_t buf;
+	unsigned int i;
+	size_t size = 0;
+
+	for (i = 0; i < test->rounds; i++) {
+		rec = gen_record(test);
+
+		start = g_get_monotonic_time();
+		g_assert(sdp_gen_record_pdu(rec, &buf) == 0);
+		cur += g_get_monotonic_time() - start;
+
+		size = buf.data_size;
+		free(buf.data);
+		sdp_record_free(rec);
+
+		rec = gen_record(test);
+
+		start = g_get_monotonic_time();
+		ref_gen_record_pdu(rec, &buf);
+		ref += g_get_monotonic_time() - start;
+
+		g_assert_cmpuint(buf.data_size, ==, size);
+		g_free(buf.data);
+		sdp_record_free(rec);
+	}
+
+	g_test_message("%zu bytes x %u: %.3f ms (reference %.3f ms, %.1fx)",
+				size, test->rounds, cur / 1000.0, ref / 1000.0,
+				cur ? (double) ref / cur : 0.0);
+}
+
+static void assert_same_record(sdp_record_t *rec, sdp_record_t *ref)
+{
+	sdp_buf_t buf, ref_buf;
+	sdp_list_t *l, *ref_l;
+	unsigned int attr;
+
+	g_assert_cmphex(rec->handle, ==, ref->handle);
+	g_assert(!memcmp(&rec->svclass, &ref->svclass, sizeof(uuid_t)));
+
+	for (l = rec->pattern, ref_l = ref->pattern; l && ref_l;
+					l = l->next, ref_l = ref_l->next)
+		g_assert(!sdp_uuid128_cmp(l->data, ref_l->data));
+
+	g_assert(!l && !ref_l);
+
+	g_assert_cmpint(sdp_list_len(rec->attrlist), ==,
+					sdp_list_len(ref->attrlist));
+
+	/* Look up every attribute and the gaps around it */
+	for (ref_l = ref->attrlist; ref_l; ref_l = ref_l->next) {
+		sdp_data_t *ref_d = ref_l->data;
+		sdp_data_t *d;
+
+		attr = ref_d->attrId ? ref_d->attrId - 1 : 0;
+
+		for (; attr <= ref_d->attrId + 1u; attr++) {
+			d = sdp_data_get(rec, attr);
+
+			g_assert(!d == !sdp_data_get(ref, attr));
+
+			if (d)
+				g_assert_cmpuint(d->attrId, ==, attr);
+		}
+
+		d = sdp_data_get(rec, ref_d->attrId);
+		g_assert_cmphex(d->dtd, ==, ref_d->dtd);
+
+		/* Copied records have it set for all types */
+		if (SDP_IS_TEXT_STR(d->dtd))
+			g_assert_cmpint(d->unitSize, ==, ref_d->unitSize);
+	}
+
+	g_assert(sdp_gen_record_pdu(rec, &buf) == 0);
+	g_assert(sdp_gen_record_pdu(ref, &ref_buf) == 0);
+
+	g_assert_cmpuint(buf.data_size, ==, ref_buf.data_size);
+	g_assert(!memcmp(buf.data, ref_buf.data, buf.data_size));
+
+	free(buf.data);
+	free(ref_buf.data);
+}
+
+static void test_sdp_compact(gconstpointer data)
+{
+	const struct test_data_gen *test = data;
+	sdp_record_t *gen, *rec, *ref, *cpy;
+	sdp_data_t *d;
+	int scanned, ref_scanned;
+	sdp_buf_t buf;
+	uint32_t handle = 0x10042;
+	unsigned int len;
+
+	gen = gen_record(test);
+	sdp_attr_replace(gen, SDP_ATTR_RECORD_HANDLE,
+				sdp_data_alloc(SDP_UINT32, &handle));
+	g_assert(sdp_gen_record_pdu(gen, &buf) == 0);
+	sdp_record_free(gen);
+
+	ref = sdp_extract_pdu(buf.data, buf.data_size, &ref_scanned);
+	rec = sdp_extract_pdu_compact(buf.data, buf.data_size, &scanned);
+
+	g_assert_cmpint(scanned, ==, ref_scanned);
+	g_assert_cmphex(rec->handle, ==, handle);
+	assert_same_record(rec, ref);
+
+	/* Copies are compact as well and don't depend on the original */
+	cpy = sdp_copy_record(rec);
+	sdp_record_free(rec);
+	assert_same_record(cpy, ref);
+
+	/*
+	 * Modifications turn it into a regular record, copying attributes
+	 * the way sdp_copy_record() does for regular ones.
+	 */
+	rec = sdp_copy_record(ref);
+	sdp_record_free(ref);
+	ref = rec;
+
+	d = sdp_data_alloc(SDP_TEXT_STR8, "compact");
+	sdp_attr_replace(cpy, SDP_ATTR_SVCNAME_PRIMARY, d);
+	sdp_attr_replace(ref, SDP_ATTR_SVCNAME_PRIMARY,
+				sdp_data_alloc(SDP_TEXT_STR8, "compact"));
+	g_assert(sdp_data_get(cpy, SDP_ATTR_SVCNAME_PRIMARY) == d);
+	assert_same_record(cpy, ref);
+
+	sdp_record_free(cpy);
+	sdp_record_free(ref);
+
+	/* Truncated or otherwise broken input is parsed the regular way */
+	for (len = 0; len < buf.data_size; len += 1 + len / 16) {
+		ref = sdp_extract_pdu(buf.data, len, &ref_scanned);
+		rec = sdp_extract_pdu_compact(buf.data, len, &scanned);
+
+		g_assert_cmpint(scanned, ==, ref_scanned);
+		assert_same_record(rec, ref);
+
+		sdp_record_free(rec);
+		sdp_record_free(ref);
+	}
+
+	free(buf.data);
+}
+
+static void test_sdp_compact_bench(gconstpointer data)
+{
+	const struct test_data_gen *test = data;
+	gint64 start, cur, ref;
+	sdp_record_t *rec;
+	sdp_buf_t buf;
+	unsigned int i;
+	int scanned;
+
+	rec = gen_record(test);
+	g_assert(sdp_gen_record_pdu(rec, &buf) == 0);
+	sdp_record_free(rec);
+
+	start = g_get_monotonic_time();
+
+	for (i = 0; i < test->rounds; i++) {
+		rec = sdp_extract_pdu_compact(buf.data, buf.data_size,
+								&scanned);
+		g_assert(sdp_data_get(rec, 0x0200));
+		sdp_record_free(rec);
+	}
+
+	cur = g_get_monotonic_time() - start;
+
+	start = g_get_monotonic_time();
+
+	for (i = 0; i < test->rounds; i++) {
+		rec = sdp_extract_pdu(buf.data, buf.data_size, &scanned);
+		g_assert(sdp_data_get(rec, 0x0200));
+		sdp_record_free(rec);
+	}
+
+	ref = g_get_monotonic_time() - start;
+
+	g_test_message("%u bytes x %u: %.3f ms (regular %.3f ms, %.1fx)",
+				buf.data_size, test->rounds, cur / 1000.0,
+				ref / 1000.0, cur ? (double) ref / cur : 0.0);
+
+	free(buf.data);
+}
+
 int main(int argc, char *argv[])
 {
+	unsigned int i;
+
 	g_test_init(&argc, &argv, NULL);
 
 	if (g_test_verbose())
@@ -2822,5 +3401,47 @@ int main(int argc, char *argv[])
 						0x00, 0x00, 0x00, 0x00, 0x00,
 						0x00, 0x00, 0x00, 0x00, 0x00)));
 
+	/*
+	 * Data Element generation
+	 *
+	 * Synthetic records are serialized and compared against the
+	 * reference encoder, including sequences right at the 8/16 bit
+	 * length boundary.
+	 */
+	define_test_gen("flat", 1, 64, 0, 0);
+	define_test_gen("nested", 2, 16, 3, 8);
+	define_test_gen("deep", 3, 4, 8, 3);
+	define_test_gen("wide", 4, 8, 2, 40);
+
+	for (i = 0; i < G_N_ELEMENTS(gen_random_tests); i++) {
+		struct test_data_gen *data = &gen_random_tests[i];
+		char name[32];
+
+		data->seed = 100 + i;
+		data->attrs = 1 + i % 7;
+		data->depth = i % 6;
+		data->width = 1 + i % 12;
+
+		sprintf(name, "/sdp/GEN/random-%u", i);
+		g_test_add_data_func(name, data, test_sdp_gen_record);
+	}
+
+	define_bench_gen("wide", 16, 2, 12, 100);
+	define_bench_gen("deep", 2, 6, 3, 100);
+
+	/*
+	 * Compact records
+	 *
+	 * Records parsed into a single allocation have to match the regular
+	 * parser, also after being copied or modified.
+	 */
+	define_test_compact("flat", 1, 64, 0, 0);
+	define_test_compact("nested", 2, 16, 3, 8);
+	define_test_compact("deep", 3, 4, 8, 3);
+	define_test_compact("wide", 4, 8, 2, 40);
+
+	define_bench_compact("wide", 16, 2, 12, 1000);
+	define_bench_compact("deep", 2, 6, 3, 1000);
+
 	return g_test_run();
 }